@@ -0,0 +1,638 @@
+// Benchmark suite: generates synthetic playlist exports and tagged audio files, then times
+// ingestion, index builds, snapshots, queries and tag reading. Results are written as JSON
+// so runs can be compared by scripts; progress goes to stderr.
+//
+//   benchmark [--sizes 10k,100k,1m,10m] [--queries N] [--batch N] [--threads N]
+//             [--format fp32|fp16|int8] [--audio-files N] [--dir PATH] [--out FILE] [--seed N] [--keep]
+
+#include "hnswlib_csv_to_db.h"
+#include "library_scanner.h"
+#include "metadata.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <filesystem>
+#include <random>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+namespace fs = std::filesystem;
+
+struct BenchOptions {
+    std::vector<size_t> sizes = {10000, 100000};
+    size_t queries = 1000;
+    size_t batch_size = 64;
+    size_t threads = 0;
+    size_t audio_files = 2000;
+    size_t k = 10;
+    VectorFormat format = VectorFormat::FP32;
+    uint64_t seed = 42;
+    std::string dir;
+    std::string out;
+    bool keep = false;
+};
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Latency summary of a series of samples in microseconds
+struct LatencyStats {
+    size_t count = 0;
+    double mean_us = 0;
+    double p50_us = 0;
+    double p99_us = 0;
+    double max_us = 0;
+};
+
+static LatencyStats summarize(std::vector<double> samples_us) {
+    LatencyStats stats;
+    if (samples_us.empty()) return stats;
+    std::sort(samples_us.begin(), samples_us.end());
+    auto percentile = [&](double p) {
+        size_t rank = static_cast<size_t>(p * (samples_us.size() - 1) + 0.5);
+        return samples_us[std::min(rank, samples_us.size() - 1)];
+    };
+    stats.count = samples_us.size();
+    for (double sample : samples_us) stats.mean_us += sample;
+    stats.mean_us /= samples_us.size();
+    stats.p50_us = percentile(0.50);
+    stats.p99_us = percentile(0.99);
+    stats.max_us = samples_us.back();
+    return stats;
+}
+
+// Minimal streaming JSON writer; enough for nested objects of numbers, strings and flags
+class JsonWriter {
+private:
+    std::ostringstream out;
+    std::vector<bool> first = {true};
+
+    void separator() {
+        if (!first.back()) out << ",";
+        first.back() = false;
+    }
+
+    void key(const std::string& name) {
+        separator();
+        out << "\"" << escape(name) << "\":";
+    }
+
+public:
+    JsonWriter() {
+        out << std::setprecision(6);
+    }
+
+    static std::string escape(const std::string& value) {
+        std::string result;
+        for (char c : value) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+                result += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char buffer[8];
+                std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                result += buffer;
+            } else {
+                result += c;
+            }
+        }
+        return result;
+    }
+
+    void begin_object(const std::string& name = "") {
+        if (name.empty()) separator(); else key(name);
+        out << "{";
+        first.push_back(true);
+    }
+
+    void end_object() {
+        out << "}";
+        first.pop_back();
+    }
+
+    void begin_array(const std::string& name) {
+        key(name);
+        out << "[";
+        first.push_back(true);
+    }
+
+    void end_array() {
+        out << "]";
+        first.pop_back();
+    }
+
+    void value(const std::string& name, double number) {
+        key(name);
+        out << number;
+    }
+
+    void value(const std::string& name, size_t number) {
+        key(name);
+        out << number;
+    }
+
+    void value(const std::string& name, const std::string& text) {
+        key(name);
+        out << "\"" << escape(text) << "\"";
+    }
+
+    void flag(const std::string& name, bool set) {
+        key(name);
+        out << (set ? "true" : "false");
+    }
+
+    // Splice in an already serialized JSON value
+    void raw(const std::string& name, const std::string& json) {
+        key(name);
+        out << json;
+    }
+
+    void latency(const std::string& name, const LatencyStats& stats) {
+        begin_object(name);
+        value("count", stats.count);
+        value("mean_us", stats.mean_us);
+        value("p50_us", stats.p50_us);
+        value("p99_us", stats.p99_us);
+        value("max_us", stats.max_us);
+        end_object();
+    }
+
+    std::string str() const {
+        return out.str();
+    }
+};
+
+// ---- Synthetic data ----
+
+static const char* const KEYS[] = {"C Major", "C♯/D♭ Major", "D Minor", "E Minor", "F Major", "G Major", "A Minor", "B♭ Major"};
+static const char* const CAMELOT[] = {"8B", "3B", "7A", "9A", "7B", "9B", "8A", "6B"};
+static const char* const GENRES[] = {"indie rock", "electropop", "pop", "metal", "lo-fi", "jazz", "hip hop", "synthwave"};
+static const char* const WORDS[] = {"Night", "Drive", "Golden", "Echo", "River", "Fire", "Glass", "Static", "Neon", "Rain",
+                                    "Heart", "Signal", "Ocean", "Paper", "Shadow", "Light"};
+
+static std::string random_id(std::mt19937_64& rng, size_t length) {
+    static const char alphabet[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    std::string id(length, ' ');
+    for (char& c : id) c = alphabet[rng() % (sizeof(alphabet) - 1)];
+    return id;
+}
+
+static std::string random_title(std::mt19937_64& rng) {
+    size_t words = 1 + rng() % 3;
+    std::string title;
+    for (size_t i = 0; i < words; i++) {
+        if (i > 0) title += ' ';
+        title += WORDS[rng() % (sizeof(WORDS) / sizeof(WORDS[0]))];
+    }
+    return title;
+}
+
+// Write a playlist export with the same columns as the real one. Tracks are drawn around a
+// handful of "mood" centres so the features have structure like a real library.
+static void generate_csv(const std::string& path, size_t tracks, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::normal_distribution<double> noise(0.0, 1.0);
+    constexpr size_t MOODS = 12;
+    double centres[MOODS][10];
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    for (auto& centre : centres) {
+        centre[0] = 20 + unit(rng) * 70;   // Popularity
+        centre[1] = 70 + unit(rng) * 110;  // BPM
+        for (int f = 2; f < 9; f++) centre[f] = unit(rng) * 100;
+        centre[9] = -14 + unit(rng) * 12;  // Loud (Db)
+    }
+    const double spread[10] = {12, 15, 12, 12, 15, 10, 15, 5, 8, 2};
+
+    std::ofstream out(path, std::ios::binary);
+    std::vector<char> buffer(1 << 20);
+    out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    out << "#,Song,Artist,Popularity,BPM,Genres,Album,Album Date,Time,Dance,Energy,Acoustic,Instrumental,Happy,"
+           "Speech,Live,Loud (Db),Key,Time Signature,Added At,Spotify Track Id,Camelot,ISRC\n";
+
+    std::vector<std::string> artists;
+    for (size_t i = 0; i < std::max<size_t>(16, tracks / 20); i++) {
+        artists.push_back(random_title(rng));
+    }
+
+    for (size_t i = 0; i < tracks; i++) {
+        const double* centre = centres[rng() % MOODS];
+        int features[10];
+        for (int f = 0; f < 10; f++) {
+            double value = centre[f] + noise(rng) * spread[f];
+            features[f] = static_cast<int>(std::lround(f == 9 ? std::min(0.0, value) : std::max(0.0, value)));
+        }
+        size_t key = rng() % (sizeof(KEYS) / sizeof(KEYS[0]));
+        int year = 1970 + static_cast<int>(rng() % 55);
+
+        out << (i + 1) << ",\"" << random_title(rng) << "\",\"" << artists[rng() % artists.size()] << "\","
+            << features[0] << "," << features[1] << ",\"" << GENRES[rng() % 8] << "," << GENRES[rng() % 8] << "\",\""
+            << random_title(rng) << "\"," << year << "-01-01," << (2 + rng() % 4) << ":" << std::setw(2)
+            << std::setfill('0') << (rng() % 60) << std::setfill(' ') << "," << features[2] << "," << features[3] << ","
+            << features[4] << "," << features[5] << "," << features[6] << "," << features[7] << "," << features[8]
+            << "," << features[9] << "," << KEYS[key] << "," << (3 + rng() % 2) << ",2024-01-01,"
+            << random_id(rng, 22) << "," << CAMELOT[key] << ",US" << random_id(rng, 10) << "\n";
+    }
+}
+
+static void put_be32(std::string& out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) out += static_cast<char>((value >> shift) & 0xFF);
+}
+
+static void put_le32(std::string& out, uint32_t value) {
+    for (int shift = 0; shift < 32; shift += 8) out += static_cast<char>((value >> shift) & 0xFF);
+}
+
+static void put_id3_frame(std::string& tag, const char* id, const std::string& body) {
+    tag.append(id, 4);
+    put_be32(tag, static_cast<uint32_t>(body.size()));
+    tag.append(2, '\0');
+    tag += body;
+}
+
+// ID3v2.3 tag with text frames and embedded artwork, a Xing header frame and CBR frames
+static void generate_mp3(const std::string& path, std::mt19937_64& rng, size_t artwork_bytes) {
+    std::string frames;
+    put_id3_frame(frames, "TIT2", std::string(1, '\0') + random_title(rng));
+    put_id3_frame(frames, "TPE1", std::string(1, '\0') + random_title(rng));
+    put_id3_frame(frames, "TALB", std::string(1, '\0') + random_title(rng));
+    put_id3_frame(frames, "TYER", std::string(1, '\0') + "2021");
+    put_id3_frame(frames, "TCON", std::string(1, '\0') + GENRES[rng() % 8]);
+    put_id3_frame(frames, "APIC", std::string("\0image/jpeg\0\x03\0", 14) + std::string(artwork_bytes, '\x5A'));
+
+    std::string file = "ID3";
+    file += '\x03';
+    file += '\0';
+    file += '\0';
+    uint32_t size = static_cast<uint32_t>(frames.size());
+    for (int shift = 21; shift >= 0; shift -= 7) file += static_cast<char>((size >> shift) & 0x7F);
+    file += frames;
+
+    // MPEG-1 Layer III, 128 kbps, 44.1 kHz, no padding: 417 byte frames
+    const size_t frame_count = 400 + rng() % 400;
+    const size_t frame_size = 417;
+    std::string xing(frame_size, '\0');
+    const unsigned char header[4] = {0xFF, 0xFB, 0x90, 0x00};
+    std::memcpy(&xing[0], header, 4);
+    std::memcpy(&xing[36], "Xing", 4);
+    std::string fields;
+    put_be32(fields, 0x3);
+    put_be32(fields, static_cast<uint32_t>(frame_count));
+    put_be32(fields, static_cast<uint32_t>(frame_count * frame_size));
+    std::memcpy(&xing[40], fields.data(), fields.size());
+    file += xing;
+
+    std::string frame(frame_size, '\x11');
+    std::memcpy(&frame[0], header, 4);
+    for (size_t i = 0; i < frame_count; i++) file += frame;
+
+    std::ofstream(path, std::ios::binary).write(file.data(), file.size());
+}
+
+// FLAC stream with STREAMINFO, VORBIS_COMMENT, a PICTURE block and filler audio
+static void generate_flac(const std::string& path, std::mt19937_64& rng, size_t artwork_bytes) {
+    std::string file = "fLaC";
+    auto block_header = [&](int type, size_t length, bool last) {
+        file += static_cast<char>((last ? 0x80 : 0) | type);
+        file += static_cast<char>((length >> 16) & 0xFF);
+        file += static_cast<char>((length >> 8) & 0xFF);
+        file += static_cast<char>(length & 0xFF);
+    };
+
+    // STREAMINFO: block sizes, frame sizes, then sample rate (20 bits), channels - 1 (3),
+    // bits per sample - 1 (5) and total samples (36) packed into 64 bits, then the MD5
+    uint64_t total_samples = 44100ull * (120 + rng() % 180);
+    std::string info = std::string("\x10\x00\x10\x00", 4) + std::string(6, '\0');
+    uint64_t packed = (44100ull << 44) | (1ull << 41) | (15ull << 36) | total_samples;
+    for (int shift = 56; shift >= 0; shift -= 8) info += static_cast<char>((packed >> shift) & 0xFF);
+    info += std::string(16, '\0');
+    block_header(0, info.size(), false);
+    file += info;
+
+    std::string comments;
+    std::string vendor = "benchmark";
+    put_le32(comments, static_cast<uint32_t>(vendor.size()));
+    comments += vendor;
+    std::vector<std::string> entries = {
+        "TITLE=" + random_title(rng), "ARTIST=" + random_title(rng), "ALBUM=" + random_title(rng),
+        "DATE=2019", "GENRE=" + std::string(GENRES[rng() % 8]), "TRACKNUMBER=" + std::to_string(1 + rng() % 12)};
+    put_le32(comments, static_cast<uint32_t>(entries.size()));
+    for (const std::string& entry : entries) {
+        put_le32(comments, static_cast<uint32_t>(entry.size()));
+        comments += entry;
+    }
+    block_header(4, comments.size(), false);
+    file += comments;
+
+    block_header(6, artwork_bytes, true);
+    file += std::string(artwork_bytes, '\x5A');
+    file += std::string(64 * 1024, '\x22');
+
+    std::ofstream(path, std::ios::binary).write(file.data(), file.size());
+}
+
+static void generate_audio(const std::string& dir, size_t count, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    fs::create_directories(dir);
+    for (size_t i = 0; i < count; i++) {
+        // Artwork between 16 KiB and 256 KiB, like real embedded covers
+        size_t artwork = (16 + rng() % 240) * 1024;
+        std::string base = dir + "/track" + std::to_string(i);
+        if (i % 2 == 0) {
+            generate_mp3(base + ".mp3", rng, artwork);
+        } else {
+            generate_flac(base + ".flac", rng, artwork);
+        }
+    }
+}
+
+// ---- Measurements ----
+
+static std::vector<float> random_queries(size_t count, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<float> percent(0.0f, 100.0f);
+    std::uniform_real_distribution<float> bpm(70.0f, 180.0f);
+    std::uniform_real_distribution<float> loud(-14.0f, -2.0f);
+    std::vector<float> queries(count * 10);
+    for (size_t q = 0; q < count; q++) {
+        float* query = &queries[q * 10];
+        for (int f = 0; f < 10; f++) query[f] = percent(rng);
+        query[1] = bpm(rng);
+        query[9] = loud(rng);
+    }
+    return queries;
+}
+
+static LatencyStats time_single_queries(HNSWVectorDB& db, const std::vector<float>& queries, size_t k) {
+    std::vector<double> samples;
+    samples.reserve(queries.size() / 10);
+    for (size_t q = 0; q < queries.size() / 10; q++) {
+        std::vector<float> query(queries.begin() + q * 10, queries.begin() + (q + 1) * 10);
+        auto start = Clock::now();
+        auto results = db.search(query, k);
+        samples.push_back(seconds_since(start) * 1e6);
+    }
+    return summarize(samples);
+}
+
+// Latency of whole batches, plus the overall queries per second
+static LatencyStats time_batches(HNSWVectorDB& db, const std::vector<float>& queries, size_t batch_size, size_t k,
+                                 size_t threads, double& queries_per_second) {
+    size_t count = queries.size() / 10;
+    std::vector<size_t> labels(batch_size * k);
+    std::vector<float> distances(batch_size * k);
+    std::vector<double> samples;
+    auto total = Clock::now();
+    for (size_t first = 0; first < count; first += batch_size) {
+        size_t n = std::min(batch_size, count - first);
+        auto start = Clock::now();
+        db.search_batch(&queries[first * 10], n, k, labels.data(), distances.data(), threads);
+        samples.push_back(seconds_since(start) * 1e6);
+    }
+    double elapsed = seconds_since(total);
+    queries_per_second = elapsed > 0 ? count / elapsed : 0.0;
+    return summarize(samples);
+}
+
+static constexpr size_t FLAT_BENCH_MAX_TRACKS = 1000000;
+
+static void bench_library(JsonWriter& json, const BenchOptions& options, size_t tracks) {
+    std::string csv_path = options.dir + "/library_" + std::to_string(tracks) + ".csv";
+    std::string snapshot_path = options.dir + "/library_" + std::to_string(tracks) + ".snapshot";
+
+    std::cerr << "[" << tracks << " tracks] generating CSV" << std::endl;
+    auto start = Clock::now();
+    generate_csv(csv_path, tracks, options.seed + tracks);
+    double generate_seconds = seconds_since(start);
+    size_t csv_bytes = static_cast<size_t>(fs::file_size(csv_path));
+
+    json.begin_object();
+    json.value("tracks", tracks);
+    json.value("csv_bytes", csv_bytes);
+    json.value("generate_seconds", generate_seconds);
+
+    // Parsing and metadata storage alone
+    {
+        std::cerr << "[" << tracks << " tracks] ingesting CSV" << std::endl;
+        HNSWVectorDB db(10);
+        start = Clock::now();
+        db.load_metadata_from_csv(csv_path);
+        double seconds = seconds_since(start);
+        json.begin_object("ingest");
+        json.value("seconds", seconds);
+        json.value("rows_per_second", tracks / seconds);
+        json.value("mb_per_second", csv_bytes / seconds / 1e6);
+        json.end_object();
+    }
+
+    std::vector<float> queries = random_queries(options.queries, options.seed);
+    for (IndexBackend backend : {IndexBackend::HNSW, IndexBackend::FLAT}) {
+        bool flat = backend == IndexBackend::FLAT;
+        // Exact scans of 10M tracks take minutes per thousand queries and say nothing new
+        if (flat && tracks > FLAT_BENCH_MAX_TRACKS) continue;
+        std::string name = flat ? "flat" : "hnsw";
+        std::cerr << "[" << tracks << " tracks] " << name << " build" << std::endl;
+
+        HNSWVectorDB db(10, 10000, 16, 200, FeatureMetric::WEIGHTED_L2, options.format);
+        db.set_backend(backend);
+        db.reset_stats();
+        start = Clock::now();
+        db.load_from_csv(csv_path, options.threads);
+        double build_seconds = seconds_since(start);
+
+        json.begin_object(name);
+        json.value("build_seconds", build_seconds);
+        json.value("build_rows_per_second", tracks / build_seconds);
+
+        start = Clock::now();
+        db.save_snapshot(snapshot_path, csv_path);
+        json.value("snapshot_save_seconds", seconds_since(start));
+        json.value("snapshot_bytes", static_cast<size_t>(fs::file_size(snapshot_path)));
+
+        HNSWVectorDB loaded(10, 10000, 16, 200, FeatureMetric::WEIGHTED_L2, options.format);
+        loaded.set_backend(backend);
+        start = Clock::now();
+        bool ok = loaded.load_snapshot(snapshot_path, csv_path);
+        json.value("snapshot_load_seconds", seconds_since(start));
+        json.flag("snapshot_loaded", ok);
+
+        std::cerr << "[" << tracks << " tracks] " << name << " queries" << std::endl;
+        json.value("k", options.k);
+        json.latency("query", time_single_queries(db, queries, options.k));
+        double qps = 0;
+        json.latency("batch", time_batches(db, queries, options.batch_size, options.k, options.threads, qps));
+        json.value("batch_size", options.batch_size);
+        json.value("batch_queries_per_second", qps);
+
+        if (!flat) {
+            HNSWVectorDB::RecallReport recall = db.evaluate_recall(std::min<size_t>(options.queries, 200), options.k, options.seed);
+            json.value("recall", recall.recall);
+        }
+        json.raw("stats", db.stats().to_json());
+        json.end_object();
+    }
+    json.end_object();
+
+    if (!options.keep) {
+        fs::remove(csv_path);
+        fs::remove(snapshot_path);
+    }
+}
+
+static void bench_metadata(JsonWriter& json, const BenchOptions& options) {
+    std::string audio_dir = options.dir + "/audio";
+    std::cerr << "[metadata] generating " << options.audio_files << " files" << std::endl;
+    generate_audio(audio_dir, options.audio_files, options.seed);
+
+    std::vector<std::string> paths;
+    size_t total_bytes = 0;
+    for (const auto& entry : fs::directory_iterator(audio_dir)) {
+        paths.push_back(entry.path().string());
+        total_bytes += static_cast<size_t>(entry.file_size());
+    }
+    std::sort(paths.begin(), paths.end());
+
+    std::cerr << "[metadata] reading tags" << std::endl;
+    size_t with_title = 0;
+    auto start = Clock::now();
+    for (const std::string& path : paths) {
+        AudioMetadata metadata = readAudioMetadata(path);
+        if (!metadata.title.empty() && metadata.duration > 0) with_title++;
+    }
+    double seconds = seconds_since(start);
+
+    json.begin_object("metadata");
+    json.value("files", paths.size());
+    json.value("bytes", total_bytes);
+    json.value("parsed", with_title);
+    json.value("seconds", seconds);
+    json.value("files_per_second", paths.size() / seconds);
+    json.value("file_mb_per_second", total_bytes / seconds / 1e6);
+
+    ScanOptions scan_options;
+    scan_options.ioDepth = options.threads == 0 ? 4 : options.threads;
+    start = Clock::now();
+    ScanStats stats = scanLibrary(audio_dir, scan_options, [](std::vector<ScannedTrack>&) {});
+    double scan_seconds = seconds_since(start);
+    json.value("scan_seconds", scan_seconds);
+    json.value("scan_files_per_second", stats.filesRead / scan_seconds);
+    json.end_object();
+
+    if (!options.keep) {
+        fs::remove_all(audio_dir);
+    }
+}
+
+// ---- Command line ----
+
+static size_t parse_count(const std::string& text) {
+    size_t multiplier = 1;
+    std::string digits = text;
+    char suffix = digits.empty() ? '\0' : static_cast<char>(std::tolower(static_cast<unsigned char>(digits.back())));
+    if (suffix == 'k') multiplier = 1000;
+    if (suffix == 'm') multiplier = 1000000;
+    if (multiplier != 1) digits.pop_back();
+    return static_cast<size_t>(std::stoull(digits)) * multiplier;
+}
+
+static void print_usage() {
+    std::cerr << "Usage: benchmark [--sizes 10k,100k,1m,10m] [--queries N] [--batch N] [--threads N]\n"
+                 "                 [--format fp32|fp16|int8] [--audio-files N] [--dir PATH] [--out FILE] [--seed N] [--keep]\n";
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            auto next = [&]() -> std::string {
+                if (i + 1 >= argc) throw std::invalid_argument("Missing value for " + arg);
+                return argv[++i];
+            };
+            if (arg == "--sizes") {
+                options.sizes.clear();
+                std::stringstream list(next());
+                std::string item;
+                while (std::getline(list, item, ',')) options.sizes.push_back(parse_count(item));
+            } else if (arg == "--queries") {
+                options.queries = std::max<size_t>(1, parse_count(next()));
+            } else if (arg == "--batch") {
+                options.batch_size = std::max<size_t>(1, parse_count(next()));
+            } else if (arg == "--threads") {
+                options.threads = parse_count(next());
+            } else if (arg == "--audio-files") {
+                options.audio_files = parse_count(next());
+            } else if (arg == "--dir") {
+                options.dir = next();
+            } else if (arg == "--out") {
+                options.out = next();
+            } else if (arg == "--seed") {
+                options.seed = parse_count(next());
+            } else if (arg == "--format") {
+                std::string format = next();
+                if (format == "fp32") {
+                    options.format = VectorFormat::FP32;
+                } else if (format == "fp16") {
+                    options.format = VectorFormat::FP16;
+                } else if (format == "int8") {
+                    options.format = VectorFormat::INT8;
+                } else {
+                    throw std::invalid_argument("Unknown vector format: " + format);
+                }
+            } else if (arg == "--keep") {
+                options.keep = true;
+            } else {
+                print_usage();
+                return arg == "--help" ? 0 : 2;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        print_usage();
+        return 2;
+    }
+
+    if (options.dir.empty()) {
+        options.dir = (fs::temp_directory_path() / "better-shuffle-bench").string();
+    }
+    fs::create_directories(options.dir);
+
+    JsonWriter json;
+    try {
+        json.begin_object();
+        json.value("benchmark", std::string("better-shuffle"));
+        json.value("timestamp", static_cast<size_t>(std::time(nullptr)));
+        json.value("hardware_threads", static_cast<size_t>(std::thread::hardware_concurrency()));
+        json.value("threads", options.threads);
+        json.value("queries", options.queries);
+        json.value("format", std::string(options.format == VectorFormat::FP32 ? "fp32" : options.format == VectorFormat::FP16 ? "fp16" : "int8"));
+        json.begin_array("libraries");
+        for (size_t tracks : options.sizes) {
+            bench_library(json, options, tracks);
+        }
+        json.end_array();
+        if (options.audio_files > 0) {
+            bench_metadata(json, options);
+        }
+        json.end_object();
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    if (options.out.empty()) {
+        std::cout << json.str() << std::endl;
+    } else {
+        std::ofstream(options.out) << json.str() << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,997 @@
+#include "audio_analysis.h"
+#include "metadata.h"
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <memory>
+
+#if defined(__AVX__)
+#define AUDIO_SIMD_AVX 1
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64)
+#define AUDIO_SIMD_SSE 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const float NOT_AVAILABLE = numeric_limits<float>::quiet_NaN();
+static const double PI = 3.14159265358979323846;
+
+// Analysis frames: 1024 samples with a hop of 512, about 23 ms and 12 ms at 44.1 kHz
+static const size_t FRAME_SIZE = 1024;
+static const size_t HOP_SIZE = 512;
+static const size_t BINS = FRAME_SIZE / 2;
+
+// Loudness is gated over blocks of 400 ms, like ITU-R BS.1770 (without its K-weighting)
+static const double LOUDNESS_BLOCK_SECONDS = 0.4;
+static const double LOUDNESS_ABSOLUTE_GATE = -70.0;
+static const double LOUDNESS_RELATIVE_GATE = -10.0;
+static const int LOUDNESS_BINS_PER_DB = 10;
+static const int LOUDNESS_BINS = 80 * LOUDNESS_BINS_PER_DB; // -70 to +10 dBFS
+
+// Onset envelopes that vary less than this (mean log-power rise per bin) have no beat to
+// find; a steady tone still shows tiny periodic ripples
+static const double MIN_ONSET_DEVIATION = 0.01;
+
+// Tracks shorter than this aren't analysed
+static const double MIN_DURATION_SECONDS = 1.0;
+
+// ---------------------------------------------------------------------------------------
+// Blockwise kernels
+
+static float sumOfSquares(const float* x, size_t n) {
+    size_t i = 0;
+    float sum = 0.0f;
+#if defined(AUDIO_SIMD_AVX)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i < n - n % 8; i += 8) {
+        __m256 v = _mm256_loadu_ps(x + i);
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(v, v));
+    }
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, acc);
+    for (float lane : lanes) sum += lane;
+#elif defined(AUDIO_SIMD_SSE)
+    __m128 acc = _mm_setzero_ps();
+    for (; i < n - n % 4; i += 4) {
+        __m128 v = _mm_loadu_ps(x + i);
+        acc = _mm_add_ps(acc, _mm_mul_ps(v, v));
+    }
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, acc);
+    for (float lane : lanes) sum += lane;
+#endif
+    for (; i < n; i++) sum += x[i] * x[i];
+    return sum;
+}
+
+static float dot(const float* a, const float* b, size_t n) {
+    size_t i = 0;
+    float sum = 0.0f;
+#if defined(AUDIO_SIMD_AVX)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i < n - n % 8; i += 8) {
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, acc);
+    for (float lane : lanes) sum += lane;
+#elif defined(AUDIO_SIMD_SSE)
+    __m128 acc = _mm_setzero_ps();
+    for (; i < n - n % 4; i += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, acc);
+    for (float lane : lanes) sum += lane;
+#endif
+    for (; i < n; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+// out = a * b, elementwise
+static void multiply(const float* a, const float* b, float* out, size_t n) {
+    size_t i = 0;
+#if defined(AUDIO_SIMD_AVX)
+    for (; i < n - n % 8; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+#elif defined(AUDIO_SIMD_SSE)
+    for (; i < n - n % 4; i += 4) {
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+#endif
+    for (; i < n; i++) out[i] = a[i] * b[i];
+}
+
+// out = re^2 + im^2
+static void powerSpectrum(const float* re, const float* im, float* out, size_t n) {
+    size_t i = 0;
+#if defined(AUDIO_SIMD_AVX)
+    for (; i < n - n % 8; i += 8) {
+        __m256 r = _mm256_loadu_ps(re + i);
+        __m256 m = _mm256_loadu_ps(im + i);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_mul_ps(r, r), _mm256_mul_ps(m, m)));
+    }
+#elif defined(AUDIO_SIMD_SSE)
+    for (; i < n - n % 4; i += 4) {
+        __m128 r = _mm_loadu_ps(re + i);
+        __m128 m = _mm_loadu_ps(im + i);
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(m, m)));
+    }
+#endif
+    for (; i < n; i++) out[i] = re[i] * re[i] + im[i] * im[i];
+}
+
+namespace {
+
+// ---------------------------------------------------------------------------------------
+// Real FFT of FRAME_SIZE samples, computed as a complex FFT of half the size
+
+class RealFFT {
+private:
+    size_t half;
+    vector<uint32_t> bitReverse;
+    vector<float> cosTable; // cos(2 pi k / n), k < n / 2
+    vector<float> sinTable; // -sin(2 pi k / n)
+    vector<float> re;
+    vector<float> im;
+
+public:
+    explicit RealFFT(size_t n) : half(n / 2), bitReverse(half), cosTable(half), sinTable(half), re(half), im(half) {
+        int bits = 0;
+        while ((size_t(1) << bits) < half) bits++;
+        for (size_t i = 0; i < half; i++) {
+            uint32_t reversed = 0;
+            for (int b = 0; b < bits; b++) {
+                if (i & (size_t(1) << b)) reversed |= 1u << (bits - 1 - b);
+            }
+            bitReverse[i] = reversed;
+            double angle = 2.0 * PI * static_cast<double>(i) / static_cast<double>(n);
+            cosTable[i] = static_cast<float>(cos(angle));
+            sinTable[i] = static_cast<float>(-sin(angle));
+        }
+    }
+
+    // Spectrum of n real samples, bins 0 to n/2 - 1, into outRe and outIm
+    void transform(const float* input, float* outRe, float* outIm) {
+        // Even samples as the real part, odd ones as the imaginary part
+        for (size_t i = 0; i < half; i++) {
+            re[bitReverse[i]] = input[2 * i];
+            im[bitReverse[i]] = input[2 * i + 1];
+        }
+        for (size_t length = 2; length <= half; length <<= 1) {
+            size_t step = 2 * half / length;
+            size_t middle = length / 2;
+            for (size_t start = 0; start < half; start += length) {
+                for (size_t j = 0; j < middle; j++) {
+                    float wr = cosTable[j * step];
+                    float wi = sinTable[j * step];
+                    size_t a = start + j;
+                    size_t b = a + middle;
+                    float tr = re[b] * wr - im[b] * wi;
+                    float ti = re[b] * wi + im[b] * wr;
+                    re[b] = re[a] - tr;
+                    im[b] = im[a] - ti;
+                    re[a] += tr;
+                    im[a] += ti;
+                }
+            }
+        }
+        // Split into the spectra of the even and odd samples and combine them
+        for (size_t k = 0; k < half; k++) {
+            size_t mirror = k == 0 ? 0 : half - k;
+            float zr = re[k];
+            float zi = im[k];
+            float cr = re[mirror];
+            float ci = -im[mirror];
+            float evenRe = 0.5f * (zr + cr);
+            float evenIm = 0.5f * (zi + ci);
+            float oddRe = 0.5f * (zi - ci);
+            float oddIm = -0.5f * (zr - cr);
+            outRe[k] = evenRe + cosTable[k] * oddRe - sinTable[k] * oddIm;
+            outIm[k] = evenIm + cosTable[k] * oddIm + sinTable[k] * oddRe;
+        }
+    }
+};
+
+// ---------------------------------------------------------------------------------------
+// Feature extraction over a stream of mono samples
+
+class SpectralAnalyzer {
+private:
+    int sampleRate;
+    RealFFT fft;
+    vector<float> window;
+    vector<float> binFrequencies;
+    vector<float> frame;      // last FRAME_SIZE samples
+    size_t frameFill = 0;
+    vector<float> windowed;
+    vector<float> spectrumRe;
+    vector<float> spectrumIm;
+    vector<float> power;
+    vector<float> logPower;
+    vector<float> previousLogPower;
+    bool havePrevious = false;
+
+    // Spectral descriptors, summed over the non-silent frames
+    double centroidSum = 0;
+    double rolloffSum = 0;
+    double flatnessSum = 0;
+    size_t spectralFrames = 0;
+
+    // Onset strength per hop, for the tempo estimate
+    vector<float> onsets;
+    size_t maxOnsets;
+
+    // Loudness blocks, kept as a histogram of levels so memory doesn't grow with length
+    size_t blockSize;
+    size_t blockFill = 0;
+    double blockEnergy = 0;
+    vector<double> levelEnergy;
+    vector<size_t> levelCount;
+
+    size_t samples = 0;
+    size_t zeroCrossings = 0;
+    float lastSample = 0;
+
+    // Bin of a level in the histogram; levels above +10 dBFS share the top bin
+    static int levelBin(double level) {
+        double bin = (level - LOUDNESS_ABSOLUTE_GATE) * LOUDNESS_BINS_PER_DB;
+        return static_cast<int>(max(0.0, min<double>(LOUDNESS_BINS - 1, bin)));
+    }
+
+    void addLoudnessBlock(double meanSquare) {
+        double level = 10.0 * log10(max(meanSquare, 1e-20));
+        if (!(level >= LOUDNESS_ABSOLUTE_GATE)) return;
+        int bin = levelBin(level);
+        levelEnergy[bin] += meanSquare;
+        levelCount[bin]++;
+    }
+
+    void analyzeFrame() {
+        multiply(frame.data(), window.data(), windowed.data(), FRAME_SIZE);
+        fft.transform(windowed.data(), spectrumRe.data(), spectrumIm.data());
+        powerSpectrum(spectrumRe.data(), spectrumIm.data(), power.data(), BINS);
+
+        // Log power floored at -100 dB of full scale, so silence stays flat
+        const float floor = 1e-10f * FRAME_SIZE * FRAME_SIZE;
+        for (size_t k = 0; k < BINS; k++) {
+            logPower[k] = log(power[k] + floor);
+        }
+
+        // Onset strength: how much the spectrum rose since the previous frame
+        if (onsets.size() < maxOnsets) {
+            float flux = 0.0f;
+            if (havePrevious) {
+                for (size_t k = 0; k < BINS; k++) {
+                    flux += max(0.0f, logPower[k] - previousLogPower[k]);
+                }
+            }
+            onsets.push_back(flux / BINS);
+        }
+
+        float total = 0.0f;
+        for (size_t k = 0; k < BINS; k++) total += power[k];
+        if (total >= floor * BINS) { // skip silent frames
+            centroidSum += dot(power.data(), binFrequencies.data(), BINS) / total;
+            float threshold = 0.85f * total;
+            float cumulative = 0.0f;
+            size_t rolloff = 0;
+            while (rolloff + 1 < BINS && (cumulative += power[rolloff]) < threshold) rolloff++;
+            rolloffSum += binFrequencies[rolloff];
+
+            // Geometric over arithmetic mean of the power spectrum
+            double meanLog = 0.0;
+            for (size_t k = 0; k < BINS; k++) meanLog += logPower[k];
+            meanLog /= BINS;
+            flatnessSum += min(1.0, exp(meanLog) / (total / BINS + floor));
+            spectralFrames++;
+        }
+
+        logPower.swap(previousLogPower);
+        havePrevious = true;
+    }
+
+    // Tempo from the autocorrelation of the onset envelope, between 60 and 200 BPM with a
+    // preference for tempos near 120 to settle octave ambiguities. Returns the beat strength
+    // (autocorrelation at the beat period relative to lag 0) through clarity.
+    float estimateTempo(float& clarity) const {
+        clarity = NOT_AVAILABLE;
+        double framesPerSecond = static_cast<double>(sampleRate) / HOP_SIZE;
+        size_t minLag = static_cast<size_t>(floor(60.0 * framesPerSecond / 200.0));
+        size_t maxLag = static_cast<size_t>(ceil(60.0 * framesPerSecond / 60.0));
+        if (minLag < 2 || onsets.size() < 4 * maxLag) return NOT_AVAILABLE;
+
+        double mean = 0.0;
+        for (float onset : onsets) mean += onset;
+        mean /= onsets.size();
+        vector<float> envelope(onsets.size());
+        for (size_t i = 0; i < onsets.size(); i++) {
+            envelope[i] = static_cast<float>(onsets[i] - mean);
+        }
+
+        size_t n = envelope.size();
+        double energy = sumOfSquares(envelope.data(), n) / n;
+        if (sqrt(energy) < MIN_ONSET_DEVIATION) return NOT_AVAILABLE;
+
+        // Unbiased autocorrelation for lags minLag - 1 .. maxLag + 1
+        vector<double> correlation(maxLag + 2, 0.0);
+        for (size_t lag = minLag - 1; lag <= maxLag + 1; lag++) {
+            correlation[lag] = dot(envelope.data(), envelope.data() + lag, n - lag) / (n - lag);
+        }
+
+        size_t best = 0;
+        double bestScore = 0.0;
+        for (size_t lag = minLag; lag <= maxLag; lag++) {
+            double bpm = 60.0 * framesPerSecond / lag;
+            double octaves = log2(bpm / 120.0);
+            double score = correlation[lag] * exp(-0.5 * octaves * octaves);
+            if (score > bestScore) {
+                bestScore = score;
+                best = lag;
+            }
+        }
+        if (best == 0) return NOT_AVAILABLE;
+
+        // Parabolic interpolation around the peak for a fractional period
+        double before = correlation[best - 1];
+        double peak = correlation[best];
+        double after = correlation[best + 1];
+        double offset = 0.0;
+        double curvature = before - 2.0 * peak + after;
+        if (curvature < 0.0) {
+            offset = max(-0.5, min(0.5, 0.5 * (before - after) / curvature));
+        }
+        clarity = static_cast<float>(max(0.0, min(1.0, peak / energy)));
+        return static_cast<float>(60.0 * framesPerSecond / (best + offset));
+    }
+
+    static float clamp01(double value) {
+        return static_cast<float>(max(0.0, min(1.0, value)));
+    }
+
+public:
+    SpectralAnalyzer(int rate, const AnalysisOptions& options)
+        : sampleRate(rate), fft(FRAME_SIZE), window(FRAME_SIZE), binFrequencies(BINS), frame(FRAME_SIZE),
+          windowed(FRAME_SIZE), spectrumRe(BINS), spectrumIm(BINS), power(BINS), logPower(BINS),
+          previousLogPower(BINS), levelEnergy(LOUDNESS_BINS, 0.0), levelCount(LOUDNESS_BINS, 0) {
+        for (size_t i = 0; i < FRAME_SIZE; i++) {
+            window[i] = static_cast<float>(0.5 - 0.5 * cos(2.0 * PI * i / FRAME_SIZE));
+        }
+        for (size_t k = 0; k < BINS; k++) {
+            binFrequencies[k] = static_cast<float>(k) * sampleRate / FRAME_SIZE;
+        }
+        maxOnsets = static_cast<size_t>(options.tempoSeconds * sampleRate / HOP_SIZE);
+        onsets.reserve(min<size_t>(maxOnsets, 1 << 16));
+        blockSize = max<size_t>(1, static_cast<size_t>(LOUDNESS_BLOCK_SECONDS * sampleRate));
+    }
+
+    void push(const float* input, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            zeroCrossings += (input[i] < 0.0f) != (lastSample < 0.0f);
+            lastSample = input[i];
+        }
+        samples += count;
+
+        // Loudness blocks
+        for (size_t i = 0; i < count;) {
+            size_t take = min(count - i, blockSize - blockFill);
+            blockEnergy += sumOfSquares(input + i, take);
+            blockFill += take;
+            i += take;
+            if (blockFill == blockSize) {
+                addLoudnessBlock(blockEnergy / blockSize);
+                blockFill = 0;
+                blockEnergy = 0;
+            }
+        }
+
+        // Analysis frames
+        for (size_t i = 0; i < count;) {
+            size_t take = min(count - i, FRAME_SIZE - frameFill);
+            memcpy(frame.data() + frameFill, input + i, take * sizeof(float));
+            frameFill += take;
+            i += take;
+            if (frameFill == FRAME_SIZE) {
+                analyzeFrame();
+                memmove(frame.data(), frame.data() + HOP_SIZE, (FRAME_SIZE - HOP_SIZE) * sizeof(float));
+                frameFill = FRAME_SIZE - HOP_SIZE;
+            }
+        }
+    }
+
+    AudioFeatures finish() {
+        AudioFeatures features;
+        features.sampleRate = sampleRate;
+        features.duration = static_cast<double>(samples) / sampleRate;
+        features.valid = features.duration >= MIN_DURATION_SECONDS;
+        if (blockFill > blockSize / 2) {
+            addLoudnessBlock(blockEnergy / blockFill);
+        }
+
+        // Gated loudness: blocks above the absolute gate set a relative gate 10 dB below
+        // their mean, and the blocks above that are averaged
+        double energy = 0.0;
+        size_t blocks = 0;
+        for (int bin = 0; bin < LOUDNESS_BINS; bin++) {
+            energy += levelEnergy[bin];
+            blocks += levelCount[bin];
+        }
+        features.loudness = static_cast<float>(LOUDNESS_ABSOLUTE_GATE);
+        if (blocks > 0) {
+            double gate = 10.0 * log10(energy / blocks) + LOUDNESS_RELATIVE_GATE;
+            int firstBin = levelBin(gate);
+            double gatedEnergy = 0.0;
+            size_t gatedBlocks = 0;
+            for (int bin = firstBin; bin < LOUDNESS_BINS; bin++) {
+                gatedEnergy += levelEnergy[bin];
+                gatedBlocks += levelCount[bin];
+            }
+            if (gatedBlocks > 0) {
+                features.loudness = static_cast<float>(10.0 * log10(gatedEnergy / gatedBlocks));
+            }
+        }
+
+        features.zeroCrossingRate = samples > 0 ? static_cast<float>(zeroCrossings / features.duration) : 0.0f;
+        if (spectralFrames > 0) {
+            features.spectralCentroid = static_cast<float>(centroidSum / spectralFrames);
+            features.spectralRolloff = static_cast<float>(rolloffSum / spectralFrames);
+            features.spectralFlatness = static_cast<float>(flatnessSum / spectralFrames);
+        } else {
+            features.spectralCentroid = NOT_AVAILABLE;
+            features.spectralRolloff = NOT_AVAILABLE;
+            features.spectralFlatness = NOT_AVAILABLE;
+        }
+
+        float clarity = 0.0f;
+        features.bpm = estimateTempo(clarity);
+        if (!isnan(features.bpm)) {
+            // Dance music sits around 100-130 BPM; a clear pulse there scores highest
+            double octaves = log2(features.bpm / 118.0);
+            double tempoFit = exp(-0.5 * (octaves / 0.5) * (octaves / 0.5));
+            features.danceability = 100.0f * clamp01(clarity / 0.6) * (0.5f + 0.5f * static_cast<float>(tempoFit));
+        } else {
+            features.danceability = NOT_AVAILABLE;
+        }
+
+        // Energy and acousticness on the export's 0-100 scale, from how loud, bright and
+        // noise-like the track is
+        double loud = clamp01((features.loudness + 30.0) / 25.0);
+        if (spectralFrames > 0) {
+            double bright = clamp01((features.spectralCentroid - 500.0) / 3500.0);
+            double noisy = clamp01(features.spectralFlatness / 0.4);
+            features.energy = 100.0f * clamp01(0.5 * loud + 0.3 * bright + 0.2 * noisy);
+            features.acousticness = 100.0f * clamp01(1.0 - (0.5 * bright + 0.3 * noisy + 0.2 * loud));
+        } else {
+            features.energy = 0.0f;
+            features.acousticness = NOT_AVAILABLE;
+        }
+        return features;
+    }
+};
+
+// ---------------------------------------------------------------------------------------
+// PCM sources
+
+// Decodes a file into mono samples in [-1, 1], a block at a time
+class PcmSource {
+public:
+    int sampleRate = 0;
+
+    virtual ~PcmSource() = default;
+
+    // Decode up to frames samples into out; returns 0 at the end of the stream
+    virtual size_t read(float* out, size_t frames) = 0;
+};
+
+static uint32_t readLE16(const unsigned char* data) {
+    return static_cast<uint32_t>(data[0]) | (static_cast<uint32_t>(data[1]) << 8);
+}
+
+static uint32_t readLE32(const unsigned char* data) {
+    return readLE16(data) | (readLE16(data + 2) << 16);
+}
+
+class WAVSource : public PcmSource {
+private:
+    ifstream file;
+    uint32_t format = 0;
+    uint32_t channels = 0;
+    uint32_t bitsPerSample = 0;
+    uint32_t blockAlign = 0;
+    uint64_t remaining = 0; // bytes of the data chunk not read yet
+    vector<unsigned char> raw;
+
+    static const uint32_t FORMAT_PCM = 1;
+    static const uint32_t FORMAT_FLOAT = 3;
+    static const uint32_t FORMAT_EXTENSIBLE = 0xFFFE;
+
+    float sample(const unsigned char* p) const {
+        switch (format == FORMAT_FLOAT ? bitsPerSample + 100 : bitsPerSample) {
+        case 8:
+            return (static_cast<int>(p[0]) - 128) / 128.0f;
+        case 16:
+            return static_cast<int16_t>(readLE16(p)) / 32768.0f;
+        case 24:
+            return static_cast<int32_t>((readLE16(p) << 8) | (static_cast<uint32_t>(p[2]) << 24)) / 2147483648.0f;
+        case 32:
+            return static_cast<int32_t>(readLE32(p)) / 2147483648.0f;
+        case 132: {
+            float value;
+            uint32_t bits = readLE32(p);
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+        case 164: {
+            double value;
+            uint64_t bits = readLE32(p) | (static_cast<uint64_t>(readLE32(p + 4)) << 32);
+            memcpy(&value, &bits, sizeof(value));
+            return static_cast<float>(value);
+        }
+        }
+        return 0.0f;
+    }
+
+public:
+    // Parse the RIFF chunks up to the start of the audio data
+    bool open(const string& filePath) {
+        file.open(filePath, ios::binary);
+        if (!file) {
+            cerr << "Error opening WAV file" << endl;
+            return false;
+        }
+        unsigned char header[12];
+        if (!file.read(reinterpret_cast<char*>(header), 12) || memcmp(header, "RIFF", 4) != 0 ||
+            memcmp(header + 8, "WAVE", 4) != 0) {
+            cerr << "Not a WAV file" << endl;
+            return false;
+        }
+
+        bool haveFormat = false;
+        unsigned char chunk[8];
+        while (file.read(reinterpret_cast<char*>(chunk), 8)) {
+            uint32_t size = readLE32(chunk + 4);
+            if (memcmp(chunk, "fmt ", 4) == 0) {
+                unsigned char fmt[40] = {};
+                size_t length = min<size_t>(size, sizeof(fmt));
+                if (size < 16 || !file.read(reinterpret_cast<char*>(fmt), length)) break;
+                format = readLE16(fmt);
+                channels = readLE16(fmt + 2);
+                sampleRate = static_cast<int>(readLE32(fmt + 4));
+                blockAlign = readLE16(fmt + 12);
+                bitsPerSample = readLE16(fmt + 14);
+                if (format == FORMAT_EXTENSIBLE && size >= 26) {
+                    format = readLE16(fmt + 24); // first two bytes of the sub-format GUID
+                }
+                haveFormat = true;
+                file.seekg(static_cast<streamoff>(size - length + (size & 1)), ios::cur);
+            } else if (memcmp(chunk, "data", 4) == 0) {
+                if (!haveFormat) break;
+                // Streamed files leave the size at 0 or 0xFFFFFFFF; read to the end then
+                remaining = size == 0 || size == 0xFFFFFFFF ? numeric_limits<uint64_t>::max() : size;
+                bool supported = (format == FORMAT_PCM && (bitsPerSample == 8 || bitsPerSample == 16 ||
+                                                           bitsPerSample == 24 || bitsPerSample == 32)) ||
+                                 (format == FORMAT_FLOAT && (bitsPerSample == 32 || bitsPerSample == 64));
+                if (!supported || channels == 0 || sampleRate <= 0 || blockAlign < channels * bitsPerSample / 8) {
+                    cerr << "Unsupported WAV encoding" << endl;
+                    return false;
+                }
+                return true;
+            } else {
+                file.seekg(static_cast<streamoff>(size) + (size & 1), ios::cur);
+            }
+        }
+        cerr << "Invalid WAV file" << endl;
+        return false;
+    }
+
+    size_t read(float* out, size_t frames) override {
+        size_t want = static_cast<size_t>(min<uint64_t>(frames, remaining / blockAlign));
+        if (want == 0) return 0;
+        raw.resize(want * blockAlign);
+        file.read(reinterpret_cast<char*>(raw.data()), static_cast<streamsize>(raw.size()));
+        size_t got = static_cast<size_t>(file.gcount()) / blockAlign;
+        remaining -= got * blockAlign;
+        if (got < want) remaining = 0;
+
+        size_t bytesPerSample = bitsPerSample / 8;
+        float scale = 1.0f / channels;
+        for (size_t i = 0; i < got; i++) {
+            const unsigned char* p = raw.data() + i * blockAlign;
+            float sum = 0.0f;
+            for (uint32_t c = 0; c < channels; c++) {
+                sum += sample(p + c * bytesPerSample);
+            }
+            out[i] = sum * scale;
+        }
+        return got;
+    }
+};
+
+// CRC-16 of FLAC frames: polynomial 0x8005, MSB first, starting from 0
+static const uint16_t* crc16Table() {
+    static const vector<uint16_t> table = [] {
+        vector<uint16_t> values(256);
+        for (uint32_t byte = 0; byte < 256; byte++) {
+            uint32_t crc = byte << 8;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1;
+            }
+            values[byte] = static_cast<uint16_t>(crc);
+        }
+        return values;
+    }();
+    return table.data();
+}
+
+// MSB-first bit reader over a file, refilled a buffer at a time. It keeps a CRC-16 of the
+// bytes since beginChecksum(); bytes already pulled into the bit cache but not consumed are
+// accounted for through a short history.
+class BitReader {
+private:
+    istream& in;
+    vector<unsigned char> buffer;
+    size_t position = 0;
+    size_t length = 0;
+    uint64_t cache = 0;
+    int cacheBits = 0;
+    bool exhausted = false;
+
+    const uint16_t* crcTable = crc16Table();
+    uint16_t crc = 0;
+    uint64_t fetched = 0;
+    unsigned char recent[8] = {};
+    uint16_t crcBefore[8] = {}; // crc before each recent byte
+
+    void checksumByte(unsigned char byte) {
+        size_t slot = fetched & 7;
+        recent[slot] = byte;
+        crcBefore[slot] = crc;
+        crc = static_cast<uint16_t>((crc << 8) ^ crcTable[(crc >> 8) ^ byte]);
+        fetched++;
+    }
+
+    unsigned nextByte() {
+        if (position == length) {
+            in.read(reinterpret_cast<char*>(buffer.data()), static_cast<streamsize>(buffer.size()));
+            length = static_cast<size_t>(in.gcount());
+            position = 0;
+            if (length == 0) {
+                exhausted = true;
+                return 0;
+            }
+        }
+        checksumByte(buffer[position]);
+        return buffer[position++];
+    }
+
+public:
+    explicit BitReader(istream& input) : in(input), buffer(64 * 1024) {}
+
+    // Restart the checksum at the current position, which must be on a byte boundary
+    void beginChecksum() {
+        size_t pending = static_cast<size_t>(cacheBits / 8);
+        uint64_t first = fetched - pending;
+        crc = 0;
+        fetched = first;
+        for (size_t i = 0; i < pending; i++) {
+            checksumByte(recent[(first + i) & 7]);
+        }
+    }
+
+    // Checksum of the bytes consumed since beginChecksum(), on a byte boundary
+    uint16_t checksum() const {
+        size_t pending = static_cast<size_t>(cacheBits / 8);
+        return pending == 0 ? crc : crcBefore[(fetched - pending) & 7];
+    }
+
+    // Whether a read went past the end of the file
+    bool ended() const {
+        return exhausted;
+    }
+
+    // Up to 32 bits
+    uint32_t read(int bits) {
+        if (bits == 0) return 0;
+        while (cacheBits < bits) {
+            cache = (cache << 8) | nextByte();
+            cacheBits += 8;
+        }
+        cacheBits -= bits;
+        return static_cast<uint32_t>((cache >> cacheBits) & ((uint64_t(1) << bits) - 1));
+    }
+
+    int32_t readSigned(int bits) {
+        if (bits == 0) return 0;
+        uint32_t value = read(bits);
+        uint32_t sign = 1u << (bits - 1);
+        return static_cast<int32_t>((value ^ sign) - sign);
+    }
+
+    // Number of 0 bits before the next 1 bit, which is consumed
+    uint32_t readUnary() {
+        uint32_t zeros = 0;
+        while (true) {
+            if (cacheBits == 0) {
+                cache = nextByte();
+                cacheBits = 8;
+                if (exhausted) return zeros;
+            }
+            uint64_t pending = cache & ((uint64_t(1) << cacheBits) - 1);
+            if (pending == 0) {
+                zeros += cacheBits;
+                cacheBits = 0;
+                continue;
+            }
+            while (!((pending >> (cacheBits - 1)) & 1)) {
+                zeros++;
+                cacheBits--;
+            }
+            cacheBits--;
+            return zeros;
+        }
+    }
+
+    void alignToByte() {
+        cacheBits -= cacheBits % 8;
+    }
+};
+
+// FLAC decoder for the frames that follow the metadata read by readFLACHeader: constant,
+// verbatim, fixed and LPC subframes with Rice-coded residuals, and the stereo decorrelation
+// modes. Decoding stops at the first frame that doesn't parse or fails its CRC-16, so a
+// damaged or truncated file is analysed up to the damage.
+class FLACSource : public PcmSource {
+private:
+    ifstream file;
+    FLACStreamInfo info;
+    unique_ptr<BitReader> bits;
+    vector<vector<int32_t>> channelSamples;
+    vector<float> decoded; // mono samples of the current frame
+    size_t decodedPosition = 0;
+    bool finished = false;
+
+    bool decodeResidual(int32_t* out, size_t blockSize, size_t order) {
+        uint32_t method = bits->read(2);
+        if (method > 1) return false;
+        int parameterBits = method == 0 ? 4 : 5;
+        uint32_t escape = method == 0 ? 15 : 31;
+        uint32_t partitionOrder = bits->read(4);
+        size_t partitionSize = blockSize >> partitionOrder;
+        if ((partitionSize << partitionOrder) != blockSize || partitionSize < order) return false;
+
+        size_t i = order;
+        for (size_t partition = 0; partition < (size_t(1) << partitionOrder); partition++) {
+            size_t count = partition == 0 ? partitionSize - order : partitionSize;
+            uint32_t parameter = bits->read(parameterBits);
+            if (parameter == escape) {
+                int rawBits = static_cast<int>(bits->read(5));
+                for (size_t j = 0; j < count; j++) out[i++] = bits->readSigned(rawBits);
+            } else {
+                for (size_t j = 0; j < count; j++) {
+                    uint32_t value = (bits->readUnary() << parameter) | bits->read(static_cast<int>(parameter));
+                    out[i++] = static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+                }
+            }
+            if (bits->ended()) return false;
+        }
+        return true;
+    }
+
+    bool decodeSubframe(int32_t* out, size_t blockSize, int sampleBits) {
+        if (bits->read(1) != 0) return false;
+        uint32_t type = bits->read(6);
+        int wasted = 0;
+        if (bits->read(1)) {
+            wasted = static_cast<int>(bits->readUnary()) + 1;
+            sampleBits -= wasted;
+        }
+        if (sampleBits <= 0 || sampleBits > 32) return false;
+
+        if (type == 0) { // constant
+            fill(out, out + blockSize, bits->readSigned(sampleBits));
+        } else if (type == 1) { // verbatim
+            for (size_t i = 0; i < blockSize; i++) out[i] = bits->readSigned(sampleBits);
+        } else if (type >= 8 && type <= 12) { // fixed predictor
+            size_t order = type - 8;
+            if (order > blockSize) return false;
+            for (size_t i = 0; i < order; i++) out[i] = bits->readSigned(sampleBits);
+            if (!decodeResidual(out, blockSize, order)) return false;
+            for (size_t i = order; i < blockSize; i++) {
+                int64_t prediction = 0;
+                switch (order) {
+                case 1: prediction = out[i - 1]; break;
+                case 2: prediction = 2 * int64_t(out[i - 1]) - out[i - 2]; break;
+                case 3: prediction = 3 * int64_t(out[i - 1]) - 3 * int64_t(out[i - 2]) + out[i - 3]; break;
+                case 4: prediction = 4 * int64_t(out[i - 1]) - 6 * int64_t(out[i - 2]) + 4 * int64_t(out[i - 3]) - out[i - 4]; break;
+                }
+                out[i] = static_cast<int32_t>(out[i] + prediction);
+            }
+        } else if (type >= 32) { // LPC
+            size_t order = type - 31;
+            if (order > blockSize) return false;
+            for (size_t i = 0; i < order; i++) out[i] = bits->readSigned(sampleBits);
+            int precision = static_cast<int>(bits->read(4)) + 1;
+            int shift = bits->readSigned(5);
+            if (precision == 16 || shift < 0) return false;
+            int32_t coefficients[32];
+            for (size_t j = 0; j < order; j++) coefficients[j] = bits->readSigned(precision);
+            if (!decodeResidual(out, blockSize, order)) return false;
+            for (size_t i = order; i < blockSize; i++) {
+                int64_t sum = 0;
+                for (size_t j = 0; j < order; j++) sum += int64_t(coefficients[j]) * out[i - 1 - j];
+                out[i] = static_cast<int32_t>(out[i] + (sum >> shift));
+            }
+        } else {
+            return false;
+        }
+
+        if (wasted > 0) {
+            for (size_t i = 0; i < blockSize; i++) out[i] = static_cast<int32_t>(static_cast<uint32_t>(out[i]) << wasted);
+        }
+        return !bits->ended();
+    }
+
+    bool decodeFrame() {
+        bits->beginChecksum();
+        uint32_t sync = bits->read(15);
+        if (bits->ended() || sync != 0x7FFC) return false; // 14 sync bits and a reserved 0
+        bits->read(1);                                       // fixed or variable block size
+
+        uint32_t blockCode = bits->read(4);
+        uint32_t rateCode = bits->read(4);
+        uint32_t channelCode = bits->read(4);
+        uint32_t sizeCode = bits->read(3);
+        bits->read(1);
+
+        // Frame or sample number, UTF-8 style: the leading 1 bits count the extra bytes
+        uint32_t first = bits->read(8);
+        int extra = 0;
+        for (uint32_t mask = 0x80; first & mask; mask >>= 1) extra++;
+        if (extra == 1 || extra > 7) return false;
+        for (int i = 1; i < extra; i++) bits->read(8);
+
+        size_t blockSize = 0;
+        if (blockCode == 1) blockSize = 192;
+        else if (blockCode >= 2 && blockCode <= 5) blockSize = size_t(576) << (blockCode - 2);
+        else if (blockCode == 6) blockSize = bits->read(8) + 1;
+        else if (blockCode == 7) blockSize = bits->read(16) + 1;
+        else if (blockCode >= 8) blockSize = size_t(256) << (blockCode - 8);
+        else return false;
+
+        if (rateCode == 12) bits->read(8);
+        else if (rateCode == 13 || rateCode == 14) bits->read(16);
+        else if (rateCode == 15) return false;
+
+        static const int sampleSizes[8] = {0, 8, 12, 0, 16, 20, 24, 32};
+        int sampleBits = sizeCode == 0 ? static_cast<int>(info.bitsPerSample) : sampleSizes[sizeCode];
+        if (sampleBits == 0) return false;
+        bits->read(8); // CRC-8 of the header
+
+        size_t channels = channelCode < 8 ? channelCode + 1 : 2;
+        if (channelCode > 10) return false;
+        if (channelSamples.size() < channels) channelSamples.resize(channels);
+        for (size_t c = 0; c < channels; c++) {
+            if (channelSamples[c].size() < blockSize) channelSamples[c].resize(blockSize);
+            // The side channel carries one extra bit
+            bool side = (channelCode == 8 && c == 1) || (channelCode == 9 && c == 0) || (channelCode == 10 && c == 1);
+            if (!decodeSubframe(channelSamples[c].data(), blockSize, sampleBits + (side ? 1 : 0))) return false;
+        }
+        bits->alignToByte();
+        uint16_t checksum = bits->checksum();
+        if (bits->read(16) != checksum) {
+            cerr << "Damaged FLAC frame, decoding stopped" << endl;
+            return false;
+        }
+
+        int32_t* first_channel = channelSamples[0].data();
+        int32_t* second_channel = channels > 1 ? channelSamples[1].data() : nullptr;
+        if (channelCode == 8) { // left, side
+            for (size_t i = 0; i < blockSize; i++) second_channel[i] = first_channel[i] - second_channel[i];
+        } else if (channelCode == 9) { // side, right
+            for (size_t i = 0; i < blockSize; i++) first_channel[i] += second_channel[i];
+        } else if (channelCode == 10) { // mid, side
+            for (size_t i = 0; i < blockSize; i++) {
+                int64_t side = second_channel[i];
+                int64_t mid = (int64_t(first_channel[i]) * 2) | (side & 1);
+                first_channel[i] = static_cast<int32_t>((mid + side) >> 1);
+                second_channel[i] = static_cast<int32_t>((mid - side) >> 1);
+            }
+        }
+
+        decoded.resize(blockSize);
+        float scale = 1.0f / (static_cast<float>(int64_t(1) << (sampleBits - 1)) * channels);
+        for (size_t i = 0; i < blockSize; i++) {
+            int64_t sum = 0;
+            for (size_t c = 0; c < channels; c++) sum += channelSamples[c][i];
+            decoded[i] = static_cast<float>(sum) * scale;
+        }
+        decodedPosition = 0;
+        return true;
+    }
+
+public:
+    bool open(const string& filePath) {
+        file.open(filePath, ios::binary);
+        if (!file) {
+            cerr << "Error opening FLAC file" << endl;
+            return false;
+        }
+        if (!readFLACHeader(file, info, nullptr) || info.sampleRate == 0 || info.bitsPerSample < 4) {
+            cerr << "Not a FLAC file" << endl;
+            return false;
+        }
+        sampleRate = static_cast<int>(info.sampleRate);
+        channelSamples.assign(info.channels, vector<int32_t>(info.maxBlockSize));
+        bits.reset(new BitReader(file));
+        return true;
+    }
+
+    size_t read(float* out, size_t frames) override {
+        size_t written = 0;
+        while (written < frames) {
+            if (decodedPosition == decoded.size()) {
+                if (finished || !decodeFrame()) {
+                    finished = true;
+                    decoded.clear();
+                    decodedPosition = 0;
+                    break;
+                }
+            }
+            size_t take = min(frames - written, decoded.size() - decodedPosition);
+            memcpy(out + written, decoded.data() + decodedPosition, take * sizeof(float));
+            decodedPosition += take;
+            written += take;
+        }
+        return written;
+    }
+};
+
+} // namespace
+
+static AudioFeatures analyzeSource(PcmSource& source, const AnalysisOptions& options) {
+    SpectralAnalyzer analyzer(source.sampleRate, options);
+    vector<float> block(max<size_t>(1, options.blockFrames));
+    while (size_t frames = source.read(block.data(), block.size())) {
+        analyzer.push(block.data(), frames);
+    }
+    return analyzer.finish();
+}
+
+AudioFeatures analyzeWAV(const std::string& filePath, const AnalysisOptions& options) {
+    WAVSource source;
+    if (!source.open(filePath)) {
+        return AudioFeatures();
+    }
+    return analyzeSource(source, options);
+}
+
+AudioFeatures analyzeFLAC(const std::string& filePath, const AnalysisOptions& options) {
+    FLACSource source;
+    if (!source.open(filePath)) {
+        return AudioFeatures();
+    }
+    return analyzeSource(source, options);
+}
+
+AudioFeatures analyzeAudioFile(const std::string& filePath, const AnalysisOptions& options) {
+    size_t dot_pos = filePath.find_last_of('.');
+    if (dot_pos != string::npos) {
+        string ext = filePath.substr(dot_pos + 1);
+        transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        if (ext == "wav" || ext == "wave") {
+            return analyzeWAV(filePath, options);
+        } else if (ext == "flac") {
+            return analyzeFLAC(filePath, options);
+        }
+    }
+    cerr << "Unsupported audio format: " << filePath << endl;
+    return AudioFeatures();
+}
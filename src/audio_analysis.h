@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// Descriptors computed from the decoded audio of a track. Values the audio doesn't support
+// (the tempo of a track without a steady beat, the spectrum of a silent one) are NaN.
+struct AudioFeatures {
+    bool valid = false;           // the file was decoded and long enough to analyse
+    int sampleRate = 0;
+    double duration = 0;          // seconds decoded
+    float loudness = 0;           // gated RMS level in dBFS, comparable to the export's "Loud (Db)"
+    float energy = 0;             // 0-100, from loudness, brightness and noisiness
+    float acousticness = 0;       // 0-100, dark and tonal rather than bright and dense
+    float bpm = 0;
+    float danceability = 0;       // 0-100, strength of the beat and how danceable its tempo is
+    float spectralCentroid = 0;   // Hz, mean over the non-silent frames
+    float spectralRolloff = 0;    // Hz below which 85% of a frame's energy lies, mean
+    float spectralFlatness = 0;   // 0 (tonal) to 1 (noise-like), mean
+    float zeroCrossingRate = 0;   // sign changes per second
+};
+
+struct AnalysisOptions {
+    // PCM frames decoded and analysed at a time; memory per file doesn't grow with its length
+    size_t blockFrames = 4096;
+    // Seconds of the onset envelope kept for the tempo estimate
+    double tempoSeconds = 360;
+};
+
+// Decode a WAV (PCM 8-32 bit or float) or FLAC file block by block and analyse it. The
+// channels are mixed down to mono. Safe to call from several threads at once.
+AudioFeatures analyzeWAV(const std::string& filePath, const AnalysisOptions& options = AnalysisOptions());
+AudioFeatures analyzeFLAC(const std::string& filePath, const AnalysisOptions& options = AnalysisOptions());
+AudioFeatures analyzeAudioFile(const std::string& filePath, const AnalysisOptions& options = AnalysisOptions());
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+// Helpers for the native-endian binary files written next to the index. Arrays are
+// aligned to 8 bytes in the file so that a memory-mapped reader can use them in place.
+namespace binary_io {
+
+constexpr size_t ARRAY_ALIGNMENT = 8;
+
+template <typename T>
+void write_pod(std::ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Pad with zeros up to the next multiple of alignment (relative to the file start)
+inline void pad_to(std::ostream& out, size_t alignment) {
+    static const char zeros[64] = {};
+    size_t position = static_cast<size_t>(out.tellp());
+    size_t padding = (alignment - position % alignment) % alignment;
+    while (padding > 0) {
+        size_t chunk = padding < sizeof(zeros) ? padding : sizeof(zeros);
+        out.write(zeros, chunk);
+        padding -= chunk;
+    }
+}
+
+template <typename T>
+void write_array(std::ostream& out, const T* data, size_t count) {
+    write_pod(out, static_cast<uint64_t>(count));
+    pad_to(out, ARRAY_ALIGNMENT);
+    if (count > 0) {
+        out.write(reinterpret_cast<const char*>(data), count * sizeof(T));
+    }
+    pad_to(out, ARRAY_ALIGNMENT);
+}
+
+inline void write_string(std::ostream& out, std::string_view value) {
+    write_array(out, value.data(), value.size());
+}
+
+// Bounds-checked reader over a mapped byte range. Arrays are returned as pointers into the
+// range rather than copied.
+class Cursor {
+private:
+    const char* base;
+    size_t length;
+    size_t pos = 0;
+
+    void require(size_t bytes) const {
+        if (bytes > length - pos) {
+            throw std::runtime_error("Truncated binary data");
+        }
+    }
+
+    void align(size_t alignment) {
+        uintptr_t address = reinterpret_cast<uintptr_t>(base + pos);
+        size_t padding = (alignment - address % alignment) % alignment;
+        require(padding);
+        pos += padding;
+    }
+
+public:
+    Cursor(const char* data, size_t size) : base(data), length(size) {}
+
+    template <typename T>
+    T read_pod() {
+        require(sizeof(T));
+        T value;
+        std::memcpy(&value, base + pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    template <typename T>
+    const T* read_array(size_t& count) {
+        uint64_t stored = read_pod<uint64_t>();
+        align(ARRAY_ALIGNMENT);
+        if (stored > (length - pos) / sizeof(T)) {
+            throw std::runtime_error("Truncated binary data");
+        }
+        const T* data = reinterpret_cast<const T*>(base + pos);
+        count = static_cast<size_t>(stored);
+        pos += count * sizeof(T);
+        align(ARRAY_ALIGNMENT);
+        return data;
+    }
+
+    std::string_view read_string() {
+        size_t size = 0;
+        const char* data = read_array<char>(size);
+        return std::string_view(data, size);
+    }
+
+    const char* current() const {
+        return base + pos;
+    }
+
+    void skip(size_t bytes) {
+        require(bytes);
+        pos += bytes;
+    }
+
+    size_t remaining() const {
+        return length - pos;
+    }
+};
+
+}  // namespace binary_io
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+// Growable bitset over dense ids, one bit per id
+class DynamicBitset {
+private:
+    std::vector<uint64_t> words;
+    size_t bits = 0;
+    size_t ones = 0;
+
+public:
+    DynamicBitset() = default;
+    explicit DynamicBitset(size_t size) : words((size + 63) / 64, 0), bits(size) {}
+
+    // Grow or shrink to size bits; new bits start cleared
+    void resize(size_t size) {
+        if (size < bits) {
+            for (size_t i = size; i < bits; i++) {
+                if (test(i)) ones--;
+            }
+        }
+        words.resize((size + 63) / 64, 0);
+        if (size % 64 != 0 && !words.empty()) {
+            words.back() &= (uint64_t(1) << (size % 64)) - 1;
+        }
+        bits = size;
+    }
+
+    // Ids past the end read as cleared
+    bool test(size_t i) const {
+        return i < bits && (words[i / 64] >> (i % 64)) & 1;
+    }
+
+    // Set a bit, growing the set if needed
+    void set(size_t i) {
+        if (i >= bits) resize(i + 1);
+        uint64_t mask = uint64_t(1) << (i % 64);
+        if (!(words[i / 64] & mask)) {
+            words[i / 64] |= mask;
+            ones++;
+        }
+    }
+
+    void reset(size_t i) {
+        if (i >= bits) return;
+        uint64_t mask = uint64_t(1) << (i % 64);
+        if (words[i / 64] & mask) {
+            words[i / 64] &= ~mask;
+            ones--;
+        }
+    }
+
+    // Clear every bit but keep the size
+    void reset() {
+        std::fill(words.begin(), words.end(), 0);
+        ones = 0;
+    }
+
+    size_t size() const {
+        return bits;
+    }
+
+    size_t count() const {
+        return ones;
+    }
+
+    const uint64_t* data() const {
+        return words.data();
+    }
+
+    // Call f(i) for every set bit in increasing order, skipping empty words
+    template <typename F>
+    void for_each_set(F f) const {
+        for (size_t w = 0; w < words.size(); w++) {
+            uint64_t word = words[w];
+            for (size_t b = 0; word != 0; b++, word >>= 1) {
+                if (word & 1) f(w * 64 + b);
+            }
+        }
+    }
+};
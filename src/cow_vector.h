@@ -0,0 +1,118 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <initializer_list>
+
+// Vector of trivially copyable values that can either own its storage or borrow a read-only
+// array, typically a section of a memory-mapped snapshot. Borrowed contents are copied into
+// owned storage the first time the vector is modified.
+template <typename T>
+class CowVector {
+private:
+    std::vector<T> owned;
+    const T* borrowed = nullptr;
+    size_t borrowed_size = 0;
+
+    void materialize(size_t extra = 0) {
+        if (!borrowed) return;
+        owned.reserve(borrowed_size + extra);
+        owned.assign(borrowed, borrowed + borrowed_size);
+        borrowed = nullptr;
+        borrowed_size = 0;
+    }
+
+public:
+    CowVector() = default;
+    CowVector(size_t count, const T& value) : owned(count, value) {}
+    CowVector(std::initializer_list<T> values) : owned(values) {}
+
+    // Point at external storage that must outlive the vector or the next modification
+    void borrow(const T* data, size_t count) {
+        std::vector<T>().swap(owned);
+        borrowed = data;
+        borrowed_size = count;
+    }
+
+    bool is_borrowed() const {
+        return borrowed != nullptr;
+    }
+
+    const T* data() const {
+        return borrowed ? borrowed : owned.data();
+    }
+
+    T* mutable_data() {
+        materialize();
+        return owned.data();
+    }
+
+    size_t size() const {
+        return borrowed ? borrowed_size : owned.size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    const T& operator[](size_t i) const {
+        return data()[i];
+    }
+
+    const T& back() const {
+        return data()[size() - 1];
+    }
+
+    void set(size_t i, const T& value) {
+        materialize();
+        owned[i] = value;
+    }
+
+    void push_back(const T& value) {
+        materialize(1);
+        owned.push_back(value);
+    }
+
+    void append(const T* first, size_t count) {
+        materialize(count);
+        owned.insert(owned.end(), first, first + count);
+    }
+
+    void resize(size_t count, const T& value = T()) {
+        materialize();
+        owned.resize(count, value);
+    }
+
+    void reserve(size_t count) {
+        materialize(count > size() ? count - size() : 0);
+        owned.reserve(count);
+    }
+
+    size_t capacity() const {
+        return borrowed ? borrowed_size : owned.capacity();
+    }
+
+    void clear() {
+        borrowed = nullptr;
+        borrowed_size = 0;
+        owned.clear();
+    }
+
+    void assign(size_t count, const T& value) {
+        borrowed = nullptr;
+        borrowed_size = 0;
+        owned.assign(count, value);
+    }
+
+    // Release owned memory as well as any borrowed view
+    void release() {
+        borrowed = nullptr;
+        borrowed_size = 0;
+        std::vector<T>().swap(owned);
+    }
+
+    // Bytes of heap memory owned by the vector; borrowed storage is not counted
+    size_t memory_usage() const {
+        return owned.capacity() * sizeof(T);
+    }
+};
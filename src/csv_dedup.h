@@ -0,0 +1,252 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <chrono>
+#include <filesystem>
+
+#include "csv_reader.h"
+#include "track_manifest.h"
+#include "hash.h"
+
+// Canonical forms of the fields that identify a track, so that exports which spell the same
+// track slightly differently ("Don't Stop Me Now" / "Dont stop me now ") still match.
+namespace track_text {
+
+// Lowercase ASCII letters and digits, drop apostrophes, and collapse every other run of
+// punctuation and whitespace into a single space. Non-ASCII bytes are kept as they are.
+inline void normalize(std::string_view text, std::string& out) {
+    out.clear();
+    bool pending_space = false;
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if (c == '\'') continue;
+        // U+2019 RIGHT SINGLE QUOTATION MARK, the apostrophe most streaming services use
+        if (c == 0xE2 && i + 2 < text.size() && static_cast<unsigned char>(text[i + 1]) == 0x80 &&
+            static_cast<unsigned char>(text[i + 2]) == 0x99) {
+            i += 2;
+            continue;
+        }
+
+        bool keep = (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80;
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<unsigned char>(c - 'A' + 'a');
+            keep = true;
+        }
+        if (!keep) {
+            pending_space = !out.empty();
+            continue;
+        }
+        if (pending_space) {
+            out.push_back(' ');
+            pending_space = false;
+        }
+        out.push_back(static_cast<char>(c));
+    }
+}
+
+// Title without version suffixes: "Song - Remastered 2011", "Song (Radio Edit)" and
+// "Song [Live]" all become "song"
+inline void base_title(std::string_view title, std::string& out) {
+    size_t cut = title.size();
+    size_t dash = title.find(" - ");
+    if (dash != std::string_view::npos && dash > 0) cut = dash;
+    size_t bracket = title.find_first_of("([");
+    if (bracket != std::string_view::npos && bracket > 0) cut = std::min(cut, bracket);
+    normalize(title.substr(0, cut), out);
+}
+
+inline std::string_view trim(std::string_view text) {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) text.remove_prefix(1);
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) text.remove_suffix(1);
+    return text;
+}
+
+} // namespace track_text
+
+// Set of 64-bit key hashes with open addressing and linear probing. Eight bytes per slot and
+// at most half full, so a million distinct tracks take 16-32 MB. 0 marks an empty slot.
+class HashSet64 {
+private:
+    std::vector<uint64_t> slots;
+    size_t count = 0;
+
+    void rehash(size_t size) {
+        std::vector<uint64_t> old;
+        old.swap(slots);
+        slots.assign(size, 0);
+        count = 0;
+        for (uint64_t value : old) {
+            if (value != 0) insert(value);
+        }
+    }
+
+public:
+    // Add a hash; false if it was already present
+    bool insert(uint64_t value) {
+        if (value == 0) value = 1;
+        if ((count + 1) * 2 > slots.size()) {
+            rehash(std::max<size_t>(64, slots.size() * 2));
+        }
+        size_t mask = slots.size() - 1;
+        for (size_t i = static_cast<size_t>(value) & mask;; i = (i + 1) & mask) {
+            if (slots[i] == value) return false;
+            if (slots[i] == 0) {
+                slots[i] = value;
+                count++;
+                return true;
+            }
+        }
+    }
+
+    void reserve(size_t values) {
+        size_t size = 64;
+        while (size < values * 2) size *= 2;
+        if (size > slots.size()) {
+            rehash(size);
+        }
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    void clear() {
+        slots.clear();
+        count = 0;
+    }
+};
+
+// Drops repeated tracks from a stream of CSV rows. A row is a repeat if its Spotify Track Id,
+// its ISRC, or its normalized Song + Artist was already seen on an earlier row; the first
+// occurrence is the one kept. Rows with none of these keys are always kept.
+class DuplicateFilter {
+private:
+    TrackManifest::KeyColumns columns;
+    HashSet64 seen;
+    std::string song;
+    std::string artist;
+    std::string isrc_code;
+
+    // Each kind of key hashes with its own seed so an ISRC never collides with a title
+    static constexpr uint64_t SPOTIFY_SEED = 0x5370;
+    static constexpr uint64_t ISRC_SEED = 0x4953;
+    static constexpr uint64_t TITLE_SEED = 0x5469;
+
+    static std::string_view field(const std::vector<std::string_view>& fields, size_t i) {
+        return i < fields.size() ? track_text::trim(fields[i]) : std::string_view();
+    }
+
+public:
+    explicit DuplicateFilter(const TrackManifest::KeyColumns& key_columns) : columns(key_columns) {}
+
+    // Record the keys of a row; true if none of them was seen before. All of a row's keys are
+    // recorded even when it turns out to be a repeat, so a later row matching it only by title
+    // is caught too.
+    bool first_occurrence(const std::vector<std::string_view>& fields) {
+        bool first = true;
+        std::string_view spotify_id = field(fields, columns.spotify_id);
+        if (!spotify_id.empty()) {
+            first &= seen.insert(hash_string(spotify_id, SPOTIFY_SEED));
+        }
+
+        std::string_view isrc = field(fields, columns.isrc);
+        if (!isrc.empty()) {
+            // ISRCs are case-insensitive and sometimes exported with dashes
+            isrc_code.clear();
+            for (char c : isrc) {
+                if (c == '-') continue;
+                isrc_code.push_back(c >= 'a' && c <= 'z' ? static_cast<char>(c - 'a' + 'A') : c);
+            }
+            first &= seen.insert(hash_string(isrc_code, ISRC_SEED));
+        }
+
+        track_text::normalize(field(fields, columns.song), song);
+        track_text::normalize(field(fields, columns.artist), artist);
+        if (!song.empty()) {
+            song.push_back('\x1f');
+            song += artist;
+            first &= seen.insert(hash_string(song, TITLE_SEED));
+        }
+        return first;
+    }
+
+    void reserve(size_t rows) {
+        seen.reserve(rows);
+    }
+};
+
+// Result of dedup_csv
+struct DedupStats {
+    size_t rows = 0;
+    size_t kept = 0;
+    size_t duplicates = 0;
+    double seconds = 0.0;
+};
+
+// Copy a playlist export without its repeated tracks, in a single pass. Kept rows are written
+// byte for byte, line endings included, in their original order, header included.
+inline DedupStats dedup_csv(const std::string& input_path, const std::string& output_path) {
+    std::error_code error;
+    if (std::filesystem::equivalent(input_path, output_path, error)) {
+        throw std::invalid_argument("De-duplication can't write over its input");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    MappedFile file(input_path);
+    std::string_view text = file.view();
+    CsvReader reader(text);
+
+    std::ofstream out(output_path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Failed to open output file: " + output_path);
+    }
+
+    // Bytes of the row the reader just parsed, without the blank lines it skipped
+    size_t row_start = 0;
+    auto row_text = [&] {
+        size_t begin = row_start;
+        while (begin < reader.offset() && (text[begin] == '\n' || text[begin] == '\r')) begin++;
+        return text.substr(begin, reader.offset() - begin);
+    };
+    // Its line ending as it was in the input: CRLF, LF, CR, or nothing at the end of the file
+    auto row_end = [&] {
+        size_t end = reader.offset();
+        size_t length = end < text.size() && (text[end] == '\n' || text[end] == '\r') ? 1 : 0;
+        if (length && text[end] == '\r' && end + 1 < text.size() && text[end + 1] == '\n') length = 2;
+        return text.substr(end, length);
+    };
+
+    DedupStats stats;
+    if (!reader.next_row()) {
+        return stats;
+    }
+    std::vector<std::string> headers(reader.row().begin(), reader.row().end());
+    out << row_text() << row_end();
+
+    DuplicateFilter filter{TrackManifest::KeyColumns(headers)};
+    filter.reserve(count_csv_lines(text));
+    row_start = reader.offset();
+    while (reader.next_row()) {
+        stats.rows++;
+        if (filter.first_occurrence(reader.row())) {
+            out << row_text() << row_end();
+            stats.kept++;
+        } else {
+            stats.duplicates++;
+        }
+        row_start = reader.offset();
+    }
+
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Failed to write output file: " + output_path);
+    }
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
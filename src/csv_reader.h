@@ -0,0 +1,261 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file. The mapping lives as long as the object,
+// so string_views into view() must not outlive it. Sequential mappings ask the kernel for
+// aggressive read-ahead; the others are paged in lazily as they are touched.
+class MappedFile {
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+
+    void close() {
+#ifdef _WIN32
+        if (data_) UnmapViewOfFile(data_);
+        if (mapping_) CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+        mapping_ = nullptr;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (data_) munmap(const_cast<char*>(data_), size_);
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+#endif
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+public:
+    explicit MappedFile(const std::string& path, bool sequential = true) {
+#ifdef _WIN32
+        file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Could not open file: " + path);
+        }
+        LARGE_INTEGER file_size;
+        GetFileSizeEx(file_, &file_size);
+        size_ = static_cast<size_t>(file_size.QuadPart);
+        if (size_ > 0) {
+            mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping_) {
+                data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+            }
+            if (!data_) {
+                close();
+                throw std::runtime_error("Could not map file: " + path);
+            }
+        }
+#else
+        fd_ = ::open(path.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::runtime_error("Could not open file: " + path);
+        }
+        struct stat st;
+        if (fstat(fd_, &st) != 0) {
+            close();
+            throw std::runtime_error("Could not stat file: " + path);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            void* mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+            if (mapped == MAP_FAILED) {
+                size_ = 0;
+                close();
+                throw std::runtime_error("Could not map file: " + path);
+            }
+            data_ = static_cast<const char*>(mapped);
+            if (sequential) {
+                madvise(mapped, size_, MADV_SEQUENTIAL);
+            }
+        }
+#endif
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    std::string_view view() const { return std::string_view(data_, size_); }
+};
+
+// RFC 4180 tokenizer that splits rows into string_views pointing straight into the input.
+// Only fields containing doubled quotes ("") are copied, into a scratch buffer owned by the
+// reader; row() stays valid until the next call to next_row().
+class CsvReader {
+private:
+    std::string_view text;
+    size_t pos = 0;
+    std::vector<std::string_view> fields;
+    std::string unescaped;
+    std::vector<std::pair<size_t, size_t>> unescaped_fields; // (field index, offset into unescaped)
+
+    bool at_row_end(size_t p) const {
+        return p >= text.size() || text[p] == '\n' || text[p] == '\r';
+    }
+
+    // Parses a quoted field starting at the opening quote, leaving pos on the delimiter
+    void read_quoted_field() {
+        size_t start = ++pos;
+        bool escaped = false;
+        size_t end = text.size();
+
+        while (pos < text.size()) {
+            const char* quote = static_cast<const char*>(
+                std::memchr(text.data() + pos, '"', text.size() - pos));
+            if (!quote) {
+                pos = text.size();
+                break;
+            }
+            pos = static_cast<size_t>(quote - text.data());
+            if (pos + 1 < text.size() && text[pos + 1] == '"') {
+                escaped = true;
+                pos += 2;
+                continue;
+            }
+            end = pos++;
+            break;
+        }
+
+        std::string_view raw = text.substr(start, std::min(end, text.size()) - start);
+        if (escaped) {
+            size_t offset = unescaped.size();
+            for (size_t i = 0; i < raw.size(); i++) {
+                unescaped.push_back(raw[i]);
+                if (raw[i] == '"') i++;
+            }
+            unescaped_fields.emplace_back(fields.size(), offset);
+            fields.push_back(raw.substr(0, unescaped.size() - offset));
+        } else {
+            fields.push_back(raw);
+        }
+
+        // Tolerate stray characters between the closing quote and the next delimiter
+        while (pos < text.size() && text[pos] != ',' && !at_row_end(pos)) pos++;
+    }
+
+    void read_plain_field() {
+        size_t start = pos;
+        while (pos < text.size() && text[pos] != ',' && !at_row_end(pos)) pos++;
+        fields.push_back(text.substr(start, pos - start));
+    }
+
+public:
+    explicit CsvReader(std::string_view input) : text(input) {
+        // Skip a UTF-8 byte order mark, which spreadsheet exports like to prepend
+        if (text.size() >= 3 && text.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+            pos = 3;
+        }
+    }
+
+    // Advance to the next non-empty row. Returns false once the input is exhausted.
+    bool next_row() {
+        fields.clear();
+        unescaped.clear();
+        unescaped_fields.clear();
+
+        // Skip blank lines
+        while (pos < text.size() && (text[pos] == '\n' || text[pos] == '\r')) pos++;
+        if (pos >= text.size()) return false;
+
+        while (true) {
+            if (text[pos] == '"') {
+                read_quoted_field();
+            } else {
+                read_plain_field();
+            }
+            if (pos < text.size() && text[pos] == ',') {
+                pos++;
+                if (at_row_end(pos)) {
+                    fields.emplace_back();
+                    break;
+                }
+                continue;
+            }
+            break;
+        }
+
+        // The scratch buffer may have reallocated while the row was parsed, so unescaped
+        // fields are only pointed at it once the row is complete
+        for (const auto& field : unescaped_fields) {
+            fields[field.first] = std::string_view(unescaped.data() + field.second, fields[field.first].size());
+        }
+        return true;
+    }
+
+    const std::vector<std::string_view>& row() const {
+        return fields;
+    }
+
+    // Byte offset of the reader within the input
+    size_t offset() const {
+        return pos;
+    }
+};
+
+// Parse a numeric CSV field without allocating. Surrounding spaces and a leading '+' are accepted.
+inline bool parse_csv_float(std::string_view field, float& out) {
+    while (!field.empty() && field.front() == ' ') field.remove_prefix(1);
+    while (!field.empty() && field.back() == ' ') field.remove_suffix(1);
+    if (!field.empty() && field.front() == '+') field.remove_prefix(1);
+    if (field.empty()) return false;
+
+    auto result = std::from_chars(field.data(), field.data() + field.size(), out);
+    return result.ec == std::errc() && result.ptr == field.data() + field.size();
+}
+
+// Index of a header column, or npos when the export does not contain it
+inline size_t find_csv_column(const std::vector<std::string>& headers, std::string_view name) {
+    for (size_t i = 0; i < headers.size(); i++) {
+        if (headers[i] == name) return i;
+    }
+    return std::string::npos;
+}
+
+// Upper bound on the number of rows in a CSV buffer (newlines inside quoted fields are counted too)
+inline size_t count_csv_lines(std::string_view text) {
+    size_t lines = 0;
+    const char* p = text.data();
+    const char* end = p + text.size();
+    while (p < end) {
+        const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        lines++;
+        if (!newline) break;
+        p = newline + 1;
+    }
+    return lines;
+}
@@ -0,0 +1,422 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+// Instrumentation of the database hot paths: event counters, phase timers and histograms of
+// per-query latency and work. Every thread records into its own block with plain relaxed
+// stores, so recording never contends; stats() sums the blocks on demand. The numbers are
+// process-wide, shared by every HNSWVectorDB in the process.
+//
+// Build with BETTER_SHUFFLE_STATS=0 to compile the recording macros out entirely.
+#ifndef BETTER_SHUFFLE_STATS
+#define BETTER_SHUFFLE_STATS 1
+#endif
+
+namespace db_stats {
+
+enum Counter : size_t {
+    QUERIES,
+    DISTANCES,        // every distance computed, builds included
+    QUERY_DISTANCES,  // distances computed while answering queries
+    ROWS_PARSED,
+    ROWS_INDEXED,
+    COUNTER_COUNT
+};
+
+enum Phase : size_t {
+    PHASE_PARSE,    // CSV tokenizing
+    PHASE_EXTRACT,  // turning rows into features, metadata and manifest entries
+    PHASE_BUILD,    // inserting vectors into the index, summed over build threads
+    PHASE_LOAD,     // loading snapshots and index files
+    PHASE_REFRESH,
+    PHASE_COUNT
+};
+
+enum Histogram : size_t {
+    HIST_QUERY_LATENCY,    // nanoseconds per query
+    HIST_QUERY_DISTANCES,  // distances per query, i.e. graph nodes visited or tracks scanned
+    HIST_COUNT
+};
+
+// Log-linear buckets: four per power of two, so any value is within 25% of its bucket
+constexpr size_t HISTOGRAM_BUCKETS = 252;
+
+inline size_t highest_bit(uint64_t value) {
+    size_t bit = 0;
+    while (value >>= 1) bit++;
+    return bit;
+}
+
+inline size_t bucket_of(uint64_t value) {
+    if (value < 4) return static_cast<size_t>(value);
+    size_t exponent = highest_bit(value);
+    size_t mantissa = static_cast<size_t>(value >> (exponent - 2)) & 3;
+    return 4 + (exponent - 2) * 4 + mantissa;
+}
+
+inline double bucket_midpoint(size_t bucket) {
+    if (bucket < 4) return static_cast<double>(bucket);
+    size_t exponent = (bucket - 4) / 4 + 2;
+    double low = static_cast<double>((4 + (bucket - 4) % 4) << (exponent - 2));
+    return low + static_cast<double>(uint64_t(1) << (exponent - 2)) / 2;
+}
+
+// Bumped by reset(). Maxima can't be subtracted like the totals, so a block's maxima only
+// count while they were recorded in the current generation.
+inline std::atomic<uint64_t> max_generation{0};
+
+// Raw totals. Live blocks are only written by their own thread.
+struct Block {
+    std::atomic<uint64_t> counters[COUNTER_COUNT] = {};
+    std::atomic<uint64_t> phase_ns[PHASE_COUNT] = {};
+    std::atomic<uint64_t> phase_calls[PHASE_COUNT] = {};
+    std::atomic<uint64_t> histograms[HIST_COUNT][HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint64_t> histogram_sums[HIST_COUNT] = {};
+    // Largest value recorded, and the max_generation it was recorded in
+    std::atomic<uint64_t> histogram_max[HIST_COUNT] = {};
+    std::atomic<uint64_t> generation{0};
+
+    // Single-writer increment: no locked instruction, still safe to read from other threads
+    static void bump(std::atomic<uint64_t>& value, uint64_t amount) {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    // this += sign * other, for folding and baselines
+    void accumulate(const Block& other, bool subtract = false) {
+        auto apply = [subtract](std::atomic<uint64_t>& into, const std::atomic<uint64_t>& from) {
+            uint64_t amount = from.load(std::memory_order_relaxed);
+            bump(into, subtract ? uint64_t(0) - amount : amount);
+        };
+        for (size_t i = 0; i < COUNTER_COUNT; i++) apply(counters[i], other.counters[i]);
+        for (size_t i = 0; i < PHASE_COUNT; i++) {
+            apply(phase_ns[i], other.phase_ns[i]);
+            apply(phase_calls[i], other.phase_calls[i]);
+        }
+        for (size_t h = 0; h < HIST_COUNT; h++) {
+            for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) apply(histograms[h][b], other.histograms[h][b]);
+            apply(histogram_sums[h], other.histogram_sums[h]);
+        }
+    }
+
+    // Forget maxima recorded before the last reset; returns the current generation
+    uint64_t renew_maxima() {
+        uint64_t current = max_generation.load(std::memory_order_relaxed);
+        if (generation.load(std::memory_order_relaxed) != current) {
+            for (auto& value : histogram_max) value.store(0, std::memory_order_relaxed);
+            generation.store(current, std::memory_order_relaxed);
+        }
+        return current;
+    }
+
+    // Single-writer max with the maxima of other, leaving out those from before the last reset
+    void merge_max(const Block& other) {
+        if (other.generation.load(std::memory_order_relaxed) != renew_maxima()) return;
+        for (size_t h = 0; h < HIST_COUNT; h++) {
+            uint64_t value = other.histogram_max[h].load(std::memory_order_relaxed);
+            if (value > histogram_max[h].load(std::memory_order_relaxed)) {
+                histogram_max[h].store(value, std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// Blocks of running threads plus the totals of threads that have exited
+class Registry {
+private:
+    std::mutex mutex;
+    std::vector<Block*> live;
+    Block retired;
+    Block baseline;
+
+public:
+    Block* attach() {
+        std::lock_guard<std::mutex> lock(mutex);
+        live.push_back(new Block());
+        return live.back();
+    }
+
+    void detach(Block* block) {
+        std::lock_guard<std::mutex> lock(mutex);
+        retired.accumulate(*block);
+        retired.merge_max(*block);
+        live.erase(std::find(live.begin(), live.end(), block));
+        delete block;
+    }
+
+    // Totals since the last reset
+    void collect(Block& total) {
+        std::lock_guard<std::mutex> lock(mutex);
+        total.accumulate(retired);
+        total.merge_max(retired);
+        for (const Block* block : live) {
+            total.accumulate(*block);
+            total.merge_max(*block);
+        }
+        total.accumulate(baseline, true);
+    }
+
+    // Start counting from zero. Blocks are never cleared under their writers; the current
+    // totals become the baseline instead.
+    void reset() {
+        Block total;
+        collect(total);
+        std::lock_guard<std::mutex> lock(mutex);
+        baseline.accumulate(total);
+        max_generation.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+// Never destroyed, so threads that outlive main() can still detach
+inline Registry& registry() {
+    static Registry* instance = new Registry();
+    return *instance;
+}
+
+// Trivially initialized, so the hot path is a plain thread-local load
+inline thread_local Block* current_block = nullptr;
+
+// Folds the thread's block into the registry when the thread exits
+struct ThreadDetacher {
+    ~ThreadDetacher() {
+        if (current_block) {
+            registry().detach(current_block);
+            current_block = nullptr;
+        }
+    }
+};
+
+inline Block& attach_thread() {
+    static thread_local ThreadDetacher detacher;
+    (void)detacher;
+    current_block = registry().attach();
+    return *current_block;
+}
+
+inline Block& local() {
+    Block* block = current_block;
+    return block ? *block : attach_thread();
+}
+
+inline void add(Counter counter, uint64_t amount = 1) {
+    Block::bump(local().counters[counter], amount);
+}
+
+inline uint64_t local_count(Counter counter) {
+    return local().counters[counter].load(std::memory_order_relaxed);
+}
+
+inline void record(Histogram histogram, uint64_t value) {
+    Block& block = local();
+    Block::bump(block.histograms[histogram][bucket_of(value)], 1);
+    Block::bump(block.histogram_sums[histogram], value);
+    block.renew_maxima();
+    if (value > block.histogram_max[histogram].load(std::memory_order_relaxed)) {
+        block.histogram_max[histogram].store(value, std::memory_order_relaxed);
+    }
+}
+
+inline void add_phase(Phase phase, std::chrono::steady_clock::duration elapsed, uint64_t calls = 1) {
+    Block& block = local();
+    Block::bump(block.phase_ns[phase], static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    Block::bump(block.phase_calls[phase], calls);
+}
+
+// Times a scope as one call of a phase
+class ScopedPhase {
+private:
+    Phase phase;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit ScopedPhase(Phase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+
+    ~ScopedPhase() {
+        add_phase(phase, std::chrono::steady_clock::now() - start);
+    }
+};
+
+// Splits a loop's time between alternating phases with one clock read per switch. Each
+// phase is counted as one call, however many times the clock switched to it. Switching to
+// PHASE_COUNT pauses the clock, for work that is timed on its own.
+class PhaseClock {
+private:
+    Phase current;
+    std::chrono::steady_clock::time_point since;
+    std::chrono::steady_clock::duration spent[PHASE_COUNT + 1] = {};
+    bool used[PHASE_COUNT + 1] = {};
+
+public:
+    explicit PhaseClock(Phase first) : current(first), since(std::chrono::steady_clock::now()) {}
+
+    void switch_to(Phase next) {
+        auto now = std::chrono::steady_clock::now();
+        spent[current] += now - since;
+        used[current] = true;
+        current = next;
+        since = now;
+    }
+
+    ~PhaseClock() {
+        switch_to(current);
+        for (size_t i = 0; i < PHASE_COUNT; i++) {
+            if (used[i]) add_phase(static_cast<Phase>(i), spent[i]);
+        }
+    }
+};
+
+// Records the latency and distance count of one query on the calling thread
+class QueryRecorder {
+private:
+    std::chrono::steady_clock::time_point start;
+    uint64_t distances_before;
+
+public:
+    QueryRecorder() : start(std::chrono::steady_clock::now()), distances_before(local_count(DISTANCES)) {}
+
+    ~QueryRecorder() {
+        uint64_t distances = local_count(DISTANCES) - distances_before;
+        add(QUERIES);
+        add(QUERY_DISTANCES, distances);
+        record(HIST_QUERY_DISTANCES, distances);
+        record(HIST_QUERY_LATENCY, static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+    }
+};
+
+struct PhaseStats {
+    uint64_t calls = 0;
+    double seconds = 0.0;
+};
+
+// Distribution summary; percentiles are bucket midpoints, the mean and max are exact
+struct HistogramStats {
+    uint64_t count = 0;
+    double mean = 0.0;
+    double p50 = 0.0;
+    double p90 = 0.0;
+    double p99 = 0.0;
+    double p999 = 0.0;
+    double max = 0.0;
+};
+
+inline HistogramStats summarize(const Block& block, Histogram histogram, double unit) {
+    HistogramStats stats;
+    const auto& buckets = block.histograms[histogram];
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        stats.count += buckets[b].load(std::memory_order_relaxed);
+    }
+    if (stats.count == 0) return stats;
+    stats.mean = block.histogram_sums[histogram].load(std::memory_order_relaxed) / unit / stats.count;
+
+    double* targets[] = {&stats.p50, &stats.p90, &stats.p99, &stats.p999};
+    const double quantiles[] = {0.50, 0.90, 0.99, 0.999};
+    size_t next = 0;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        uint64_t in_bucket = buckets[b].load(std::memory_order_relaxed);
+        if (in_bucket == 0) continue;
+        seen += in_bucket;
+        while (next < 4 && seen >= quantiles[next] * stats.count) {
+            *targets[next++] = bucket_midpoint(b) / unit;
+        }
+    }
+    stats.max = block.histogram_max[histogram].load(std::memory_order_relaxed) / unit;
+    return stats;
+}
+
+// Aggregated view returned by HNSWVectorDB::stats()
+struct Stats {
+    bool enabled = BETTER_SHUFFLE_STATS != 0;
+    uint64_t queries = 0;
+    uint64_t distance_computations = 0;
+    uint64_t query_distance_computations = 0;
+    uint64_t graph_hops = 0;  // upper-layer hops counted by hnswlib
+    uint64_t rows_parsed = 0;
+    uint64_t rows_indexed = 0;
+    PhaseStats phases[PHASE_COUNT];
+    HistogramStats query_latency_us;
+    HistogramStats query_distances;
+
+    static const char* phase_name(size_t phase) {
+        static const char* const names[PHASE_COUNT] = {"parse", "extract", "build", "load", "refresh"};
+        return names[phase];
+    }
+
+    std::string to_json() const {
+        std::ostringstream out;
+        out << std::setprecision(6);
+        auto histogram = [&](const char* name, const HistogramStats& h) {
+            out << "\"" << name << "\":{\"count\":" << h.count << ",\"mean\":" << h.mean << ",\"p50\":" << h.p50
+                << ",\"p90\":" << h.p90 << ",\"p99\":" << h.p99 << ",\"p999\":" << h.p999 << ",\"max\":" << h.max << "}";
+        };
+        out << "{\"enabled\":" << (enabled ? "true" : "false") << ",\"queries\":" << queries
+            << ",\"distance_computations\":" << distance_computations
+            << ",\"query_distance_computations\":" << query_distance_computations << ",\"graph_hops\":" << graph_hops
+            << ",\"rows_parsed\":" << rows_parsed << ",\"rows_indexed\":" << rows_indexed << ",\"phases\":{";
+        for (size_t i = 0; i < PHASE_COUNT; i++) {
+            out << (i ? "," : "") << "\"" << phase_name(i) << "\":{\"calls\":" << phases[i].calls
+                << ",\"seconds\":" << phases[i].seconds << "}";
+        }
+        out << "},";
+        histogram("query_latency_us", query_latency_us);
+        out << ",";
+        histogram("query_distances", query_distances);
+        out << "}";
+        return out.str();
+    }
+};
+
+inline Stats collect() {
+    Stats stats;
+#if BETTER_SHUFFLE_STATS
+    Block total;
+    registry().collect(total);
+    stats.queries = total.counters[QUERIES].load(std::memory_order_relaxed);
+    stats.distance_computations = total.counters[DISTANCES].load(std::memory_order_relaxed);
+    stats.query_distance_computations = total.counters[QUERY_DISTANCES].load(std::memory_order_relaxed);
+    stats.rows_parsed = total.counters[ROWS_PARSED].load(std::memory_order_relaxed);
+    stats.rows_indexed = total.counters[ROWS_INDEXED].load(std::memory_order_relaxed);
+    for (size_t i = 0; i < PHASE_COUNT; i++) {
+        stats.phases[i].calls = total.phase_calls[i].load(std::memory_order_relaxed);
+        stats.phases[i].seconds = total.phase_ns[i].load(std::memory_order_relaxed) / 1e9;
+    }
+    stats.query_latency_us = summarize(total, HIST_QUERY_LATENCY, 1e3);
+    stats.query_distances = summarize(total, HIST_QUERY_DISTANCES, 1.0);
+#endif
+    return stats;
+}
+
+inline void reset() {
+#if BETTER_SHUFFLE_STATS
+    registry().reset();
+#endif
+}
+
+} // namespace db_stats
+
+#if BETTER_SHUFFLE_STATS
+#define DB_STATS_CONCAT_(a, b) a##b
+#define DB_STATS_CONCAT(a, b) DB_STATS_CONCAT_(a, b)
+#define DB_STATS_ADD(counter, amount) db_stats::add(db_stats::counter, amount)
+#define DB_STATS_PHASE(phase) db_stats::ScopedPhase DB_STATS_CONCAT(db_stats_phase_, __LINE__)(db_stats::phase)
+#define DB_STATS_CLOCK(name, phase) db_stats::PhaseClock name(db_stats::phase)
+#define DB_STATS_SWITCH(name, phase) name.switch_to(db_stats::phase)
+#define DB_STATS_PAUSE(name) name.switch_to(db_stats::PHASE_COUNT)
+#define DB_STATS_QUERY() db_stats::QueryRecorder DB_STATS_CONCAT(db_stats_query_, __LINE__)
+#else
+#define DB_STATS_ADD(counter, amount) ((void)0)
+#define DB_STATS_PHASE(phase) ((void)0)
+#define DB_STATS_CLOCK(name, phase) ((void)0)
+#define DB_STATS_SWITCH(name, phase) ((void)0)
+#define DB_STATS_PAUSE(name) ((void)0)
+#define DB_STATS_QUERY() ((void)0)
+#endif
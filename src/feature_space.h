@@ -0,0 +1,691 @@
+#pragma once
+
+#include "../vendor/hnswlib/hnswlib/hnswlib.h"
+#include "binary_io.h"
+#include "db_stats.h"
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <ostream>
+#include <algorithm>
+
+// Distance between feature vectors
+enum class FeatureMetric : uint32_t {
+    WEIGHTED_L2 = 1,
+    WEIGHTED_COSINE = 2,
+};
+
+// Stored vectors are padded with zeros to a multiple of 16 floats, so every kernel works on
+// whole AVX-512 registers (two AVX or four SSE registers) without a remainder loop
+constexpr size_t FEATURE_BLOCK = 16;
+
+inline size_t padded_feature_dim(size_t dim) {
+    return (dim + FEATURE_BLOCK - 1) / FEATURE_BLOCK * FEATURE_BLOCK;
+}
+
+// Encoding of the vectors stored in the index
+enum class VectorFormat : uint32_t {
+    FP32 = 1,
+    FP16 = 2,  // half precision; plenty for standardized features
+    INT8 = 3,  // one byte per feature on a per-feature scale and offset fitted to the library
+};
+
+inline size_t vector_code_bytes(VectorFormat format) {
+    switch (format) {
+        case VectorFormat::FP16: return 2;
+        case VectorFormat::INT8: return 1;
+        default: return 4;
+    }
+}
+
+// Per-column z-score scaling fitted on the library, so that BPM (60-200), Popularity (0-100)
+// and loudness (negative dB) contribute on the same scale
+class FeatureStandardizer {
+private:
+    std::vector<float> mean;
+    std::vector<float> inv_std;
+
+public:
+    // Streaming mean and variance (Welford) over the rows of a library. NaN marks a feature
+    // the row's source doesn't provide and is left out of its column's statistics.
+    class Accumulator {
+    private:
+        std::vector<double> mean;
+        std::vector<double> m2;
+        std::vector<size_t> count;
+
+    public:
+        explicit Accumulator(size_t dim) : mean(dim, 0.0), m2(dim, 0.0), count(dim, 0) {}
+
+        void add(const float* row) {
+            for (size_t i = 0; i < mean.size(); i++) {
+                if (std::isnan(row[i])) continue;
+                count[i]++;
+                double delta = row[i] - mean[i];
+                mean[i] += delta / count[i];
+                m2[i] += delta * (row[i] - mean[i]);
+            }
+        }
+
+        FeatureStandardizer finish() const {
+            FeatureStandardizer result;
+            result.mean.resize(mean.size());
+            result.inv_std.resize(mean.size());
+            for (size_t i = 0; i < mean.size(); i++) {
+                double stddev = count[i] > 1 ? std::sqrt(m2[i] / (count[i] - 1)) : 0.0;
+                result.mean[i] = static_cast<float>(mean[i]);
+                // Constant columns carry no information; leave them centered but unscaled. A
+                // column no row has is dropped from the distance altogether.
+                result.inv_std[i] = count[i] == 0 ? 0.0f : stddev > 1e-6 ? static_cast<float>(1.0 / stddev) : 1.0f;
+            }
+            return result;
+        }
+    };
+
+    bool fitted() const {
+        return !mean.empty();
+    }
+
+    bool operator==(const FeatureStandardizer& other) const {
+        return mean == other.mean && inv_std == other.inv_std;
+    }
+
+    size_t dim() const {
+        return mean.size();
+    }
+
+    // Scale a raw row of dim() features into a vector padded to padded_dim floats. A NaN
+    // (unknown) feature lands on the library mean.
+    void apply(const float* raw, float* out, size_t padded_dim) const {
+        size_t i = 0;
+        for (; i < mean.size(); i++) {
+            out[i] = std::isnan(raw[i]) ? 0.0f : (raw[i] - mean[i]) * inv_std[i];
+        }
+        for (; i < padded_dim; i++) {
+            out[i] = 0.0f;
+        }
+    }
+
+    void clear() {
+        mean.clear();
+        inv_std.clear();
+    }
+
+    void write(std::ostream& out) const {
+        binary_io::write_array(out, mean.data(), mean.size());
+        binary_io::write_array(out, inv_std.data(), inv_std.size());
+    }
+
+    void read(binary_io::Cursor& in) {
+        size_t mean_count = 0;
+        size_t inv_std_count = 0;
+        const float* mean_data = in.read_array<float>(mean_count);
+        const float* inv_std_data = in.read_array<float>(inv_std_count);
+        if (mean_count != inv_std_count) {
+            throw std::runtime_error("Corrupt feature standardizer");
+        }
+        mean.assign(mean_data, mean_data + mean_count);
+        inv_std.assign(inv_std_data, inv_std_data + inv_std_count);
+    }
+};
+
+namespace feature_kernels {
+
+#if defined(USE_AVX512)
+// Spelled out rather than _mm512_reduce_add_ps, which trips -Wuninitialized in GCC's headers
+inline float horizontal_sum(__m512 sum) {
+    float lanes[16];
+    _mm512_storeu_ps(lanes, sum);
+    float total = 0.0f;
+    for (int i = 0; i < 16; i++) {
+        total += lanes[i];
+    }
+    return total;
+}
+#endif
+
+// Sum of w * (a - b)^2 over blocks of 16 floats. Inputs come straight from hnswlib's
+// element storage, which is not aligned, so every load is unaligned.
+inline float weighted_l2(const float* a, const float* b, const float* w, size_t blocks) {
+#if defined(USE_AVX512)
+    __m512 sum = _mm512_setzero_ps();
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i += 16) {
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        sum = _mm512_fmadd_ps(_mm512_mul_ps(diff, diff), _mm512_loadu_ps(w + i), sum);
+    }
+    return horizontal_sum(sum);
+#elif defined(USE_AVX)
+    __m256 sum = _mm256_setzero_ps();
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i += 8) {
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_mul_ps(diff, diff), _mm256_loadu_ps(w + i)));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7];
+#elif defined(USE_SSE)
+    __m128 sum = _mm_setzero_ps();
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i += 4) {
+        __m128 diff = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_mul_ps(diff, diff), _mm_loadu_ps(w + i)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#else
+    float sum = 0.0f;
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i++) {
+        float diff = a[i] - b[i];
+        sum += diff * diff * w[i];
+    }
+    return sum;
+#endif
+}
+
+// 1 - weighted cosine similarity, computed in one pass over both vectors
+inline float weighted_cosine(const float* a, const float* b, const float* w, size_t blocks) {
+    float dot = 0.0f;
+    float norm_a = 0.0f;
+    float norm_b = 0.0f;
+#if defined(USE_AVX512)
+    __m512 dot_sum = _mm512_setzero_ps();
+    __m512 a_sum = _mm512_setzero_ps();
+    __m512 b_sum = _mm512_setzero_ps();
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i += 16) {
+        __m512 va = _mm512_loadu_ps(a + i);
+        __m512 vb = _mm512_loadu_ps(b + i);
+        __m512 wa = _mm512_mul_ps(va, _mm512_loadu_ps(w + i));
+        dot_sum = _mm512_fmadd_ps(wa, vb, dot_sum);
+        a_sum = _mm512_fmadd_ps(wa, va, a_sum);
+        b_sum = _mm512_fmadd_ps(_mm512_mul_ps(vb, _mm512_loadu_ps(w + i)), vb, b_sum);
+    }
+    dot = horizontal_sum(dot_sum);
+    norm_a = horizontal_sum(a_sum);
+    norm_b = horizontal_sum(b_sum);
+#elif defined(USE_AVX)
+    __m256 dot_sum = _mm256_setzero_ps();
+    __m256 a_sum = _mm256_setzero_ps();
+    __m256 b_sum = _mm256_setzero_ps();
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i += 8) {
+        __m256 va = _mm256_loadu_ps(a + i);
+        __m256 vb = _mm256_loadu_ps(b + i);
+        __m256 vw = _mm256_loadu_ps(w + i);
+        __m256 wa = _mm256_mul_ps(va, vw);
+        dot_sum = _mm256_add_ps(dot_sum, _mm256_mul_ps(wa, vb));
+        a_sum = _mm256_add_ps(a_sum, _mm256_mul_ps(wa, va));
+        b_sum = _mm256_add_ps(b_sum, _mm256_mul_ps(_mm256_mul_ps(vb, vw), vb));
+    }
+    float lanes[3][8];
+    _mm256_storeu_ps(lanes[0], dot_sum);
+    _mm256_storeu_ps(lanes[1], a_sum);
+    _mm256_storeu_ps(lanes[2], b_sum);
+    for (int i = 0; i < 8; i++) {
+        dot += lanes[0][i];
+        norm_a += lanes[1][i];
+        norm_b += lanes[2][i];
+    }
+#elif defined(USE_SSE)
+    __m128 dot_sum = _mm_setzero_ps();
+    __m128 a_sum = _mm_setzero_ps();
+    __m128 b_sum = _mm_setzero_ps();
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i += 4) {
+        __m128 va = _mm_loadu_ps(a + i);
+        __m128 vb = _mm_loadu_ps(b + i);
+        __m128 vw = _mm_loadu_ps(w + i);
+        __m128 wa = _mm_mul_ps(va, vw);
+        dot_sum = _mm_add_ps(dot_sum, _mm_mul_ps(wa, vb));
+        a_sum = _mm_add_ps(a_sum, _mm_mul_ps(wa, va));
+        b_sum = _mm_add_ps(b_sum, _mm_mul_ps(_mm_mul_ps(vb, vw), vb));
+    }
+    float lanes[3][4];
+    _mm_storeu_ps(lanes[0], dot_sum);
+    _mm_storeu_ps(lanes[1], a_sum);
+    _mm_storeu_ps(lanes[2], b_sum);
+    for (int i = 0; i < 4; i++) {
+        dot += lanes[0][i];
+        norm_a += lanes[1][i];
+        norm_b += lanes[2][i];
+    }
+#else
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i++) {
+        float wa = a[i] * w[i];
+        dot += wa * b[i];
+        norm_a += wa * a[i];
+        norm_b += b[i] * w[i] * b[i];
+    }
+#endif
+    float denominator = norm_a * norm_b;
+    return denominator > 0.0f ? 1.0f - dot / std::sqrt(denominator) : 1.0f;
+}
+
+// IEEE half precision conversion for machines without F16C. Rounds to nearest even and
+// saturates at the largest finite half so distances never turn infinite.
+inline uint16_t float_to_half(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t float_exponent = (bits >> 23) & 0xFF;
+    uint32_t mantissa = bits & 0x7FFFFF;
+    if (float_exponent == 0xFF) {
+        return static_cast<uint16_t>(sign | (mantissa ? 0x7E00 : 0x7BFF));
+    }
+    int32_t exponent = static_cast<int32_t>(float_exponent) - 127 + 15;
+    if (exponent >= 31) {
+        return static_cast<uint16_t>(sign | 0x7BFF);
+    }
+    if (exponent <= 0) {
+        if (exponent < -10) return static_cast<uint16_t>(sign);
+        mantissa |= 0x800000;
+        uint32_t shift = static_cast<uint32_t>(14 - exponent);
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return static_cast<uint16_t>(sign | half);
+    }
+    uint32_t half = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return static_cast<uint16_t>(sign | std::min<uint32_t>(half, 0x7BFF));
+}
+
+inline float half_to_float(uint16_t half) {
+    uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+    uint32_t bits;
+    if (exponent == 0) {
+        float value = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign ? -value : value;
+    } else if (exponent == 31) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Codes as floats: 8-bit codes are levels 0-255, 16-bit codes are halves
+inline float code_value(uint8_t code) {
+    return static_cast<float>(code);
+}
+
+inline float code_value(uint16_t code) {
+    return half_to_float(code);
+}
+
+#if defined(USE_AVX512)
+// The zero-masking forms with a full mask are the same instructions; the plain intrinsics
+// pass an undefined vector through, which GCC 12 reports as uninitialized
+inline __m512 load_codes(const uint8_t* codes) {
+    const __mmask16 all = 0xFFFF;
+    __m512i levels = _mm512_maskz_cvtepu8_epi32(all, _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes)));
+    return _mm512_maskz_cvtepi32_ps(all, levels);
+}
+
+inline __m512 load_codes(const uint16_t* codes) {
+    return _mm512_maskz_cvtph_ps(0xFFFF, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(codes)));
+}
+#elif defined(__AVX2__) && defined(__F16C__)
+#define FEATURE_KERNELS_AVX2_CODES
+inline __m256 load_codes(const uint8_t* codes) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(codes))));
+}
+
+inline __m256 load_codes(const uint16_t* codes) {
+    return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(codes)));
+}
+#endif
+
+// Weighted squared L2 between two quantized vectors. w holds each weight times the square of
+// its feature's scale, so the offsets cancel and the difference of the codes is all that's needed.
+template <typename Code>
+inline float quantized_l2(const Code* a, const Code* b, const float* w, size_t blocks) {
+#if defined(USE_AVX512)
+    __m512 sum = _mm512_setzero_ps();
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i += 16) {
+        __m512 diff = _mm512_sub_ps(load_codes(a + i), load_codes(b + i));
+        sum = _mm512_fmadd_ps(_mm512_mul_ps(diff, diff), _mm512_loadu_ps(w + i), sum);
+    }
+    return horizontal_sum(sum);
+#elif defined(FEATURE_KERNELS_AVX2_CODES)
+    __m256 sum = _mm256_setzero_ps();
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i += 8) {
+        __m256 diff = _mm256_sub_ps(load_codes(a + i), load_codes(b + i));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_mul_ps(diff, diff), _mm256_loadu_ps(w + i)));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7];
+#else
+    float sum = 0.0f;
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i++) {
+        float diff = code_value(a[i]) - code_value(b[i]);
+        sum += diff * diff * w[i];
+    }
+    return sum;
+#endif
+}
+
+// Weighted cosine distance between two quantized vectors. Offsets don't cancel here, so the
+// codes are decoded in registers (offset + scale * code) on the way in.
+template <typename Code>
+inline float quantized_cosine(const Code* a, const Code* b, const float* w, const float* scale, const float* offset, size_t blocks) {
+    float dot = 0.0f;
+    float norm_a = 0.0f;
+    float norm_b = 0.0f;
+#if defined(USE_AVX512)
+    __m512 dot_sum = _mm512_setzero_ps();
+    __m512 a_sum = _mm512_setzero_ps();
+    __m512 b_sum = _mm512_setzero_ps();
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i += 16) {
+        __m512 vs = _mm512_loadu_ps(scale + i);
+        __m512 vo = _mm512_loadu_ps(offset + i);
+        __m512 va = _mm512_fmadd_ps(load_codes(a + i), vs, vo);
+        __m512 vb = _mm512_fmadd_ps(load_codes(b + i), vs, vo);
+        __m512 vw = _mm512_loadu_ps(w + i);
+        __m512 wa = _mm512_mul_ps(va, vw);
+        dot_sum = _mm512_fmadd_ps(wa, vb, dot_sum);
+        a_sum = _mm512_fmadd_ps(wa, va, a_sum);
+        b_sum = _mm512_fmadd_ps(_mm512_mul_ps(vb, vw), vb, b_sum);
+    }
+    dot = horizontal_sum(dot_sum);
+    norm_a = horizontal_sum(a_sum);
+    norm_b = horizontal_sum(b_sum);
+#elif defined(FEATURE_KERNELS_AVX2_CODES)
+    __m256 dot_sum = _mm256_setzero_ps();
+    __m256 a_sum = _mm256_setzero_ps();
+    __m256 b_sum = _mm256_setzero_ps();
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i += 8) {
+        __m256 vs = _mm256_loadu_ps(scale + i);
+        __m256 vo = _mm256_loadu_ps(offset + i);
+        __m256 va = _mm256_add_ps(_mm256_mul_ps(load_codes(a + i), vs), vo);
+        __m256 vb = _mm256_add_ps(_mm256_mul_ps(load_codes(b + i), vs), vo);
+        __m256 vw = _mm256_loadu_ps(w + i);
+        __m256 wa = _mm256_mul_ps(va, vw);
+        dot_sum = _mm256_add_ps(dot_sum, _mm256_mul_ps(wa, vb));
+        a_sum = _mm256_add_ps(a_sum, _mm256_mul_ps(wa, va));
+        b_sum = _mm256_add_ps(b_sum, _mm256_mul_ps(_mm256_mul_ps(vb, vw), vb));
+    }
+    float lanes[3][8];
+    _mm256_storeu_ps(lanes[0], dot_sum);
+    _mm256_storeu_ps(lanes[1], a_sum);
+    _mm256_storeu_ps(lanes[2], b_sum);
+    for (int i = 0; i < 8; i++) {
+        dot += lanes[0][i];
+        norm_a += lanes[1][i];
+        norm_b += lanes[2][i];
+    }
+#else
+    for (size_t i = 0; i < blocks * FEATURE_BLOCK; i++) {
+        float va = offset[i] + scale[i] * code_value(a[i]);
+        float vb = offset[i] + scale[i] * code_value(b[i]);
+        float wa = va * w[i];
+        dot += wa * vb;
+        norm_a += wa * va;
+        norm_b += vb * w[i] * vb;
+    }
+#endif
+    float denominator = norm_a * norm_b;
+    return denominator > 0.0f ? 1.0f - dot / std::sqrt(denominator) : 1.0f;
+}
+
+} // namespace feature_kernels
+
+// hnswlib space over padded, standardized feature vectors with per-feature weights. The
+// common padded sizes get kernels with the block count fixed at compile time so the loop
+// is fully unrolled; other sizes fall back to a runtime block count. With FP16 or INT8
+// storage the index holds codes instead of floats (see encode) and the kernels work on the
+// codes directly.
+class WeightedSpace : public hnswlib::SpaceInterface<float> {
+public:
+    // hnswlib reads the logical dimension from the start of the distance parameter
+    // (getDataByLabel), so dim must stay the first member
+    struct Params {
+        size_t dim;
+        size_t blocks;
+        const float* weights;
+        const float* scaled_weights;  // weight * scale^2, for L2 on codes
+        const float* scale;
+        const float* offset;
+    };
+
+private:
+    FeatureMetric metric;
+    VectorFormat format;
+    std::vector<float> weights;
+    std::vector<float> scaled_weights;
+    std::vector<float> scale;
+    std::vector<float> offset;
+    Params params;
+    hnswlib::DISTFUNC<float> distance;
+
+    template <size_t Blocks>
+    static float weighted_l2_fixed(const void* a, const void* b, const void* param) {
+        DB_STATS_ADD(DISTANCES, 1);
+        return feature_kernels::weighted_l2(static_cast<const float*>(a), static_cast<const float*>(b),
+                                            static_cast<const Params*>(param)->weights, Blocks);
+    }
+
+    static float weighted_l2_dynamic(const void* a, const void* b, const void* param) {
+        DB_STATS_ADD(DISTANCES, 1);
+        const Params* p = static_cast<const Params*>(param);
+        return feature_kernels::weighted_l2(static_cast<const float*>(a), static_cast<const float*>(b), p->weights, p->blocks);
+    }
+
+    template <size_t Blocks>
+    static float weighted_cosine_fixed(const void* a, const void* b, const void* param) {
+        DB_STATS_ADD(DISTANCES, 1);
+        return feature_kernels::weighted_cosine(static_cast<const float*>(a), static_cast<const float*>(b),
+                                                static_cast<const Params*>(param)->weights, Blocks);
+    }
+
+    static float weighted_cosine_dynamic(const void* a, const void* b, const void* param) {
+        DB_STATS_ADD(DISTANCES, 1);
+        const Params* p = static_cast<const Params*>(param);
+        return feature_kernels::weighted_cosine(static_cast<const float*>(a), static_cast<const float*>(b), p->weights, p->blocks);
+    }
+
+    // Quantized kernels; Blocks == 0 reads the block count at runtime
+    template <typename Code, size_t Blocks>
+    static float quantized_l2(const void* a, const void* b, const void* param) {
+        DB_STATS_ADD(DISTANCES, 1);
+        const Params* p = static_cast<const Params*>(param);
+        return feature_kernels::quantized_l2(static_cast<const Code*>(a), static_cast<const Code*>(b), p->scaled_weights,
+                                             Blocks ? Blocks : p->blocks);
+    }
+
+    template <typename Code, size_t Blocks>
+    static float quantized_cosine(const void* a, const void* b, const void* param) {
+        DB_STATS_ADD(DISTANCES, 1);
+        const Params* p = static_cast<const Params*>(param);
+        return feature_kernels::quantized_cosine(static_cast<const Code*>(a), static_cast<const Code*>(b), p->weights,
+                                                 p->scale, p->offset, Blocks ? Blocks : p->blocks);
+    }
+
+    template <typename Code>
+    static hnswlib::DISTFUNC<float> select_quantized_kernel(bool cosine, size_t blocks) {
+        switch (blocks) {
+            case 1: return cosine ? quantized_cosine<Code, 1> : quantized_l2<Code, 1>;
+            case 2: return cosine ? quantized_cosine<Code, 2> : quantized_l2<Code, 2>;
+            default: return cosine ? quantized_cosine<Code, 0> : quantized_l2<Code, 0>;
+        }
+    }
+
+    static hnswlib::DISTFUNC<float> select_kernel(FeatureMetric metric, VectorFormat format, size_t blocks) {
+        bool cosine = metric == FeatureMetric::WEIGHTED_COSINE;
+        if (format == VectorFormat::FP16) return select_quantized_kernel<uint16_t>(cosine, blocks);
+        if (format == VectorFormat::INT8) return select_quantized_kernel<uint8_t>(cosine, blocks);
+        switch (blocks) {
+            case 1: return cosine ? weighted_cosine_fixed<1> : weighted_l2_fixed<1>;
+            case 2: return cosine ? weighted_cosine_fixed<2> : weighted_l2_fixed<2>;
+            case 3: return cosine ? weighted_cosine_fixed<3> : weighted_l2_fixed<3>;
+            case 4: return cosine ? weighted_cosine_fixed<4> : weighted_l2_fixed<4>;
+            default: return cosine ? weighted_cosine_dynamic : weighted_l2_dynamic;
+        }
+    }
+
+    void update_scaled_weights() {
+        for (size_t i = 0; i < weights.size(); i++) {
+            scaled_weights[i] = weights[i] * scale[i] * scale[i];
+        }
+    }
+
+public:
+    WeightedSpace(size_t dim, FeatureMetric metric = FeatureMetric::WEIGHTED_L2, VectorFormat format = VectorFormat::FP32)
+        : metric(metric), format(format), weights(padded_feature_dim(dim), 0.0f), scaled_weights(weights.size(), 0.0f),
+          scale(weights.size(), 0.0f), offset(weights.size(), 0.0f) {
+        std::fill(weights.begin(), weights.begin() + dim, 1.0f);
+        std::fill(scale.begin(), scale.begin() + dim, 1.0f);
+        update_scaled_weights();
+        params.dim = dim;
+        params.blocks = weights.size() / FEATURE_BLOCK;
+        params.weights = weights.data();
+        params.scaled_weights = scaled_weights.data();
+        params.scale = scale.data();
+        params.offset = offset.data();
+        distance = select_kernel(metric, format, params.blocks);
+    }
+
+    // Replace the per-feature weights. Padding lanes always stay at zero. Not safe to call
+    // while searches or inserts are running.
+    void set_weights(const std::vector<float>& new_weights) {
+        if (new_weights.size() != params.dim) {
+            throw std::invalid_argument("Weight count doesn't match feature dimension");
+        }
+        for (size_t i = 0; i < params.dim; i++) {
+            if (!(new_weights[i] >= 0.0f) || !std::isfinite(new_weights[i])) {
+                throw std::invalid_argument("Feature weights must be finite and non-negative");
+            }
+            weights[i] = new_weights[i];
+        }
+        update_scaled_weights();
+    }
+
+    // Fit the INT8 scale and offset so that [low, high] of every feature spans the 256
+    // levels. Features that are integers in the CSV over a range narrower than 255 (Popularity,
+    // Dance, Energy, ...) come back exactly after rounding. FP32 and FP16 keep the identity.
+    // Must be called before any vector is encoded.
+    void fit_quantization(const float* low, const float* high) {
+        if (format != VectorFormat::INT8) {
+            return;
+        }
+        for (size_t i = 0; i < params.dim; i++) {
+            bool valid = std::isfinite(low[i]) && std::isfinite(high[i]) && high[i] >= low[i];
+            offset[i] = valid ? low[i] : 0.0f;
+            scale[i] = valid ? (high[i] - low[i]) / 255.0f : 0.0f;
+        }
+        update_scaled_weights();
+    }
+
+    // Restore a quantization saved with quantization_scale() and quantization_offset()
+    void set_quantization(const std::vector<float>& new_scale, const std::vector<float>& new_offset) {
+        if (new_scale.size() != scale.size() || new_offset.size() != offset.size()) {
+            throw std::invalid_argument("Quantization doesn't match feature dimension");
+        }
+        std::copy(new_scale.begin(), new_scale.end(), scale.begin());
+        std::copy(new_offset.begin(), new_offset.end(), offset.begin());
+        update_scaled_weights();
+    }
+
+    // Padded per-feature scale and offset: value = offset + scale * code
+    const std::vector<float>& quantization_scale() const {
+        return scale;
+    }
+
+    const std::vector<float>& quantization_offset() const {
+        return offset;
+    }
+
+    // Encode a padded vector into code_size() bytes. INT8 values outside the fitted range are
+    // clamped to it.
+    void encode(const float* vector, void* code) const {
+        if (format == VectorFormat::FP16) {
+            uint16_t* halves = static_cast<uint16_t*>(code);
+            for (size_t i = 0; i < weights.size(); i++) {
+                halves[i] = feature_kernels::float_to_half(vector[i]);
+            }
+        } else if (format == VectorFormat::INT8) {
+            uint8_t* levels = static_cast<uint8_t*>(code);
+            for (size_t i = 0; i < weights.size(); i++) {
+                float level = scale[i] > 0.0f ? std::round((vector[i] - offset[i]) / scale[i]) : 0.0f;
+                levels[i] = static_cast<uint8_t>(std::min(std::max(level, 0.0f), 255.0f));
+            }
+        } else {
+            std::memcpy(code, vector, weights.size() * sizeof(float));
+        }
+    }
+
+    // Decode code_size() bytes back into a padded vector
+    void decode(const void* code, float* vector) const {
+        if (format == VectorFormat::FP16) {
+            const uint16_t* halves = static_cast<const uint16_t*>(code);
+            for (size_t i = 0; i < weights.size(); i++) {
+                vector[i] = feature_kernels::half_to_float(halves[i]);
+            }
+        } else if (format == VectorFormat::INT8) {
+            const uint8_t* levels = static_cast<const uint8_t*>(code);
+            for (size_t i = 0; i < weights.size(); i++) {
+                vector[i] = offset[i] + scale[i] * levels[i];
+            }
+        } else {
+            std::memcpy(vector, code, weights.size() * sizeof(float));
+        }
+    }
+
+    // Full precision distance between two padded fp32 vectors, whatever the storage format
+    float float_distance(const float* a, const float* b) const {
+        DB_STATS_ADD(DISTANCES, 1);
+        if (metric == FeatureMetric::WEIGHTED_COSINE) {
+            return feature_kernels::weighted_cosine(a, b, weights.data(), params.blocks);
+        }
+        return feature_kernels::weighted_l2(a, b, weights.data(), params.blocks);
+    }
+
+    // Weights padded to padded_dim() with zeros, as the kernels read them
+    const float* weight_data() const {
+        return weights.data();
+    }
+
+    std::vector<float> get_weights() const {
+        return std::vector<float>(weights.begin(), weights.begin() + params.dim);
+    }
+
+    FeatureMetric get_metric() const {
+        return metric;
+    }
+
+    VectorFormat get_format() const {
+        return format;
+    }
+
+    size_t dim() const {
+        return params.dim;
+    }
+
+    // Floats per stored vector, including padding
+    size_t padded_dim() const {
+        return weights.size();
+    }
+
+    // Bytes per stored vector
+    size_t code_size() const {
+        return weights.size() * vector_code_bytes(format);
+    }
+
+    size_t get_data_size() override {
+        return code_size();
+    }
+
+    hnswlib::DISTFUNC<float> get_dist_func() override {
+        return distance;
+    }
+
+    void* get_dist_func_param() override {
+        return &params;
+    }
+};
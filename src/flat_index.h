@@ -0,0 +1,235 @@
+#pragma once
+
+#include "../vendor/hnswlib/hnswlib/hnswlib.h"
+#include "feature_space.h"
+#include "bitset.h"
+#include <vector>
+#include <queue>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+// Exact nearest neighbour search by scanning every track. Vectors are stored column by
+// column (structure of arrays), so the kernels compute the distances of 16 tracks at once
+// with one SIMD lane per track, whatever the feature dimension. For libraries up to a few
+// tens of thousands of tracks this is both smaller and faster to build than an HNSW graph,
+// and it is exact.
+class FlatIndex {
+public:
+    // Same shape as hnswlib's searchKnn result: farthest match on top
+    using Result = std::priority_queue<std::pair<float, hnswlib::labeltype>>;
+
+    // Tracks per kernel block
+    static constexpr size_t BLOCK = 16;
+
+private:
+    size_t dim;
+    size_t count = 0;
+    size_t capacity = 0;          // column length, a multiple of BLOCK; tail lanes stay zero
+    std::vector<float> columns;   // dim columns of capacity floats
+    DynamicBitset deleted;
+
+    void grow(size_t min_capacity) {
+        size_t new_capacity = std::max<size_t>(BLOCK, capacity);
+        while (new_capacity < min_capacity) new_capacity *= 2;
+        if (new_capacity == capacity) return;
+
+        std::vector<float> new_columns(dim * new_capacity, 0.0f);
+        for (size_t f = 0; f < dim; f++) {
+            std::copy(columns.begin() + f * capacity, columns.begin() + f * capacity + count,
+                      new_columns.begin() + f * new_capacity);
+        }
+        columns.swap(new_columns);
+        capacity = new_capacity;
+    }
+
+    // Weighted squared L2 distances from the query to the 16 tracks starting at first
+    void block_l2(const float* query, const float* weights, size_t first, float* out) const {
+#if defined(USE_AVX512)
+        __m512 sum = _mm512_setzero_ps();
+        for (size_t f = 0; f < dim; f++) {
+            __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(&columns[f * capacity + first]), _mm512_set1_ps(query[f]));
+            sum = _mm512_fmadd_ps(_mm512_mul_ps(diff, diff), _mm512_set1_ps(weights[f]), sum);
+        }
+        _mm512_storeu_ps(out, sum);
+#elif defined(USE_AVX)
+        for (size_t half = 0; half < BLOCK; half += 8) {
+            __m256 sum = _mm256_setzero_ps();
+            for (size_t f = 0; f < dim; f++) {
+                __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(&columns[f * capacity + first + half]), _mm256_set1_ps(query[f]));
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_mul_ps(diff, diff), _mm256_set1_ps(weights[f])));
+            }
+            _mm256_storeu_ps(out + half, sum);
+        }
+#elif defined(USE_SSE)
+        for (size_t quarter = 0; quarter < BLOCK; quarter += 4) {
+            __m128 sum = _mm_setzero_ps();
+            for (size_t f = 0; f < dim; f++) {
+                __m128 diff = _mm_sub_ps(_mm_loadu_ps(&columns[f * capacity + first + quarter]), _mm_set1_ps(query[f]));
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_mul_ps(diff, diff), _mm_set1_ps(weights[f])));
+            }
+            _mm_storeu_ps(out + quarter, sum);
+        }
+#else
+        std::fill(out, out + BLOCK, 0.0f);
+        for (size_t f = 0; f < dim; f++) {
+            const float* column = &columns[f * capacity + first];
+            for (size_t lane = 0; lane < BLOCK; lane++) {
+                float diff = column[lane] - query[f];
+                out[lane] += diff * diff * weights[f];
+            }
+        }
+#endif
+    }
+
+    // Weighted cosine distances from the query to the 16 tracks starting at first
+    void block_cosine(const float* query, const float* weights, float query_norm, size_t first, float* out) const {
+        float dot[BLOCK];
+        float norm[BLOCK];
+#if defined(USE_AVX512)
+        __m512 dot_sum = _mm512_setzero_ps();
+        __m512 norm_sum = _mm512_setzero_ps();
+        for (size_t f = 0; f < dim; f++) {
+            __m512 x = _mm512_loadu_ps(&columns[f * capacity + first]);
+            __m512 wx = _mm512_mul_ps(x, _mm512_set1_ps(weights[f]));
+            dot_sum = _mm512_fmadd_ps(wx, _mm512_set1_ps(query[f]), dot_sum);
+            norm_sum = _mm512_fmadd_ps(wx, x, norm_sum);
+        }
+        _mm512_storeu_ps(dot, dot_sum);
+        _mm512_storeu_ps(norm, norm_sum);
+#elif defined(USE_AVX)
+        for (size_t half = 0; half < BLOCK; half += 8) {
+            __m256 dot_sum = _mm256_setzero_ps();
+            __m256 norm_sum = _mm256_setzero_ps();
+            for (size_t f = 0; f < dim; f++) {
+                __m256 x = _mm256_loadu_ps(&columns[f * capacity + first + half]);
+                __m256 wx = _mm256_mul_ps(x, _mm256_set1_ps(weights[f]));
+                dot_sum = _mm256_add_ps(dot_sum, _mm256_mul_ps(wx, _mm256_set1_ps(query[f])));
+                norm_sum = _mm256_add_ps(norm_sum, _mm256_mul_ps(wx, x));
+            }
+            _mm256_storeu_ps(dot + half, dot_sum);
+            _mm256_storeu_ps(norm + half, norm_sum);
+        }
+#elif defined(USE_SSE)
+        for (size_t quarter = 0; quarter < BLOCK; quarter += 4) {
+            __m128 dot_sum = _mm_setzero_ps();
+            __m128 norm_sum = _mm_setzero_ps();
+            for (size_t f = 0; f < dim; f++) {
+                __m128 x = _mm_loadu_ps(&columns[f * capacity + first + quarter]);
+                __m128 wx = _mm_mul_ps(x, _mm_set1_ps(weights[f]));
+                dot_sum = _mm_add_ps(dot_sum, _mm_mul_ps(wx, _mm_set1_ps(query[f])));
+                norm_sum = _mm_add_ps(norm_sum, _mm_mul_ps(wx, x));
+            }
+            _mm_storeu_ps(dot + quarter, dot_sum);
+            _mm_storeu_ps(norm + quarter, norm_sum);
+        }
+#else
+        std::fill(dot, dot + BLOCK, 0.0f);
+        std::fill(norm, norm + BLOCK, 0.0f);
+        for (size_t f = 0; f < dim; f++) {
+            const float* column = &columns[f * capacity + first];
+            for (size_t lane = 0; lane < BLOCK; lane++) {
+                float wx = column[lane] * weights[f];
+                dot[lane] += wx * query[f];
+                norm[lane] += wx * column[lane];
+            }
+        }
+#endif
+        // Same formula as feature_kernels::weighted_cosine so both backends agree
+        for (size_t lane = 0; lane < BLOCK; lane++) {
+            float denominator = query_norm * norm[lane];
+            out[lane] = denominator > 0.0f ? 1.0f - dot[lane] / std::sqrt(denominator) : 1.0f;
+        }
+    }
+
+public:
+    explicit FlatIndex(size_t dimension) : dim(dimension) {}
+
+    void reserve(size_t tracks) {
+        grow(tracks);
+    }
+
+    // Append a vector (at least dim floats) as the next label
+    void add(const float* vector) {
+        if (count == capacity) {
+            grow(count + 1);
+        }
+        for (size_t f = 0; f < dim; f++) {
+            columns[f * capacity + count] = vector[f];
+        }
+        count++;
+    }
+
+    // Replace the vector of an existing label and bring it back if it was deleted
+    void set(size_t label, const float* vector) {
+        for (size_t f = 0; f < dim; f++) {
+            columns[f * capacity + label] = vector[f];
+        }
+        deleted.reset(label);
+    }
+
+    void mark_deleted(size_t label) {
+        deleted.set(label);
+    }
+
+    bool is_deleted(size_t label) const {
+        return deleted.test(label);
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    void clear() {
+        columns.clear();
+        columns.shrink_to_fit();
+        deleted = DynamicBitset();
+        count = 0;
+        capacity = 0;
+    }
+
+    size_t memory_usage() const {
+        return columns.capacity() * sizeof(float) + deleted.size() / 8;
+    }
+
+    // The k nearest live tracks under the space's metric and weights. The heap never holds
+    // more than k entries, and the filter is only asked about tracks close enough to make it.
+    Result search(const float* query, size_t k, const WeightedSpace& space, hnswlib::BaseFilterFunctor* filter = nullptr) const {
+        std::vector<std::pair<float, hnswlib::labeltype>> storage;
+        storage.reserve(k + 1);
+        Result heap(std::less<std::pair<float, hnswlib::labeltype>>(), std::move(storage));
+        if (k == 0 || count == 0) {
+            return heap;
+        }
+
+        DB_STATS_ADD(DISTANCES, count);
+        const float* weights = space.weight_data();
+        bool cosine = space.get_metric() == FeatureMetric::WEIGHTED_COSINE;
+        float query_norm = 0.0f;
+        if (cosine) {
+            for (size_t f = 0; f < dim; f++) {
+                query_norm += query[f] * query[f] * weights[f];
+            }
+        }
+
+        float distances[BLOCK];
+        for (size_t first = 0; first < count; first += BLOCK) {
+            if (cosine) {
+                block_cosine(query, weights, query_norm, first, distances);
+            } else {
+                block_l2(query, weights, first, distances);
+            }
+
+            size_t lanes = std::min(BLOCK, count - first);
+            for (size_t lane = 0; lane < lanes; lane++) {
+                float distance = distances[lane];
+                if (heap.size() == k && distance >= heap.top().first) continue;
+                size_t label = first + lane;
+                if (deleted.test(label) || (filter && !(*filter)(label))) continue;
+                if (heap.size() == k) heap.pop();
+                heap.emplace(distance, label);
+            }
+        }
+        return heap;
+    }
+};
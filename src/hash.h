@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// 64-bit content hash, a word at a time so hashing a whole export stays far cheaper than parsing it
+inline uint64_t hash_bytes(const char* data, size_t size, uint64_t seed = 0) {
+    const uint64_t prime = 0x9E3779B97F4A7C15ull;
+    uint64_t h = (seed ^ size) * prime;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        word *= 0xFF51AFD7ED558CCDull;
+        word ^= word >> 29;
+        h = (h ^ word) * prime;
+        h ^= h >> 32;
+    }
+    uint64_t tail = 0;
+    if (size > i) {
+        std::memcpy(&tail, data + i, size - i);
+    }
+    h = (h ^ (tail * 0xC4CEB9FE1A85EC53ull)) * prime;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return h;
+}
+
+inline uint64_t hash_string(std::string_view value, uint64_t seed = 0) {
+    return hash_bytes(value.data(), value.size(), seed);
+}
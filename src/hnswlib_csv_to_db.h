@@ -1,57 +1,523 @@
 #pragma once
 
 #include "../vendor/hnswlib/hnswlib/hnswlib.h"
+#include "csv_reader.h"
+#include "metadata_store.h"
+#include "bounded_queue.h"
+#include "cow_vector.h"
+#include "library_snapshot.h"
+#include "track_manifest.h"
+#include "csv_dedup.h"
+#include "track_filter.h"
+#include "feature_space.h"
+#include "thread_pool.h"
+#include "flat_index.h"
+#include "db_stats.h"
 #include <vector>
 #include <string>
-#include <fstream>
-#include <sstream>
-#include <unordered_map>
+#include <string_view>
+#include <algorithm>
+#include <cmath>
 #include <stdexcept>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <unordered_map>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <cstdio>
+
+// Search structure behind HNSWVectorDB
+enum class IndexBackend : uint32_t {
+    AUTO = 0,  // flat scan up to FLAT_BACKEND_MAX_TRACKS tracks, HNSW graph beyond
+    HNSW = 1,
+    FLAT = 2,
+};
 
+// Thread safety: const methods only read the database and may be called from any number of
+// threads at once; hnswlib gives every concurrent search its own visited list. Non-const
+// methods need exclusive access, including search_batch and find_near_duplicates, which
+// share one worker pool. LiveLibrary keeps serving const calls while the library changes.
 class HNSWVectorDB {
 private:
-    hnswlib::L2Space* space;
+    WeightedSpace* space;
     hnswlib::HierarchicalNSW<float>* index;
     int dim;
-    std::vector<std::unordered_map<std::string, std::string>> metadata;
-    std::vector<float> data_buffer;
+    size_t stride; // floats per stored vector, dim padded for the distance kernels
+    size_t max_elements;
+    size_t M;
+    size_t ef_construction;
+    MetadataStore metadata;
+    TrackManifest manifest;
+    // Local files that couldn't be analysed, by key, with the content hash they had then
+    std::unordered_map<std::string, uint64_t> failed_files;
+    // Artists and individual genres of the live tracks, rebuilt whenever the library changes
+    TagIndex artist_tags;
+    TagIndex genre_tags;
+    // fp32 vectors, stride floats per row. With FP32 storage these are what the index holds;
+    // with FP16/INT8 they are only kept for reranking and are empty otherwise.
+    CowVector<float> data_buffer;
+    // Quantized vectors as stored in the index, code_size bytes per row (FP16/INT8 only)
+    CowVector<uint8_t> code_buffer;
+    size_t code_size;
+    size_t rerank_candidates = 0;
+    FeatureStandardizer standardizer;
+    // The scaling was set by fix_scaling() or read_scaling() rather than fitted on a load
+    bool scaling_fixed = false;
     bool index_loaded = false;
 
-    // Helper function to parse a CSV line
-    std::unordered_map<std::string, std::string> parse_csv_line(const std::string& line, const std::vector<std::string>& headers) {
-        std::unordered_map<std::string, std::string> record;
-        std::stringstream ss(line);
-        std::string token;
-        size_t i = 0;
-        
-        while (std::getline(ss, token, ',')) {
-            if (i < headers.size()) {
-                record[headers[i]] = token;
+    // Skip rows that repeat an earlier track (see DuplicateFilter) when ingesting an export
+    bool deduplicate = false;
+
+    // With the flat backend active, index is an empty placeholder graph
+    IndexBackend backend = IndexBackend::AUTO;
+    bool flat_active = false;
+    FlatIndex flat_index;
+    size_t ef_search = 10;
+
+    // hnswlib's hop counter of graphs replaced since the last stats reset
+    uint64_t retired_hops = 0;
+
+    // Mapping of the snapshot that metadata and the vector buffers borrow from, if any
+    std::shared_ptr<MappedFile> snapshot_file;
+
+    // Workers for search_batch, created on first use and kept between batches
+    std::unique_ptr<ThreadPool> search_pool;
+
+    // Column layout of a library that starts from scanned tracks instead of an export; the
+    // same as the playlist export, so an export can be refreshed into it later
+    static const std::vector<std::string>& default_columns() {
+        static const std::vector<std::string> columns = {
+            "#", "Song", "Artist", "Popularity", "BPM", "Genres", "Album", "Album Date", "Time",
+            "Dance", "Energy", "Acoustic", "Instrumental", "Happy", "Speech", "Live", "Loud (Db)",
+            "Key", "Time Signature", "Added At", "Spotify Track Id", "Camelot", "ISRC"
+        };
+        return columns;
+    }
+
+    // Helper function to read the header row and resolve the feature column positions
+    std::vector<std::string> read_headers(CsvReader& reader, std::vector<size_t>& feature_indices) {
+        std::vector<std::string> headers;
+        if (reader.next_row()) {
+            for (std::string_view header : reader.row()) {
+                headers.emplace_back(header);
             }
-            i++;
         }
-        
-        return record;
+
+        feature_indices.clear();
+        for (const std::string& column : feature_columns()) {
+            size_t index = find_csv_column(headers, column);
+            if (index == std::string::npos) {
+                throw std::runtime_error("CSV is missing feature column: " + column);
+            }
+            feature_indices.push_back(index);
+        }
+        return headers;
+    }
+
+    // Helper function to parse the feature columns of a row straight into floats.
+    // Returns false for rows with missing or non-numeric features.
+    bool extract_features(const std::vector<std::string_view>& fields, const std::vector<size_t>& feature_indices, float* features) {
+        for (size_t i = 0; i < feature_indices.size(); i++) {
+            size_t index = feature_indices[i];
+            if (index >= fields.size() || !parse_csv_float(fields[index], features[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Fit the standardizer on the valid rows of an export. This is a quick extra pass over
+    // the mapped file so that the build can insert every vector already scaled.
+    void fit_standardizer(std::string_view csv_text) {
+        CsvReader reader(csv_text);
+        std::vector<size_t> feature_indices;
+        read_headers(reader, feature_indices);
+        std::vector<float> features(std::max(static_cast<size_t>(dim), feature_indices.size()), 0.0f);
+
+        FeatureStandardizer::Accumulator accumulator(dim);
+        std::vector<float> low(dim, std::numeric_limits<float>::infinity());
+        std::vector<float> high(dim, -std::numeric_limits<float>::infinity());
+        while (reader.next_row()) {
+            if (extract_features(reader.row(), feature_indices, features.data())) {
+                accumulate_features(features.data(), accumulator, low, high);
+            }
+        }
+        finish_fit(accumulator, low, high);
+    }
+
+    static void accumulate_features(const float* features, FeatureStandardizer::Accumulator& accumulator,
+                                    std::vector<float>& low, std::vector<float>& high) {
+        accumulator.add(features);
+        for (size_t i = 0; i < low.size(); i++) {
+            // NaN compares false, so unknown features leave the range alone
+            low[i] = std::min(low[i], features[i]);
+            high[i] = std::max(high[i], features[i]);
+        }
+    }
+
+    void finish_fit(const FeatureStandardizer::Accumulator& accumulator, std::vector<float>& low, std::vector<float>& high) {
+        standardizer = accumulator.finish();
+        for (int i = 0; i < dim; i++) {
+            if (low[i] > high[i]) {
+                // No track has this feature; it standardizes to 0 everywhere
+                low[i] = high[i] = std::numeric_limits<float>::quiet_NaN();
+            }
+        }
+
+        // Quantize over the range the library spans once standardized
+        std::vector<float> scaled_low(stride);
+        std::vector<float> scaled_high(stride);
+        standardizer.apply(low.data(), scaled_low.data(), stride);
+        standardizer.apply(high.data(), scaled_high.data(), stride);
+        space->fit_quantization(scaled_low.data(), scaled_high.data());
+    }
+
+    // Helper function to turn raw features into a standardized, padded vector of stride floats
+    void prepare_vector(const float* features, float* vector) const {
+        standardizer.apply(features, vector, stride);
+    }
+
+    bool quantized() const {
+        return space->get_format() != VectorFormat::FP32;
+    }
+
+    // Whether data_buffer holds fp32 vectors for every track
+    bool keeps_float_vectors() const {
+        return !quantized() || rerank_candidates > 0;
+    }
+
+    // Stored vector of a label in the index's format
+    const void* stored_code(size_t label) const {
+        if (quantized()) {
+            return code_buffer.data() + label * code_size;
+        }
+        return data_buffer.data() + label * stride;
+    }
+
+    // fp32 vector of a label: the kept one if there is one, otherwise decoded into scratch
+    const float* float_vector(size_t label, std::vector<float>& scratch) const {
+        if (!data_buffer.empty()) {
+            return data_buffer.data() + label * stride;
+        }
+        scratch.resize(stride);
+        space->decode(stored_code(label), scratch.data());
+        return scratch.data();
+    }
+
+    // Append (label == size) or overwrite the stored vector of a label. Appends stay within
+    // the reserved capacity during a build, so workers can keep reading earlier rows.
+    void store_vector(size_t label, const float* vector) {
+        if (quantized()) {
+            if (label * code_size == code_buffer.size()) {
+                code_buffer.resize(code_buffer.size() + code_size);
+            }
+            space->encode(vector, code_buffer.mutable_data() + label * code_size);
+        }
+        if (keeps_float_vectors()) {
+            if (label * stride == data_buffer.size()) {
+                data_buffer.append(vector, stride);
+            } else {
+                std::copy(vector, vector + stride, data_buffer.mutable_data() + label * stride);
+            }
+        }
+    }
+
+    // Grow the graph so it can hold at least count labels. Capacity at least doubles so a
+    // series of small refreshes doesn't reallocate the graph every time. Not thread-safe;
+    // call it before any concurrent inserts start.
+    void ensure_capacity(size_t count) {
+        size_t capacity = index->getMaxElements();
+        if (count > capacity) {
+            index->resizeIndex(std::max(count, capacity * 2));
+        }
+    }
+
+    // Find the label of a track key that the current pass hasn't matched yet, so repeated
+    // rows of the same track map to successive occurrences. With seen == nullptr every known
+    // label counts as matched, which is what a fresh load wants. repeats tracks the last
+    // occurrence matched per repeated key during the pass. resolved receives the key to
+    // record if the track turns out to be new.
+    size_t match_track(const std::string& key, const std::vector<uint8_t>* seen,
+                       std::unordered_map<std::string, size_t>& repeats, std::string& resolved) {
+        resolved = key;
+        size_t label = manifest.find(resolved);
+        if (label == TrackManifest::npos || (seen && !(*seen)[label])) {
+            return label;
+        }
+        size_t& occurrence = repeats[key];
+        while (true) {
+            resolved = TrackManifest::occurrence_key(key, ++occurrence);
+            label = manifest.find(resolved);
+            if (label == TrackManifest::npos || (seen && !(*seen)[label])) {
+                return label;
+            }
+        }
+    }
+
+    // Re-split the Artist and Genres columns after the tracks changed. Only integer work on
+    // the interned columns, so it stays cheap next to parsing.
+    void rebuild_tags() {
+        DynamicBitset removed;
+        for (size_t label = 0; manifest.removed() > 0 && label < manifest.size(); label++) {
+            if (manifest.is_deleted(label)) removed.set(label);
+        }
+        artist_tags.build(metadata, "Artist", TagSeparator::BARE_COMMA, &removed);
+        genre_tags.build(metadata, "Genres", TagSeparator::COMMA, &removed);
+    }
+
+    // Install a new graph, carrying over the search settings
+    void replace_index(hnswlib::HierarchicalNSW<float>* graph) {
+        retired_hops += static_cast<uint64_t>(index->metric_hops);
+        delete index;
+        index = graph;
+        index->setEf(ef_search);
+    }
+
+    bool wants_flat(size_t tracks) const {
+        return backend == IndexBackend::FLAT || (backend == IndexBackend::AUTO && tracks <= FLAT_BACKEND_MAX_TRACKS);
+    }
+
+    // Make the active backend match the setting for a library of the given size, moving the
+    // stored vectors over. Switching to HNSW builds the graph on all cores.
+    void apply_backend(size_t tracks) {
+        bool flat = wants_flat(tracks);
+        if (flat == flat_active) {
+            return;
+        }
+
+        size_t count = metadata.size();
+        if (flat) {
+            DB_STATS_PHASE(PHASE_BUILD);
+            std::vector<float> scratch;
+            flat_index.clear();
+            flat_index.reserve(std::max(tracks, count));
+            for (size_t i = 0; i < count; i++) {
+                flat_index.add(float_vector(i, scratch));
+                if (manifest.is_deleted(i)) flat_index.mark_deleted(i);
+            }
+            replace_index(new hnswlib::HierarchicalNSW<float>(space, 1, M, ef_construction));
+        } else {
+            std::unique_ptr<hnswlib::HierarchicalNSW<float>> graph(
+                new hnswlib::HierarchicalNSW<float>(space, std::max({tracks, count, max_elements, size_t(1)}), M, ef_construction));
+            ThreadPool pool;
+            pool.parallel_for(count, BUILD_CHUNK_ROWS, [&](size_t begin, size_t end, size_t) {
+                DB_STATS_PHASE(PHASE_BUILD);
+                for (size_t i = begin; i < end; i++) {
+                    graph->addPoint(stored_code(i), i);
+                }
+            });
+            for (size_t i = 0; i < count; i++) {
+                if (manifest.is_deleted(i)) graph->markDelete(i);
+            }
+            replace_index(graph.release());
+            flat_index.clear();
+        }
+        flat_active = flat;
+    }
+
+    // Add or replace the vector of a label in the active backend. Safe to call from several
+    // threads for distinct labels with HNSW only; flat labels must be added in order.
+    void index_point(size_t label) {
+        if (!flat_active) {
+            index->addPoint(stored_code(label), label);
+            return;
+        }
+        std::vector<float> scratch;
+        const float* vector = float_vector(label, scratch);
+        if (label == flat_index.size()) {
+            flat_index.add(vector);
+        } else {
+            flat_index.set(label, vector);
+        }
+    }
+
+    void remove_point(size_t label) {
+        if (flat_active) {
+            flat_index.mark_deleted(label);
+        } else {
+            index->markDelete(label);
+        }
     }
 
-    // Helper function to normalize features
-    void normalize_features(std::vector<float>& features) {
-        float norm = 0.0f;
-        for (float val : features) {
-            norm += val * val;
+    // Nearest neighbours of a stored-space vector from the active backend, farthest on top.
+    // Quantized graphs are searched with the encoded query; with reranking on, the top
+    // rerank_candidates are then reordered by their fp32 distance.
+    FlatIndex::Result knn(const float* vector, size_t k, hnswlib::BaseFilterFunctor* filter = nullptr) const {
+        DB_STATS_QUERY();
+        if (flat_active) {
+            return flat_index.search(vector, k, *space, filter);
+        }
+        if (!quantized()) {
+            return index->searchKnn(vector, k, filter);
+        }
+
+        std::vector<uint8_t> code(code_size);
+        space->encode(vector, code.data());
+        if (rerank_candidates == 0 || data_buffer.empty()) {
+            return index->searchKnn(code.data(), k, filter);
         }
-        norm = std::sqrt(norm);
-        if (norm > 0) {
-            for (float& val : features) {
-                val /= norm;
+
+        auto candidates = index->searchKnn(code.data(), std::max(k, rerank_candidates), filter);
+        FlatIndex::Result result;
+        for (; !candidates.empty(); candidates.pop()) {
+            size_t label = candidates.top().second;
+            float distance = space->float_distance(vector, data_buffer.data() + label * stride);
+            if (result.size() < k) {
+                result.emplace(distance, label);
+            } else if (distance < result.top().first) {
+                result.pop();
+                result.emplace(distance, label);
             }
         }
+        return result;
+    }
+
+    // Exact k nearest among the selected tracks only, for selections too small for the graph
+    // walk to find enough of them. Distances are computed like the active index computes them.
+    FlatIndex::Result scan_selection(const float* vector, size_t k, const TrackSelection& selection) const {
+        DB_STATS_QUERY();
+        DB_STATS_ADD(DISTANCES, selection.size());
+        std::vector<std::pair<float, hnswlib::labeltype>> storage;
+        storage.reserve(k + 1);
+        FlatIndex::Result heap(std::less<std::pair<float, hnswlib::labeltype>>(), std::move(storage));
+        if (k == 0) {
+            return heap;
+        }
+
+        // Graphs over quantized codes compare codes unless reranking by the fp32 vectors; the
+        // flat backend always compares fp32 (possibly decoded) vectors
+        bool compare_codes = quantized() && !flat_active && (rerank_candidates == 0 || data_buffer.empty());
+        std::vector<uint8_t> query_code;
+        std::vector<float> scratch;
+        hnswlib::DISTFUNC<float> distance_function = space->get_dist_func();
+        void* params = space->get_dist_func_param();
+        if (compare_codes) {
+            query_code.resize(code_size);
+            space->encode(vector, query_code.data());
+        }
+
+        selection.bits().for_each_set([&](size_t label) {
+            if (label >= metadata.size() || manifest.is_deleted(label)) return;
+            float distance = compare_codes ? distance_function(query_code.data(), stored_code(label), params)
+                                           : space->float_distance(vector, float_vector(label, scratch));
+            if (heap.size() < k) {
+                heap.emplace(distance, label);
+            } else if (distance < heap.top().first) {
+                heap.pop();
+                heap.emplace(distance, label);
+            }
+        });
+        return heap;
     }
 
+    // Nearest neighbours within a selection: a graph walk that skips unselected tracks, or a
+    // scan of just the selected ones when they are a small fraction of the library
+    FlatIndex::Result knn(const float* vector, size_t k, const TrackSelection& selection) const {
+        size_t live = metadata.size() - manifest.removed();
+        if (selection.size() <= std::max(k, static_cast<size_t>(live * FILTER_SCAN_MAX_SELECTIVITY))) {
+            return scan_selection(vector, k, selection);
+        }
+        // hnswlib's filter interface isn't const-qualified; testing a selection doesn't modify it
+        return knn(vector, k, const_cast<TrackSelection*>(&selection));
+    }
+
+    // Queries a search worker claims at a time
+    static constexpr size_t SEARCH_BATCH_GRAIN = 8;
+
+    // Search workers, created on first use and kept while the thread count stays the same
+    ThreadPool& worker_pool(size_t num_threads) {
+        if (num_threads == 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        if (!search_pool || search_pool->size() != num_threads) {
+            search_pool.reset(new ThreadPool(num_threads));
+        }
+        return *search_pool;
+    }
+
+    // Node and bucket of hnswlib's label -> internal id hash map, per track
+    static constexpr size_t LABEL_LOOKUP_ENTRY_BYTES = 40;
+
+    // Rows handed to a build worker at a time
+    static constexpr size_t BUILD_CHUNK_ROWS = 256;
+    static constexpr std::chrono::milliseconds BUILD_REPORT_INTERVAL{500};
+
 public:
-    HNSWVectorDB(int dimension = 16, int max_elements = 10000, int M = 16, int ef_construction = 200) 
-        : dim(dimension) {
-        space = new hnswlib::L2Space(dim);
+    // Progress of an index build
+    struct BuildProgress {
+        size_t rows_parsed = 0;
+        size_t rows_indexed = 0;
+        double elapsed_seconds = 0.0;
+        double rows_per_second = 0.0;
+        bool finished = false;
+    };
+    using BuildProgressCallback = std::function<void(const BuildProgress&)>;
+
+    // Libraries up to this many tracks use the flat backend when the backend is AUTO
+    static constexpr size_t FLAT_BACKEND_MAX_TRACKS = 50000;
+
+    // Filtered searches whose selection holds at most this fraction of the live tracks scan
+    // the selection instead of walking the graph, which would have to visit most of the
+    // library to find enough selected tracks
+    static constexpr double FILTER_SCAN_MAX_SELECTIVITY = 0.02;
+
+    // HNSW search quality measured against an exact scan
+    struct RecallReport {
+        size_t queries = 0;
+        size_t k = 0;
+        double recall = 0.0;          // fraction of the true k nearest found
+        double hnsw_query_us = 0.0;   // mean latency per query
+        double exact_query_us = 0.0;
+    };
+
+    // A track whose vector lies within epsilon of an earlier track with the same artist and
+    // base title, such as a remaster or a single edit of an album track
+    struct NearDuplicate {
+        size_t id = 0;
+        size_t duplicate_of = 0;
+        float distance = 0.0f;
+    };
+
+    // Changes applied by refresh_from_csv
+    struct RefreshStats {
+        size_t added = 0;
+        size_t updated = 0;
+        size_t removed = 0;
+        size_t unchanged = 0;
+        double seconds = 0.0;
+    };
+
+    // A track from a source other than the playlist export, such as an analysed audio file
+    struct TrackRecord {
+        std::string key;        // identity, e.g. TrackManifest::file_key(path)
+        uint64_t hash = 0;      // content hash; a known track with the same hash is left as is
+        std::vector<std::pair<std::string, std::string>> fields; // metadata by column name
+        std::vector<float> features; // raw values in feature_columns() order, NaN where unknown
+    };
+
+    // Columns used as features, in vector order
+    static const std::vector<std::string>& feature_columns() {
+        static const std::vector<std::string> columns = {
+            "Popularity", "BPM", "Dance", "Energy", "Acoustic",
+            "Instrumental", "Happy", "Speech", "Live", "Loud (Db)"
+        };
+        return columns;
+    }
+
+    // FP16 and INT8 storage shrink the vectors held by the graph 2x and 4x. The fp32
+    // vectors are then dropped after encoding unless reranking is enabled (set_rerank).
+    HNSWVectorDB(int dimension = 16, int max_elements = 10000, int M = 16, int ef_construction = 200,
+                 FeatureMetric metric = FeatureMetric::WEIGHTED_L2, VectorFormat format = VectorFormat::FP32)
+        : dim(dimension), max_elements(max_elements), M(M), ef_construction(ef_construction), flat_index(padded_feature_dim(dimension)) {
+        space = new WeightedSpace(dim, metric, format);
+        stride = space->padded_dim();
+        code_size = space->code_size();
         index = new hnswlib::HierarchicalNSW<float>(space, max_elements, M, ef_construction);
     }
 
@@ -60,71 +526,219 @@ public:
         delete space;
     }
 
-    // Load data from CSV file and create vector database
-    void load_from_csv(const std::string& csv_file_path) {
-        std::ifstream file(csv_file_path);
-        if (!file.is_open()) {
-            throw std::runtime_error("Could not open file: " + csv_file_path);
+    // Load data from CSV file and create vector database. The calling thread parses rows
+    // and extracts features while num_threads workers insert them into the graph in chunks
+    // (0 = one per core, 1 = build on the calling thread). The flat backend needs no graph
+    // and is filled on the calling thread. The optional callback receives throughput
+    // updates from the workers and a final report once the build is done.
+    void load_from_csv(const std::string& csv_file_path, size_t num_threads = 0, const BuildProgressCallback& progress = nullptr) {
+        MappedFile file(csv_file_path);
+        CsvReader reader(file.view());
+
+        std::vector<size_t> feature_indices;
+        metadata.set_headers(read_headers(reader, feature_indices));
+        TrackManifest::KeyColumns key_columns(metadata.get_headers());
+        std::vector<float> features(std::max(static_cast<size_t>(dim), feature_indices.size()));
+        std::vector<float> vector(stride);
+        std::string key;
+        std::unordered_map<std::string, size_t> repeats;
+        DuplicateFilter duplicates(key_columns);
+
+        // The first load fixes the scaling; later loads and refreshes reuse it so existing
+        // vectors stay comparable
+        if (!standardizer.fitted()) {
+            fit_standardizer(file.view());
         }
 
-        std::string line;
-        std::vector<std::string> headers;
+        if (num_threads == 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
 
-        // Read headers
-        if (std::getline(file, line)) {
-            std::stringstream ss(line);
-            std::string header;
-            while (std::getline(ss, header, ',')) {
-                headers.push_back(header);
-            }
+        // Workers read the vector buffers while the parser keeps appending to them, so reserve
+        // enough room up front that they never reallocate during the build
+        size_t first_row = metadata.size();
+        size_t max_rows = first_row + count_csv_lines(file.view());
+        if (keeps_float_vectors()) {
+            data_buffer.reserve(max_rows * stride);
+        }
+        if (quantized()) {
+            code_buffer.reserve(max_rows * code_size);
+        }
+        metadata.reserve(max_rows);
+        apply_backend(max_rows);
+        if (flat_active) {
+            num_threads = 1;
+            flat_index.reserve(max_rows);
+        } else {
+            ensure_capacity(max_rows);
         }
 
-        // Read data
-        while (std::getline(file, line)) {
-            auto record = parse_csv_line(line, headers);
-            metadata.push_back(record);
+        auto start = std::chrono::steady_clock::now();
+        auto last_report = start;
+        std::mutex progress_mutex;
+        std::atomic<size_t> rows_parsed{0};
+        std::atomic<size_t> rows_indexed{0};
+
+        auto report = [&](bool finished) {
+            auto now = std::chrono::steady_clock::now();
+            BuildProgress status;
+            status.rows_parsed = rows_parsed;
+            status.rows_indexed = rows_indexed;
+            status.elapsed_seconds = std::chrono::duration<double>(now - start).count();
+            status.rows_per_second = status.elapsed_seconds > 0 ? status.rows_indexed / status.elapsed_seconds : 0.0;
+            status.finished = finished;
+            progress(status);
+        };
 
-            // Extract features (modify this based on which columns you want to use as features)
-            std::vector<float> features;
-            try {
-                features.push_back(std::stof(record["Popularity"]));
-                features.push_back(std::stof(record["BPM"]));
-                features.push_back(std::stof(record["Dance"]));
-                features.push_back(std::stof(record["Energy"]));
-                features.push_back(std::stof(record["Acoustic"]));
-                features.push_back(std::stof(record["Instrumental"]));
-                features.push_back(std::stof(record["Happy"]));
-                features.push_back(std::stof(record["Speech"]));
-                features.push_back(std::stof(record["Live"]));
-                features.push_back(std::stof(record["Loud (Db)"]));
-                // Add more features as needed
-            } catch (...) {
-                continue; // Skip records with invalid data
+        auto add_rows = [&](size_t begin, size_t end) {
+            DB_STATS_PHASE(PHASE_BUILD);
+            for (size_t i = begin; i < end; i++) {
+                index_point(i);
             }
+            rows_indexed += end - begin;
+            DB_STATS_ADD(ROWS_INDEXED, end - begin);
 
-            // Pad with zeros if needed to match dimension
-            while (features.size() < static_cast<size_t>(dim)) {
-                features.push_back(0.0f);
+            if (progress) {
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                auto now = std::chrono::steady_clock::now();
+                if (now - last_report >= BUILD_REPORT_INTERVAL) {
+                    last_report = now;
+                    report(false);
+                }
             }
+        };
 
-            // Normalize features
-            normalize_features(features);
+        // Add data to index
+        BoundedQueue<std::pair<size_t, size_t>> chunks(num_threads * 4);
+        std::exception_ptr worker_error;
+        std::mutex error_mutex;
+        std::vector<std::thread> workers;
 
-            // Add to data buffer
-            data_buffer.insert(data_buffer.end(), features.begin(), features.end());
+        if (num_threads > 1) {
+            for (size_t t = 0; t < num_threads; t++) {
+                workers.emplace_back([&] {
+                    std::pair<size_t, size_t> chunk;
+                    while (chunks.pop(chunk)) {
+                        try {
+                            add_rows(chunk.first, chunk.second);
+                        } catch (...) {
+                            std::lock_guard<std::mutex> lock(error_mutex);
+                            if (!worker_error) worker_error = std::current_exception();
+                            chunks.close();
+                            chunks.clear();
+                        }
+                    }
+                });
+            }
         }
 
-        // Add data to index
-        for (size_t i = 0; i < metadata.size(); i++) {
-            index->addPoint(data_buffer.data() + i * dim, i);
+        auto join_workers = [&] {
+            chunks.close();
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        };
+
+        size_t chunk_begin = first_row;
+        auto flush_chunk = [&] {
+            size_t chunk_end = metadata.size();
+            if (chunk_end == chunk_begin) return true;
+            bool queued = true;
+            if (workers.empty()) {
+                add_rows(chunk_begin, chunk_end);
+            } else {
+                queued = chunks.push(std::make_pair(chunk_begin, chunk_end));
+            }
+            chunk_begin = chunk_end;
+            return queued;
+        };
+
+        try {
+            // Read data
+            DB_STATS_CLOCK(phases, PHASE_PARSE);
+            while (reader.next_row()) {
+                DB_STATS_SWITCH(phases, PHASE_EXTRACT);
+                const auto& fields = reader.row();
+
+                // Skip records with invalid data. Metadata is only kept for rows that make it
+                // into the index so that ids line up with labels.
+                std::fill(features.begin(), features.end(), 0.0f);
+                if (!extract_features(fields, feature_indices, features.data()) ||
+                    (deduplicate && !duplicates.first_occurrence(fields))) {
+                    DB_STATS_SWITCH(phases, PHASE_PARSE);
+                    continue;
+                }
+
+                metadata.append(fields);
+                match_track(TrackManifest::track_key(fields, key_columns), nullptr, repeats, key);
+                manifest.add(key, metadata.size() - 1, TrackManifest::row_hash(fields, key_columns));
+
+                // Standardize features and store them in the index's format
+                prepare_vector(features.data(), vector.data());
+                store_vector(metadata.size() - 1, vector.data());
+                rows_parsed++;
+                DB_STATS_ADD(ROWS_PARSED, 1);
+
+                // Inserts are timed as build work, wherever they run
+                DB_STATS_PAUSE(phases);
+                if (metadata.size() - chunk_begin >= BUILD_CHUNK_ROWS && !flush_chunk()) {
+                    break; // a worker failed and closed the queue
+                }
+                DB_STATS_SWITCH(phases, PHASE_PARSE);
+            }
+            DB_STATS_PAUSE(phases);
+            flush_chunk();
+        } catch (...) {
+            join_workers();
+            throw;
+        }
+
+        join_workers();
+        if (worker_error) {
+            std::rethrow_exception(worker_error);
+        }
+        rebuild_tags();
+        if (progress) {
+            report(true);
         }
     }
 
     // Load a previously saved index from file
     void load_index(const std::string& index_file_path, const std::string& metadata_csv_path = "") {
-        if (index) delete index;
-        index = new hnswlib::HierarchicalNSW<float>(space, index_file_path);
+        DB_STATS_PHASE(PHASE_LOAD);
+        if (quantized()) {
+            throw std::logic_error("Index files hold fp32 vectors; open them with FP32 storage");
+        }
+        std::unique_ptr<hnswlib::HierarchicalNSW<float>> loaded(new hnswlib::HierarchicalNSW<float>(space, index_file_path));
+        // hnswlib takes the element layout from the file but the vector size from the space.
+        // Files from before the padded weighted space hold shorter vectors, which would load
+        // fine and then be read past on every distance.
+        size_t stored_vector_bytes = loaded->size_data_per_element_ - loaded->size_links_level0_ - sizeof(hnswlib::labeltype);
+        if (stored_vector_bytes != space->get_data_size() || loaded->data_size_ != space->get_data_size()) {
+            throw std::runtime_error("Index " + index_file_path + " was written by an older version; rebuild from the CSV");
+        }
+
+        // The graph holds the only copy of the vectors. Refreshes, upserts and the flat
+        // backend work from the stored vectors, so copy them out by label.
+        size_t elements = loaded->cur_element_count;
+        size_t labels = 0;
+        for (size_t i = 0; i < elements; i++) {
+            labels = std::max<size_t>(labels, loaded->getExternalLabel(static_cast<hnswlib::tableint>(i)) + 1);
+        }
+        std::vector<float> vectors(labels * stride, 0.0f);
+        for (size_t i = 0; i < elements; i++) {
+            auto internal_id = static_cast<hnswlib::tableint>(i);
+            const float* vector = reinterpret_cast<const float*>(loaded->getDataByInternalId(internal_id));
+            std::copy(vector, vector + stride, vectors.begin() + loaded->getExternalLabel(internal_id) * stride);
+        }
+
+        replace_index(loaded.release());
         index_loaded = true;
+        flat_active = false;
+        flat_index.clear();
+        data_buffer.release();
+        data_buffer.append(vectors.data(), vectors.size());
+        code_buffer.release();
 
         // If metadata CSV is provided, load it to populate the metadata
         if (!metadata_csv_path.empty()) {
@@ -132,53 +746,980 @@ public:
         }
     }
 
-    // Helper function to load just metadata from CSV
+    // Helper function to load just metadata from CSV. Rows are filtered exactly like
+    // load_from_csv so that ids match the labels stored in a saved index.
     void load_metadata_from_csv(const std::string& csv_file_path) {
-        std::ifstream file(csv_file_path);
-        if (!file.is_open()) {
-            throw std::runtime_error("Could not open file: " + csv_file_path);
+        MappedFile file(csv_file_path);
+        CsvReader reader(file.view());
+        metadata.clear();
+        manifest.clear();
+
+        std::vector<size_t> feature_indices;
+        metadata.set_headers(read_headers(reader, feature_indices));
+        TrackManifest::KeyColumns key_columns(metadata.get_headers());
+        std::vector<float> features(feature_indices.size());
+        std::string key;
+        std::unordered_map<std::string, size_t> repeats;
+        DuplicateFilter duplicates(key_columns);
+
+        // A legacy index file doesn't carry the scaling, so refit it on the same export
+        if (!standardizer.fitted()) {
+            fit_standardizer(file.view());
         }
 
-        std::string line;
-        std::vector<std::string> headers;
-        metadata.clear();
+        // Read data
+        DB_STATS_CLOCK(phases, PHASE_PARSE);
+        while (reader.next_row()) {
+            DB_STATS_SWITCH(phases, PHASE_EXTRACT);
+            const auto& fields = reader.row();
+            if (extract_features(fields, feature_indices, features.data()) &&
+                (!deduplicate || duplicates.first_occurrence(fields))) {
+                metadata.append(fields);
+                match_track(TrackManifest::track_key(fields, key_columns), nullptr, repeats, key);
+                manifest.add(key, metadata.size() - 1, TrackManifest::row_hash(fields, key_columns));
+                DB_STATS_ADD(ROWS_PARSED, 1);
+            }
+            DB_STATS_SWITCH(phases, PHASE_PARSE);
+        }
+        DB_STATS_PAUSE(phases);
+        rebuild_tags();
+    }
+
+    // Bring the index in line with a newer export of the same library without rebuilding it.
+    // Tracks are matched by Spotify Track Id, ISRC, or Song + Artist: new tracks are inserted,
+    // edited ones have their metadata and vector updated in place, and tracks missing from
+    // the export are marked deleted so searches skip them. Tracks scanned from disk aren't
+    // part of the export and are left alone. Existing ids stay valid. Throws if the export
+    // has different columns, which needs a full rebuild.
+    RefreshStats refresh_from_csv(const std::string& csv_file_path) {
+        DB_STATS_PHASE(PHASE_REFRESH);
+        auto start = std::chrono::steady_clock::now();
+        MappedFile file(csv_file_path);
+        CsvReader reader(file.view());
+
+        std::vector<size_t> feature_indices;
+        metadata.set_headers(read_headers(reader, feature_indices));
+        if (manifest.size() != metadata.size()) {
+            throw std::runtime_error("Track manifest doesn't match the loaded metadata");
+        }
+        TrackManifest::KeyColumns key_columns(metadata.get_headers());
+        std::vector<float> features(std::max(static_cast<size_t>(dim), feature_indices.size()));
+        std::vector<float> vector(stride);
+        std::string key;
+        std::unordered_map<std::string, size_t> repeats;
+        DuplicateFilter duplicates(key_columns);
+        if (!standardizer.fitted()) {
+            fit_standardizer(file.view());
+        }
+
+        RefreshStats stats;
+        size_t known = metadata.size();
+        std::vector<uint8_t> seen(known, 0);
+
+        while (reader.next_row()) {
+            const auto& fields = reader.row();
+            std::fill(features.begin(), features.end(), 0.0f);
+            if (!extract_features(fields, feature_indices, features.data()) ||
+                (deduplicate && !duplicates.first_occurrence(fields))) {
+                continue;
+            }
+            prepare_vector(features.data(), vector.data());
+            uint64_t hash = TrackManifest::row_hash(fields, key_columns);
+            size_t label = match_track(TrackManifest::track_key(fields, key_columns), &seen, repeats, key);
+
+            if (label == TrackManifest::npos) {
+                label = metadata.size();
+                if (!flat_active) {
+                    ensure_capacity(label + 1);
+                }
+                metadata.append(fields);
+                store_vector(label, vector.data());
+                manifest.add(key, label, hash);
+                index_point(label);
+                seen.push_back(1);
+                stats.added++;
+                continue;
+            }
 
-        // Read headers
-        if (std::getline(file, line)) {
-            std::stringstream ss(line);
-            std::string header;
-            while (std::getline(ss, header, ',')) {
-                headers.push_back(header);
+            seen[label] = 1;
+            if (manifest.hash(label) == hash && !manifest.is_deleted(label)) {
+                stats.unchanged++;
+                continue;
             }
+
+            // Re-indexing an existing label replaces its vector (for HNSW, addPoint relinks it
+            // in the graph) and brings back a track that was deleted by an earlier refresh
+            metadata.set_row(label, fields);
+            store_vector(label, vector.data());
+            index_point(label);
+            manifest.update(label, hash);
+            stats.updated++;
         }
 
-        // Read data
-        while (std::getline(file, line)) {
-            metadata.push_back(parse_csv_line(line, headers));
+        manifest.for_each_key([&](std::string_view track_key, size_t label) {
+            if (label < known && TrackManifest::is_file_key(track_key)) seen[label] = 1;
+        });
+        for (size_t label = 0; label < known; label++) {
+            if (!seen[label] && !manifest.is_deleted(label)) {
+                remove_point(label);
+                manifest.mark_deleted(label);
+                stats.removed++;
+            }
+        }
+
+        // A library that outgrew the flat backend switches to a graph here
+        apply_backend(metadata.size());
+        rebuild_tags();
+
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+
+    // Add or update tracks that don't come from the export, such as analysed audio files.
+    // A record whose key is known replaces that track's metadata and vector unless its hash
+    // is unchanged; new keys get new ids. Metadata fields are matched to the library's columns
+    // by name and the feature columns are filled in from the features. An empty library takes
+    // the export's column layout and, without an export to fit on, fits the scaling on this
+    // batch. Unknown features sit at the library mean.
+    RefreshStats upsert_tracks(const std::vector<TrackRecord>& records) {
+        DB_STATS_PHASE(PHASE_REFRESH);
+        auto start = std::chrono::steady_clock::now();
+        if (manifest.size() != metadata.size()) {
+            throw std::runtime_error("Track manifest doesn't match the loaded metadata");
+        }
+        for (const TrackRecord& record : records) {
+            if (record.features.size() != feature_columns().size()) {
+                throw std::invalid_argument("Track records need one value per feature column, NaN where unknown");
+            }
+        }
+        if (metadata.size() == 0 && metadata.get_headers().empty()) {
+            metadata.set_headers(default_columns());
+        }
+
+        std::vector<float> features(std::max(static_cast<size_t>(dim), feature_columns().size()), 0.0f);
+        if (!standardizer.fitted()) {
+            FeatureStandardizer::Accumulator accumulator(dim);
+            std::vector<float> low(dim, std::numeric_limits<float>::infinity());
+            std::vector<float> high(dim, -std::numeric_limits<float>::infinity());
+            for (const TrackRecord& record : records) {
+                std::copy(record.features.begin(), record.features.end(), features.begin());
+                accumulate_features(features.data(), accumulator, low, high);
+            }
+            finish_fit(accumulator, low, high);
+        }
+
+        const std::vector<std::string>& headers = metadata.get_headers();
+        std::vector<size_t> feature_indices;
+        for (const std::string& column : feature_columns()) {
+            feature_indices.push_back(find_csv_column(headers, column));
+        }
+        std::vector<std::string> values(headers.size());
+        std::vector<std::string_view> fields(headers.size());
+        std::vector<float> vector(stride);
+        char number[32];
+
+        RefreshStats stats;
+        for (const TrackRecord& record : records) {
+            size_t label = manifest.find(record.key);
+            if (label != TrackManifest::npos && manifest.hash(label) == record.hash && !manifest.is_deleted(label)) {
+                stats.unchanged++;
+                continue;
+            }
+
+            std::fill(values.begin(), values.end(), std::string());
+            for (const auto& field : record.fields) {
+                size_t column = find_csv_column(headers, field.first);
+                if (column != std::string::npos) values[column] = field.second;
+            }
+            for (size_t i = 0; i < feature_indices.size(); i++) {
+                features[i] = record.features[i];
+                if (feature_indices[i] != std::string::npos && !std::isnan(features[i])) {
+                    std::snprintf(number, sizeof(number), "%.4g", features[i]);
+                    values[feature_indices[i]] = number;
+                }
+            }
+            for (size_t i = 0; i < values.size(); i++) {
+                fields[i] = values[i];
+            }
+            prepare_vector(features.data(), vector.data());
+
+            if (label == TrackManifest::npos) {
+                label = metadata.size();
+                if (!flat_active) {
+                    ensure_capacity(label + 1);
+                }
+                metadata.append(fields);
+                store_vector(label, vector.data());
+                manifest.add(record.key, label, record.hash);
+                index_point(label);
+                stats.added++;
+            } else {
+                metadata.set_row(label, fields);
+                store_vector(label, vector.data());
+                index_point(label);
+                manifest.update(label, record.hash);
+                stats.updated++;
+            }
+        }
+
+        apply_backend(metadata.size());
+        rebuild_tags();
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+
+    // Remove tracks by key, e.g. files that are gone from disk. Their ids stay reserved like
+    // those of tracks a refresh removes. Returns the number of tracks removed.
+    size_t remove_tracks(const std::vector<std::string>& keys) {
+        size_t removed = 0;
+        for (const std::string& key : keys) {
+            size_t label = manifest.find(key);
+            if (label == TrackManifest::npos || manifest.is_deleted(label)) continue;
+            remove_point(label);
+            manifest.mark_deleted(label);
+            removed++;
         }
+        if (removed > 0) {
+            rebuild_tags();
+        }
+        return removed;
+    }
+
+    // Whether the library holds a live track with this key and content hash
+    bool has_track(std::string_view key, uint64_t hash) const {
+        size_t label = manifest.find(key);
+        return label != TrackManifest::npos && !manifest.is_deleted(label) && manifest.hash(label) == hash;
+    }
+
+    // Remember a file that couldn't be analysed, so syncs skip it until its content hash changes
+    void mark_failed(const std::string& key, uint64_t hash) {
+        failed_files[key] = hash;
+    }
+
+    // Whether the file failed to analyse with this same content hash
+    bool failed_before(const std::string& key, uint64_t hash) const {
+        auto failed = failed_files.find(key);
+        return failed != failed_files.end() && failed->second == hash;
+    }
+
+    void forget_failed(const std::string& key) {
+        failed_files.erase(key);
+    }
+
+    // Keys of the failed files starting with prefix
+    std::vector<std::string> failed_keys(std::string_view prefix) const {
+        std::vector<std::string> keys;
+        for (const auto& failed : failed_files) {
+            if (std::string_view(failed.first).substr(0, prefix.size()) == prefix) keys.push_back(failed.first);
+        }
+        return keys;
+    }
+
+    // Keys of the live tracks starting with prefix, e.g. the files under a folder
+    std::vector<std::string> track_keys(std::string_view prefix) const {
+        std::vector<std::string> keys;
+        manifest.for_each_key([&](std::string_view key, size_t label) {
+            if (key.substr(0, prefix.size()) == prefix && !manifest.is_deleted(label)) {
+                keys.emplace_back(key);
+            }
+        });
+        return keys;
+    }
+
+    // (id, path) of the live tracks that were added from local files by sync_local_library()
+    std::vector<std::pair<size_t, std::string>> track_files() const {
+        std::vector<std::pair<size_t, std::string>> files;
+        manifest.for_each_key([&](std::string_view key, size_t label) {
+            if (TrackManifest::is_file_key(key) && !manifest.is_deleted(label)) {
+                files.emplace_back(label, std::string(key.substr(TrackManifest::file_key("").size())));
+            }
+        });
+        return files;
+    }
+
+    // Save the graph, feature vectors, normalization parameters and metadata into a single
+    // snapshot file. When source_csv_path is given the snapshot remembers its fingerprint so
+    // open_library() can tell when it has gone stale.
+    void save_snapshot(const std::string& snapshot_path, const std::string& source_csv_path = "") {
+        library_snapshot::SourceFingerprint source;
+        if (!source_csv_path.empty()) {
+            source = library_snapshot::fingerprint_file(source_csv_path, true);
+        }
+
+        library_snapshot::Writer writer(snapshot_path, static_cast<uint32_t>(dim), source, 9);
+        library_snapshot::write_hnsw_graph(writer.begin_section(library_snapshot::SECTION_GRAPH), *index);
+        binary_io::write_array(writer.begin_section(library_snapshot::SECTION_FEATURES), data_buffer.data(), data_buffer.size());
+        std::ostream& normalization = writer.begin_section(library_snapshot::SECTION_NORMALIZATION);
+        binary_io::write_pod(normalization, static_cast<uint32_t>(library_snapshot::NORMALIZE_STANDARDIZE));
+        binary_io::write_pod(normalization, static_cast<uint32_t>(space->get_metric()));
+        standardizer.write(normalization);
+        std::vector<float> weights = space->get_weights();
+        binary_io::write_array(normalization, weights.data(), weights.size());
+        metadata.write(writer.begin_section(library_snapshot::SECTION_METADATA));
+        manifest.write(writer.begin_section(library_snapshot::SECTION_MANIFEST));
+        binary_io::write_pod(writer.begin_section(library_snapshot::SECTION_BACKEND),
+                             static_cast<uint32_t>(flat_active ? IndexBackend::FLAT : IndexBackend::HNSW));
+        std::ostream& vectors = writer.begin_section(library_snapshot::SECTION_VECTORS);
+        binary_io::write_pod(vectors, static_cast<uint32_t>(space->get_format()));
+        binary_io::write_array(vectors, space->quantization_scale().data(), space->quantization_scale().size());
+        binary_io::write_array(vectors, space->quantization_offset().data(), space->quantization_offset().size());
+        binary_io::write_array(vectors, code_buffer.data(), code_buffer.size());
+        binary_io::write_pod(writer.begin_section(library_snapshot::SECTION_INGEST), static_cast<uint32_t>(deduplicate));
+        std::ostream& failed = writer.begin_section(library_snapshot::SECTION_FAILED_FILES);
+        binary_io::write_pod(failed, static_cast<uint64_t>(failed_files.size()));
+        for (const auto& file : failed_files) {
+            binary_io::write_string(failed, file.first);
+            binary_io::write_pod(failed, file.second);
+        }
+        writer.finish();
+    }
+
+    // Map a snapshot written by save_snapshot. Metadata and feature vectors are used in place
+    // from the mapping and paged in lazily; only the graph is copied into hnswlib. Returns false
+    // without touching the database if the snapshot is missing, was written by another version,
+    // for another dimension or vector format, without the fp32 vectors reranking needs, or
+    // (when source_csv_path is given) no longer matches the CSV. Throws std::runtime_error if
+    // the snapshot is damaged, also without touching the database.
+    bool load_snapshot(const std::string& snapshot_path, const std::string& source_csv_path = "") {
+        DB_STATS_PHASE(PHASE_LOAD);
+        std::error_code error;
+        if (!std::filesystem::exists(snapshot_path, error)) {
+            return false;
+        }
+
+        auto file = std::make_shared<MappedFile>(snapshot_path, false);
+        library_snapshot::Reader reader(file);
+        if (reader.get_version() != library_snapshot::VERSION || reader.get_dim() != static_cast<uint32_t>(dim)) {
+            return false;
+        }
+        // A snapshot ingested with the other de-duplication setting no longer reflects the
+        // CSV either; loaded without a source it is brought in line by a refresh
+        binary_io::Cursor ingest = reader.section(library_snapshot::SECTION_INGEST);
+        bool loaded_deduplicate = ingest.read_pod<uint32_t>() != 0;
+        if (!source_csv_path.empty() && (loaded_deduplicate != deduplicate ||
+                                         !library_snapshot::source_matches(reader.source(), source_csv_path))) {
+            return false;
+        }
+
+        // The graph was built for one metric; a database opened with another has to rebuild
+        binary_io::Cursor normalization = reader.section(library_snapshot::SECTION_NORMALIZATION);
+        if (normalization.read_pod<uint32_t>() != library_snapshot::NORMALIZE_STANDARDIZE ||
+            normalization.read_pod<uint32_t>() != static_cast<uint32_t>(space->get_metric())) {
+            return false;
+        }
+        FeatureStandardizer loaded_standardizer;
+        loaded_standardizer.read(normalization);
+        size_t weight_count = 0;
+        const float* weight_data = normalization.read_array<float>(weight_count);
+        if (loaded_standardizer.dim() != static_cast<size_t>(dim) || weight_count != static_cast<size_t>(dim)) {
+            throw std::runtime_error("Snapshot normalization doesn't match its dimension");
+        }
+        if (scaling_fixed && !(loaded_standardizer == standardizer)) {
+            return false;
+        }
+
+        MetadataStore loaded_metadata;
+        binary_io::Cursor metadata_section = reader.section(library_snapshot::SECTION_METADATA);
+        loaded_metadata.attach(metadata_section);
+
+        TrackManifest loaded_manifest;
+        binary_io::Cursor manifest_section = reader.section(library_snapshot::SECTION_MANIFEST);
+        loaded_manifest.attach(manifest_section);
+        if (loaded_manifest.size() != loaded_metadata.size()) {
+            throw std::runtime_error("Snapshot manifest doesn't match its metadata");
+        }
+
+        binary_io::Cursor vectors_section = reader.section(library_snapshot::SECTION_VECTORS);
+        if (vectors_section.read_pod<uint32_t>() != static_cast<uint32_t>(space->get_format())) {
+            return false;
+        }
+        size_t scale_count = 0;
+        size_t offset_count = 0;
+        size_t code_count = 0;
+        const float* scale = vectors_section.read_array<float>(scale_count);
+        const float* offset = vectors_section.read_array<float>(offset_count);
+        const uint8_t* codes = vectors_section.read_array<uint8_t>(code_count);
+        if (scale_count != stride || offset_count != stride ||
+            code_count != (quantized() ? loaded_metadata.size() * code_size : 0)) {
+            throw std::runtime_error("Snapshot vectors don't match its metadata");
+        }
+        if (scaling_fixed && (!std::equal(scale, scale + scale_count, space->quantization_scale().begin()) ||
+                              !std::equal(offset, offset + offset_count, space->quantization_offset().begin()))) {
+            return false;
+        }
+
+        // fp32 vectors are optional with quantized storage
+        size_t feature_count = 0;
+        binary_io::Cursor features_section = reader.section(library_snapshot::SECTION_FEATURES);
+        const float* features = features_section.read_array<float>(feature_count);
+        if (feature_count != loaded_metadata.size() * stride && (feature_count != 0 || !quantized())) {
+            throw std::runtime_error("Snapshot features don't match its metadata");
+        }
+        if (keeps_float_vectors() && feature_count != loaded_metadata.size() * stride) {
+            return false;
+        }
+
+        // Snapshots written before failures were remembered don't have the section
+        std::unordered_map<std::string, uint64_t> loaded_failed;
+        if (reader.has_section(library_snapshot::SECTION_FAILED_FILES)) {
+            binary_io::Cursor failed_section = reader.section(library_snapshot::SECTION_FAILED_FILES);
+            for (uint64_t i = failed_section.read_pod<uint64_t>(); i > 0; i--) {
+                std::string key(failed_section.read_string());
+                loaded_failed[key] = failed_section.read_pod<uint64_t>();
+            }
+        }
+
+        binary_io::Cursor backend_section = reader.section(library_snapshot::SECTION_BACKEND);
+        bool loaded_flat = backend_section.read_pod<uint32_t>() == static_cast<uint32_t>(IndexBackend::FLAT);
+
+        binary_io::Cursor graph_section = reader.section(library_snapshot::SECTION_GRAPH);
+        std::unique_ptr<hnswlib::HierarchicalNSW<float>> loaded_index(library_snapshot::read_hnsw_graph(graph_section, space));
+
+        // Flat snapshots carry an empty graph; the column layout is rebuilt from the features.
+        // The space keeps its quantization until the commit below, so INT8 codes are decoded
+        // with the snapshot's.
+        FlatIndex loaded_flat_index(stride);
+        if (loaded_flat) {
+            std::vector<float> decoded(stride);
+            loaded_flat_index.reserve(loaded_metadata.size());
+            for (size_t i = 0; i < loaded_metadata.size(); i++) {
+                const uint8_t* code = codes + i * code_size;
+                if (feature_count > 0) {
+                    loaded_flat_index.add(features + i * stride);
+                } else if (space->get_format() == VectorFormat::INT8) {
+                    for (size_t j = 0; j < stride; j++) decoded[j] = offset[j] + scale[j] * code[j];
+                    loaded_flat_index.add(decoded.data());
+                } else {
+                    space->decode(code, decoded.data());
+                    loaded_flat_index.add(decoded.data());
+                }
+                if (loaded_manifest.is_deleted(i)) loaded_flat_index.mark_deleted(i);
+            }
+        }
+
+        std::vector<float> loaded_scale(scale, scale + scale_count);
+        std::vector<float> loaded_offset(offset, offset + offset_count);
+
+        space->set_quantization(loaded_scale, loaded_offset);
+        replace_index(loaded_index.release());
+        index_loaded = true;
+        flat_active = loaded_flat;
+        flat_index = std::move(loaded_flat_index);
+        metadata = std::move(loaded_metadata);
+        manifest = std::move(loaded_manifest);
+        failed_files = std::move(loaded_failed);
+        standardizer = std::move(loaded_standardizer);
+        space->set_weights(std::vector<float>(weight_data, weight_data + weight_count));
+        if (keeps_float_vectors()) {
+            data_buffer.borrow(features, feature_count);
+        } else {
+            data_buffer.release();
+        }
+        code_buffer.borrow(codes, code_count);
+        snapshot_file = std::move(file);
+
+        // Honour the current backend setting even if the snapshot was saved with the other one
+        apply_backend(metadata.size());
+        rebuild_tags();
+        return true;
+    }
+
+    // Open a library from its snapshot. When the CSV has changed since the snapshot was
+    // written the snapshot is refreshed with just the differences; when it is missing or
+    // unreadable the library is rebuilt from the CSV. Either way a fresh snapshot is saved.
+    void open_library(const std::string& snapshot_path, const std::string& csv_file_path, size_t num_threads = 0,
+                      const BuildProgressCallback& progress = nullptr) {
+        try {
+            if (load_snapshot(snapshot_path, csv_file_path)) {
+                return;
+            }
+            if (load_snapshot(snapshot_path)) {
+                refresh_from_csv(csv_file_path);
+                save_snapshot(snapshot_path, csv_file_path);
+                return;
+            }
+        } catch (const std::exception&) {
+            // Corrupt or incompatible snapshot, or an export with different columns; fall
+            // through to a rebuild
+        }
+
+        reset();
+        load_from_csv(csv_file_path, num_threads, progress);
+        save_snapshot(snapshot_path, csv_file_path);
+    }
+
+    // Scale features with a fit over a whole catalog instead of fitting them on the first
+    // load. Libraries holding parts of one catalog, such as the shards of a ShardedLibrary,
+    // then measure distances on the same scale. A fixed scaling survives reset(), and
+    // snapshots scaled any other way are stale. Must be set while the library is empty.
+    void fix_scaling(const std::string& csv_file_path) {
+        if (metadata.size() > 0) {
+            throw std::logic_error("The scaling can only be fixed before tracks are loaded");
+        }
+        MappedFile file(csv_file_path);
+        fit_standardizer(file.view());
+        scaling_fixed = true;
+    }
+
+    // Write the fitted scaling (standardizer and quantization) for read_scaling()
+    void write_scaling(std::ostream& out) const {
+        standardizer.write(out);
+        binary_io::write_array(out, space->quantization_scale().data(), space->quantization_scale().size());
+        binary_io::write_array(out, space->quantization_offset().data(), space->quantization_offset().size());
+    }
+
+    // Fix the scaling written by write_scaling() of a library with the same dimension and format
+    void read_scaling(binary_io::Cursor& in) {
+        if (metadata.size() > 0) {
+            throw std::logic_error("The scaling can only be fixed before tracks are loaded");
+        }
+        FeatureStandardizer loaded;
+        loaded.read(in);
+        size_t scale_count = 0;
+        size_t offset_count = 0;
+        const float* scale = in.read_array<float>(scale_count);
+        const float* offset = in.read_array<float>(offset_count);
+        if (loaded.dim() != static_cast<size_t>(dim)) {
+            throw std::runtime_error("Scaling doesn't match the index dimension");
+        }
+        space->set_quantization(std::vector<float>(scale, scale + scale_count), std::vector<float>(offset, offset + offset_count));
+        standardizer = std::move(loaded);
+        scaling_fixed = true;
+    }
+
+    // Approximate heap bytes held by the library: the graph as allocated for its capacity,
+    // the vector buffers, metadata, manifest and tag indexes. Data still borrowed from a mapped
+    // snapshot isn't counted; the OS pages it in and out.
+    size_t memory_usage() const {
+        size_t graph = index->max_elements_ * (index->size_data_per_element_ + sizeof(int) + sizeof(std::mutex)) +
+                       index->label_lookup_.size() * LABEL_LOOKUP_ENTRY_BYTES;
+        for (size_t i = 0; i < index->cur_element_count; i++) {
+            graph += index->element_levels_[i] * index->size_links_per_element_;
+        }
+        return graph + flat_index.memory_usage() + data_buffer.memory_usage() + code_buffer.memory_usage() +
+               metadata.memory_usage() + manifest.memory_usage() + artist_tags.memory_usage() + genre_tags.memory_usage();
+    }
+
+    // Expected bytes per track of the search structures alone (graph links, stored vectors,
+    // bookkeeping), for planning capacity ahead of a build; metadata comes on top. Counts the
+    // graph unless the backend is forced to FLAT.
+    size_t bytes_per_track() const {
+        size_t vectors = (keeps_float_vectors() ? stride * sizeof(float) : 0) + (quantized() ? code_size : 0);
+        if (backend == IndexBackend::FLAT) {
+            return vectors + stride * sizeof(float);
+        }
+        // A node reaches upper level l with probability M^-l, so it has 1 / (M - 1) upper levels on average
+        size_t upper_links = index->size_links_per_element_ / std::max<size_t>(M - 1, 1);
+        return vectors + index->size_data_per_element_ + sizeof(int) + sizeof(std::mutex) + upper_links +
+               LABEL_LOOKUP_ENTRY_BYTES;
+    }
+
+    // Drop all tracks and start over with an empty index
+    void reset() {
+        replace_index(new hnswlib::HierarchicalNSW<float>(space, max_elements, M, ef_construction));
+        index_loaded = false;
+        flat_active = false;
+        flat_index.clear();
+        metadata.clear();
+        manifest.clear();
+        failed_files.clear();
+        artist_tags.clear();
+        genre_tags.clear();
+        if (!scaling_fixed) {
+            standardizer.clear();
+        }
+        data_buffer.release();
+        code_buffer.release();
+        snapshot_file.reset();
     }
 
     // Save the index to a file
     void save_index(const std::string& file_path) {
+        if (flat_active) {
+            throw std::logic_error("The flat backend has no graph to save; use save_snapshot");
+        }
+        if (quantized()) {
+            throw std::logic_error("Index files can't hold the quantization; use save_snapshot");
+        }
         index->saveIndex(file_path);
     }
 
-    // Get metadata for a specific item
-    std::unordered_map<std::string, std::string> get_metadata(size_t id) {
+    // Get metadata for a specific item. The returned row is a view into the store.
+    MetadataStore::Row get_metadata(size_t id) const {
         if (id >= metadata.size()) {
             throw std::out_of_range("Invalid ID");
         }
-        return metadata[id];
+        return metadata.row(id);
+    }
+
+    // Choose the search backend. AUTO picks the exact flat scan for libraries up to
+    // FLAT_BACKEND_MAX_TRACKS tracks and the HNSW graph for larger ones; HNSW and FLAT force
+    // one. A loaded library is converted right away.
+    void set_backend(IndexBackend setting) {
+        backend = setting;
+        apply_backend(metadata.size());
+    }
+
+    // Backend currently answering searches, HNSW or FLAT
+    IndexBackend get_backend() const {
+        return flat_active ? IndexBackend::FLAT : IndexBackend::HNSW;
+    }
+
+    // Drop rows that repeat an earlier track of the export: the same Spotify Track Id, ISRC,
+    // or Song + Artist after normalizing case and punctuation. Only the first occurrence gets
+    // an id. Off by default; takes effect on the next load, and a refresh or open_library()
+    // brings an existing library in line with it.
+    void set_deduplicate(bool enabled) {
+        deduplicate = enabled;
+    }
+
+    bool get_deduplicate() const {
+        return deduplicate;
+    }
+
+    // Size of the HNSW candidate list during search (at least k is always used). Higher
+    // values raise recall at the cost of latency.
+    void set_ef(size_t ef) {
+        ef_search = ef;
+        index->setEf(ef);
+    }
+
+    // Rerank the best candidates of every graph search by their fp32 distance, fetching
+    // max(k, candidates) from the graph (0 = off). Only affects FP16/INT8 storage, where it
+    // needs the fp32 vectors next to the codes: enable it before the library is loaded.
+    // Turning it off frees them.
+    void set_rerank(size_t candidates) {
+        if (candidates > 0 && quantized() && data_buffer.empty() && metadata.size() > 0) {
+            throw std::logic_error("Reranking needs the fp32 vectors; enable it before loading the library");
+        }
+        rerank_candidates = candidates;
+        if (!keeps_float_vectors()) {
+            data_buffer.release();
+        }
+    }
+
+    // Compare HNSW results with an exact scan on queries made by jittering random tracks of
+    // the library. A result counts as found when it is no farther than the true k-th
+    // neighbour, so exact duplicates in the library don't count as misses. With quantized
+    // storage the exact scan uses the fp32 vectors if kept, so the report covers both the
+    // graph and the quantization error (minus what reranking wins back).
+    RecallReport evaluate_recall(size_t queries = 200, size_t k = 10, uint64_t seed = 42) const {
+        if (flat_active) {
+            throw std::logic_error("Recall can only be measured with the HNSW backend");
+        }
+        std::vector<size_t> live;
+        for (size_t i = 0; i < metadata.size(); i++) {
+            if (!manifest.is_deleted(i)) live.push_back(i);
+        }
+        RecallReport report;
+        report.k = k;
+        if (live.empty() || queries == 0 || k == 0) {
+            return report;
+        }
+
+        std::vector<float> scratch;
+        std::vector<float> result_scratch;
+        FlatIndex exact(stride);
+        exact.reserve(metadata.size());
+        for (size_t i = 0; i < metadata.size(); i++) {
+            exact.add(float_vector(i, scratch));
+            if (manifest.is_deleted(i)) exact.mark_deleted(i);
+        }
+
+        std::mt19937_64 rng(seed);
+        std::uniform_int_distribution<size_t> pick(0, live.size() - 1);
+        std::normal_distribution<float> jitter(0.0f, 0.25f);
+        std::vector<float> query(stride, 0.0f);
+        size_t found = 0;
+        size_t expected = 0;
+        std::chrono::duration<double> hnsw_time{0};
+        std::chrono::duration<double> exact_time{0};
+
+        for (size_t q = 0; q < queries; q++) {
+            const float* track = float_vector(live[pick(rng)], scratch);
+            for (int i = 0; i < dim; i++) {
+                query[i] = track[i] + jitter(rng);
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            auto approximate = knn(query.data(), k);
+            auto middle = std::chrono::steady_clock::now();
+            auto truth = exact.search(query.data(), k, *space);
+            exact_time += std::chrono::steady_clock::now() - middle;
+            hnsw_time += middle - start;
+
+            float limit = truth.top().first;
+            limit += std::max(1e-6f, std::abs(limit) * 1e-5f);
+            expected += truth.size();
+            // Quantized distances are approximate, so judge every result by its fp32 distance
+            for (; !approximate.empty(); approximate.pop()) {
+                const float* result = float_vector(approximate.top().second, result_scratch);
+                if (space->float_distance(query.data(), result) <= limit) found++;
+            }
+        }
+
+        report.queries = queries;
+        report.recall = expected > 0 ? static_cast<double>(std::min(found, expected)) / expected : 1.0;
+        report.hnsw_query_us = hnsw_time.count() * 1e6 / queries;
+        report.exact_query_us = exact_time.count() * 1e6 / queries;
+        return report;
+    }
+
+    // Per-feature weights of the distance, in feature column order (1 for every feature by
+    // default). Raising a weight makes that feature matter more when comparing tracks. The
+    // graph keeps the neighbourhoods it was built with, so large changes trade some recall
+    // until the next rebuild. Must not be called while searches are running.
+    void set_feature_weights(const std::vector<float>& weights) {
+        space->set_weights(weights);
+    }
+
+    std::vector<float> get_feature_weights() const {
+        return space->get_weights();
+    }
+
+    // Counters, phase timings and query histograms since the last reset_stats(). Everything
+    // but graph_hops is process-wide; graph_hops counts this database's upper-layer hops. All
+    // zero when built with BETTER_SHUFFLE_STATS=0. stats().to_json() gives a JSON dump.
+    db_stats::Stats stats() const {
+        db_stats::Stats result = db_stats::collect();
+        if (result.enabled) {
+            result.graph_hops = retired_hops + static_cast<uint64_t>(index->metric_hops);
+        }
+        return result;
+    }
+
+    void reset_stats() {
+        db_stats::reset();
+        retired_hops = 0;
+        index->metric_hops = 0;
+        index->metric_distance_computations = 0;
+    }
+
+    // Evaluate a filter against the current library. The selection stays valid until the
+    // library is reloaded or refreshed; tracks removed by a refresh are never selected.
+    TrackSelection compile_filter(const TrackFilter& filter) const {
+        DynamicBitset bits = filter.compile(metadata, artist_tags, genre_tags);
+        if (manifest.removed() > 0) {
+            for (size_t label = 0; label < metadata.size(); label++) {
+                if (manifest.is_deleted(label)) bits.reset(label);
+            }
+        }
+        return TrackSelection(std::move(bits));
+    }
+
+    // Artists and genres of the library as interned tags with posting lists, e.g. for
+    // genre_index().intersect({indie, shoegaze}) or tag ids as sparse features. Valid until
+    // the library is reloaded or refreshed.
+    const TagIndex& artist_index() const {
+        return artist_tags;
+    }
+
+    const TagIndex& genre_index() const {
+        return genre_tags;
+    }
+
+    // Content hash of a track's CSV row; changes whenever the track is edited
+    uint64_t track_hash(size_t id) const {
+        return manifest.hash(id);
+    }
+
+    // Hash of everything that places tracks in the vector space: metric, storage format,
+    // feature weights, standardization and quantization. Equal hashes mean distances between
+    // unchanged tracks are still the same.
+    uint64_t space_hash() const {
+        std::ostringstream out;
+        binary_io::write_pod(out, static_cast<uint32_t>(space->get_metric()));
+        binary_io::write_pod(out, static_cast<uint32_t>(space->get_format()));
+        std::vector<float> weights = space->get_weights();
+        binary_io::write_array(out, weights.data(), weights.size());
+        standardizer.write(out);
+        binary_io::write_array(out, space->quantization_scale().data(), space->quantization_scale().size());
+        binary_io::write_array(out, space->quantization_offset().data(), space->quantization_offset().size());
+        return hash_string(out.str());
+    }
+
+    // Whether a track was removed from the library by a refresh. Its id stays reserved and
+    // its metadata readable, but searches no longer return it.
+    bool is_deleted(size_t id) const {
+        return manifest.is_deleted(id);
+    }
+
+    // Resolve a metadata column once so per-result lookups skip the header search
+    size_t metadata_column(std::string_view name) const {
+        return metadata.column_index(name);
+    }
+
+    // Metadata columns in the order get_metadata() rows hold them
+    const std::vector<std::string>& metadata_headers() const {
+        return metadata.get_headers();
+    }
+
+    // Number of track ids, including tracks removed by a refresh
+    size_t size() const {
+        return metadata.size();
+    }
+
+    // Features per track, the length of a query
+    size_t dimension() const {
+        return static_cast<size_t>(dim);
+    }
+
+    // Floats per stored vector, the feature dimension padded for the distance kernels
+    size_t vector_size() const {
+        return stride;
+    }
+
+    // Stored (standardized, padded) vector of a track, decoded from the index's format when
+    // the fp32 vectors aren't kept; vector must hold vector_size() floats
+    void get_vector(size_t id, float* vector) const {
+        if (id >= metadata.size()) {
+            throw std::out_of_range("Invalid ID");
+        }
+        if (!data_buffer.empty()) {
+            std::copy(data_buffer.data() + id * stride, data_buffer.data() + (id + 1) * stride, vector);
+        } else {
+            space->decode(stored_code(id), vector);
+        }
+    }
+
+    // Scale a raw query into the space of the stored vectors; vector must hold vector_size() floats
+    void prepare_query(const std::vector<float>& query, float* vector) const {
+        if (query.size() != static_cast<size_t>(dim)) {
+            throw std::invalid_argument("Query dimension doesn't match index dimension");
+        }
+        prepare_vector(query.data(), vector);
+    }
+
+    // Search with a vector that is already in the stored space (see prepare_query and
+    // get_vector). Results are written closest first into results, which is reused across
+    // calls. The filter is consulted inside the graph walk, so excluded tracks cost no
+    // extra over-fetching.
+    void search_vector(const float* vector, size_t k, std::vector<std::pair<size_t, float>>& results,
+                       hnswlib::BaseFilterFunctor* filter = nullptr) const {
+        auto pq = knn(vector, k, filter);
+        results.resize(pq.size());
+        for (size_t slot = pq.size(); slot-- > 0; pq.pop()) {
+            results[slot] = std::make_pair(static_cast<size_t>(pq.top().second), pq.top().first);
+        }
+    }
+
+    // Label written by search_batch for result slots beyond the matches found
+    static constexpr size_t NO_RESULT = static_cast<size_t>(-1);
+
+    // Same as above, restricted to the tracks of a selection from compile_filter()
+    void search_vector(const float* vector, size_t k, std::vector<std::pair<size_t, float>>& results,
+                       const TrackSelection& selection) const {
+        auto pq = knn(vector, k, selection);
+        results.resize(pq.size());
+        for (size_t slot = pq.size(); slot-- > 0; pq.pop()) {
+            results[slot] = std::make_pair(static_cast<size_t>(pq.top().second), pq.top().first);
+        }
+    }
+
+    // Search many queries at once. queries holds count rows of dim raw feature values. The k
+    // nearest tracks of query i are written closest first to labels[i * k ...] and
+    // distances[i * k ...]; slots without a match get NO_RESULT and infinity. Queries are
+    // spread over a pool of num_threads workers (0 = one per core) that is kept for later
+    // batches; hnswlib hands every concurrent search its own visited list.
+    void search_batch(const float* queries, size_t count, size_t k, size_t* labels, float* distances, size_t num_threads = 0) {
+        if (count == 0 || k == 0) {
+            return;
+        }
+
+        ThreadPool& pool = worker_pool(num_threads);
+        std::vector<std::vector<float>> scratch(pool.size(), std::vector<float>(stride));
+        pool.parallel_for(count, SEARCH_BATCH_GRAIN, [&](size_t begin, size_t end, size_t worker) {
+            float* vector = scratch[worker].data();
+            for (size_t q = begin; q < end; q++) {
+                prepare_vector(queries + q * dim, vector);
+                auto pq = knn(vector, k);
+
+                // The queue pops farthest first, so fill the row from the back
+                size_t* row_labels = labels + q * k;
+                float* row_distances = distances + q * k;
+                for (size_t slot = pq.size(); slot < k; slot++) {
+                    row_labels[slot] = NO_RESULT;
+                    row_distances[slot] = std::numeric_limits<float>::infinity();
+                }
+                for (size_t slot = pq.size(); slot-- > 0; pq.pop()) {
+                    row_labels[slot] = pq.top().second;
+                    row_distances[slot] = pq.top().first;
+                }
+            }
+        });
+    }
+
+    // Find versions of the same song that exact de-duplication keeps apart: each live track is
+    // searched for its k nearest neighbours, and a neighbour with a lower id that lies within
+    // epsilon (in the index's metric) and has the same artist and base title, ignoring
+    // suffixes like " - Remastered" or "(Radio Edit)", makes it a near-duplicate. Only the
+    // nearest match is reported per track, in id order. Nothing is removed.
+    std::vector<NearDuplicate> find_near_duplicates(float epsilon, size_t k = 8, size_t num_threads = 0) {
+        size_t song_column = metadata.column_index("Song");
+        size_t artist_column = metadata.column_index("Artist");
+        std::vector<NearDuplicate> found;
+        if (song_column == std::string::npos || artist_column == std::string::npos || metadata.size() == 0) {
+            return found;
+        }
+
+        ThreadPool& pool = worker_pool(num_threads);
+        std::vector<std::vector<NearDuplicate>> worker_found(pool.size());
+        std::vector<std::vector<float>> scratch(pool.size(), std::vector<float>(stride));
+        pool.parallel_for(metadata.size(), SEARCH_BATCH_GRAIN, [&](size_t begin, size_t end, size_t worker) {
+            std::string title, artist, other_title, other_artist;
+            float* vector = scratch[worker].data();
+            for (size_t id = begin; id < end; id++) {
+                if (manifest.is_deleted(id)) continue;
+                get_vector(id, vector);
+                auto pq = knn(vector, k + 1);
+
+                // The queue pops farthest first, so later matches are closer
+                bool described = false;
+                bool matched = false;
+                NearDuplicate best;
+                for (; !pq.empty(); pq.pop()) {
+                    size_t other = pq.top().second;
+                    float distance = pq.top().first;
+                    if (other >= id || distance > epsilon) continue;
+                    if (!described) {
+                        track_text::base_title(metadata.value(id, song_column), title);
+                        track_text::normalize(metadata.value(id, artist_column), artist);
+                        described = true;
+                    }
+                    track_text::base_title(metadata.value(other, song_column), other_title);
+                    track_text::normalize(metadata.value(other, artist_column), other_artist);
+                    if (!title.empty() && other_title == title && other_artist == artist) {
+                        best = NearDuplicate{id, other, distance};
+                        matched = true;
+                    }
+                }
+                if (matched) {
+                    worker_found[worker].push_back(best);
+                }
+            }
+        });
+
+        for (const auto& part : worker_found) {
+            found.insert(found.end(), part.begin(), part.end());
+        }
+        std::sort(found.begin(), found.end(), [](const NearDuplicate& a, const NearDuplicate& b) {
+            return a.id < b.id;
+        });
+        return found;
     }
 
     // Search for similar items
-    std::vector<std::pair<size_t, float>> search(const std::vector<float>& query, size_t k = 5) {
+    std::vector<std::pair<size_t, float>> search(const std::vector<float>& query, size_t k = 5) const {
         if (query.size() != static_cast<size_t>(dim)) {
             throw std::invalid_argument("Query dimension doesn't match index dimension");
         }
 
+        // The query is given in raw feature units and scaled like the library
+        std::vector<float> vector(stride);
+        prepare_vector(query.data(), vector.data());
+
         std::vector<std::pair<size_t, float>> results;
-        auto pq = index->searchKnn(query.data(), k);
+        auto pq = knn(vector.data(), k);
         
         while (!pq.empty()) {
             results.emplace_back(pq.top().second, pq.top().first);
@@ -187,4 +1728,22 @@ public:
         
         return results;
     }
-};
\ No newline at end of file
+
+    // Search among the tracks of a selection from compile_filter(). Unlike over-fetching and
+    // filtering the results afterwards, a selective filter still yields k results as long as
+    // k tracks pass it.
+    std::vector<std::pair<size_t, float>> search(const std::vector<float>& query, size_t k, const TrackSelection& selection) const {
+        if (query.size() != static_cast<size_t>(dim)) {
+            throw std::invalid_argument("Query dimension doesn't match index dimension");
+        }
+
+        std::vector<float> vector(stride);
+        prepare_vector(query.data(), vector.data());
+
+        std::vector<std::pair<size_t, float>> results;
+        for (auto pq = knn(vector.data(), k, selection); !pq.empty(); pq.pop()) {
+            results.emplace_back(pq.top().second, pq.top().first);
+        }
+        return results;
+    }
+};
@@ -0,0 +1,139 @@
+#include "library_scanner.h"
+#include "bounded_queue.h"
+#include <filesystem>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cctype>
+#include <exception>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+static string lowercaseExtension(const fs::path& path) {
+    string ext = path.extension().string();
+    transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+    return ext;
+}
+
+static bool readTrack(const fs::path& path, const string& ext, ScannedTrack& track) {
+    error_code error;
+    track.path = path.string();
+    track.fileSize = fs::file_size(path, error);
+    if (error) return false;
+    track.modifiedTime = static_cast<int64_t>(fs::last_write_time(path, error).time_since_epoch().count());
+    if (error) return false;
+
+    if (ext == ".mp3") {
+        track.metadata = readMP3Metadata(track.path);
+    } else if (ext == ".flac") {
+        track.metadata = readFLACMetadata(track.path);
+    } else {
+        track.metadata = readAudioMetadata(track.path);
+    }
+    return true;
+}
+
+ScanStats scanLibrary(const string& root, const ScanOptions& options, const ScanBatchCallback& onBatch) {
+    auto start = chrono::steady_clock::now();
+    size_t ioDepth = max<size_t>(1, options.ioDepth);
+    size_t batchSize = max<size_t>(1, options.batchSize);
+
+    // The walker only needs to stay a little ahead of the readers; a deep queue would just
+    // hold paths in memory while the disk is the bottleneck
+    BoundedQueue<pair<fs::path, string>> paths(ioDepth * 4);
+    BoundedQueue<vector<ScannedTrack>> batches(ioDepth * 2);
+    atomic<bool> cancelled{false};
+    atomic<size_t> filesFound{0};
+    atomic<size_t> filesRead{0};
+    atomic<size_t> errors{0};
+
+    thread walker([&] {
+        auto dirOptions = fs::directory_options::skip_permission_denied;
+        if (options.followSymlinks) {
+            dirOptions |= fs::directory_options::follow_directory_symlink;
+        }
+
+        error_code error;
+        fs::recursive_directory_iterator it(root, dirOptions, error), end;
+        if (error) errors++;
+        while (!error && it != end && !cancelled) {
+            error_code entryError;
+            if (it->is_regular_file(entryError)) {
+                string ext = lowercaseExtension(it->path());
+                if (find(options.extensions.begin(), options.extensions.end(), ext) != options.extensions.end()) {
+                    filesFound++;
+                    if (!paths.push(make_pair(it->path(), ext))) break;
+                }
+            }
+            it.increment(error);
+            if (error) {
+                // Unreadable directory entry; skip it and keep walking
+                errors++;
+                error.clear();
+            }
+        }
+        paths.close();
+    });
+
+    vector<thread> workers;
+    atomic<size_t> activeWorkers{ioDepth};
+    for (size_t i = 0; i < ioDepth; i++) {
+        workers.emplace_back([&] {
+            vector<ScannedTrack> batch;
+            batch.reserve(batchSize);
+            pair<fs::path, string> item;
+            while (paths.pop(item)) {
+                ScannedTrack track;
+                if (readTrack(item.first, item.second, track)) {
+                    batch.push_back(move(track));
+                    filesRead++;
+                } else {
+                    errors++;
+                }
+                if (batch.size() >= batchSize) {
+                    if (!batches.push(move(batch))) break;
+                    batch = vector<ScannedTrack>();
+                    batch.reserve(batchSize);
+                }
+            }
+            if (!batch.empty()) {
+                batches.push(move(batch));
+            }
+            if (--activeWorkers == 0) {
+                batches.close();
+            }
+        });
+    }
+
+    exception_ptr callbackError;
+    vector<ScannedTrack> batch;
+    while (batches.pop(batch)) {
+        try {
+            onBatch(batch);
+        } catch (...) {
+            callbackError = current_exception();
+            cancelled = true;
+            paths.close();
+            paths.clear();
+            batches.close();
+            break;
+        }
+    }
+
+    walker.join();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    if (callbackError) {
+        rethrow_exception(callbackError);
+    }
+
+    ScanStats stats;
+    stats.filesFound = filesFound;
+    stats.filesRead = filesRead;
+    stats.errors = errors;
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return stats;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "metadata.h"
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+struct ScannedTrack {
+    std::string path;
+    uint64_t fileSize = 0;
+    int64_t modifiedTime = 0; // filesystem clock ticks, only meaningful for comparisons
+    AudioMetadata metadata;
+};
+
+struct ScanOptions {
+    // Number of files read concurrently. Keep this low (1-2) for spinning disks, where
+    // parallel reads only add seeks; SSDs and network shares benefit from 8-16.
+    size_t ioDepth = 4;
+    // Tracks delivered per callback
+    size_t batchSize = 256;
+    bool followSymlinks = false;
+    // Lowercase extensions to read; anything else is skipped without being opened
+    std::vector<std::string> extensions = {".mp3", ".flac"};
+};
+
+struct ScanStats {
+    size_t filesFound = 0;
+    size_t filesRead = 0;
+    size_t errors = 0;
+    double seconds = 0;
+};
+
+using ScanBatchCallback = std::function<void(std::vector<ScannedTrack>& batch)>;
+
+// Walk root recursively and read the tags of every audio file on a bounded pool of ioDepth
+// workers. Batches are handed to onBatch on the calling thread as they complete, in no
+// particular order. An exception thrown by onBatch stops the scan and is rethrown.
+ScanStats scanLibrary(const std::string& root, const ScanOptions& options, const ScanBatchCallback& onBatch);
@@ -0,0 +1,337 @@
+#pragma once
+
+#include "../vendor/hnswlib/hnswlib/hnswlib.h"
+#include "binary_io.h"
+#include "csv_reader.h"
+#include "hash.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <filesystem>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <algorithm>
+#include <stdexcept>
+
+// Single-file library snapshot: the HNSW graph, the feature vectors (fp32 and/or quantized),
+// the normalization parameters, the metadata columns and the track manifest, fingerprinted
+// against the CSV they were built from.
+//
+// Layout (native endian):
+//   header   magic "BSHFSNAP", version, dim, source fingerprint, section count
+//   table    section_count x { type, offset, size }
+//   sections each starting on a 64-byte boundary so that arrays can be used in place
+//            once the file is memory-mapped
+namespace library_snapshot {
+
+constexpr char MAGIC[8] = {'B', 'S', 'H', 'F', 'S', 'N', 'A', 'P'};
+constexpr uint32_t VERSION = 6;
+constexpr size_t SECTION_ALIGNMENT = 64;
+
+enum SectionType : uint32_t {
+    SECTION_GRAPH = 1,
+    SECTION_FEATURES = 2,
+    SECTION_NORMALIZATION = 3,
+    SECTION_METADATA = 4,
+    SECTION_MANIFEST = 5,
+    SECTION_BACKEND = 6,
+    SECTION_VECTORS = 7,  // vector format, quantization scale and offset, quantized codes
+    SECTION_INGEST = 8,   // ingest options the library was built with
+    SECTION_FAILED_FILES = 9, // local files that couldn't be analysed; optional
+};
+
+// Normalization methods stored in SECTION_NORMALIZATION
+enum NormalizationMethod : uint32_t {
+    NORMALIZE_ROW_L2 = 1,       // per-row unit length, written by version 1 and 2 snapshots
+    NORMALIZE_STANDARDIZE = 2,  // per-column z-scores, followed by the metric, the standardizer and the weights
+};
+
+struct Section {
+    uint32_t type = 0;
+    uint32_t reserved = 0;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+};
+
+// Identity of the CSV a snapshot was built from
+struct SourceFingerprint {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    uint64_t hash = 0;
+};
+
+// Size and modification time of a file, plus its content hash when with_hash is set
+inline SourceFingerprint fingerprint_file(const std::string& path, bool with_hash) {
+    SourceFingerprint fingerprint;
+    fingerprint.size = static_cast<uint64_t>(std::filesystem::file_size(path));
+    fingerprint.mtime = static_cast<int64_t>(std::filesystem::last_write_time(path).time_since_epoch().count());
+    if (with_hash) {
+        MappedFile file(path);
+        fingerprint.hash = hash_bytes(file.data(), file.size());
+    }
+    return fingerprint;
+}
+
+// Whether a CSV still matches the fingerprint stored in a snapshot. The content hash is
+// only computed when the modification time differs, so an untouched file costs two stats.
+inline bool source_matches(const SourceFingerprint& stored, const std::string& path) {
+    std::error_code error;
+    if (!std::filesystem::exists(path, error)) return false;
+    SourceFingerprint current = fingerprint_file(path, false);
+    if (current.size != stored.size) return false;
+    if (current.mtime == stored.mtime) return true;
+    return fingerprint_file(path, true).hash == stored.hash;
+}
+
+// Serialize an HNSW graph. This mirrors HierarchicalNSW::saveIndex but writes into an
+// open stream so the graph can live inside the snapshot.
+inline void write_hnsw_graph(std::ostream& out, const hnswlib::HierarchicalNSW<float>& index) {
+    size_t count = index.cur_element_count;
+    binary_io::write_pod(out, static_cast<uint64_t>(index.max_elements_));
+    binary_io::write_pod(out, static_cast<uint64_t>(count));
+    binary_io::write_pod(out, static_cast<uint64_t>(index.M_));
+    binary_io::write_pod(out, static_cast<uint64_t>(index.ef_construction_));
+    binary_io::write_pod(out, static_cast<uint64_t>(index.size_data_per_element_));
+    binary_io::write_pod(out, static_cast<uint64_t>(index.size_links_per_element_));
+    binary_io::write_pod(out, static_cast<uint64_t>(index.label_offset_));
+    binary_io::write_pod(out, static_cast<uint64_t>(index.offsetData_));
+    binary_io::write_pod(out, static_cast<int32_t>(index.maxlevel_));
+    binary_io::write_pod(out, static_cast<uint32_t>(index.enterpoint_node_));
+
+    binary_io::write_array(out, index.data_level0_memory_, count * index.size_data_per_element_);
+    binary_io::write_array(out, index.element_levels_.data(), count);
+
+    // Upper layer link lists, concatenated in element order
+    uint64_t upper_bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (index.element_levels_[i] > 0) {
+            upper_bytes += index.size_links_per_element_ * index.element_levels_[i];
+        }
+    }
+    binary_io::write_pod(out, upper_bytes);
+    binary_io::pad_to(out, binary_io::ARRAY_ALIGNMENT);
+    for (size_t i = 0; i < count; i++) {
+        if (index.element_levels_[i] > 0) {
+            out.write(index.linkLists_[i], index.size_links_per_element_ * index.element_levels_[i]);
+        }
+    }
+    binary_io::pad_to(out, binary_io::ARRAY_ALIGNMENT);
+}
+
+// Rebuild an HNSW graph written by write_hnsw_graph. The index is constructed normally, so
+// every allocation and lock table matches this build of hnswlib, and then the stored graph
+// is copied in. Throws if the stored layout doesn't match what this build would produce.
+inline hnswlib::HierarchicalNSW<float>* read_hnsw_graph(binary_io::Cursor& in, hnswlib::SpaceInterface<float>* space) {
+    size_t max_elements = static_cast<size_t>(in.read_pod<uint64_t>());
+    size_t count = static_cast<size_t>(in.read_pod<uint64_t>());
+    size_t M = static_cast<size_t>(in.read_pod<uint64_t>());
+    size_t ef_construction = static_cast<size_t>(in.read_pod<uint64_t>());
+    size_t size_data_per_element = static_cast<size_t>(in.read_pod<uint64_t>());
+    size_t size_links_per_element = static_cast<size_t>(in.read_pod<uint64_t>());
+    size_t label_offset = static_cast<size_t>(in.read_pod<uint64_t>());
+    size_t offset_data = static_cast<size_t>(in.read_pod<uint64_t>());
+    int32_t max_level = in.read_pod<int32_t>();
+    uint32_t enterpoint = in.read_pod<uint32_t>();
+
+    size_t level0_bytes = 0;
+    size_t level_count = 0;
+    size_t upper_bytes = 0;
+    const char* level0 = in.read_array<char>(level0_bytes);
+    const int* levels = in.read_array<int>(level_count);
+    const char* upper_links = in.read_array<char>(upper_bytes);
+
+    if (count > max_elements || level_count != count || level0_bytes != count * size_data_per_element ||
+        (count > 0 && (enterpoint >= count || max_level != levels[enterpoint]))) {
+        throw std::runtime_error("Corrupt snapshot graph");
+    }
+    size_t expected_upper = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (levels[i] < 0 || levels[i] > max_level) {
+            throw std::runtime_error("Corrupt snapshot graph");
+        }
+        expected_upper += size_links_per_element * levels[i];
+    }
+    if (expected_upper != upper_bytes) {
+        throw std::runtime_error("Corrupt snapshot graph");
+    }
+
+    std::unique_ptr<hnswlib::HierarchicalNSW<float>> index(
+        new hnswlib::HierarchicalNSW<float>(space, std::max<size_t>(max_elements, 1), M, ef_construction));
+    if (index->size_data_per_element_ != size_data_per_element ||
+        index->size_links_per_element_ != size_links_per_element ||
+        index->label_offset_ != label_offset || index->offsetData_ != offset_data) {
+        throw std::runtime_error("Snapshot graph layout doesn't match this build of hnswlib");
+    }
+
+    if (level0_bytes > 0) {
+        std::memcpy(index->data_level0_memory_, level0, level0_bytes);
+    }
+    size_t upper_offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        index->element_levels_[i] = levels[i];
+        index->linkLists_[i] = nullptr;
+        if (levels[i] > 0) {
+            size_t bytes = size_links_per_element * levels[i];
+            char* links = static_cast<char*>(std::malloc(bytes + 1));
+            if (!links) throw std::bad_alloc();
+            std::memcpy(links, upper_links + upper_offset, bytes);
+            index->linkLists_[i] = links;
+            upper_offset += bytes;
+        }
+        // Grow the count as we go so the destructor frees exactly what was allocated
+        index->cur_element_count = i + 1;
+    }
+
+    // Searches follow the links without bounds checks, so a damaged list must not get through
+    for (size_t i = 0; i < count; i++) {
+        hnswlib::tableint element = static_cast<hnswlib::tableint>(i);
+        for (int level = 0; level <= levels[i]; level++) {
+            hnswlib::linklistsizeint* list = level == 0 ? index->get_linklist0(element) : index->get_linklist(element, level);
+            size_t links = index->getListCount(list);
+            const hnswlib::tableint* ids = reinterpret_cast<const hnswlib::tableint*>(list + 1);
+            if (links > (level == 0 ? index->maxM0_ : index->maxM_)) {
+                throw std::runtime_error("Corrupt snapshot graph");
+            }
+            for (size_t j = 0; j < links; j++) {
+                if (ids[j] >= count) throw std::runtime_error("Corrupt snapshot graph");
+            }
+        }
+    }
+
+    if (count > 0) {
+        index->maxlevel_ = max_level;
+        index->enterpoint_node_ = enterpoint;
+    }
+    for (size_t i = 0; i < count; i++) {
+        index->label_lookup_[index->getExternalLabel(static_cast<hnswlib::tableint>(i))] = static_cast<hnswlib::tableint>(i);
+        if (index->isMarkedDeleted(static_cast<hnswlib::tableint>(i))) {
+            index->num_deleted_ += 1;
+        }
+    }
+    return index.release();
+}
+
+// Writes sections into a snapshot file. The file is written next to the destination and
+// renamed into place on finish(), so readers never see a partial snapshot.
+class Writer {
+private:
+    std::string path;
+    std::string temp_path;
+    std::ofstream out;
+    std::vector<Section> sections;
+    std::streampos table_position;
+    size_t next_section = 0;
+
+public:
+    Writer(const std::string& snapshot_path, uint32_t dim, const SourceFingerprint& source, size_t section_count)
+        : path(snapshot_path), temp_path(snapshot_path + ".tmp"), sections(section_count) {
+        out.open(temp_path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            throw std::runtime_error("Could not write snapshot: " + temp_path);
+        }
+        out.write(MAGIC, sizeof(MAGIC));
+        binary_io::write_pod(out, VERSION);
+        binary_io::write_pod(out, dim);
+        binary_io::write_pod(out, source.size);
+        binary_io::write_pod(out, source.mtime);
+        binary_io::write_pod(out, source.hash);
+        binary_io::write_pod(out, static_cast<uint32_t>(section_count));
+        binary_io::write_pod(out, static_cast<uint32_t>(0));
+        table_position = out.tellp();
+        for (const Section& section : sections) {
+            binary_io::write_pod(out, section);
+        }
+    }
+
+    // Start a new section; its contents are whatever is written to stream() until the next call
+    std::ostream& begin_section(SectionType type) {
+        end_section();
+        if (next_section >= sections.size()) {
+            throw std::logic_error("Too many snapshot sections");
+        }
+        binary_io::pad_to(out, SECTION_ALIGNMENT);
+        sections[next_section].type = type;
+        sections[next_section].offset = static_cast<uint64_t>(out.tellp());
+        next_section++;
+        return out;
+    }
+
+    void finish() {
+        end_section();
+        out.seekp(table_position);
+        for (const Section& section : sections) {
+            binary_io::write_pod(out, section);
+        }
+        out.close();
+        if (!out) {
+            throw std::runtime_error("Could not write snapshot: " + temp_path);
+        }
+        std::filesystem::rename(temp_path, path);
+    }
+
+private:
+    void end_section() {
+        if (next_section > 0 && sections[next_section - 1].size == 0) {
+            sections[next_section - 1].size = static_cast<uint64_t>(out.tellp()) - sections[next_section - 1].offset;
+        }
+    }
+};
+
+// Read-only view of a mapped snapshot. Sections are handed out as cursors over the mapping.
+class Reader {
+private:
+    std::shared_ptr<MappedFile> file;
+    uint32_t version = 0;
+    uint32_t dimension = 0;
+    SourceFingerprint fingerprint;
+    std::vector<Section> sections;
+
+public:
+    explicit Reader(std::shared_ptr<MappedFile> mapped) : file(std::move(mapped)) {
+        binary_io::Cursor in(file->data(), file->size());
+        char magic[sizeof(MAGIC)];
+        for (char& c : magic) c = in.read_pod<char>();
+        if (std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+            throw std::runtime_error("Not a library snapshot");
+        }
+        version = in.read_pod<uint32_t>();
+        dimension = in.read_pod<uint32_t>();
+        fingerprint.size = in.read_pod<uint64_t>();
+        fingerprint.mtime = in.read_pod<int64_t>();
+        fingerprint.hash = in.read_pod<uint64_t>();
+        uint32_t section_count = in.read_pod<uint32_t>();
+        in.read_pod<uint32_t>();
+        for (uint32_t i = 0; i < section_count; i++) {
+            Section section = in.read_pod<Section>();
+            if (section.offset > file->size() || section.size > file->size() - section.offset) {
+                throw std::runtime_error("Corrupt snapshot section table");
+            }
+            sections.push_back(section);
+        }
+    }
+
+    uint32_t get_version() const { return version; }
+    uint32_t get_dim() const { return dimension; }
+    const SourceFingerprint& source() const { return fingerprint; }
+
+    bool has_section(SectionType type) const {
+        for (const Section& section : sections) {
+            if (section.type == type) return true;
+        }
+        return false;
+    }
+
+    binary_io::Cursor section(SectionType type) const {
+        for (const Section& section : sections) {
+            if (section.type == type) {
+                return binary_io::Cursor(file->data() + section.offset, static_cast<size_t>(section.size));
+            }
+        }
+        throw std::runtime_error("Snapshot is missing a section");
+    }
+};
+
+}  // namespace library_snapshot
@@ -0,0 +1,185 @@
+#pragma once
+
+#include "hnswlib_csv_to_db.h"
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <functional>
+#include <type_traits>
+#include <stdexcept>
+
+// A library that keeps answering searches while it is refreshed, grown or reloaded.
+//
+// Published versions are immutable: readers only ever call const methods on them, which are
+// safe to run concurrently (see HNSWVectorDB). A writer never touches a published version.
+// update() opens a private copy from the library snapshot, applies the change to it, saves
+// the snapshot and then publishes the copy with an atomic pointer swap, so a reader sees
+// either the old library or the new one, never one half built. Searches running on the old
+// version finish on it undisturbed; the writer frees it once no reader holds it any more.
+//
+// Readers don't share a lock with the writer. acquire() is one atomic load of the current
+// version; a Reader goes further and only checks a generation counter per call, picking up
+// a new version the first time it sees the counter move (its quiescent point, in RCU terms).
+// Old versions are destroyed on the writer's thread in reclaim(), so a reader letting go of
+// a version never pays for tearing down its graph.
+//
+// While an update runs the old and new versions coexist. The copy maps the snapshot like
+// load_snapshot() does, so metadata and vectors are shared through the page cache until the
+// change touches them; the graph is copied.
+class LiveLibrary {
+public:
+    using Version = std::shared_ptr<const HNSWVectorDB>;
+    // Creates an empty database with the settings every version should have
+    using Factory = std::function<std::unique_ptr<HNSWVectorDB>()>;
+
+    // Per-thread handle on the current version. Not itself thread-safe: give every reader
+    // thread its own.
+    class Reader {
+    private:
+        const LiveLibrary* library;
+        Version version;
+        uint64_t seen = 0;
+
+    public:
+        explicit Reader(const LiveLibrary& live) : library(&live) {}
+
+        // The current version, or nullptr before anything was published. The reference stays
+        // valid, and the library unchanged, until the next call to get() or release().
+        const HNSWVectorDB* get() {
+            uint64_t generation = library->generation();
+            if (generation != seen || !version) {
+                version = library->acquire();
+                seen = generation;
+            }
+            return version.get();
+        }
+
+        // Let go of the held version, e.g. before the thread goes idle for a while
+        void release() {
+            version.reset();
+        }
+    };
+
+private:
+    std::string snapshot_path;
+    std::string source_csv_path;
+    Factory factory;
+
+    // Read with std::atomic_load and replaced with std::atomic_store
+    Version current;
+    // Bumped after every publication, so readers can tell without touching current
+    std::atomic<uint64_t> published{0};
+
+    // Serializes writers; readers never take it
+    std::mutex writer;
+    // Replaced versions that readers may still hold
+    std::vector<Version> retired;
+
+    void publish(std::unique_ptr<HNSWVectorDB> next) {
+        Version version(std::move(next));
+        Version previous = std::atomic_load(&current);
+        std::atomic_store(&current, version);
+        published.fetch_add(1, std::memory_order_release);
+        if (previous) {
+            retired.push_back(std::move(previous));
+        }
+        sweep();
+    }
+
+    // Destroy retired versions that only this list still refers to. A version that is no
+    // longer current can't be acquired again, so a count of one can't go back up.
+    size_t sweep() {
+        size_t kept = 0;
+        for (Version& version : retired) {
+            if (version.use_count() > 1) {
+                retired[kept++] = std::move(version);
+            }
+        }
+        retired.resize(kept);
+        return kept;
+    }
+
+    // A private copy of the current version to change, read back from its snapshot
+    std::unique_ptr<HNSWVectorDB> copy_current() {
+        std::unique_ptr<HNSWVectorDB> next = factory();
+        if (std::atomic_load(&current) && !next->load_snapshot(snapshot_path)) {
+            throw std::runtime_error("Could not reopen the library snapshot: " + snapshot_path);
+        }
+        return next;
+    }
+
+public:
+    explicit LiveLibrary(std::string snapshot, Factory make_database = nullptr)
+        : snapshot_path(std::move(snapshot)), factory(std::move(make_database)) {
+        if (!factory) {
+            factory = [] { return std::unique_ptr<HNSWVectorDB>(new HNSWVectorDB(10)); };
+        }
+    }
+
+    LiveLibrary(const LiveLibrary&) = delete;
+    LiveLibrary& operator=(const LiveLibrary&) = delete;
+
+    // The current version, or nullptr before anything was published. The library it points
+    // to never changes; hold on to it for as long as its results (ids, metadata rows,
+    // compiled selections) are in use.
+    Version acquire() const {
+        return std::atomic_load(&current);
+    }
+
+    // Number of versions published so far
+    uint64_t generation() const {
+        return published.load(std::memory_order_acquire);
+    }
+
+    // Open the library like HNSWVectorDB::open_library() and publish it. The CSV is also the
+    // source recorded by the snapshots that update() saves.
+    void open(const std::string& csv_file_path, size_t num_threads = 0,
+              const HNSWVectorDB::BuildProgressCallback& progress = nullptr) {
+        std::lock_guard<std::mutex> lock(writer);
+        std::unique_ptr<HNSWVectorDB> next = factory();
+        next->open_library(snapshot_path, csv_file_path, num_threads, progress);
+        source_csv_path = csv_file_path;
+        publish(std::move(next));
+    }
+
+    // Publish the snapshot as it is on disk now, e.g. after another process rewrote it.
+    // Returns false, keeping the current version, if it can't be loaded.
+    bool reload() {
+        std::lock_guard<std::mutex> lock(writer);
+        std::unique_ptr<HNSWVectorDB> next = factory();
+        if (!next->load_snapshot(snapshot_path)) {
+            return false;
+        }
+        publish(std::move(next));
+        return true;
+    }
+
+    // Apply a change, such as refresh_from_csv() or sync_local_library(), to a copy of the
+    // current version and publish it, returning what change returns. Readers keep using the
+    // current version meanwhile. If change throws, nothing is published. Updates run one at
+    // a time.
+    template <typename Change>
+    auto update(Change&& change) -> decltype(change(std::declval<HNSWVectorDB&>())) {
+        std::lock_guard<std::mutex> lock(writer);
+        std::unique_ptr<HNSWVectorDB> next = copy_current();
+        if constexpr (std::is_void_v<decltype(change(*next))>) {
+            change(*next);
+            next->save_snapshot(snapshot_path, source_csv_path);
+            publish(std::move(next));
+        } else {
+            auto result = change(*next);
+            next->save_snapshot(snapshot_path, source_csv_path);
+            publish(std::move(next));
+            return result;
+        }
+    }
+
+    // Destroy replaced versions that readers have let go of since the last update. Returns
+    // the number still held by a reader.
+    size_t reclaim() {
+        std::lock_guard<std::mutex> lock(writer);
+        return sweep();
+    }
+};
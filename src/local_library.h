@@ -0,0 +1,158 @@
+#pragma once
+
+#include "hnswlib_csv_to_db.h"
+#include "library_scanner.h"
+#include "audio_analysis.h"
+#include "thread_pool.h"
+#include "track_manifest.h"
+#include <vector>
+#include <string>
+#include <unordered_set>
+#include <filesystem>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+
+// Options of sync_local_library
+struct LocalLibraryOptions {
+    // Files analysed concurrently (0 = one per core). Each holds a few blocks of samples and
+    // its FFT buffers, so memory stays flat however many files the folder has.
+    size_t analysis_threads = 0;
+    ScanOptions scan;
+    AnalysisOptions analysis;
+
+    LocalLibraryOptions() {
+        scan.extensions = {".wav", ".flac"};
+    }
+};
+
+// Result of sync_local_library
+struct LocalSyncStats {
+    size_t files = 0;        // audio files found
+    size_t analysed = 0;     // files decoded and analysed because they were new or changed
+    size_t failed = 0;       // files that couldn't be decoded
+    size_t skipped = 0;      // files that failed before and haven't changed since
+    size_t added = 0;
+    size_t updated = 0;
+    size_t removed = 0;      // tracks whose file is gone
+    size_t unchanged = 0;
+    double seconds = 0.0;
+};
+
+// Features of an analysed file in the library's feature column order. The audio can't tell
+// popularity, instrumentalness, valence, speechiness or liveness; those stay unknown (NaN)
+// and land on the library mean.
+inline std::vector<float> local_track_features(const AudioFeatures& audio) {
+    const float unknown = std::numeric_limits<float>::quiet_NaN();
+    std::vector<float> features;
+    for (const std::string& column : HNSWVectorDB::feature_columns()) {
+        float value = unknown;
+        if (column == "BPM") value = audio.bpm;
+        else if (column == "Dance") value = audio.danceability;
+        else if (column == "Energy") value = audio.energy;
+        else if (column == "Acoustic") value = audio.acousticness;
+        else if (column == "Loud (Db)") value = audio.loudness;
+        features.push_back(value);
+    }
+    return features;
+}
+
+inline HNSWVectorDB::TrackRecord local_track_record(const ScannedTrack& track, const AudioFeatures& audio) {
+    HNSWVectorDB::TrackRecord record;
+    record.key = TrackManifest::file_key(track.path);
+    record.hash = TrackManifest::file_hash(track.fileSize, track.modifiedTime);
+
+    std::string title = track.metadata.title;
+    if (title.empty()) {
+        title = std::filesystem::path(track.path).stem().string();
+    }
+    int seconds = static_cast<int>(std::lround(audio.duration));
+    char time[16];
+    std::snprintf(time, sizeof(time), "%02d:%02d", seconds / 60, seconds % 60);
+    record.fields = {
+        {"Song", title},
+        {"Artist", track.metadata.artist},
+        {"Album", track.metadata.album},
+        {"Album Date", track.metadata.year},
+        {"Genres", track.metadata.genre},
+        {"Time", time},
+    };
+    record.features = local_track_features(audio);
+    return record;
+}
+
+// Bring the tracks of a music folder into the library: files that are new or changed since
+// the last sync (by size and modification time) are decoded and analysed, and tracks whose
+// file is gone are removed. Files that can't be decoded are remembered and left alone until
+// they change. Tags are read by the scanner's I/O workers while the files of
+// each batch are analysed in parallel, one batch at a time, so memory is bounded by the
+// batch size rather than the size of the folder.
+inline LocalSyncStats sync_local_library(HNSWVectorDB& db, const std::string& root, const LocalLibraryOptions& options = LocalLibraryOptions()) {
+    auto start = std::chrono::steady_clock::now();
+    LocalSyncStats stats;
+
+    // Absolute paths, so the same file keeps its key whatever the working directory
+    std::filesystem::path root_path = std::filesystem::absolute(root).lexically_normal();
+    std::string root_prefix = TrackManifest::file_key((root_path / "").string());
+
+    ThreadPool pool(options.analysis_threads);
+    std::unordered_set<std::string> present;
+    std::vector<ScannedTrack> changed;
+    std::vector<AudioFeatures> analyses;
+    std::vector<HNSWVectorDB::TrackRecord> records;
+
+    ScanStats scan = scanLibrary(root_path.string(), options.scan, [&](std::vector<ScannedTrack>& batch) {
+        changed.clear();
+        for (ScannedTrack& track : batch) {
+            std::string key = TrackManifest::file_key(track.path);
+            uint64_t hash = TrackManifest::file_hash(track.fileSize, track.modifiedTime);
+            if (db.has_track(key, hash)) {
+                stats.unchanged++;
+            } else if (db.failed_before(key, hash)) {
+                stats.skipped++;
+            } else {
+                changed.push_back(std::move(track));
+            }
+            present.insert(std::move(key));
+        }
+
+        analyses.assign(changed.size(), AudioFeatures());
+        pool.parallel_for(changed.size(), 1, [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; i++) {
+                analyses[i] = analyzeAudioFile(changed[i].path, options.analysis);
+            }
+        });
+
+        records.clear();
+        for (size_t i = 0; i < changed.size(); i++) {
+            std::string key = TrackManifest::file_key(changed[i].path);
+            if (!analyses[i].valid) {
+                db.mark_failed(key, TrackManifest::file_hash(changed[i].fileSize, changed[i].modifiedTime));
+                stats.failed++;
+                continue;
+            }
+            db.forget_failed(key);
+            records.push_back(local_track_record(changed[i], analyses[i]));
+        }
+        stats.analysed += records.size();
+        if (!records.empty()) {
+            HNSWVectorDB::RefreshStats applied = db.upsert_tracks(records);
+            stats.added += applied.added;
+            stats.updated += applied.updated;
+        }
+    });
+    stats.files = scan.filesFound;
+
+    std::vector<std::string> gone;
+    for (std::string& key : db.track_keys(root_prefix)) {
+        if (present.find(key) == present.end()) gone.push_back(std::move(key));
+    }
+    stats.removed = db.remove_tracks(gone);
+    for (const std::string& key : db.failed_keys(root_prefix)) {
+        if (present.find(key) == present.end()) db.forget_failed(key);
+    }
+
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
@@ -6,24 +6,180 @@
 
 // #include "metadata.h"
 #include "hnswlib_csv_to_db.h"
+#include "shuffle_queue.h"
+#include "local_library.h"
+#include "live_library.h"
+#include "query_server.h"
+#include "track_prefetcher.h"
+
+#ifndef _WIN32
+#include <csignal>
+#endif
+
+static const char* LIBRARY_SNAPSHOT = "music_library.snapshot";
+static const char* LIBRARY_CSV = "../songs/Adams Playlist #5326.csv";
+
+// better-shuffle dedup <input.csv> <output.csv> [--near-duplicates <epsilon>]
+// Writes the export without repeated tracks, then optionally lists the remasters and edits
+// that remain within epsilon of another version of the same song.
+static int runDedup(int argc, char* argv[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " dedup <input.csv> <output.csv> [--near-duplicates <epsilon>]" << std::endl;
+        return 2;
+    }
+    std::string input = argv[2];
+    std::string output = argv[3];
+    float epsilon = -1.0f;
+    if (argc >= 6 && std::strcmp(argv[4], "--near-duplicates") == 0) {
+        epsilon = std::stof(argv[5]);
+    }
+
+    DedupStats stats = dedup_csv(input, output);
+    std::cout << "Kept " << stats.kept << " of " << stats.rows << " rows, removed " << stats.duplicates
+              << " duplicates in " << stats.seconds << " s" << std::endl;
+
+    if (epsilon >= 0.0f) {
+        HNSWVectorDB db(10);
+        db.load_from_csv(output);
+        size_t song_column = db.metadata_column("Song");
+        size_t artist_column = db.metadata_column("Artist");
+        for (const auto& pair : db.find_near_duplicates(epsilon)) {
+            auto track = db.get_metadata(pair.id);
+            auto original = db.get_metadata(pair.duplicate_of);
+            std::cout << "Near duplicate: " << track.get(song_column) << " - " << track.get(artist_column)
+                      << " ~ " << original.get(song_column) << " (distance " << pair.distance << ")" << std::endl;
+        }
+    }
+    return 0;
+}
+
+// better-shuffle analyze <audio file | music folder>
+// Prints the features of a WAV or FLAC file, or analyses the new and changed files of a
+// folder into the library snapshot.
+static int runAnalyze(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " analyze <audio file | music folder>" << std::endl;
+        return 2;
+    }
+    std::string target = argv[2];
+
+    if (!std::filesystem::is_directory(target)) {
+        AudioFeatures features = analyzeAudioFile(target);
+        if (!features.valid) {
+            std::cerr << "Could not analyse " << target << std::endl;
+            return 1;
+        }
+        std::cout << "Duration: " << features.duration << " s\n"
+                  << "Loudness: " << features.loudness << " dB\n"
+                  << "BPM: " << features.bpm << "\n"
+                  << "Danceability: " << features.danceability << "\n"
+                  << "Energy: " << features.energy << "\n"
+                  << "Acousticness: " << features.acousticness << "\n"
+                  << "Spectral centroid: " << features.spectralCentroid << " Hz\n"
+                  << "Spectral rolloff: " << features.spectralRolloff << " Hz\n"
+                  << "Spectral flatness: " << features.spectralFlatness << "\n"
+                  << "Zero crossings: " << features.zeroCrossingRate << " /s" << std::endl;
+        return 0;
+    }
+
+    HNSWVectorDB db(10);
+    db.set_deduplicate(true);
+    db.open_library(LIBRARY_SNAPSHOT, LIBRARY_CSV);
+    LocalSyncStats stats = sync_local_library(db, target);
+    db.save_snapshot(LIBRARY_SNAPSHOT, LIBRARY_CSV);
+    std::cout << "Found " << stats.files << " files, analysed " << stats.analysed << " (" << stats.failed
+              << " failed, " << stats.skipped << " skipped as failed before): " << stats.added << " added, "
+              << stats.updated << " updated, " << stats.removed << " removed, " << stats.unchanged << " unchanged in "
+              << stats.seconds << " s" << std::endl;
+    return 0;
+}
+
+#ifndef _WIN32
+static QueryServer* runningServer = nullptr;
+
+static void stopServer(int) {
+    if (runningServer) runningServer->stop();
+}
+#endif
+
+// better-shuffle serve [--socket <path>] [--max-batch <n>] [--batch-window-us <n>] [--threads <n>]
+// Loads the library once and answers search, next-track and metadata requests over a Unix
+// domain socket until interrupted (see query_protocol.h).
+static int runServe(int argc, char* argv[]) {
+#ifdef _WIN32
+    std::cerr << "serve is not supported on Windows" << std::endl;
+    return 1;
+#else
+    QueryServerOptions options;
+    options.csv_path = LIBRARY_CSV;
+    for (int i = 2; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (std::strcmp(argv[i], "--socket") == 0 && has_value) {
+            options.socket_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--max-batch") == 0 && has_value) {
+            options.max_batch = std::stoul(argv[++i]);
+        } else if (std::strcmp(argv[i], "--batch-window-us") == 0 && has_value) {
+            options.batch_window = std::chrono::microseconds(std::stol(argv[++i]));
+        } else if (std::strcmp(argv[i], "--threads") == 0 && has_value) {
+            options.search_threads = std::stoul(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " serve [--socket <path>] [--max-batch <n>] [--batch-window-us <n>] [--threads <n>]" << std::endl;
+            return 2;
+        }
+    }
+
+    LiveLibrary library(LIBRARY_SNAPSHOT, [] {
+        std::unique_ptr<HNSWVectorDB> db(new HNSWVectorDB(10));
+        db->set_deduplicate(true);
+        return db;
+    });
+    library.open(LIBRARY_CSV);
+
+    QueryServer server(library, options);
+    runningServer = &server;
+    std::signal(SIGINT, stopServer);
+    std::signal(SIGTERM, stopServer);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "Serving " << library.acquire()->size() << " tracks on " << options.socket_path << std::endl;
+    server.run();
+    runningServer = nullptr;
+
+    QueryServerStats stats = server.stats();
+    std::cout << "Served " << stats.requests << " requests on " << stats.connections << " connections, "
+              << stats.searches << " searches in " << stats.batches << " batches (largest " << stats.largest_batch
+              << ")" << std::endl;
+    return 0;
+#endif
+}
+
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && (std::strcmp(argv[1], "dedup") == 0 || std::strcmp(argv[1], "analyze") == 0 ||
+                      std::strcmp(argv[1], "serve") == 0)) {
+        try {
+            if (std::strcmp(argv[1], "serve") == 0) return runServe(argc, argv);
+            return std::strcmp(argv[1], "dedup") == 0 ? runDedup(argc, argv) : runAnalyze(argc, argv);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
 
-int main() {
     // print current directory using fstream
     std::cout << "Current directory is: " << std::filesystem::current_path() << std::endl;
 
-    std::string path = "../songs/Adams Playlist #5326.csv";
+    std::string path = LIBRARY_CSV;
     // std::string path = "../songs/Golden.flac";
     // std::string path = "../songs/Ain't No Rest For The Wicked.mp3";
 
     try {
         // Create vector database
         HNSWVectorDB db(10); // Using 10 dimensions
+        db.set_deduplicate(true); // repeated tracks would make the shuffle play the same song twice
         
-        // Load data from CSV file
-        // db.load_from_csv(path);
-        
-        // Save the index to a file
-        db.load_index("music_index.bin", path);
+        // Load the library snapshot, rebuilding it from the CSV file if it is missing or stale
+        db.open_library(LIBRARY_SNAPSHOT, path);
         
         // Example search (using dummy query)
 
@@ -38,16 +194,61 @@ int main() {
         // Live
         // Loud
 
+        // Raw values in CSV units; the database standardizes them the same way as the library
         std::vector<float> query = {65, 130, 85, 67, 51, 0, 99, 10, 10, -7};
         auto results = db.search(query);
         
+        size_t song_column = db.metadata_column("Song");
+        size_t artist_column = db.metadata_column("Artist");
+
         std::cout << "\nSearch results:" << std::endl;
         for (const auto& result : results) {
             auto metadata = db.get_metadata(result.first);
-            std::cout << "Song: " << metadata["Song"] 
-                      << ", Artist: " << metadata["Artist"]
+            std::cout << "Song: " << metadata.get(song_column)
+                      << ", Artist: " << metadata.get(artist_column)
+                      << ", Distance: " << result.second << std::endl;
+        }
+
+        // Same search limited to 4/4 tracks released after 2000
+        TrackSelection selection = db.compile_filter(TrackFilter().year_between(2000, 9999).time_signature_in({4}));
+        std::cout << "\nFiltered results (" << selection.size() << " tracks match):" << std::endl;
+        for (const auto& result : db.search(query, 5, selection)) {
+            auto metadata = db.get_metadata(result.first);
+            std::cout << "Song: " << metadata.get(song_column)
+                      << ", Artist: " << metadata.get(artist_column)
                       << ", Distance: " << result.second << std::endl;
         }
+
+        // Shuffle a few songs starting from the same mood. A player keeps the files of the
+        // next few tracks read ahead, so a transition doesn't wait on the disk.
+        ShuffleQueue queue(db, query);
+        TrackPrefetcher prefetcher(db);
+        std::cout << "\nShuffle:" << std::endl;
+        for (int i = 0; i < 5; i++) {
+            prefetcher.prefetch(queue.upcoming(3));
+            size_t id = queue.next();
+            if (id == HNSWVectorDB::NO_RESULT) break;
+            auto metadata = db.get_metadata(id);
+            std::cout << "Song: " << metadata.get(song_column)
+                      << ", Artist: " << metadata.get(artist_column) << std::endl;
+        }
+
+        // Radio: every pick follows the track before it, served from the precomputed
+        // neighbour lists kept next to the snapshot
+        NeighborGraph neighbors;
+        neighbors.open("music_library.neighbors", db, 16);
+        ShuffleOptions radio_options;
+        radio_options.drift = 1.0f;
+        ShuffleQueue radio(db, query, radio_options);
+        radio.set_neighbor_graph(&neighbors);
+        std::cout << "\nRadio:" << std::endl;
+        for (int i = 0; i < 5; i++) {
+            size_t id = radio.next();
+            if (id == HNSWVectorDB::NO_RESULT) break;
+            auto metadata = db.get_metadata(id);
+            std::cout << "Song: " << metadata.get(song_column)
+                      << ", Artist: " << metadata.get(artist_column) << std::endl;
+        }
         
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
@@ -16,165 +16,488 @@ uint32_t synchsafeToUInt(const char bytes[4]) {
     return result;
 }
 
+static uint32_t readBE32(const unsigned char* data) {
+    return (static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16) |
+           (static_cast<uint32_t>(data[2]) << 8) | static_cast<uint32_t>(data[3]);
+}
+
+// Reusable per-thread buffer for the frames and blocks the readers do load, so a library
+// scan doesn't allocate per file
+static char* threadBuffer(size_t size) {
+    static thread_local vector<char> buffer;
+    if (buffer.size() < size) buffer.resize(size);
+    return buffer.data();
+}
+
+// Text fields larger than this are not tags we care about (lyrics, embedded base64 art, ...)
+static const uint32_t MAX_TEXT_FIELD_SIZE = 64 * 1024;
+
+static void appendUTF8(string& out, uint32_t codepoint) {
+    if (codepoint < 0x80) {
+        out += static_cast<char>(codepoint);
+    } else if (codepoint < 0x800) {
+        out += static_cast<char>(0xC0 | (codepoint >> 6));
+        out += static_cast<char>(0x80 | (codepoint & 0x3F));
+    } else if (codepoint < 0x10000) {
+        out += static_cast<char>(0xE0 | (codepoint >> 12));
+        out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (codepoint & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (codepoint >> 18));
+        out += static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (codepoint & 0x3F));
+    }
+}
+
+// Decode an ID3v2 text frame body (encoding byte + text) to UTF-8. Multiple NUL-separated
+// values (ID3v2.4) are joined with "; ", which TagIndex splits on; a comma could be part of
+// a name ("Earth, Wind & Fire").
 string getFrameText(const char* data, size_t data_size) {
     if (data_size < 1) return "";
-    const char* text_start = data + 1;
-    size_t text_length = data_size - 1;
-    while (text_length > 0 && text_start[text_length - 1] == '\0') {
-        text_length--;
+    unsigned char encoding = static_cast<unsigned char>(data[0]);
+    const unsigned char* text = reinterpret_cast<const unsigned char*>(data + 1);
+    size_t length = data_size - 1;
+    string result;
+
+    if (encoding == 1 || encoding == 2) { // UTF-16 with BOM, UTF-16BE
+        bool bigEndian = encoding == 2;
+        uint32_t pendingHigh = 0;
+        for (size_t i = 0; i + 1 < length; i += 2) {
+            uint32_t unit = bigEndian ? (text[i] << 8) | text[i + 1] : text[i] | (text[i + 1] << 8);
+            if (unit == 0xFEFF || unit == 0xFFFE) {
+                bigEndian = unit == 0xFEFF ? bigEndian : !bigEndian;
+                continue;
+            }
+            if (unit == 0) {
+                result += "; ";
+            } else if (unit >= 0xD800 && unit < 0xDC00) {
+                pendingHigh = unit;
+            } else if (unit >= 0xDC00 && unit < 0xE000) {
+                if (pendingHigh) appendUTF8(result, 0x10000 + ((pendingHigh - 0xD800) << 10) + (unit - 0xDC00));
+                pendingHigh = 0;
+            } else {
+                appendUTF8(result, unit);
+            }
+        }
+    } else {
+        for (size_t i = 0; i < length; i++) {
+            if (text[i] == 0) {
+                result += "; ";
+            } else if (encoding == 0 && text[i] >= 0x80) { // ISO-8859-1
+                appendUTF8(result, text[i]);
+            } else {
+                result += static_cast<char>(text[i]);
+            }
+        }
+    }
+
+    // Trailing terminators turn into trailing separators above
+    while (result.size() >= 2 && result.compare(result.size() - 2, 2, "; ") == 0) {
+        result.resize(result.size() - 2);
+    }
+    return result;
+}
+
+// Field of AudioMetadata an ID3v2 frame id maps to, or nullptr for frames we skip
+static string* id3FrameTarget(const char* id, size_t idLength, AudioMetadata& metadata) {
+    if (idLength == 3) { // ID3v2.2
+        if (memcmp(id, "TT2", 3) == 0) return &metadata.title;
+        if (memcmp(id, "TP1", 3) == 0) return &metadata.artist;
+        if (memcmp(id, "TAL", 3) == 0) return &metadata.album;
+        if (memcmp(id, "TYE", 3) == 0) return &metadata.year;
+        if (memcmp(id, "TRK", 3) == 0) return &metadata.track;
+        if (memcmp(id, "TCO", 3) == 0) return &metadata.genre;
+        return nullptr;
     }
-    return string(text_start, text_length);
+    if (memcmp(id, "TIT2", 4) == 0) return &metadata.title;
+    if (memcmp(id, "TPE1", 4) == 0) return &metadata.artist;
+    if (memcmp(id, "TALB", 4) == 0) return &metadata.album;
+    if (memcmp(id, "TYER", 4) == 0 || memcmp(id, "TDRC", 4) == 0) return &metadata.year;
+    if (memcmp(id, "TRCK", 4) == 0) return &metadata.track;
+    if (memcmp(id, "TCON", 4) == 0) return &metadata.genre;
+    return nullptr;
 }
 
-AudioMetadata readMP3Metadata(const std::string& filePath) {
-    AudioMetadata metadata;
-    ifstream file(filePath, ios::binary);
-    if (!file) {
-        cerr << "Error opening file" << endl;
-        return metadata;
+// Read the text frames of an ID3v2 tag whose 10-byte header has already been read. Only
+// frame headers and the handful of text frames we use are read; everything else, cover
+// art included, is skipped with a seek.
+static void readID3v2Frames(istream& file, const char header[10], AudioMetadata& metadata) {
+    int version = static_cast<unsigned char>(header[3]);
+    unsigned char flags = static_cast<unsigned char>(header[5]);
+    streamoff tagEnd = 10 + static_cast<streamoff>(synchsafeToUInt(header + 6));
+    if (version < 2 || version > 4) return;
+
+    file.clear();
+    file.seekg(10);
+
+    // Skip the extended header
+    if (version >= 3 && (flags & 0x40)) {
+        char sizeBytes[4];
+        if (!file.read(sizeBytes, 4)) return;
+        if (version == 4) {
+            file.seekg(static_cast<streamoff>(synchsafeToUInt(sizeBytes)) - 4, ios::cur);
+        } else {
+            file.seekg(static_cast<streamoff>(readBE32(reinterpret_cast<unsigned char*>(sizeBytes))), ios::cur);
+        }
     }
 
-    // Read ID3v2 tag
-    char header[10];
-    file.read(header, 10);
-    if (strncmp(header, "ID3", 3) != 0) {
-        cerr << "No ID3v2 tag found" << endl;
-        return metadata;
+    size_t idLength = version == 2 ? 3 : 4;
+    size_t headerLength = version == 2 ? 6 : 10;
+    char frameHeader[10];
+    while (file.read(frameHeader, headerLength)) {
+        streamoff frameStart = file.tellg();
+        if (frameHeader[0] == '\0' || frameStart > tagEnd) break; // padding
+
+        uint32_t frameSize;
+        const unsigned char* sizeBytes = reinterpret_cast<const unsigned char*>(frameHeader + idLength);
+        if (version == 2) {
+            frameSize = (sizeBytes[0] << 16) | (sizeBytes[1] << 8) | sizeBytes[2];
+        } else if (version == 3) {
+            frameSize = readBE32(sizeBytes);
+        } else {
+            frameSize = synchsafeToUInt(reinterpret_cast<const char*>(sizeBytes));
+        }
+        if (frameStart + static_cast<streamoff>(frameSize) > tagEnd) break;
+
+        string* target = id3FrameTarget(frameHeader, idLength, metadata);
+        if (target && frameSize <= MAX_TEXT_FIELD_SIZE) {
+            char* data = threadBuffer(frameSize);
+            if (!file.read(data, frameSize)) break;
+            string value = getFrameText(data, frameSize);
+            if (!value.empty()) *target = value;
+        } else {
+            file.seekg(frameSize, ios::cur);
+        }
     }
+}
 
-    uint32_t tag_size = synchsafeToUInt(header + 6);
-    uint32_t total_tag_size = 10 + tag_size;
+struct MPEGFrameHeader {
+    int bitrate;         // in kbps
+    int sampleRate;
+    int samplesPerFrame;
+    int frameSize;       // in bytes, including the header
+    int sideInfoSize;    // Layer III side information following the header
+    bool mpeg1;
+};
+
+// Parse a 4-byte MPEG audio frame header. Covers MPEG-1, MPEG-2 and MPEG-2.5, layers I-III.
+static bool parseMPEGFrameHeader(const unsigned char* h, MPEGFrameHeader& frame) {
+    if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0) return false;
+
+    int version = (h[1] >> 3) & 0x03;   // 0 = MPEG-2.5, 1 = reserved, 2 = MPEG-2, 3 = MPEG-1
+    int layerBits = (h[1] >> 1) & 0x03; // 1 = Layer III, 2 = Layer II, 3 = Layer I
+    int bitrateIndex = (h[2] >> 4) & 0x0F;
+    int sampleRateIndex = (h[2] >> 2) & 0x03;
+    int padding = (h[2] >> 1) & 0x01;
+    int channelMode = (h[3] >> 6) & 0x03;
+    if (version == 1 || layerBits == 0 || bitrateIndex == 0 || bitrateIndex == 15 || sampleRateIndex == 3) {
+        return false;
+    }
 
-    vector<char> tag_buffer(total_tag_size);
-    file.seekg(0);
-    file.read(tag_buffer.data(), total_tag_size);
-
-    size_t pos = 10;
-    while (pos < total_tag_size) {
-        if (pos + 10 > total_tag_size) break;
-
-        char frame_id[5];
-        memcpy(frame_id, &tag_buffer[pos], 4);
-        frame_id[4] = '\0';
-        pos += 4;
-
-        if (frame_id[0] == '\0') break;
-
-        uint32_t frame_size = synchsafeToUInt(&tag_buffer[pos]);
-        pos += 4;
-        pos += 2; // Skip flags
-
-        if (pos + frame_size > total_tag_size) break;
-
-        const char* frame_data = &tag_buffer[pos];
-        pos += frame_size;
-
-        string value = getFrameText(frame_data, frame_size);
-        if (value.empty()) continue;
-
-        if (strcmp(frame_id, "TIT2") == 0) {
-            metadata.title = value;
-        } else if (strcmp(frame_id, "TPE1") == 0) {
-            metadata.artist = value;
-        } else if (strcmp(frame_id, "TALB") == 0) {
-            metadata.album = value;
-        } else if (strcmp(frame_id, "TYER") == 0) {
-            metadata.year = value;
-        } else if (strcmp(frame_id, "TRCK") == 0) {
-            metadata.track = value;
-        } else if (strcmp(frame_id, "TCON") == 0) {
-            metadata.genre = value;
+    static const int bitrateTable[2][3][16] = {
+        { // MPEG-1: Layer I, II, III
+            {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
+            {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0},
+        },
+        { // MPEG-2 and MPEG-2.5: Layer I, II, III
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0},
+            {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+            {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+        },
+    };
+    static const int sampleRateTable[4][3] = {
+        {11025, 12000, 8000},  // MPEG-2.5
+        {0, 0, 0},             // reserved
+        {22050, 24000, 16000}, // MPEG-2
+        {44100, 48000, 32000}, // MPEG-1
+    };
+
+    int layer = 4 - layerBits;
+    frame.mpeg1 = version == 3;
+    frame.bitrate = bitrateTable[frame.mpeg1 ? 0 : 1][layer - 1][bitrateIndex];
+    frame.sampleRate = sampleRateTable[version][sampleRateIndex];
+
+    if (layer == 1) {
+        frame.samplesPerFrame = 384;
+        frame.frameSize = (12 * frame.bitrate * 1000 / frame.sampleRate + padding) * 4;
+    } else if (layer == 2 || frame.mpeg1) {
+        frame.samplesPerFrame = 1152;
+        frame.frameSize = 144 * frame.bitrate * 1000 / frame.sampleRate + padding;
+    } else {
+        frame.samplesPerFrame = 576;
+        frame.frameSize = 72 * frame.bitrate * 1000 / frame.sampleRate + padding;
+    }
+
+    bool mono = channelMode == 3;
+    frame.sideInfoSize = frame.mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+    return frame.frameSize > 4;
+}
+
+// Sequential reader that serves small windows out of large buffered reads, so scanning
+// frame headers costs one read per MP3_SCAN_BUFFER bytes instead of one per frame
+class BufferedFileWindow {
+    istream& file;
+    vector<unsigned char> buffer;
+    streamoff bufferStart = 0;
+    size_t bufferLength = 0;
+    streamoff fileEnd;
+
+public:
+    BufferedFileWindow(istream& f, streamoff end, size_t bufferSize) : file(f), buffer(bufferSize), fileEnd(end) {}
+
+    // Pointer to at least `length` bytes at absolute offset `pos`, or nullptr past the end
+    const unsigned char* at(streamoff pos, size_t length) {
+        if (pos < 0 || pos + static_cast<streamoff>(length) > fileEnd) return nullptr;
+        if (pos < bufferStart || pos + static_cast<streamoff>(length) > bufferStart + static_cast<streamoff>(bufferLength)) {
+            size_t toRead = static_cast<size_t>(min<streamoff>(buffer.size(), fileEnd - pos));
+            file.clear();
+            file.seekg(pos);
+            file.read(reinterpret_cast<char*>(buffer.data()), toRead);
+            bufferStart = pos;
+            bufferLength = static_cast<size_t>(file.gcount());
+            if (bufferLength < length) return nullptr;
         }
+        return buffer.data() + (pos - bufferStart);
     }
 
-    // Calculate duration and bitrate from MP3 frames
-    file.seekg(total_tag_size);
-    char frame_header[4];
-    int total_frames = 0;
-    double total_duration = 0; // Changed to double to accumulate in milliseconds
-    int total_bitrate = 0;
-
-    while (file.read(frame_header, 4)) {
-        if ((frame_header[0] & 0xFF) == 0xFF && (frame_header[1] & 0xE0) == 0xE0) {
-            int version = (frame_header[1] >> 3) & 0x03;
-            int layer = (frame_header[1] >> 1) & 0x03;
-            int bitrate_index = (frame_header[2] >> 4) & 0x0F;
-            int sampling_rate_index = (frame_header[2] >> 2) & 0x03;
-            int padding = (frame_header[2] >> 1) & 0x01;
-
-            const int bitrate_table[16] = {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0};
-            int bitrate = bitrate_table[bitrate_index];
-
-            const int sampling_rate_table[4] = {44100, 48000, 32000, 0};
-            int sampling_rate = sampling_rate_table[sampling_rate_index];
-
-            if (bitrate == 0 || sampling_rate == 0) break;
-
-            // Calculate frame size and duration
-            int frame_size;
-            if (layer == 3) { // Layer I
-                frame_size = (12 * bitrate * 1000 / sampling_rate + padding) * 4;
-            } else if (layer == 2) { // Layer II
-                frame_size = (144 * bitrate * 1000 / sampling_rate + padding);
-            } else { // Layer III (MP3)
-                frame_size = (144 * bitrate * 1000 / sampling_rate + padding);
-            }
+    // Bytes available from `pos` to the end of the current buffer
+    size_t available(streamoff pos) const {
+        if (pos < bufferStart || pos >= bufferStart + static_cast<streamoff>(bufferLength)) return 0;
+        return static_cast<size_t>(bufferStart + static_cast<streamoff>(bufferLength) - pos);
+    }
 
-            float frame_duration;
-            if (version == 3 || version == 2) { // MPEG-1 or MPEG-2
-                int samples_per_frame = (layer == 3) ? 576 : 1152;
-                frame_duration = static_cast<float>(samples_per_frame) / sampling_rate * 1000; // in milliseconds
-            } else {
-                break; // unsupported version
-            }
+    streamoff end() const { return fileEnd; }
+};
 
-            total_bitrate += bitrate;
-            total_frames++;
-            total_duration += frame_duration;
+static const size_t MP3_SCAN_BUFFER = 256 * 1024;
 
-            // Skip the rest of the frame
-            if (frame_size > 4) {
-                file.seekg(frame_size - 4, ios::cur);
-            } else {
-                file.seekg(0, ios::cur);
+// Find the first valid frame header at or after `pos`. With requireNext, the frame's successor
+// must be valid too, which avoids locking onto stray 0xFFE patterns in padding or tag data.
+static streamoff findMPEGFrame(BufferedFileWindow& window, streamoff pos, MPEGFrameHeader& frame, bool requireNext) {
+    while (pos + 4 <= window.end()) {
+        const unsigned char* data = window.at(pos, 4);
+        if (!data) return -1;
+
+        size_t available = window.available(pos);
+        const unsigned char* sync = static_cast<const unsigned char*>(memchr(data, 0xFF, available - 3));
+        if (!sync) {
+            pos += static_cast<streamoff>(available - 3);
+            continue;
+        }
+        pos += sync - data;
+
+        MPEGFrameHeader next;
+        const unsigned char* header = window.at(pos, 4);
+        if (header && parseMPEGFrameHeader(header, frame)) {
+            const unsigned char* following = window.at(pos + frame.frameSize, 4);
+            if (!requireNext || !following || parseMPEGFrameHeader(following, next)) {
+                return pos;
             }
-        } else {
-            // Attempt to resync by moving 1 byte forward
-            file.seekg(-3, ios::cur);
         }
+        pos++;
     }
+    return -1;
+}
 
-    if (total_frames > 0) {
-        metadata.bitrate = total_bitrate / total_frames;
-        metadata.duration = total_duration / 1000.0; // Convert ms to seconds
+// Duration and bitrate from the Xing/Info or VBRI header that encoders put in the first
+// frame. Returns false if the frame carries neither, or they lack a frame count.
+static bool readVBRHeader(BufferedFileWindow& window, streamoff framePos, const MPEGFrameHeader& frame,
+                          streamoff audioEnd, AudioMetadata& metadata) {
+    uint32_t frames = 0;
+    uint32_t bytes = 0;
+
+    streamoff xingPos = framePos + 4 + frame.sideInfoSize;
+    const unsigned char* xing = window.at(xingPos, 16);
+    const unsigned char* vbri = window.at(framePos + 36, 18);
+    if (xing && (memcmp(xing, "Xing", 4) == 0 || memcmp(xing, "Info", 4) == 0)) {
+        uint32_t flags = readBE32(xing + 4);
+        size_t offset = 8;
+        if (!(flags & 0x1)) return false;
+        frames = readBE32(xing + offset);
+        offset += 4;
+        if (flags & 0x2) {
+            bytes = readBE32(xing + offset);
+        }
+    } else if (vbri && memcmp(vbri, "VBRI", 4) == 0) {
+        bytes = readBE32(vbri + 10);
+        frames = readBE32(vbri + 14);
+    } else {
+        return false;
     }
+    if (frames == 0) return false;
 
-    return metadata;
+    if (bytes == 0) {
+        bytes = static_cast<uint32_t>(audioEnd - framePos);
+    }
+    metadata.duration = static_cast<double>(frames) * frame.samplesPerFrame / frame.sampleRate;
+    metadata.bitrate = static_cast<int>(bytes * 8.0 / metadata.duration / 1000.0 + 0.5);
+    return true;
 }
 
-AudioMetadata readFLACMetadata(const std::string& filePath) {
+// Walk every frame between audioStart and audioEnd through large buffered reads
+static void scanMPEGFrames(BufferedFileWindow& window, streamoff pos, streamoff audioEnd, AudioMetadata& metadata) {
+    uint64_t totalSamples = 0;
+    uint64_t totalBytes = 0;
+    int sampleRate = 0;
+    MPEGFrameHeader frame;
+
+    while (pos + 4 <= audioEnd) {
+        const unsigned char* header = window.at(pos, 4);
+        if (!header) break;
+        if (!parseMPEGFrameHeader(header, frame)) {
+            // Lost sync; search forward for the next frame
+            pos = findMPEGFrame(window, pos + 1, frame, false);
+            if (pos < 0 || pos + 4 > audioEnd) break;
+            continue;
+        }
+        totalSamples += frame.samplesPerFrame;
+        totalBytes += frame.frameSize;
+        sampleRate = frame.sampleRate;
+        pos += frame.frameSize;
+    }
+
+    if (sampleRate > 0 && totalSamples > 0) {
+        metadata.duration = static_cast<double>(totalSamples) / sampleRate;
+        metadata.bitrate = static_cast<int>(totalBytes * 8.0 / metadata.duration / 1000.0 + 0.5);
+    }
+}
+
+// Tags, duration and bitrate of the MP3 in file, which may hold only the first dataEnd bytes
+// of a file of fileSize bytes. Without a VBR header the duration comes from walking the
+// frames, if scanFrames and they are all there.
+static AudioMetadata parseMP3(istream& file, streamoff dataEnd, streamoff fileSize, bool scanFrames) {
     AudioMetadata metadata;
+    file.seekg(0);
+
+    // Read ID3v2 tag
+    char header[10];
+    file.read(header, 10);
+    streamoff audioStart = 0;
+    if (file.gcount() == 10 && strncmp(header, "ID3", 3) == 0) {
+        audioStart = 10 + static_cast<streamoff>(synchsafeToUInt(header + 6));
+        if (header[5] & 0x10) audioStart += 10; // footer present
+        readID3v2Frames(file, header, metadata);
+    }
+
+    // An ID3v1 tag occupies the last 128 bytes
+    streamoff audioEnd = fileSize;
+    if (fileSize >= 128 && fileSize <= dataEnd) {
+        char tag[3];
+        file.clear();
+        file.seekg(fileSize - 128);
+        if (file.read(tag, 3) && memcmp(tag, "TAG", 3) == 0) audioEnd -= 128;
+    }
+
+    // Calculate duration and bitrate from the first frame's VBR header when present,
+    // otherwise by walking the frames
+    BufferedFileWindow window(file, audioEnd, MP3_SCAN_BUFFER);
+    MPEGFrameHeader frame;
+    streamoff firstFrame = findMPEGFrame(window, audioStart, frame, true);
+    if (firstFrame < 0) {
+        firstFrame = findMPEGFrame(window, audioStart, frame, false);
+    }
+    if (firstFrame < 0) {
+        return metadata;
+    }
+    if (!readVBRHeader(window, firstFrame, frame, audioEnd, metadata) && scanFrames && fileSize <= dataEnd) {
+        scanMPEGFrames(window, firstFrame, audioEnd, metadata);
+    }
+
+    return metadata;
+}
+
+AudioMetadata readMP3Metadata(const std::string& filePath) {
     ifstream file(filePath, ios::binary | ios::ate);
     if (!file) {
-        cerr << "Error opening FLAC file" << endl;
-        return metadata;
+        cerr << "Error opening file" << endl;
+        return AudioMetadata();
     }
+    streamoff fileSize = file.tellg();
+    return parseMP3(file, fileSize, fileSize, true);
+}
 
-    streamsize file_size = file.tellg();
-    file.seekg(0);
+static uint32_t readLE32(const char* data) {
+    return static_cast<uint32_t>(static_cast<unsigned char>(data[0])) |
+           (static_cast<uint32_t>(static_cast<unsigned char>(data[1])) << 8) |
+           (static_cast<uint32_t>(static_cast<unsigned char>(data[2])) << 16) |
+           (static_cast<uint32_t>(static_cast<unsigned char>(data[3])) << 24);
+}
+
+// Parse a VORBIS_COMMENT block straight from the file. Each comment's key is read first and
+// comments we don't use (or that are too large, like embedded pictures) are skipped.
+static void readVorbisComments(istream& file, streamoff blockEnd, AudioMetadata& metadata) {
+    char lengthBytes[4];
+    if (!file.read(lengthBytes, 4)) return;
+    file.seekg(readLE32(lengthBytes), ios::cur); // Skip vendor string
+    if (!file.read(lengthBytes, 4)) return;
+    uint32_t num_comments = readLE32(lengthBytes);
+
+    const size_t keyPrefix = 16; // longest key we want ("TRACKNUMBER=") fits
+    for (uint32_t i = 0; i < num_comments; ++i) {
+        if (!file.read(lengthBytes, 4)) return;
+        uint32_t comment_len = readLE32(lengthBytes);
+        streamoff commentEnd = static_cast<streamoff>(file.tellg()) + comment_len;
+        if (commentEnd > blockEnd) return;
+
+        size_t prefixLength = min<size_t>(comment_len, keyPrefix);
+        char prefix[keyPrefix];
+        if (!file.read(prefix, prefixLength)) return;
+
+        const char* eq = static_cast<const char*>(memchr(prefix, '=', prefixLength));
+        string* target = nullptr;
+        if (eq) {
+            string key(prefix, eq - prefix);
+
+            // Case-insensitive comparison
+            transform(key.begin(), key.end(), key.begin(), ::toupper);
+
+            if (key == "TITLE") {
+                target = &metadata.title;
+            } else if (key == "ARTIST") {
+                target = &metadata.artist;
+            } else if (key == "ALBUM") {
+                target = &metadata.album;
+            } else if (key == "DATE") {
+                target = &metadata.year;
+            } else if (key == "TRACKNUMBER") {
+                target = &metadata.track;
+            } else if (key == "GENRE") {
+                target = &metadata.genre;
+            }
+        }
+
+        if (target && comment_len <= MAX_TEXT_FIELD_SIZE) {
+            char* data = threadBuffer(comment_len);
+            memcpy(data, prefix, prefixLength);
+            if (!file.read(data + prefixLength, comment_len - prefixLength)) return;
+            size_t valueStart = eq - prefix + 1;
+            *target = string(data + valueStart, comment_len - valueStart);
+        } else {
+            file.seekg(commentEnd);
+        }
+    }
+}
+
+bool readFLACHeader(istream& file, FLACStreamInfo& info, AudioMetadata* metadata) {
+    streamoff start = file.tellg();
+    file.seekg(0, ios::end);
+    streamoff file_size = file.tellg();
+    file.seekg(start);
 
     // Check FLAC signature
     char signature[4];
     file.read(signature, 4);
-    if (strncmp(signature, "fLaC", 4) != 0) {
-        cerr << "Not a FLAC file" << endl;
-        return metadata;
+    if (file.gcount() != 4 || strncmp(signature, "fLaC", 4) != 0) {
+        return false;
     }
 
     bool last_block = false;
-    uint32_t sample_rate = 0;
-    uint64_t total_samples = 0;
+    info.audioStart = file.tellg();
 
+    // Only block headers, STREAMINFO and VORBIS_COMMENT are read; PICTURE, PADDING,
+    // SEEKTABLE etc. are skipped with a seek
     while (!last_block && file) {
         char header[4];
         file.read(header, 4);
@@ -186,92 +509,71 @@ AudioMetadata readFLACMetadata(const std::string& filePath) {
         uint32_t block_length = (static_cast<uint8_t>(header[1]) << 16) |
                                (static_cast<uint8_t>(header[2]) << 8) |
                                static_cast<uint8_t>(header[3]);
-
-        vector<char> block_data(block_length);
-        file.read(block_data.data(), block_length);
-        if (file.gcount() != block_length) break;
+        streamoff block_end = static_cast<streamoff>(file.tellg()) + block_length;
+        if (block_end > file_size) break;
 
         if (block_type == 0) { // STREAMINFO
-            if (block_length < 34) {
+            unsigned char block_data[34];
+            if (block_length < 34 || !file.read(reinterpret_cast<char*>(block_data), 34)) {
                 cerr << "Invalid STREAMINFO block" << endl;
-                continue;
-            }
-
-            // Parse sample rate (20 bits)
-            sample_rate = (static_cast<uint32_t>(static_cast<unsigned char>(block_data[10])) << 12);
-            sample_rate |= (static_cast<uint32_t>(static_cast<unsigned char>(block_data[11])) << 4);
-            sample_rate |= (static_cast<unsigned char>(block_data[12]) >> 4);
-
-            // Parse total_samples (36 bits)
-            uint32_t raw_total = (static_cast<uint32_t>(static_cast<unsigned char>(block_data[13])) << 16);
-            raw_total |= (static_cast<uint32_t>(static_cast<unsigned char>(block_data[14])) << 8);
-            raw_total |= static_cast<unsigned char>(block_data[15]);
-            total_samples = raw_total;
-
-        } else if (block_type == 4) { // VORBIS_COMMENT
-            auto read_le32 = [](const char* data) {
-                return static_cast<uint32_t>(static_cast<unsigned char>(data[0])) |
-                       (static_cast<uint32_t>(static_cast<unsigned char>(data[1])) << 8) |
-                       (static_cast<uint32_t>(static_cast<unsigned char>(data[2])) << 16) |
-                       (static_cast<uint32_t>(static_cast<unsigned char>(data[3])) << 24);
-            };
-
-            const char* data = block_data.data();
-            size_t pos = 0;
-
-            uint32_t vendor_len = read_le32(data + pos);
-            pos += 4 + vendor_len; // Skip vendor string
-
-            if (pos + 4 > block_length) continue;
-            uint32_t num_comments = read_le32(data + pos);
-            pos += 4;
-
-            for (uint32_t i = 0; i < num_comments; ++i) {
-                if (pos + 4 > block_length) break;
-                uint32_t comment_len = read_le32(data + pos);
-                pos += 4;
-                if (pos + comment_len > block_length) break;
-
-                string comment(data + pos, comment_len);
-                pos += comment_len;
-
-                size_t eq = comment.find('=');
-                if (eq == string::npos) continue;
-
-                string key = comment.substr(0, eq);
-                string value = comment.substr(eq + 1);
-
-                // Case-insensitive comparison
-                transform(key.begin(), key.end(), key.begin(), ::toupper);
-
-                if (key == "TITLE") {
-                    metadata.title = value;
-                } else if (key == "ARTIST") {
-                    metadata.artist = value;
-                } else if (key == "ALBUM") {
-                    metadata.album = value;
-                } else if (key == "DATE") {
-                    metadata.year = value;
-                } else if (key == "TRACKNUMBER") {
-                    metadata.track = value;
-                } else if (key == "GENRE") {
-                    metadata.genre = value;
+            } else {
+                info.maxBlockSize = (static_cast<uint32_t>(block_data[2]) << 8) | block_data[3];
+                // Sample rate (20 bits), channels (3), bits per sample (5), total samples (36)
+                uint64_t packed = 0;
+                for (int i = 10; i < 18; i++) {
+                    packed = (packed << 8) | block_data[i];
                 }
+                info.sampleRate = static_cast<uint32_t>(packed >> 44);
+                info.channels = static_cast<uint32_t>((packed >> 41) & 0x7) + 1;
+                info.bitsPerSample = static_cast<uint32_t>((packed >> 36) & 0x1F) + 1;
+                info.totalSamples = packed & 0xFFFFFFFFFull;
             }
+        } else if (block_type == 4 && metadata) { // VORBIS_COMMENT
+            readVorbisComments(file, block_end, *metadata);
         }
+
+        file.clear();
+        file.seekg(block_end);
+        info.audioStart = block_end;
     }
 
-    if (sample_rate > 0 && total_samples > 0) {
-        metadata.duration = static_cast<double>(total_samples) / sample_rate;
+    file.clear();
+    file.seekg(info.audioStart);
+    return true;
+}
+
+// Tags, duration and bitrate of the FLAC file in file, which may hold only its start
+static AudioMetadata parseFLAC(istream& file, streamoff file_size) {
+    AudioMetadata metadata;
+    file.seekg(0);
+
+    FLACStreamInfo info;
+    if (!readFLACHeader(file, info, &metadata)) {
+        cerr << "Not a FLAC file" << endl;
+        return metadata;
     }
 
-    if (metadata.duration > 0 && file_size > 0) {
-        metadata.bitrate = static_cast<int>((file_size * 8) / (metadata.duration * 1000));
+    if (info.sampleRate > 0 && info.totalSamples > 0) {
+        metadata.duration = static_cast<double>(info.totalSamples) / info.sampleRate;
+    }
+
+    // Bitrate of the audio frames only, not counting embedded artwork
+    if (metadata.duration > 0 && file_size > info.audioStart) {
+        metadata.bitrate = static_cast<int>(((file_size - info.audioStart) * 8) / (metadata.duration * 1000));
     }
 
     return metadata;
 }
 
+AudioMetadata readFLACMetadata(const std::string& filePath) {
+    ifstream file(filePath, ios::binary | ios::ate);
+    if (!file) {
+        cerr << "Error opening FLAC file" << endl;
+        return AudioMetadata();
+    }
+    return parseFLAC(file, file.tellg());
+}
+
 AudioMetadata readAudioMetadata(const std::string& filePath) {
     // Check file extension and call appropriate reader
     size_t dot_pos = filePath.find_last_of('.');
@@ -285,4 +587,70 @@ AudioMetadata readAudioMetadata(const std::string& filePath) {
         // Add other format handlers here
     }
     return AudioMetadata(); // Unsupported format
+}
+
+// Read-only, seekable stream over bytes in memory
+class MemoryBuffer : public streambuf {
+public:
+    MemoryBuffer(const char* data, size_t size) {
+        char* begin = const_cast<char*>(data);
+        setg(begin, begin, begin + size);
+    }
+
+protected:
+    pos_type seekoff(off_type offset, ios_base::seekdir dir, ios_base::openmode which) override {
+        off_type base = dir == ios_base::beg ? 0 : dir == ios_base::cur ? gptr() - eback() : egptr() - eback();
+        return seekpos(pos_type(base + offset), which);
+    }
+
+    pos_type seekpos(pos_type pos, ios_base::openmode which) override {
+        off_type offset = pos;
+        if (!(which & ios_base::in) || offset < 0 || offset > egptr() - eback()) {
+            return pos_type(off_type(-1));
+        }
+        setg(eback(), eback() + offset, egptr());
+        return pos;
+    }
+};
+
+// Whether the ID3v2 tag at the start of an MP3, if any, lies within its first size bytes
+static bool id3TagWithin(const char* data, size_t size) {
+    if (size < 3 || strncmp(data, "ID3", 3) != 0) return true;
+    return size >= 10 && 10 + static_cast<size_t>(synchsafeToUInt(data + 6)) <= size;
+}
+
+// Whether the metadata blocks of a FLAC file all lie within its first size bytes
+static bool flacBlocksWithin(const char* data, size_t size) {
+    size_t pos = 4;
+    while (pos + 4 <= size) {
+        const unsigned char* header = reinterpret_cast<const unsigned char*>(data + pos);
+        pos += 4 + ((static_cast<size_t>(header[1]) << 16) | (header[2] << 8) | header[3]);
+        if (header[0] & 0x80) return pos <= size;
+    }
+    return false;
+}
+
+AudioMetadata readAudioMetadata(const std::string& filePath, const char* head, size_t headSize, uint64_t fileSize) {
+    MemoryBuffer buffer(head, headSize);
+    istream memory(&buffer);
+    streamoff dataEnd = static_cast<streamoff>(headSize);
+    streamoff size = max(dataEnd, static_cast<streamoff>(fileSize));
+    size_t dot_pos = filePath.find_last_of('.');
+    if (dot_pos != string::npos) {
+        string ext = filePath.substr(dot_pos + 1);
+        if (ext == "mp3") {
+            if (id3TagWithin(head, headSize)) {
+                return parseMP3(memory, dataEnd, size, true);
+            }
+            // Tags behind a large picture; read those from the file, but still don't walk it
+            ifstream file(filePath, ios::binary);
+            return file ? parseMP3(file, size, size, false) : AudioMetadata();
+        } else if (ext == "flac") {
+            if (flacBlocksWithin(head, headSize)) {
+                return parseFLAC(memory, size);
+            }
+            return readFLACMetadata(filePath);
+        }
+    }
+    return AudioMetadata();
 }
\ No newline at end of file
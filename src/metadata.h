@@ -1,6 +1,8 @@
 #pragma once
 
 #include <string>
+#include <cstdint>
+#include <istream>
 
 struct AudioMetadata {
     std::string title;
@@ -9,8 +11,28 @@ struct AudioMetadata {
     std::string year;
     std::string track;
     std::string genre;
-    double duration; // in seconds
-    int bitrate;  // in kbps
+    double duration = 0; // in seconds
+    int bitrate = 0;  // in kbps
 };
 
-AudioMetadata readAudioMetadata(const std::string& filePath);
\ No newline at end of file
+// Stream parameters from a FLAC file's STREAMINFO block
+struct FLACStreamInfo {
+    uint32_t sampleRate = 0;
+    uint32_t channels = 0;
+    uint32_t bitsPerSample = 0;
+    uint32_t maxBlockSize = 0;
+    uint64_t totalSamples = 0; // per channel, 0 if unknown
+    int64_t audioStart = 0;    // offset of the first audio frame
+};
+
+// Read the metadata blocks of a FLAC file, leaving file at the first audio frame. Tags are
+// parsed into metadata when it is given. Returns false if the file isn't FLAC.
+bool readFLACHeader(std::istream& file, FLACStreamInfo& info, AudioMetadata* metadata);
+
+AudioMetadata readMP3Metadata(const std::string& filePath);
+AudioMetadata readFLACMetadata(const std::string& filePath);
+AudioMetadata readAudioMetadata(const std::string& filePath);
+// Like readAudioMetadata for a file of fileSize bytes whose first headSize bytes are already
+// in memory. The file is only opened when its tags don't fit in head, and an MP3 without a
+// Xing/VBRI header gets no duration unless head holds all of it.
+AudioMetadata readAudioMetadata(const std::string& filePath, const char* head, size_t headSize, uint64_t fileSize);
\ No newline at end of file
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include <ostream>
+
+#include "cow_vector.h"
+#include "binary_io.h"
+
+// Append-only string storage addressed by dense 32-bit ids. All characters live in one
+// contiguous buffer; with interning enabled, equal strings share a single id.
+class StringArena {
+private:
+    CowVector<char> chars;
+    CowVector<uint32_t> offsets = {0};   // string id spans offsets[id] .. offsets[id + 1]
+    std::vector<uint32_t> slots;         // open addressing table of id + 1, 0 marks an empty slot
+    bool interned;
+
+    static uint64_t hash(std::string_view value) {
+        uint64_t h = 14695981039346656037ull; // FNV-1a
+        for (char c : value) {
+            h ^= static_cast<unsigned char>(c);
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    // Rebuild the intern table with room for at least twice the current strings. Arenas
+    // attached to a snapshot start without a table and get one on their first add().
+    void grow_slots() {
+        size_t capacity = 64;
+        while (capacity < (size() + 1) * 2) capacity *= 2;
+        slots.assign(std::max(capacity, slots.size() * 2), 0);
+        size_t mask = slots.size() - 1;
+        for (uint32_t id = 0; id < size(); id++) {
+            size_t i = hash(get(id)) & mask;
+            while (slots[i] != 0) i = (i + 1) & mask;
+            slots[i] = id + 1;
+        }
+    }
+
+    uint32_t push(std::string_view value) {
+        if (chars.size() + value.size() > UINT32_MAX) {
+            throw std::length_error("StringArena exceeds 4 GiB");
+        }
+        chars.append(value.data(), value.size());
+        offsets.push_back(static_cast<uint32_t>(chars.size()));
+        return static_cast<uint32_t>(offsets.size() - 2);
+    }
+
+public:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    explicit StringArena(bool intern = false) : interned(intern) {}
+
+    // Store a string and return its id
+    uint32_t add(std::string_view value) {
+        if (!interned) {
+            return push(value);
+        }
+
+        // Keep the table at most half full
+        if ((size() + 1) * 2 > slots.size()) {
+            grow_slots();
+        }
+        size_t mask = slots.size() - 1;
+        size_t i = hash(value) & mask;
+        while (slots[i] != 0) {
+            if (get(slots[i] - 1) == value) {
+                return slots[i] - 1;
+            }
+            i = (i + 1) & mask;
+        }
+        uint32_t id = push(value);
+        slots[i] = id + 1;
+        return id;
+    }
+
+    // Build the intern table of an attached arena ahead of its first find(), which otherwise
+    // has to compare every string
+    void build_lookup() {
+        if (interned && slots.empty() && size() > 0) {
+            grow_slots();
+        }
+    }
+
+    // Id of a string that was added before, or npos. Only interned arenas can be searched.
+    // Doesn't modify the arena, so concurrent lookups are safe.
+    uint32_t find(std::string_view value) const {
+        if (!interned || size() == 0) {
+            return npos;
+        }
+        if (slots.empty()) {
+            for (uint32_t id = 0; id < size(); id++) {
+                if (get(id) == value) return id;
+            }
+            return npos;
+        }
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash(value) & mask; slots[i] != 0; i = (i + 1) & mask) {
+            if (get(slots[i] - 1) == value) {
+                return slots[i] - 1;
+            }
+        }
+        return npos;
+    }
+
+    std::string_view get(uint32_t id) const {
+        return std::string_view(chars.data() + offsets[id], offsets[id + 1] - offsets[id]);
+    }
+
+    size_t size() const {
+        return offsets.size() - 1;
+    }
+
+    bool is_interned() const {
+        return interned;
+    }
+
+    void clear() {
+        chars.clear();
+        offsets.assign(1, 0);
+        slots.clear();
+    }
+
+    size_t memory_usage() const {
+        return chars.memory_usage() + offsets.memory_usage() + slots.capacity() * sizeof(uint32_t);
+    }
+
+    void write(std::ostream& out) const {
+        binary_io::write_pod(out, static_cast<uint32_t>(interned));
+        binary_io::write_array(out, chars.data(), chars.size());
+        binary_io::write_array(out, offsets.data(), offsets.size());
+    }
+
+    // Borrow the arena contents from a mapped snapshot written by write()
+    void attach(binary_io::Cursor& in) {
+        interned = in.read_pod<uint32_t>() != 0;
+        size_t char_count = 0;
+        size_t offset_count = 0;
+        const char* char_data = in.read_array<char>(char_count);
+        const uint32_t* offset_data = in.read_array<uint32_t>(offset_count);
+        if (offset_count == 0 || offset_data[offset_count - 1] != char_count) {
+            throw std::runtime_error("Corrupt string arena");
+        }
+        chars.borrow(char_data, char_count);
+        offsets.borrow(offset_data, offset_count);
+        slots.clear();
+    }
+};
+
+// Column-oriented track metadata. Every CSV header becomes one contiguous column of string
+// ids backed by its own arena; low-cardinality columns (Artist, Album, Genres, Key, Camelot,
+// the numeric columns, ...) are interned so repeated values are stored once.
+class MetadataStore {
+private:
+    std::vector<std::string> headers;
+    std::vector<StringArena> arenas;
+    std::vector<CowVector<uint32_t>> columns;
+    size_t rows = 0;
+
+    // Columns that are unique per track, where interning would only cost memory
+    static bool is_unique_column(std::string_view header) {
+        return header == "#" || header == "Song" || header == "Spotify Track Id" || header == "ISRC";
+    }
+
+public:
+    // Lightweight view of a single track. Values are string_views into the store and stay
+    // valid until the store is modified.
+    class Row {
+    private:
+        const MetadataStore* store;
+        size_t row;
+
+    public:
+        Row(const MetadataStore* owner, size_t id) : store(owner), row(id) {}
+
+        size_t id() const {
+            return row;
+        }
+
+        std::string_view get(size_t column) const {
+            return store->value(row, column);
+        }
+
+        // Value of a column by header name, empty if the column doesn't exist
+        std::string_view operator[](std::string_view column) const {
+            return store->value(row, store->column_index(column));
+        }
+    };
+
+    // Set the column layout. Headers can only change while the store is empty.
+    void set_headers(const std::vector<std::string>& new_headers) {
+        if (rows > 0) {
+            if (new_headers != headers) {
+                throw std::runtime_error("CSV headers don't match the loaded metadata");
+            }
+            return;
+        }
+        headers = new_headers;
+        arenas.clear();
+        columns.assign(headers.size(), {});
+        for (const std::string& header : headers) {
+            arenas.emplace_back(!is_unique_column(header));
+        }
+    }
+
+    // Append a row. Missing trailing fields are stored as empty strings; extra fields are ignored.
+    void append(const std::vector<std::string_view>& fields) {
+        for (size_t i = 0; i < columns.size(); i++) {
+            columns[i].push_back(arenas[i].add(i < fields.size() ? fields[i] : std::string_view()));
+        }
+        rows++;
+    }
+
+    // Replace the values of an existing row. Strings of the old values stay in the arenas
+    // until the store is rebuilt.
+    void set_row(size_t row, const std::vector<std::string_view>& fields) {
+        for (size_t i = 0; i < columns.size(); i++) {
+            columns[i].set(row, arenas[i].add(i < fields.size() ? fields[i] : std::string_view()));
+        }
+    }
+
+    void clear() {
+        for (size_t i = 0; i < columns.size(); i++) {
+            columns[i].clear();
+            arenas[i].clear();
+        }
+        rows = 0;
+    }
+
+    void reserve(size_t count) {
+        for (auto& column : columns) {
+            column.reserve(count);
+        }
+    }
+
+    size_t size() const {
+        return rows;
+    }
+
+    bool empty() const {
+        return rows == 0;
+    }
+
+    const std::vector<std::string>& get_headers() const {
+        return headers;
+    }
+
+    // Position of a column, or npos when the export does not contain it
+    size_t column_index(std::string_view name) const {
+        for (size_t i = 0; i < headers.size(); i++) {
+            if (headers[i] == name) return i;
+        }
+        return std::string::npos;
+    }
+
+    std::string_view value(size_t row, size_t column) const {
+        if (column >= columns.size()) return std::string_view();
+        return arenas[column].get(columns[column][row]);
+    }
+
+    // Interned id of a value, comparable across rows of the same column
+    uint32_t value_id(size_t row, size_t column) const {
+        return columns[column][row];
+    }
+
+    const StringArena& column_values(size_t column) const {
+        return arenas[column];
+    }
+
+    Row row(size_t id) const {
+        return Row(this, id);
+    }
+
+    size_t memory_usage() const {
+        size_t total = 0;
+        for (size_t i = 0; i < columns.size(); i++) {
+            total += columns[i].memory_usage() + arenas[i].memory_usage();
+        }
+        return total;
+    }
+
+    void write(std::ostream& out) const {
+        binary_io::write_pod(out, static_cast<uint64_t>(rows));
+        binary_io::write_pod(out, static_cast<uint64_t>(headers.size()));
+        for (size_t i = 0; i < headers.size(); i++) {
+            binary_io::write_string(out, headers[i]);
+            arenas[i].write(out);
+            binary_io::write_array(out, columns[i].data(), columns[i].size());
+        }
+    }
+
+    // Borrow all columns from a mapped snapshot written by write(). The mapping must
+    // outlive the store or the next modification.
+    void attach(binary_io::Cursor& in) {
+        size_t row_count = static_cast<size_t>(in.read_pod<uint64_t>());
+        size_t column_count = static_cast<size_t>(in.read_pod<uint64_t>());
+
+        std::vector<std::string> new_headers;
+        std::vector<StringArena> new_arenas(column_count);
+        std::vector<CowVector<uint32_t>> new_columns(column_count);
+        for (size_t i = 0; i < column_count; i++) {
+            new_headers.emplace_back(in.read_string());
+            new_arenas[i].attach(in);
+            size_t count = 0;
+            const uint32_t* ids = in.read_array<uint32_t>(count);
+            if (count != row_count) {
+                throw std::runtime_error("Corrupt metadata column: " + new_headers.back());
+            }
+            for (size_t row = 0; row < count; row++) {
+                if (ids[row] >= new_arenas[i].size()) {
+                    throw std::runtime_error("Corrupt metadata column: " + new_headers.back());
+                }
+            }
+            new_columns[i].borrow(ids, count);
+        }
+
+        headers = std::move(new_headers);
+        arenas = std::move(new_arenas);
+        columns = std::move(new_columns);
+        rows = row_count;
+    }
+};
@@ -0,0 +1,309 @@
+#pragma once
+
+#include "hnswlib_csv_to_db.h"
+#include "cow_vector.h"
+#include "binary_io.h"
+#include "csv_reader.h"
+#include "thread_pool.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+// The K nearest tracks of every track, precomputed so that "tracks like the one that just
+// played" is a memory read instead of a graph search. Rows have a fixed stride of K slots
+// (labels and distances, closest first, plus a count), so track t's row is found without an
+// offset table and can be rewritten in place.
+//
+// The graph remembers the content hash of every track it computed a row for, plus a hash of
+// the vector space, so update() can tell what changed since: only new and edited tracks, and
+// the tracks whose lists pointed at edited or removed ones, are searched again. New tracks
+// are also offered to their neighbours' lists, since nearness is symmetric.
+//
+// File layout (native endian, arrays 8-byte aligned so they are used in place once mapped):
+//   magic "BSHFNBRS", version, k, space hash, row hashes, counts, labels, distances
+class NeighborGraph {
+public:
+    static constexpr char MAGIC[8] = {'B', 'S', 'H', 'F', 'N', 'B', 'R', 'S'};
+    static constexpr uint32_t VERSION = 1;
+
+    // Neighbours of one track, closest first
+    struct Neighbors {
+        const uint32_t* labels = nullptr;
+        const float* distances = nullptr;
+        size_t count = 0;
+    };
+
+    // Work done by update()
+    struct UpdateStats {
+        bool rebuilt = false;    // everything was recomputed
+        size_t searched = 0;     // rows recomputed with a search
+        size_t inserted = 0;     // new tracks added to existing rows
+        size_t removed = 0;      // rows dropped for removed tracks
+        double seconds = 0.0;
+    };
+
+private:
+    // Row hash of a track without a row (removed, or never computed)
+    static constexpr uint64_t NO_ROW = 0;
+
+    size_t k = 0;
+    uint64_t space = 0;
+    CowVector<uint64_t> row_hashes;
+    CowVector<uint32_t> counts;
+    CowVector<uint32_t> labels;
+    CowVector<float> distances;
+    std::shared_ptr<MappedFile> file;
+
+    // Rows a search worker claims at a time
+    static constexpr size_t BUILD_GRAIN = 32;
+
+    void resize(size_t tracks) {
+        row_hashes.resize(tracks, NO_ROW);
+        counts.resize(tracks, 0);
+        labels.resize(tracks * k, 0);
+        distances.resize(tracks * k, 0.0f);
+    }
+
+    // Insert a neighbour into a row, keeping it sorted and at most k long
+    bool offer(size_t track, uint32_t neighbor, float distance) {
+        uint32_t count = counts[track];
+        uint32_t* row_labels = labels.mutable_data() + track * k;
+        float* row_distances = distances.mutable_data() + track * k;
+        if (count == k && distance >= row_distances[k - 1]) return false;
+        for (uint32_t i = 0; i < count; i++) {
+            if (row_labels[i] == neighbor) return false;
+        }
+
+        size_t slot = std::min<size_t>(count, k - 1);
+        while (slot > 0 && row_distances[slot - 1] > distance) {
+            row_labels[slot] = row_labels[slot - 1];
+            row_distances[slot] = row_distances[slot - 1];
+            slot--;
+        }
+        row_labels[slot] = neighbor;
+        row_distances[slot] = distance;
+        if (count < k) counts.set(track, count + 1);
+        return true;
+    }
+
+public:
+    // Neighbours stored for a track; empty for removed tracks and ids the graph hasn't seen
+    Neighbors neighbors(size_t track) const {
+        Neighbors result;
+        if (track < counts.size()) {
+            result.labels = labels.data() + track * k;
+            result.distances = distances.data() + track * k;
+            result.count = counts[track];
+        }
+        return result;
+    }
+
+    size_t size() const {
+        return counts.size();
+    }
+
+    size_t get_k() const {
+        return k;
+    }
+
+    size_t memory_usage() const {
+        return row_hashes.memory_usage() + counts.memory_usage() + labels.memory_usage() + distances.memory_usage();
+    }
+
+    // Bring the graph in line with the library, computing k neighbours per track. Rows are
+    // searched in parallel on num_threads workers (0 = one per core) through the library's
+    // active backend, so an HNSW library gives approximate lists (raise set_ef for better ones).
+    // A different k or vector space (metric, weights, scaling, format) recomputes everything.
+    UpdateStats update(const HNSWVectorDB& db, size_t neighbors_per_track, size_t num_threads = 0) {
+        if (neighbors_per_track == 0) {
+            throw std::invalid_argument("NeighborGraph needs at least one neighbour per track");
+        }
+        auto start = std::chrono::steady_clock::now();
+        UpdateStats stats;
+        size_t tracks = db.size();
+
+        uint64_t db_space = db.space_hash();
+        if (neighbors_per_track != k || db_space != space) {
+            k = neighbors_per_track;
+            space = db_space;
+            row_hashes.clear();
+            counts.clear();
+            labels.clear();
+            distances.clear();
+            stats.rebuilt = true;
+        }
+        size_t known = std::min(row_hashes.size(), tracks);
+        if (row_hashes.size() != tracks) {
+            resize(tracks);
+        }
+
+        // Tracks to search again: new and edited ones, and those whose row pointed at an
+        // edited or removed track. stale marks the tracks that moved or went away.
+        std::vector<uint8_t> search(tracks, 0);
+        std::vector<uint8_t> stale(tracks, 0);
+        for (size_t t = 0; t < tracks; t++) {
+            bool live = !db.is_deleted(t);
+            uint64_t hash = live ? db.track_hash(t) : NO_ROW;
+            if (row_hashes[t] == hash) continue;
+            if (t < known && row_hashes[t] != NO_ROW) stale[t] = 1;
+            if (live) {
+                search[t] = 1;
+            } else {
+                counts.set(t, 0);
+                row_hashes.set(t, NO_ROW);
+                stats.removed++;
+            }
+        }
+        for (size_t t = 0; t < known; t++) {
+            if (search[t] || row_hashes[t] == NO_ROW) continue;
+            Neighbors row = neighbors(t);
+            for (size_t i = 0; i < row.count; i++) {
+                if (row.labels[i] >= tracks || stale[row.labels[i]]) {
+                    search[t] = 1;
+                    break;
+                }
+            }
+        }
+
+        std::vector<uint32_t> pending;
+        for (size_t t = 0; t < tracks; t++) {
+            if (search[t]) pending.push_back(static_cast<uint32_t>(t));
+        }
+
+        stats.searched = pending.size();
+        if (pending.empty()) {
+            // Nothing to search; a mapped graph stays borrowed
+            stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return stats;
+        }
+
+        // Searches only read the library; every worker writes its own rows
+        uint32_t* label_data = labels.mutable_data();
+        float* distance_data = distances.mutable_data();
+        uint32_t* count_data = counts.mutable_data();
+        ThreadPool pool(num_threads);
+        std::vector<std::vector<float>> vectors(pool.size(), std::vector<float>(db.vector_size()));
+        std::vector<std::vector<std::pair<size_t, float>>> results(pool.size());
+        pool.parallel_for(pending.size(), BUILD_GRAIN, [&](size_t begin, size_t end, size_t worker) {
+            for (size_t i = begin; i < end; i++) {
+                size_t track = pending[i];
+                db.get_vector(track, vectors[worker].data());
+                db.search_vector(vectors[worker].data(), k + 1, results[worker]);
+
+                uint32_t count = 0;
+                for (const auto& result : results[worker]) {
+                    if (result.first == track || count == k) continue;
+                    label_data[track * k + count] = static_cast<uint32_t>(result.first);
+                    distance_data[track * k + count] = result.second;
+                    count++;
+                }
+                count_data[track] = count;
+            }
+        });
+
+        // Offer new and edited tracks to the rows of their neighbours that weren't searched
+        for (uint32_t track : pending) {
+            row_hashes.set(track, db.track_hash(track));
+            if (stats.rebuilt) continue;
+            Neighbors row = neighbors(track);
+            for (size_t i = 0; i < row.count; i++) {
+                uint32_t neighbor = row.labels[i];
+                if (!search[neighbor] && offer(neighbor, track, row.distances[i])) {
+                    stats.inserted++;
+                }
+            }
+        }
+
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+
+    // Write the graph to path, through a temporary file renamed into place
+    void save(const std::string& path) const {
+        std::string temp_path = path + ".tmp";
+        {
+            std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+            if (!out.is_open()) {
+                throw std::runtime_error("Could not write neighbour graph: " + temp_path);
+            }
+            out.write(MAGIC, sizeof(MAGIC));
+            binary_io::write_pod(out, VERSION);
+            binary_io::write_pod(out, static_cast<uint32_t>(k));
+            binary_io::write_pod(out, space);
+            binary_io::write_array(out, row_hashes.data(), row_hashes.size());
+            binary_io::write_array(out, counts.data(), counts.size());
+            binary_io::write_array(out, labels.data(), labels.size());
+            binary_io::write_array(out, distances.data(), distances.size());
+            out.close();
+            if (!out) {
+                throw std::runtime_error("Could not write neighbour graph: " + temp_path);
+            }
+        }
+        std::filesystem::rename(temp_path, path);
+    }
+
+    // Map a graph written by save(). Rows are read in place from the mapping until update()
+    // changes them. Returns false if the file is missing or was written by another version.
+    bool load(const std::string& path) {
+        std::error_code error;
+        if (!std::filesystem::exists(path, error)) {
+            return false;
+        }
+        auto mapped = std::make_shared<MappedFile>(path, false);
+        binary_io::Cursor in(mapped->data(), mapped->size());
+        char magic[sizeof(MAGIC)];
+        for (char& c : magic) c = in.read_pod<char>();
+        if (std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || in.read_pod<uint32_t>() != VERSION) {
+            return false;
+        }
+        size_t loaded_k = in.read_pod<uint32_t>();
+        uint64_t loaded_space = in.read_pod<uint64_t>();
+        size_t hash_count = 0;
+        size_t count_count = 0;
+        size_t label_count = 0;
+        size_t distance_count = 0;
+        const uint64_t* hash_data = in.read_array<uint64_t>(hash_count);
+        const uint32_t* count_data = in.read_array<uint32_t>(count_count);
+        const uint32_t* label_data = in.read_array<uint32_t>(label_count);
+        const float* distance_data = in.read_array<float>(distance_count);
+        if (count_count != hash_count || label_count != hash_count * loaded_k || distance_count != label_count) {
+            throw std::runtime_error("Corrupt neighbour graph");
+        }
+        for (size_t t = 0; t < count_count; t++) {
+            if (count_data[t] > loaded_k) {
+                throw std::runtime_error("Corrupt neighbour graph");
+            }
+        }
+
+        k = loaded_k;
+        space = loaded_space;
+        row_hashes.borrow(hash_data, hash_count);
+        counts.borrow(count_data, count_count);
+        labels.borrow(label_data, label_count);
+        distances.borrow(distance_data, distance_count);
+        file = std::move(mapped);
+        return true;
+    }
+
+    // Load the graph saved next to a library, update it for the library's current tracks and
+    // save it again if anything changed. A missing or unreadable file is rebuilt.
+    UpdateStats open(const std::string& path, const HNSWVectorDB& db, size_t neighbors_per_track, size_t num_threads = 0) {
+        try {
+            load(path);
+        } catch (const std::exception&) {
+            // Corrupt file; rebuild below
+        }
+        UpdateStats stats = update(db, neighbors_per_track, num_threads);
+        if (stats.rebuilt || stats.searched > 0 || stats.removed > 0) {
+            save(path);
+        }
+        return stats;
+    }
+};
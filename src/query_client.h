@@ -0,0 +1,162 @@
+#pragma once
+
+#ifndef _WIN32
+
+#include "query_protocol.h"
+#include <vector>
+#include <string>
+#include <utility>
+#include <stdexcept>
+#include <unistd.h>
+
+// Client of the query daemon (see query_protocol.h). The blocking calls send one request
+// and wait for its answer, throwing on an error status. For pipelining, send_* queue a
+// request without waiting and receive() returns answers as they arrive; don't mix the two
+// while requests are in flight. Not thread-safe: use one client per thread.
+class QueryClient {
+public:
+    // An answer as received; payload points into the client's buffer until the next receive()
+    struct Response {
+        uint32_t request_id = 0;
+        query_protocol::Status status = query_protocol::Status::OK;
+        query_protocol::MessageReader payload;
+    };
+
+    struct ServerInfo {
+        uint32_t tracks = 0;
+        uint32_t dimension = 0;
+        uint64_t generation = 0;
+    };
+
+private:
+    int fd;
+    query_protocol::FrameReader frames;
+    uint32_t next_request = 1;
+    std::string out;
+
+    uint32_t send(query_protocol::Request type, const std::vector<float>* floats, uint32_t number, uint16_t small) {
+        using query_protocol::Request;
+        out.clear();
+        query_protocol::MessageWriter writer(out);
+        uint32_t request_id = next_request++;
+        writer.begin(request_id, static_cast<uint8_t>(type));
+        if (type == Request::SEARCH) {
+            writer.put_u16(small);
+        } else if (type == Request::NEXT || type == Request::METADATA) {
+            writer.put_u32(number);
+        }
+        if (floats) {
+            writer.put_u16(static_cast<uint16_t>(floats->size()));
+            for (float value : *floats) writer.put_f32(value);
+        }
+        writer.end();
+        if (!query_protocol::write_all(fd, out.data(), out.size())) {
+            throw std::runtime_error("Lost the connection to the server");
+        }
+        return request_id;
+    }
+
+    // Wait for the answer to a request and check its status
+    query_protocol::MessageReader expect(uint32_t request_id) {
+        Response response;
+        do {
+            response = receive();
+        } while (response.request_id != request_id);
+        if (response.status != query_protocol::Status::OK) {
+            throw std::runtime_error("Server error: " + std::string(response.payload.string()));
+        }
+        return response.payload;
+    }
+
+public:
+    explicit QueryClient(const std::string& socket_path = query_protocol::default_socket_path())
+        : fd(query_protocol::connect_socket(socket_path)), frames(fd) {}
+
+    ~QueryClient() {
+        close(fd);
+    }
+
+    QueryClient(const QueryClient&) = delete;
+    QueryClient& operator=(const QueryClient&) = delete;
+
+    uint32_t send_ping() {
+        return send(query_protocol::Request::PING, nullptr, 0, 0);
+    }
+
+    uint32_t send_search(const std::vector<float>& features, size_t k) {
+        return send(query_protocol::Request::SEARCH, &features, 0, static_cast<uint16_t>(k));
+    }
+
+    // An empty mood continues the session
+    uint32_t send_next(uint32_t session, const std::vector<float>& mood = {}) {
+        return send(query_protocol::Request::NEXT, &mood, session, 0);
+    }
+
+    uint32_t send_metadata(uint32_t id) {
+        return send(query_protocol::Request::METADATA, nullptr, id, 0);
+    }
+
+    uint32_t send_reload() {
+        return send(query_protocol::Request::RELOAD, nullptr, 0, 0);
+    }
+
+    // Next answer from the server, whichever request it belongs to
+    Response receive() {
+        query_protocol::Frame frame;
+        if (!frames.next(frame)) {
+            throw std::runtime_error("The server closed the connection");
+        }
+        Response response;
+        response.request_id = frame.request_id;
+        response.status = static_cast<query_protocol::Status>(frame.type);
+        response.payload = frame.payload;
+        return response;
+    }
+
+    ServerInfo ping() {
+        query_protocol::MessageReader in = expect(send_ping());
+        ServerInfo info;
+        info.tracks = in.u32();
+        info.dimension = in.u32();
+        info.generation = in.u64();
+        return info;
+    }
+
+    // The k nearest tracks to raw feature values, closest first, as (id, distance)
+    std::vector<std::pair<uint32_t, float>> search(const std::vector<float>& features, size_t k) {
+        query_protocol::MessageReader in = expect(send_search(features, k));
+        std::vector<std::pair<uint32_t, float>> results(in.u16());
+        for (auto& result : results) {
+            result.first = in.u32();
+            result.second = in.f32();
+        }
+        return results;
+    }
+
+    // Next track of a shuffle session, or query_protocol::NO_TRACK
+    uint32_t next(uint32_t session, const std::vector<float>& mood = {}) {
+        return expect(send_next(session, mood)).u32();
+    }
+
+    // (column, value) pairs of a track
+    std::vector<std::pair<std::string, std::string>> metadata(uint32_t id) {
+        query_protocol::MessageReader in = expect(send_metadata(id));
+        std::vector<std::pair<std::string, std::string>> fields(in.u16());
+        for (auto& field : fields) {
+            field.first = std::string(in.string());
+            field.second = std::string(in.string());
+        }
+        return fields;
+    }
+
+    // Have the server refresh its library; returns the new generation and track count
+    ServerInfo reload() {
+        query_protocol::MessageReader in = expect(send_reload());
+        ServerInfo info;
+        info.generation = in.u64();
+        info.tracks = in.u32();
+        return info;
+    }
+};
+
+#endif
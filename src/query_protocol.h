@@ -0,0 +1,331 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+// Wire format of the query daemon (better-shuffle serve). Every message is a frame:
+//
+//   u32 size        bytes after this field
+//   u32 request id  chosen by the client, echoed in the response
+//   u8  type        Request in requests, Status in responses
+//   ...             payload
+//
+// Integers and floats are little-endian; strings are a u16 length and the bytes. Clients
+// may pipeline requests; responses to searches can overtake each other, so they are matched
+// by request id rather than order.
+//
+// Payloads (request -> OK response):
+//   PING                                      -> u32 tracks, u32 dimension, u64 generation
+//   SEARCH   u16 k, u16 n, f32 features[n]    -> u16 count, count x (u32 id, f32 distance), closest first
+//   NEXT     u32 session, u16 n, f32 mood[n]  -> u32 id, NO_TRACK once every track was played
+//            (a mood starts the session over; n = 0 continues it)
+//   METADATA u32 id                           -> u16 count, count x (str column, str value)
+//   RELOAD                                    -> u64 generation, u32 tracks
+// Any other status carries a message string.
+namespace query_protocol {
+
+enum class Request : uint8_t {
+    PING = 0,
+    SEARCH = 1,
+    NEXT = 2,
+    METADATA = 3,
+    RELOAD = 4,
+};
+
+enum class Status : uint8_t {
+    OK = 0,
+    BAD_REQUEST = 1,
+    NOT_FOUND = 2,
+    FAILED = 3,
+};
+
+constexpr size_t HEADER_SIZE = 9;
+constexpr size_t MAX_FRAME_SIZE = 1 << 20;
+constexpr uint16_t MAX_K = 1024;
+constexpr uint32_t NO_TRACK = UINT32_MAX;
+
+// Socket of the daemon: $XDG_RUNTIME_DIR/better-shuffle.sock, or one per user in /tmp
+inline std::string default_socket_path() {
+    const char* runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && *runtime_dir) {
+        return std::string(runtime_dir) + "/better-shuffle.sock";
+    }
+#ifndef _WIN32
+    return "/tmp/better-shuffle-" + std::to_string(getuid()) + ".sock";
+#else
+    return "better-shuffle.sock";
+#endif
+}
+
+// Appends frames to a buffer; several frames can be collected and sent at once
+class MessageWriter {
+private:
+    std::string& out;
+    size_t frame_start = 0;
+
+public:
+    explicit MessageWriter(std::string& buffer) : out(buffer) {}
+
+    void begin(uint32_t request_id, uint8_t type) {
+        frame_start = out.size();
+        put_u32(0);
+        put_u32(request_id);
+        put_u8(type);
+    }
+
+    // Patch the size of the frame started by begin()
+    void end() {
+        uint32_t size = static_cast<uint32_t>(out.size() - frame_start - sizeof(uint32_t));
+        for (size_t i = 0; i < sizeof(uint32_t); i++) {
+            out[frame_start + i] = static_cast<char>((size >> (8 * i)) & 0xFF);
+        }
+    }
+
+    void put_u8(uint8_t value) {
+        out.push_back(static_cast<char>(value));
+    }
+
+    void put_u16(uint16_t value) {
+        put_u8(static_cast<uint8_t>(value));
+        put_u8(static_cast<uint8_t>(value >> 8));
+    }
+
+    void put_u32(uint32_t value) {
+        for (int i = 0; i < 4; i++) put_u8(static_cast<uint8_t>(value >> (8 * i)));
+    }
+
+    void put_u64(uint64_t value) {
+        for (int i = 0; i < 8; i++) put_u8(static_cast<uint8_t>(value >> (8 * i)));
+    }
+
+    void put_f32(float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        put_u32(bits);
+    }
+
+    // Strings longer than 64 KiB are cut
+    void put_string(std::string_view value) {
+        size_t size = std::min<size_t>(value.size(), UINT16_MAX);
+        put_u16(static_cast<uint16_t>(size));
+        out.append(value.data(), size);
+    }
+};
+
+// Bounds-checked reader over a frame's payload
+class MessageReader {
+private:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+    size_t pos = 0;
+
+    void require(size_t bytes) const {
+        if (bytes > size - pos) {
+            throw std::runtime_error("Truncated message");
+        }
+    }
+
+public:
+    MessageReader() = default;
+    MessageReader(const char* bytes, size_t length) : data(reinterpret_cast<const unsigned char*>(bytes)), size(length) {}
+
+    uint8_t u8() {
+        require(1);
+        return data[pos++];
+    }
+
+    uint16_t u16() {
+        require(2);
+        uint16_t value = static_cast<uint16_t>(data[pos] | (data[pos + 1] << 8));
+        pos += 2;
+        return value;
+    }
+
+    uint32_t u32() {
+        require(4);
+        uint32_t value = 0;
+        for (int i = 3; i >= 0; i--) value = (value << 8) | data[pos + i];
+        pos += 4;
+        return value;
+    }
+
+    uint64_t u64() {
+        uint64_t low = u32();
+        return low | (static_cast<uint64_t>(u32()) << 32);
+    }
+
+    float f32() {
+        uint32_t bits = u32();
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    std::string_view string() {
+        size_t length = u16();
+        require(length);
+        std::string_view value(reinterpret_cast<const char*>(data + pos), length);
+        pos += length;
+        return value;
+    }
+
+    std::vector<float> floats(size_t count) {
+        require(count * sizeof(float));
+        std::vector<float> values(count);
+        for (float& value : values) value = f32();
+        return values;
+    }
+
+    size_t remaining() const {
+        return size - pos;
+    }
+};
+
+// A received frame; the payload points into the FrameReader's buffer until its next call
+struct Frame {
+    uint32_t request_id = 0;
+    uint8_t type = 0;
+    MessageReader payload;
+};
+
+#ifndef _WIN32
+
+// Reads frames from a stream socket, as many per recv() as have arrived
+class FrameReader {
+private:
+    int fd;
+    std::vector<char> buffer;
+    size_t begin = 0;
+    size_t end = 0;
+
+public:
+    explicit FrameReader(int socket_fd) : fd(socket_fd), buffer(64 * 1024) {}
+
+    // Blocks until a whole frame is buffered. Returns false when the peer closed the
+    // connection; throws on a read error or a frame over MAX_FRAME_SIZE.
+    bool next(Frame& frame) {
+        while (true) {
+            size_t available = end - begin;
+            if (available >= sizeof(uint32_t)) {
+                MessageReader header(buffer.data() + begin, available);
+                size_t size = header.u32();
+                if (size < HEADER_SIZE - sizeof(uint32_t) || size > MAX_FRAME_SIZE) {
+                    throw std::runtime_error("Invalid frame size");
+                }
+                size_t total = sizeof(uint32_t) + size;
+                if (available >= total) {
+                    frame.request_id = header.u32();
+                    frame.type = header.u8();
+                    frame.payload = MessageReader(buffer.data() + begin + HEADER_SIZE, total - HEADER_SIZE);
+                    begin += total;
+                    return true;
+                }
+                if (buffer.size() < total) {
+                    buffer.resize(total);
+                }
+            }
+
+            // Move the partial frame to the front and read more behind it
+            if (begin > 0) {
+                std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+                end -= begin;
+                begin = 0;
+            }
+            ssize_t received = recv(fd, buffer.data() + end, buffer.size() - end, 0);
+            if (received == 0) {
+                return false;
+            }
+            if (received < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("Socket read failed: ") + std::strerror(errno));
+            }
+            end += static_cast<size_t>(received);
+        }
+    }
+};
+
+// Send all of data; false if the peer is gone
+inline bool write_all(int fd, const char* data, size_t size) {
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, flags);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+inline sockaddr_un socket_address(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("Socket path too long: " + path);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+inline int connect_socket(const std::string& path) {
+    sockaddr_un address = socket_address(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Could not create socket: ") + std::strerror(errno));
+    }
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        int error = errno;
+        close(fd);
+        throw std::runtime_error("Could not connect to " + path + ": " + std::strerror(error));
+    }
+    return fd;
+}
+
+// Bind and listen on path. A socket file left behind by a daemon that is no longer
+// running is replaced; one with a live daemon behind it is an error.
+inline int listen_socket(const std::string& path) {
+    sockaddr_un address = socket_address(path);
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0) {
+        bool live = connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+        close(probe);
+        if (live) {
+            throw std::runtime_error("Another server is listening on " + path);
+        }
+    }
+    unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Could not create socket: ") + std::strerror(errno));
+    }
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        int error = errno;
+        close(fd);
+        throw std::runtime_error("Could not listen on " + path + ": " + std::strerror(error));
+    }
+    return fd;
+}
+
+#endif
+
+}  // namespace query_protocol
@@ -0,0 +1,514 @@
+#pragma once
+
+#ifndef _WIN32
+
+#include "live_library.h"
+#include "shuffle_queue.h"
+#include "query_protocol.h"
+#include "bounded_queue.h"
+#include "thread_pool.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct QueryServerOptions {
+    std::string socket_path = query_protocol::default_socket_path();
+    // Searches answered by one batch at most
+    size_t max_batch = 64;
+    // How long a batch waits for more searches after its first one. 0 batches whatever
+    // queued up while the previous batch ran, so a lone request never waits.
+    std::chrono::microseconds batch_window{0};
+    // Workers searching a batch (0 = one per core)
+    size_t search_threads = 0;
+    // Searches queued at most; connections wait while the queue is full
+    size_t queue_capacity = 4096;
+    // Sessions not asked for a track this long are dropped, along with the library version
+    // they hold on to
+    std::chrono::seconds session_idle_timeout{30 * 60};
+    // Sessions kept at most; starting another drops the one that was idle longest
+    size_t max_sessions = 1024;
+    // Export that RELOAD refreshes the library from. Empty: RELOAD loads the snapshot as it
+    // is on disk, e.g. after `better-shuffle analyze` rewrote it.
+    std::string csv_path;
+};
+
+// Counters since the server started
+struct QueryServerStats {
+    uint64_t connections = 0;
+    uint64_t requests = 0;
+    uint64_t searches = 0;
+    uint64_t batches = 0;
+    uint64_t largest_batch = 0;
+};
+
+// Resident query daemon over a Unix domain socket (see query_protocol.h for the wire
+// format). Every connection gets a thread that decodes its requests and answers metadata
+// and next-track requests itself. Searches are queued for a single batcher thread that takes
+// them in micro-batches and spreads each batch over a worker pool, then writes every
+// connection's answers from the batch in one send.
+//
+// The library is served through a LiveLibrary, so RELOAD swaps in a refreshed version while
+// the other connections keep searching. Shuffle sessions are named by the client and shared
+// by all connections, so a player can pick its session up again after reconnecting. A new
+// mood starts a session over on the current version; the next track after a reload carries
+// it over with its played tracks, so it doesn't keep the old version alive. Sessions idle
+// for session_idle_timeout are dropped, as is the idlest one when max_sessions is reached.
+class QueryServer {
+private:
+    struct Connection {
+        int fd;
+        std::mutex write_mutex;
+
+        explicit Connection(int socket_fd) : fd(socket_fd) {}
+
+        ~Connection() {
+            close(fd);
+        }
+
+        bool send(const std::string& data) {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            return query_protocol::write_all(fd, data.data(), data.size());
+        }
+    };
+
+    struct PendingSearch {
+        std::shared_ptr<Connection> connection;
+        uint32_t request_id = 0;
+        uint16_t k = 0;
+        std::vector<float> query;
+    };
+
+    struct Session {
+        std::mutex mutex;
+        LiveLibrary::Version version;
+        std::unique_ptr<ShuffleQueue> queue;
+        // Mood the session started from and the tracks played since, to replay on a newer version
+        std::vector<float> mood;
+        std::vector<uint32_t> played;
+        // Guarded by sessions_mutex
+        std::chrono::steady_clock::time_point last_used;
+    };
+
+    LiveLibrary& library;
+    QueryServerOptions options;
+    BoundedQueue<PendingSearch> searches;
+    ThreadPool pool;
+    std::atomic<bool> stopping{false};
+
+    // Shuffle sessions by id, shared by all connections so a player can reconnect
+    std::mutex sessions_mutex;
+    std::unordered_map<uint32_t, std::shared_ptr<Session>> sessions;
+
+    std::mutex connections_mutex;
+    std::condition_variable connections_closed;
+    std::vector<std::weak_ptr<Connection>> connections;
+    size_t active_connections = 0;
+
+    std::atomic<uint64_t> connection_count{0};
+    std::atomic<uint64_t> request_count{0};
+    std::atomic<uint64_t> search_count{0};
+    std::atomic<uint64_t> batch_count{0};
+    std::atomic<uint64_t> largest_batch{0};
+
+    // Batches smaller than this are searched on the batcher thread; waking the pool costs
+    // more than the searches
+    static constexpr size_t PARALLEL_BATCH_MIN = 4;
+    // How often the accept loop checks for stop()
+    static constexpr int ACCEPT_POLL_MS = 200;
+
+    static void error_response(query_protocol::MessageWriter& writer, uint32_t request_id, query_protocol::Status status,
+                               std::string_view message) {
+        writer.begin(request_id, static_cast<uint8_t>(status));
+        writer.put_string(message);
+        writer.end();
+    }
+
+    void run_batch(const HNSWVectorDB* db, std::vector<PendingSearch>& batch, std::vector<std::vector<std::pair<size_t, float>>>& results,
+                   std::vector<std::vector<float>>& scratch) {
+        using query_protocol::Status;
+        batch_count++;
+        search_count += batch.size();
+        uint64_t largest = largest_batch.load();
+        while (batch.size() > largest && !largest_batch.compare_exchange_weak(largest, batch.size())) {
+        }
+
+        if (results.size() < batch.size()) results.resize(batch.size());
+        if (db) {
+            auto search = [&](size_t begin, size_t end, size_t worker) {
+                float* vector = scratch[worker].data();
+                for (size_t i = begin; i < end; i++) {
+                    db->prepare_query(batch[i].query, vector);
+                    db->search_vector(vector, batch[i].k, results[i]);
+                }
+            };
+            if (batch.size() < PARALLEL_BATCH_MIN) {
+                search(0, batch.size(), 0);
+            } else {
+                pool.parallel_for(batch.size(), 1, search);
+            }
+        }
+
+        // One send per connection, in the order its searches were queued
+        std::unordered_map<Connection*, std::string> replies;
+        for (size_t i = 0; i < batch.size(); i++) {
+            std::string& out = replies[batch[i].connection.get()];
+            query_protocol::MessageWriter writer(out);
+            if (!db) {
+                error_response(writer, batch[i].request_id, Status::FAILED, "No library loaded");
+                continue;
+            }
+            writer.begin(batch[i].request_id, static_cast<uint8_t>(Status::OK));
+            writer.put_u16(static_cast<uint16_t>(results[i].size()));
+            for (const auto& result : results[i]) {
+                writer.put_u32(static_cast<uint32_t>(result.first));
+                writer.put_f32(result.second);
+            }
+            writer.end();
+        }
+        for (size_t i = 0; i < batch.size(); i++) {
+            auto reply = replies.find(batch[i].connection.get());
+            if (reply != replies.end()) {
+                batch[i].connection->send(reply->second);
+                replies.erase(reply);
+            }
+        }
+    }
+
+    void batch_loop() {
+        LiveLibrary::Reader reader(library);
+        std::vector<PendingSearch> batch;
+        std::vector<std::vector<std::pair<size_t, float>>> results;
+        std::vector<std::vector<float>> scratch(pool.size());
+        PendingSearch item;
+        while (searches.pop(item)) {
+            batch.push_back(std::move(item));
+            auto deadline = std::chrono::steady_clock::now() + options.batch_window;
+            while (batch.size() < options.max_batch && searches.pop_until(item, deadline)) {
+                batch.push_back(std::move(item));
+            }
+
+            const HNSWVectorDB* db = reader.get();
+            if (db) {
+                for (auto& vector : scratch) vector.resize(db->vector_size());
+            }
+            run_batch(db, batch, results, scratch);
+            // Don't keep closed connections open until the next batch
+            batch.clear();
+        }
+    }
+
+    // Start a session over with a mood on the current version. The session is left as it was
+    // if the queue can't be built.
+    void start(Session& session, const std::vector<float>& mood) {
+        LiveLibrary::Version version = library.acquire();
+        std::unique_ptr<ShuffleQueue> queue(new ShuffleQueue(*version, mood));
+        // The old queue goes before its version, which it refers to
+        session.queue = std::move(queue);
+        session.version = std::move(version);
+        session.mood = mood;
+        session.played.clear();
+    }
+
+    // Move a session to the current version if a reload replaced its own: start from its mood
+    // again and play its tracks once more, which drifts the mood the same way. Ids stay valid
+    // across refreshes; tracks the new version removed are forgotten.
+    void catch_up(Session& session) {
+        LiveLibrary::Version version = library.acquire();
+        if (version == session.version) {
+            return;
+        }
+        std::unique_ptr<ShuffleQueue> queue(new ShuffleQueue(*version, session.mood));
+        size_t kept = 0;
+        for (uint32_t id : session.played) {
+            if (id < version->size() && !version->is_deleted(id)) {
+                queue->mark_played(id);
+                session.played[kept++] = id;
+            }
+        }
+        session.played.resize(kept);
+        session.queue = std::move(queue);
+        session.version = std::move(version);
+    }
+
+    // Drop the sessions idle for longer than the timeout and, to make room for another,
+    // the idlest ones over the cap. Call with sessions_mutex held; the dropped sessions are
+    // moved to expired so they can be destroyed after it is released.
+    void expire_sessions(size_t room, std::vector<std::shared_ptr<Session>>& expired) {
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = sessions.begin(); it != sessions.end();) {
+            if (now - it->second->last_used > options.session_idle_timeout) {
+                expired.push_back(std::move(it->second));
+                it = sessions.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        size_t limit = std::max<size_t>(1, options.max_sessions);
+        while (!sessions.empty() && sessions.size() + room > limit) {
+            auto idlest = std::min_element(sessions.begin(), sessions.end(), [](const auto& a, const auto& b) {
+                return a.second->last_used < b.second->last_used;
+            });
+            expired.push_back(std::move(idlest->second));
+            sessions.erase(idlest);
+        }
+    }
+
+    // Answer one request into out; searches are queued for the batcher instead
+    void handle(const std::shared_ptr<Connection>& connection, query_protocol::Frame& frame, LiveLibrary::Reader& reader,
+                std::string& out) {
+        using query_protocol::Request;
+        using query_protocol::Status;
+        query_protocol::MessageWriter writer(out);
+        query_protocol::MessageReader& in = frame.payload;
+        request_count++;
+
+        const HNSWVectorDB* db = reader.get();
+        if (!db) {
+            error_response(writer, frame.request_id, Status::FAILED, "No library loaded");
+            return;
+        }
+
+        switch (static_cast<Request>(frame.type)) {
+        case Request::PING: {
+            writer.begin(frame.request_id, static_cast<uint8_t>(Status::OK));
+            writer.put_u32(static_cast<uint32_t>(db->size()));
+            writer.put_u32(static_cast<uint32_t>(db->dimension()));
+            writer.put_u64(library.generation());
+            writer.end();
+            return;
+        }
+        case Request::SEARCH: {
+            PendingSearch search;
+            search.connection = connection;
+            search.request_id = frame.request_id;
+            search.k = in.u16();
+            size_t count = in.u16();
+            if (search.k == 0 || search.k > query_protocol::MAX_K || count != db->dimension()) {
+                error_response(writer, frame.request_id, Status::BAD_REQUEST, "Search needs 1-1024 results and one value per feature");
+                return;
+            }
+            search.query = in.floats(count);
+            if (!searches.push(std::move(search))) {
+                error_response(writer, frame.request_id, Status::FAILED, "Server is shutting down");
+            }
+            return;
+        }
+        case Request::NEXT: {
+            uint32_t id = in.u32();
+            size_t count = in.u16();
+            if (count > 0 && count != db->dimension()) {
+                error_response(writer, frame.request_id, Status::BAD_REQUEST, "The mood needs one value per feature");
+                return;
+            }
+            std::vector<float> mood = in.floats(count);
+            std::shared_ptr<Session> session;
+            {
+                std::lock_guard<std::mutex> lock(sessions_mutex);
+                auto found = sessions.find(id);
+                if (found != sessions.end()) {
+                    session = found->second;
+                    session->last_used = std::chrono::steady_clock::now();
+                }
+            }
+            bool started = false;
+            std::vector<std::shared_ptr<Session>> expired;
+            if (!session && count > 0) {
+                // Give a new session its queue before other connections can see it
+                auto fresh = std::make_shared<Session>();
+                start(*fresh, mood);
+                std::lock_guard<std::mutex> lock(sessions_mutex);
+                auto found = sessions.find(id);
+                if (found == sessions.end()) {
+                    expire_sessions(1, expired);
+                    found = sessions.emplace(id, std::move(fresh)).first;
+                    started = true;
+                }
+                session = found->second;
+                session->last_used = std::chrono::steady_clock::now();
+            }
+            if (!session) {
+                error_response(writer, frame.request_id, Status::NOT_FOUND, "Unknown session; start it with a mood");
+                return;
+            }
+            std::lock_guard<std::mutex> lock(session->mutex);
+            if (count > 0 && !started) {
+                start(*session, mood);
+            } else if (count == 0) {
+                catch_up(*session);
+            }
+            size_t track = session->queue->next();
+            if (track != HNSWVectorDB::NO_RESULT) {
+                // After a repeat started the history over, only the tracks since count
+                if (session->played.size() >= session->queue->played_count()) {
+                    session->played.erase(session->played.begin(),
+                                          session->played.end() - (session->queue->played_count() - 1));
+                }
+                session->played.push_back(static_cast<uint32_t>(track));
+            }
+            writer.begin(frame.request_id, static_cast<uint8_t>(Status::OK));
+            writer.put_u32(track == HNSWVectorDB::NO_RESULT ? query_protocol::NO_TRACK : static_cast<uint32_t>(track));
+            writer.end();
+            return;
+        }
+        case Request::METADATA: {
+            uint32_t id = in.u32();
+            if (id >= db->size() || db->is_deleted(id)) {
+                error_response(writer, frame.request_id, Status::NOT_FOUND, "Unknown track");
+                return;
+            }
+            const std::vector<std::string>& headers = db->metadata_headers();
+            MetadataStore::Row row = db->get_metadata(id);
+            writer.begin(frame.request_id, static_cast<uint8_t>(Status::OK));
+            writer.put_u16(static_cast<uint16_t>(headers.size()));
+            for (size_t column = 0; column < headers.size(); column++) {
+                writer.put_string(headers[column]);
+                writer.put_string(row.get(column));
+            }
+            writer.end();
+            return;
+        }
+        case Request::RELOAD: {
+            if (options.csv_path.empty()) {
+                if (!library.reload()) {
+                    error_response(writer, frame.request_id, Status::FAILED, "Could not load the library snapshot");
+                    return;
+                }
+            } else {
+                // A missing or changed export, or a snapshot that can't be written, is the
+                // server's failure, not a bad request
+                try {
+                    library.update([&](HNSWVectorDB& next) { next.refresh_from_csv(options.csv_path); });
+                } catch (const std::exception& e) {
+                    error_response(writer, frame.request_id, Status::FAILED, std::string("Reload failed: ") + e.what());
+                    return;
+                }
+            }
+            LiveLibrary::Version current = library.acquire();
+            writer.begin(frame.request_id, static_cast<uint8_t>(Status::OK));
+            writer.put_u64(library.generation());
+            writer.put_u32(static_cast<uint32_t>(current->size()));
+            writer.end();
+            return;
+        }
+        }
+        error_response(writer, frame.request_id, Status::BAD_REQUEST, "Unknown request type");
+    }
+
+    void serve_connection(const std::shared_ptr<Connection>& connection) {
+        // Everything the connection holds is released before run() is told it is gone
+        {
+            LiveLibrary::Reader reader(library);
+            query_protocol::FrameReader frames(connection->fd);
+            query_protocol::Frame frame;
+            std::string out;
+            try {
+                while (frames.next(frame)) {
+                    out.clear();
+                    try {
+                        handle(connection, frame, reader, out);
+                    } catch (const std::exception& e) {
+                        // Malformed payload; the connection stays usable
+                        out.clear();
+                        query_protocol::MessageWriter writer(out);
+                        error_response(writer, frame.request_id, query_protocol::Status::BAD_REQUEST, e.what());
+                    }
+                    if (!out.empty() && !connection->send(out)) {
+                        break;
+                    }
+                }
+            } catch (const std::exception&) {
+                // Broken framing or a read error; drop the connection
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        active_connections--;
+        connections_closed.notify_all();
+    }
+
+public:
+    QueryServer(LiveLibrary& live, QueryServerOptions server_options = QueryServerOptions())
+        : library(live), options(std::move(server_options)), searches(options.queue_capacity), pool(options.search_threads) {
+        options.max_batch = std::max<size_t>(1, options.max_batch);
+    }
+
+    QueryServer(const QueryServer&) = delete;
+    QueryServer& operator=(const QueryServer&) = delete;
+
+    // Listen and serve until stop(). Throws if the socket can't be opened.
+    void run() {
+        int listener = query_protocol::listen_socket(options.socket_path);
+        std::thread batcher([this] { batch_loop(); });
+
+        while (!stopping) {
+            {
+                std::vector<std::shared_ptr<Session>> expired;
+                std::lock_guard<std::mutex> lock(sessions_mutex);
+                expire_sessions(0, expired);
+            }
+            pollfd ready{listener, POLLIN, 0};
+            if (poll(&ready, 1, ACCEPT_POLL_MS) <= 0 || !(ready.revents & POLLIN)) {
+                continue;
+            }
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) {
+                continue;
+            }
+            auto connection = std::make_shared<Connection>(fd);
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                                 [](const std::weak_ptr<Connection>& c) { return c.expired(); }),
+                                  connections.end());
+                connections.push_back(connection);
+                active_connections++;
+            }
+            connection_count++;
+            std::thread([this, connection] { serve_connection(connection); }).detach();
+        }
+
+        close(listener);
+        unlink(options.socket_path.c_str());
+
+        // Unblock the connection threads, then let the batcher drain what they queued
+        std::unique_lock<std::mutex> lock(connections_mutex);
+        for (const auto& weak : connections) {
+            if (auto connection = weak.lock()) shutdown(connection->fd, SHUT_RDWR);
+        }
+        connections_closed.wait(lock, [this] { return active_connections == 0; });
+        lock.unlock();
+        searches.close();
+        batcher.join();
+    }
+
+    // Ask run() to return. Only sets a flag, so it is safe to call from a signal handler.
+    void stop() {
+        stopping.store(true);
+    }
+
+    QueryServerStats stats() const {
+        QueryServerStats result;
+        result.connections = connection_count;
+        result.requests = request_count;
+        result.searches = search_count;
+        result.batches = batch_count;
+        result.largest_batch = largest_batch;
+        return result;
+    }
+
+    const QueryServerOptions& get_options() const {
+        return options;
+    }
+};
+
+#endif
@@ -0,0 +1,551 @@
+#pragma once
+
+#include "hnswlib_csv_to_db.h"
+#include "csv_reader.h"
+#include "csv_dedup.h"
+#include "track_manifest.h"
+#include "thread_pool.h"
+#include "binary_io.h"
+#include "hash.h"
+#include <vector>
+#include <string>
+#include <string_view>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <functional>
+#include <random>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+// How ShardedLibrary assigns tracks to shards
+enum class ShardPartition : uint32_t {
+    HASH = 0,     // by a hash of the track key; shards come out alike in size and content
+    CLUSTER = 1,  // by the nearest k-means centroid of the scaled features, so that a search
+                  // can probe just the shards nearest the query
+};
+
+struct ShardOptions {
+    // At least this many shards; more when the catalog doesn't fit the memory budget
+    size_t shards = 4;
+    ShardPartition partition = ShardPartition::HASH;
+    // Bytes of index, vectors and metadata per shard, 0 = unlimited. Shards are planned from
+    // an estimate (HNSWVectorDB::bytes_per_track plus the metadata of an average row), and no
+    // shard is given more tracks than that estimate allows.
+    size_t memory_budget = 0;
+    // Workers building shards and searching them (0 = one per core)
+    size_t threads = 0;
+    // Drop repeated tracks of the whole catalog before it is partitioned (see DuplicateFilter)
+    bool deduplicate = false;
+};
+
+// Nearest track found by ShardedLibrary::search: the id is local to its shard
+struct ShardMatch {
+    uint32_t shard = 0;
+    size_t id = 0;
+    float distance = 0.0f;
+};
+
+// A catalog split over independent HNSWVectorDB shards, for catalogs too large for one
+// index or one build. Every shard is a library of its own with its own CSV and snapshot, so
+// it is built, saved and reopened without the others, and no graph has to be allocated for
+// the whole catalog. Searches fan out to the shards on a thread pool and the per-shard top k
+// are merged.
+//
+// All shards scale features with one fit over the catalog (HNSWVectorDB::fix_scaling), so
+// their distances compare. The fit, the partitioning and the cluster centroids are kept in a
+// shard map next to the shards; like the scaling of a single library, the fit is made once
+// and kept by later opens.
+//
+// Directory layout: shards.map, shard-000.csv, shard-000.snapshot, shard-001.csv, ...
+class ShardedLibrary {
+public:
+    // Creates an empty database with the settings every shard should have
+    using Factory = std::function<std::unique_ptr<HNSWVectorDB>()>;
+
+    static constexpr char MAGIC[8] = {'B', 'S', 'H', 'F', 'S', 'H', 'R', 'D'};
+    static constexpr uint32_t VERSION = 1;
+
+    // Result of open()
+    struct OpenStats {
+        size_t tracks = 0;          // tracks partitioned over the shards
+        size_t shards = 0;
+        bool planned = false;       // the shard count or centroids were (re)computed
+        size_t changed_shards = 0;  // shards whose CSV changed and were refreshed or rebuilt
+        size_t largest_shard_bytes = 0;
+        size_t over_budget = 0;     // shards whose measured memory_usage() exceeds the budget
+        double seconds = 0.0;
+    };
+
+private:
+    std::string directory;
+    ShardOptions options;
+    Factory factory;
+
+    // Shard map
+    ShardPartition partition = ShardPartition::HASH;
+    size_t shard_count = 0;
+    std::string scaling;          // written by HNSWVectorDB::write_scaling
+    std::vector<float> centroids; // shard_count rows of stride floats (CLUSTER only)
+    size_t stride = 0;
+
+    std::vector<std::unique_ptr<HNSWVectorDB>> shards;
+    std::unique_ptr<ThreadPool> pool;
+
+    // Rows sampled to fit the cluster centroids, and Lloyd iterations over them
+    static constexpr size_t CLUSTER_SAMPLE = 16384;
+    static constexpr size_t CLUSTER_ITERATIONS = 10;
+    // Manifest entry and tag postings of a track, on top of its metadata
+    static constexpr size_t TRACK_OVERHEAD_BYTES = 64;
+
+    std::string shard_path(size_t shard, const char* extension) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "shard-%03zu.%s", shard, extension);
+        return (std::filesystem::path(directory) / name).string();
+    }
+
+    std::string map_path() const {
+        return (std::filesystem::path(directory) / "shards.map").string();
+    }
+
+    // Raw feature values of a CSV row, or false if one is missing or not a number (such rows
+    // aren't loaded by HNSWVectorDB either)
+    static bool row_features(const std::vector<std::string_view>& fields, const std::vector<size_t>& feature_indices, std::vector<float>& features) {
+        for (size_t i = 0; i < feature_indices.size(); i++) {
+            size_t index = feature_indices[i];
+            if (index >= fields.size() || !parse_csv_float(fields[index], features[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static float squared_distance(const float* a, const float* b, size_t size) {
+        float sum = 0.0f;
+        for (size_t i = 0; i < size; i++) {
+            float d = a[i] - b[i];
+            sum += d * d;
+        }
+        return sum;
+    }
+
+    // Centroid rows ordered by distance to a scaled vector
+    void rank_centroids(const float* vector, std::vector<std::pair<float, uint32_t>>& order) const {
+        order.resize(shard_count);
+        for (size_t c = 0; c < shard_count; c++) {
+            order[c] = {squared_distance(vector, centroids.data() + c * stride, stride), static_cast<uint32_t>(c)};
+        }
+        std::sort(order.begin(), order.end());
+    }
+
+    // k-means++ seeding followed by Lloyd iterations over the sample
+    void fit_centroids(const std::vector<float>& sample) {
+        size_t count = sample.size() / stride;
+        centroids.assign(shard_count * stride, 0.0f);
+        if (count == 0) {
+            return;
+        }
+
+        std::mt19937_64 random(42);
+        std::vector<float> nearest(count, std::numeric_limits<float>::infinity());
+        size_t first = std::uniform_int_distribution<size_t>(0, count - 1)(random);
+        std::copy_n(sample.data() + first * stride, stride, centroids.data());
+        for (size_t c = 1; c < shard_count; c++) {
+            double total = 0.0;
+            for (size_t i = 0; i < count; i++) {
+                nearest[i] = std::min(nearest[i], squared_distance(sample.data() + i * stride, centroids.data() + (c - 1) * stride, stride));
+                total += nearest[i];
+            }
+            // Fewer distinct rows than shards: the spare centroids repeat and stay empty
+            size_t pick = 0;
+            double target = std::uniform_real_distribution<double>(0.0, total)(random);
+            while (pick + 1 < count && (target -= nearest[pick]) > 0.0) pick++;
+            std::copy_n(sample.data() + pick * stride, stride, centroids.data() + c * stride);
+        }
+
+        std::vector<double> sums(shard_count * stride);
+        std::vector<size_t> members(shard_count);
+        std::vector<std::pair<float, uint32_t>> order;
+        for (size_t iteration = 0; iteration < CLUSTER_ITERATIONS; iteration++) {
+            std::fill(sums.begin(), sums.end(), 0.0);
+            std::fill(members.begin(), members.end(), 0);
+            for (size_t i = 0; i < count; i++) {
+                const float* row = sample.data() + i * stride;
+                rank_centroids(row, order);
+                size_t c = order[0].second;
+                members[c]++;
+                for (size_t d = 0; d < stride; d++) sums[c * stride + d] += row[d];
+            }
+            for (size_t c = 0; c < shard_count; c++) {
+                if (members[c] == 0) continue;
+                for (size_t d = 0; d < stride; d++) {
+                    centroids[c * stride + d] = static_cast<float>(sums[c * stride + d] / members[c]);
+                }
+            }
+        }
+    }
+
+    bool read_map(HNSWVectorDB& reference) {
+        std::error_code error;
+        if (!std::filesystem::exists(map_path(), error)) {
+            return false;
+        }
+        try {
+            MappedFile file(map_path(), false);
+            binary_io::Cursor in(file.data(), file.size());
+            char magic[sizeof(MAGIC)];
+            for (char& c : magic) c = in.read_pod<char>();
+            if (std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || in.read_pod<uint32_t>() != VERSION ||
+                in.read_pod<uint32_t>() != static_cast<uint32_t>(reference.dimension())) {
+                return false;
+            }
+            ShardPartition loaded_partition = static_cast<ShardPartition>(in.read_pod<uint32_t>());
+            size_t loaded_count = in.read_pod<uint32_t>();
+            std::string loaded_scaling(in.read_string());
+            size_t centroid_count = 0;
+            const float* centroid_data = in.read_array<float>(centroid_count);
+            if (loaded_count == 0 || (loaded_partition == ShardPartition::CLUSTER && centroid_count != loaded_count * stride)) {
+                return false;
+            }
+
+            binary_io::Cursor scaling_in(loaded_scaling.data(), loaded_scaling.size());
+            reference.read_scaling(scaling_in);
+            partition = loaded_partition;
+            shard_count = loaded_count;
+            scaling = std::move(loaded_scaling);
+            centroids.assign(centroid_data, centroid_data + centroid_count);
+            return true;
+        } catch (const std::exception&) {
+            // Corrupt map, or a scaling for another vector format; plan again
+            return false;
+        }
+    }
+
+    void write_map(const HNSWVectorDB& reference) const {
+        std::string path = map_path();
+        std::string temp_path = path + ".tmp";
+        {
+            std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+            if (!out.is_open()) {
+                throw std::runtime_error("Could not write shard map: " + temp_path);
+            }
+            out.write(MAGIC, sizeof(MAGIC));
+            binary_io::write_pod(out, VERSION);
+            binary_io::write_pod(out, static_cast<uint32_t>(reference.dimension()));
+            binary_io::write_pod(out, static_cast<uint32_t>(partition));
+            binary_io::write_pod(out, static_cast<uint32_t>(shard_count));
+            binary_io::write_string(out, scaling);
+            binary_io::write_array(out, centroids.data(), centroids.size());
+            out.close();
+            if (!out) {
+                throw std::runtime_error("Could not write shard map: " + temp_path);
+            }
+        }
+        std::filesystem::rename(temp_path, path);
+    }
+
+    // Replace a shard's CSV with the freshly partitioned one unless they are the same, so
+    // that unchanged shards keep matching their snapshots
+    static bool replace_if_changed(const std::string& temp_path, const std::string& path) {
+        std::error_code error;
+        if (std::filesystem::exists(path, error) &&
+            std::filesystem::file_size(path, error) == std::filesystem::file_size(temp_path, error)) {
+            MappedFile current(path);
+            MappedFile fresh(temp_path);
+            if (current.size() == 0 || std::memcmp(current.data(), fresh.data(), fresh.size()) == 0) {
+                std::filesystem::remove(temp_path);
+                return false;
+            }
+        }
+        std::filesystem::rename(temp_path, path);
+        return true;
+    }
+
+    // Files of shards beyond the current count, left by an earlier plan
+    void remove_stale_shards() const {
+        std::error_code error;
+        for (size_t shard = shard_count;; shard++) {
+            bool csv = std::filesystem::remove(shard_path(shard, "csv"), error);
+            bool snapshot = std::filesystem::remove(shard_path(shard, "snapshot"), error);
+            if (!csv && !snapshot) break;
+        }
+    }
+
+public:
+    explicit ShardedLibrary(std::string shard_directory, ShardOptions shard_options = ShardOptions(), Factory make_database = nullptr)
+        : directory(std::move(shard_directory)), options(shard_options), factory(std::move(make_database)) {
+        if (!factory) {
+            factory = [] { return std::unique_ptr<HNSWVectorDB>(new HNSWVectorDB(10, 1024)); };
+        }
+        if (options.shards == 0) {
+            throw std::invalid_argument("A sharded library needs at least one shard");
+        }
+        pool.reset(new ThreadPool(options.threads));
+    }
+
+    // Open the catalog of an export: partition its tracks over the shards, then open every
+    // shard like HNSWVectorDB::open_library() in parallel, so only shards whose part of the
+    // export changed are refreshed or rebuilt. The shards are planned on the first open, and
+    // again when the catalog has outgrown the memory budget or the options ask for another
+    // partitioning or more shards.
+    OpenStats open(const std::string& csv_file_path) {
+        auto start = std::chrono::steady_clock::now();
+        OpenStats stats;
+        std::filesystem::create_directories(directory);
+
+        std::unique_ptr<HNSWVectorDB> reference = factory();
+        stride = reference->vector_size();
+        bool mapped = read_map(*reference);
+        if (!mapped) {
+            reference = factory();
+            reference->fix_scaling(csv_file_path);
+            std::ostringstream out;
+            reference->write_scaling(out);
+            scaling = out.str();
+        }
+
+        MappedFile file(csv_file_path);
+        std::string_view text = file.view();
+        size_t row_start = 0;
+        CsvReader reader(text);
+        auto row_text = [&] {
+            size_t begin = row_start;
+            while (begin < reader.offset() && (text[begin] == '\n' || text[begin] == '\r')) begin++;
+            return text.substr(begin, reader.offset() - begin);
+        };
+
+        if (!reader.next_row()) {
+            throw std::runtime_error("CSV has no header row: " + csv_file_path);
+        }
+        std::vector<std::string> headers(reader.row().begin(), reader.row().end());
+        std::string header_text(row_text());
+        row_start = reader.offset();
+        std::vector<size_t> feature_indices;
+        for (const std::string& column : HNSWVectorDB::feature_columns()) {
+            size_t index = find_csv_column(headers, column);
+            if (index == std::string::npos) {
+                throw std::runtime_error("CSV is missing feature column: " + column);
+            }
+            feature_indices.push_back(index);
+        }
+        TrackManifest::KeyColumns key_columns(headers);
+        std::vector<float> features(feature_indices.size());
+        std::vector<float> vector(stride);
+
+        // First pass: count and size the tracks, and sample them for the centroids
+        std::vector<uint8_t> keep;
+        std::vector<float> sample;
+        size_t row_bytes = 0;
+        std::mt19937_64 random(7);
+        {
+            DuplicateFilter duplicates(key_columns);
+            while (reader.next_row()) {
+                bool kept = row_features(reader.row(), feature_indices, features) &&
+                            (!options.deduplicate || duplicates.first_occurrence(reader.row()));
+                keep.push_back(kept);
+                if (kept) {
+                    stats.tracks++;
+                    row_bytes += row_text().size();
+                    if (options.partition == ShardPartition::CLUSTER) {
+                        // Reservoir sample of the scaled vectors
+                        size_t slot = stats.tracks - 1;
+                        if (slot >= CLUSTER_SAMPLE) slot = std::uniform_int_distribution<size_t>(0, stats.tracks - 1)(random);
+                        if (slot < CLUSTER_SAMPLE) {
+                            reference->prepare_query(features, vector.data());
+                            if (sample.size() < CLUSTER_SAMPLE * stride) sample.resize(sample.size() + stride);
+                            std::copy(vector.begin(), vector.end(), sample.begin() + slot * stride);
+                        }
+                    }
+                }
+                row_start = reader.offset();
+            }
+        }
+
+        // Tracks a shard may hold within the budget
+        const size_t unbounded = std::numeric_limits<size_t>::max();
+        size_t capacity = unbounded;
+        if (options.memory_budget > 0 && stats.tracks > 0) {
+            size_t track_bytes = reference->bytes_per_track() + row_bytes / stats.tracks +
+                                 headers.size() * sizeof(uint32_t) + TRACK_OVERHEAD_BYTES;
+            capacity = std::max<size_t>(1, options.memory_budget / track_bytes);
+        }
+        size_t needed = std::max(options.shards, capacity == unbounded ? 1 : (stats.tracks + capacity - 1) / capacity);
+        // Without a budget shard_count * capacity would wrap around
+        bool outgrown = capacity != unbounded && stats.tracks > shard_count * capacity;
+        if (!mapped || partition != options.partition || shard_count < options.shards || outgrown) {
+            partition = options.partition;
+            shard_count = needed;
+            centroids.clear();
+            if (partition == ShardPartition::CLUSTER) {
+                fit_centroids(sample);
+            }
+            stats.planned = true;
+        }
+
+        // Second pass: write every shard's part of the export, each track going to the first
+        // shard in its order of preference that still has room
+        std::vector<std::ofstream> outputs(shard_count);
+        for (size_t shard = 0; shard < shard_count; shard++) {
+            outputs[shard].open(shard_path(shard, "csv.tmp"), std::ios::binary | std::ios::trunc);
+            if (!outputs[shard].is_open()) {
+                throw std::runtime_error("Could not write shard: " + shard_path(shard, "csv.tmp"));
+            }
+            outputs[shard] << header_text << '\n';
+        }
+        std::vector<size_t> counts(shard_count, 0);
+        std::vector<std::pair<float, uint32_t>> order;
+        reader = CsvReader(text);
+        reader.next_row();
+        row_start = reader.offset();
+        for (size_t row = 0; reader.next_row(); row++) {
+            if (keep[row]) {
+                size_t shard = 0;
+                if (partition == ShardPartition::CLUSTER) {
+                    row_features(reader.row(), feature_indices, features);
+                    reference->prepare_query(features, vector.data());
+                    rank_centroids(vector.data(), order);
+                    size_t rank = 0;
+                    while (rank + 1 < shard_count && counts[order[rank].second] >= capacity) rank++;
+                    shard = order[rank].second;
+                } else {
+                    shard = hash_string(TrackManifest::track_key(reader.row(), key_columns)) % shard_count;
+                    for (size_t probe = 0; probe + 1 < shard_count && counts[shard] >= capacity; probe++) {
+                        shard = (shard + 1) % shard_count;
+                    }
+                }
+                counts[shard]++;
+                outputs[shard] << row_text() << '\n';
+            }
+            row_start = reader.offset();
+        }
+
+        std::vector<uint8_t> changed(shard_count, 0);
+        for (size_t shard = 0; shard < shard_count; shard++) {
+            outputs[shard].close();
+            if (!outputs[shard]) {
+                throw std::runtime_error("Could not write shard: " + shard_path(shard, "csv.tmp"));
+            }
+            changed[shard] = replace_if_changed(shard_path(shard, "csv.tmp"), shard_path(shard, "csv"));
+            stats.changed_shards += changed[shard];
+        }
+        remove_stale_shards();
+        if (stats.planned) {
+            write_map(*reference);
+        }
+
+        // Shards are opened side by side, each building on its share of the workers
+        shards.clear();
+        shards.resize(shard_count);
+        size_t build_threads = std::max<size_t>(1, pool->size() / shard_count);
+        pool->parallel_for(shard_count, 1, [&](size_t begin, size_t end, size_t) {
+            for (size_t shard = begin; shard < end; shard++) {
+                open_shard(shard, build_threads);
+            }
+        });
+
+        stats.shards = shard_count;
+        for (const auto& shard : shards) {
+            size_t bytes = shard->memory_usage();
+            stats.largest_shard_bytes = std::max(stats.largest_shard_bytes, bytes);
+            stats.over_budget += options.memory_budget > 0 && bytes > options.memory_budget;
+        }
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+
+    // Open one shard from its CSV and snapshot with the catalog's scaling, rebuilding it if
+    // the snapshot is missing or stale. open() calls this for every shard; a process that
+    // only maintains some of them can call it on its own once the map exists.
+    void open_shard(size_t shard, size_t num_threads = 0) {
+        if (shard >= shard_count) {
+            throw std::out_of_range("Invalid shard");
+        }
+        std::unique_ptr<HNSWVectorDB> db = factory();
+        binary_io::Cursor in(scaling.data(), scaling.size());
+        db->read_scaling(in);
+        db->set_deduplicate(options.deduplicate);
+        db->open_library(shard_path(shard, "snapshot"), shard_path(shard, "csv"), num_threads);
+        if (shards.size() < shard_count) {
+            shards.resize(shard_count);
+        }
+        shards[shard] = std::move(db);
+    }
+
+    // The k nearest tracks over all shards, closest first. With CLUSTER partitioning, probe
+    // limits the search to that many shards nearest the query (0 = all); HASH shards hold
+    // every part of the feature space, so they are always all searched. Shards are searched
+    // in parallel on the library's pool, one call at a time.
+    std::vector<ShardMatch> search(const std::vector<float>& query, size_t k, size_t probe = 0) {
+        std::vector<ShardMatch> matches;
+        if (shards.empty() || k == 0) {
+            return matches;
+        }
+
+        // Every shard scales the same way, so the query is prepared once
+        std::vector<float> vector(stride);
+        shards[0]->prepare_query(query, vector.data());
+        std::vector<uint32_t> targets;
+        if (partition == ShardPartition::CLUSTER && probe > 0 && probe < shard_count) {
+            std::vector<std::pair<float, uint32_t>> order;
+            rank_centroids(vector.data(), order);
+            for (size_t i = 0; i < probe; i++) targets.push_back(order[i].second);
+        } else {
+            for (size_t shard = 0; shard < shard_count; shard++) targets.push_back(static_cast<uint32_t>(shard));
+        }
+
+        std::vector<std::vector<std::pair<size_t, float>>> found(targets.size());
+        pool->parallel_for(targets.size(), 1, [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; i++) {
+                if (shards[targets[i]]) shards[targets[i]]->search_vector(vector.data(), k, found[i]);
+            }
+        });
+
+        for (size_t i = 0; i < targets.size(); i++) {
+            for (const auto& result : found[i]) {
+                matches.push_back(ShardMatch{targets[i], result.first, result.second});
+            }
+        }
+        size_t keep = std::min(k, matches.size());
+        std::partial_sort(matches.begin(), matches.begin() + keep, matches.end(), [](const ShardMatch& a, const ShardMatch& b) {
+            return a.distance < b.distance;
+        });
+        matches.resize(keep);
+        return matches;
+    }
+
+    MetadataStore::Row get_metadata(const ShardMatch& match) const {
+        if (match.shard >= shards.size() || !shards[match.shard]) {
+            throw std::out_of_range("Invalid shard");
+        }
+        return shards[match.shard]->get_metadata(match.id);
+    }
+
+    const HNSWVectorDB& shard(size_t index) const {
+        if (index >= shards.size() || !shards[index]) {
+            throw std::out_of_range("Invalid shard");
+        }
+        return *shards[index];
+    }
+
+    size_t get_shard_count() const {
+        return shard_count;
+    }
+
+    ShardPartition get_partition() const {
+        return partition;
+    }
+
+    // Tracks over all shards, including removed ones still holding an id
+    size_t size() const {
+        size_t total = 0;
+        for (const auto& shard : shards) {
+            if (shard) total += shard->size();
+        }
+        return total;
+    }
+};
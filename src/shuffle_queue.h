@@ -0,0 +1,248 @@
+#pragma once
+
+#include "hnswlib_csv_to_db.h"
+#include "neighbor_graph.h"
+#include "bitset.h"
+#include <vector>
+#include <deque>
+#include <memory>
+#include <random>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+// Shuffle settings for a listening session
+struct ShuffleOptions {
+    // 0 always plays the closest match to the mood, 1 picks almost uniformly among the
+    // candidates
+    float spiciness = 0.3f;
+    // How far the mood moves toward each played track (0 = fixed mood, 1 = follow the last track)
+    float drift = 0.2f;
+    // Candidates fetched per pick. Fixed, so every next() does the same amount of work.
+    size_t candidates = 16;
+    // Start over when every track has been played instead of ending the session
+    bool repeat_when_exhausted = true;
+    uint64_t seed = std::random_device{}();
+};
+
+// Stateful next-song generator for one session. The mood is a point in the index's vector
+// space that drifts toward every played track; each pick searches a fixed number of
+// candidates around it with played tracks excluded inside the graph walk by a bitset, then
+// samples one weighted by distance according to the spiciness. Not thread-safe: use one
+// queue per session. The database must outlive the queue and not be modified during next().
+//
+// upcoming() makes the picks ahead of time, so a player can prefetch the tracks it is about
+// to play (see TrackPrefetcher). Those picks are what next() returns, in order, until
+// something changes the course of the session (a new mood, a track picked by hand, ...), at
+// which point they are taken back as if they had never been made.
+class ShuffleQueue {
+private:
+    // Rejects played tracks during the search
+    class PlayedFilter : public hnswlib::BaseFilterFunctor {
+    private:
+        const DynamicBitset& played;
+
+    public:
+        explicit PlayedFilter(const DynamicBitset& bits) : played(bits) {}
+
+        bool operator()(hnswlib::labeltype id) override {
+            return !played.test(id);
+        }
+    };
+
+    const HNSWVectorDB& db;
+    ShuffleOptions options;
+    std::vector<float> mood;
+    std::vector<float> track;
+    DynamicBitset played;
+    PlayedFilter filter;
+    std::mt19937_64 rng;
+    std::vector<std::pair<size_t, float>> candidates;
+    std::vector<double> weights;
+    const NeighborGraph* graph = nullptr;
+    size_t last_played = HNSWVectorDB::NO_RESULT;
+
+    // Picks made ahead by upcoming(), with the state to return to if they are taken back
+    struct Pick {
+        size_t id;
+        size_t last_played;
+        std::vector<float> mood;
+        std::mt19937_64 rng;
+        // The played tracks before this pick started them over (repeat_when_exhausted)
+        std::unique_ptr<DynamicBitset> played_before;
+    };
+    std::deque<Pick> ahead;
+    std::vector<size_t> ahead_ids;
+
+    // With drift 1 the mood is exactly the last played track, so its precomputed neighbours
+    // are the candidates a search would find. False without a graph or when all of them were
+    // played, in which case next() searches as usual.
+    bool graph_candidates() {
+        if (!graph || options.drift < 1.0f || last_played == HNSWVectorDB::NO_RESULT) {
+            return false;
+        }
+        NeighborGraph::Neighbors row = graph->neighbors(last_played);
+        candidates.clear();
+        for (size_t i = 0; i < row.count && candidates.size() < options.candidates; i++) {
+            size_t id = row.labels[i];
+            if (!played.test(id) && !db.is_deleted(id)) {
+                candidates.emplace_back(id, row.distances[i]);
+            }
+        }
+        return !candidates.empty();
+    }
+
+    // Pick a candidate index. Distances are measured from the nearest candidate and scaled by
+    // the spread of the candidate set, so the spiciness means the same thing whatever the
+    // metric or how dense the library is around the mood.
+    size_t sample() {
+        if (options.spiciness <= 0.0f || candidates.size() == 1) {
+            return 0;
+        }
+        float nearest = candidates.front().second;
+        float spread = std::max(candidates.back().second - nearest, 1e-6f);
+        double temperature = options.spiciness * options.spiciness * spread;
+        weights.resize(candidates.size());
+        for (size_t i = 0; i < candidates.size(); i++) {
+            weights[i] = std::exp(-(candidates[i].second - nearest) / temperature);
+        }
+        std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+        return pick(rng);
+    }
+
+    // Choose a track around the mood and play it. A pick made ahead keeps the played tracks
+    // in pending if it has to start them over.
+    size_t pick_next(Pick* pending = nullptr) {
+        if (!graph_candidates()) {
+            db.search_vector(mood.data(), options.candidates, candidates, &filter);
+        }
+        if (candidates.empty() && options.repeat_when_exhausted && played.count() > 0) {
+            if (pending) {
+                pending->played_before.reset(new DynamicBitset(played));
+            }
+            played.reset();
+            // Tracks already lined up still count as played
+            for (const Pick& queued : ahead) played.set(queued.id);
+            db.search_vector(mood.data(), options.candidates, candidates, &filter);
+        }
+        if (candidates.empty()) {
+            return HNSWVectorDB::NO_RESULT;
+        }
+
+        size_t id = candidates[sample()].first;
+        advance(id);
+        return id;
+    }
+
+    // Mark a track played and drift the mood toward it
+    void advance(size_t id) {
+        played.set(id);
+        last_played = id;
+        db.get_vector(id, track.data());
+        for (size_t i = 0; i < mood.size(); i++) {
+            mood[i] += options.drift * (track[i] - mood[i]);
+        }
+    }
+
+    // Take back the picks made ahead, restoring the session to where it was before them
+    void discard_ahead() {
+        if (ahead.empty()) return;
+        // Undo the picks last to first, so a pick that started the history over gets back
+        // what the earlier ones had played
+        for (auto pending = ahead.rbegin(); pending != ahead.rend(); ++pending) {
+            if (pending->played_before) {
+                played = std::move(*pending->played_before);
+            } else {
+                played.reset(pending->id);
+            }
+        }
+        mood = std::move(ahead.front().mood);
+        last_played = ahead.front().last_played;
+        rng = ahead.front().rng;
+        ahead.clear();
+    }
+
+public:
+    // Start a session from a mood given in raw feature units, like a search query
+    ShuffleQueue(const HNSWVectorDB& database, const std::vector<float>& initial_mood, const ShuffleOptions& settings = ShuffleOptions())
+        : db(database), options(settings), mood(database.vector_size()), track(database.vector_size()),
+          played(database.size()),
+          filter(played), rng(settings.seed) {
+        if (options.candidates == 0) {
+            throw std::invalid_argument("ShuffleQueue needs at least one candidate per pick");
+        }
+        set_mood(initial_mood);
+        set_spiciness(options.spiciness);
+        candidates.reserve(options.candidates);
+        weights.reserve(options.candidates);
+    }
+
+    // Pick the next track and mark it played. Returns HNSWVectorDB::NO_RESULT when every
+    // track has been played and repeat_when_exhausted is off.
+    size_t next() {
+        if (!ahead.empty()) {
+            size_t id = ahead.front().id;
+            ahead.pop_front();
+            return id;
+        }
+        return pick_next();
+    }
+
+    // The next count tracks next() will return, picking them now if needed. Fewer when the
+    // session runs out of tracks. They count as played from now on. The reference is valid
+    // until the next call on the queue.
+    const std::vector<size_t>& upcoming(size_t count) {
+        while (ahead.size() < count) {
+            Pick pending{HNSWVectorDB::NO_RESULT, last_played, mood, rng, nullptr};
+            pending.id = pick_next(&pending);
+            if (pending.id == HNSWVectorDB::NO_RESULT) break;
+            ahead.push_back(std::move(pending));
+        }
+        ahead_ids.clear();
+        for (size_t i = 0; i < ahead.size() && i < count; i++) {
+            ahead_ids.push_back(ahead[i].id);
+        }
+        return ahead_ids;
+    }
+
+    // Record a track as played (also for tracks the user picked by hand) and drift the mood
+    // toward it. Picks made ahead are taken back, since they followed the old mood.
+    void mark_played(size_t id) {
+        discard_ahead();
+        advance(id);
+    }
+
+    void set_mood(const std::vector<float>& raw_mood) {
+        discard_ahead();
+        db.prepare_query(raw_mood, mood.data());
+        last_played = HNSWVectorDB::NO_RESULT;
+    }
+
+    // Serve picks that follow the last track (drift 1) from a precomputed neighbour graph of
+    // the same library instead of searching. The graph must outlive the queue; nullptr turns
+    // it off.
+    void set_neighbor_graph(const NeighborGraph* neighbor_graph) {
+        discard_ahead();
+        graph = neighbor_graph;
+    }
+
+    void set_spiciness(float spiciness) {
+        discard_ahead();
+        options.spiciness = std::min(std::max(spiciness, 0.0f), 1.0f);
+    }
+
+    // Forget the played tracks; the mood stays where it drifted to
+    void reset_history() {
+        discard_ahead();
+        played.reset();
+    }
+
+    size_t played_count() const {
+        return played.count();
+    }
+
+    bool was_played(size_t id) const {
+        return played.test(id);
+    }
+};
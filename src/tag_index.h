@@ -0,0 +1,305 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <algorithm>
+#include <cctype>
+
+#include "metadata_store.h"
+#include "bitset.h"
+#include "csv_dedup.h"
+
+// How the values of a tag column are split into tags. ';' always separates tags; it is also
+// what several values of an ID3v2.4 frame are joined with (see getFrameText).
+enum class TagSeparator {
+    // Every comma: Genres ("classic rock, rock, glam rock")
+    COMMA,
+    // Only commas without a space after them, so names keep theirs: the export's
+    // "Bernth,Syncatto" is two artists, "Earth, Wind & Fire" is one
+    BARE_COMMA,
+};
+
+// Inverted index over a tag column such as Genres or Artist (see TagSeparator). Every
+// distinct tag gets a dense id and a posting list of the tracks carrying it. Tags are
+// matched regardless of case and punctuation; the first spelling seen is kept as the
+// display name.
+//
+// Posting lists are sorted track ids stored as varint-encoded gaps, with a skip entry every
+// SKIP_INTERVAL ids so intersections can jump ahead without decoding the whole list. Tracks
+// removed by a refresh are left out.
+class TagIndex {
+public:
+    static constexpr uint32_t npos = UINT32_MAX;
+    static constexpr size_t SKIP_INTERVAL = 64;
+
+private:
+    // Resume point inside a posting list: the id at a multiple of SKIP_INTERVAL and the byte
+    // offset of the gap that follows it
+    struct Skip {
+        uint32_t id;
+        uint32_t offset;
+    };
+
+    struct List {
+        size_t begin = 0;        // into bytes
+        uint32_t count = 0;
+        uint32_t skip_begin = 0; // into skips; count / SKIP_INTERVAL entries
+    };
+
+    StringArena keys{true};
+    StringArena names;
+    std::vector<List> lists;
+    std::vector<uint8_t> bytes;
+    std::vector<Skip> skips;
+    std::vector<uint32_t> track_offsets = {0}; // tags of track t are track_tags[track_offsets[t] ..]
+    std::vector<uint32_t> track_tags;
+    bool column_present = false;
+
+    static void write_varint(std::vector<uint8_t>& out, uint32_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(value));
+    }
+
+    static uint32_t read_varint(const uint8_t*& p) {
+        uint32_t value = *p & 0x7F;
+        for (int shift = 7; *p++ & 0x80; shift += 7) {
+            value |= static_cast<uint32_t>(*p & 0x7F) << shift;
+        }
+        return value;
+    }
+
+public:
+    // Walks one posting list in increasing track order
+    class Cursor {
+    private:
+        const TagIndex* index;
+        const List* list;
+        const uint8_t* pos;
+        uint32_t position = 0; // entries consumed
+        uint32_t value = 0;
+        bool ended = false;
+
+    public:
+        Cursor(const TagIndex& owner, uint32_t tag) : index(&owner), list(&owner.lists[tag]) {
+            pos = owner.bytes.data() + list->begin;
+            next();
+        }
+
+        bool done() const {
+            return ended;
+        }
+
+        // Current track id; only valid while !done()
+        uint32_t track() const {
+            return value;
+        }
+
+        void next() {
+            if (position == list->count) {
+                ended = true;
+                return;
+            }
+            uint32_t gap = read_varint(pos);
+            value = position == 0 ? gap : value + gap;
+            position++;
+        }
+
+        // Move to the first track >= target, using the skip entries to pass over whole blocks
+        void seek(uint32_t target) {
+            if (ended || value >= target) return;
+            const Skip* first = index->skips.data() + list->skip_begin;
+            const Skip* last = first + list->count / SKIP_INTERVAL;
+            const Skip* skip = std::lower_bound(first, last, target, [](const Skip& s, uint32_t id) {
+                return s.id < id;
+            });
+            if (skip != first) {
+                // Resume after the last block start below target, unless we are already past it
+                size_t block = static_cast<size_t>(skip - first);
+                uint32_t block_position = static_cast<uint32_t>(block * SKIP_INTERVAL);
+                if (block_position > position) {
+                    --skip;
+                    value = skip->id;
+                    position = block_position;
+                    pos = index->bytes.data() + list->begin + skip->offset;
+                }
+            }
+            while (!ended && value < target) next();
+        }
+    };
+
+    // Index the tags of one metadata column. Tracks set in excluded (if given) are left out of
+    // the posting lists.
+    void build(const MetadataStore& metadata, std::string_view column, TagSeparator separator,
+               const DynamicBitset* excluded = nullptr) {
+        clear();
+        size_t column_index = metadata.column_index(column);
+        column_present = column_index != std::string::npos;
+        if (!column_present) {
+            track_offsets.assign(metadata.size() + 1, 0);
+            return;
+        }
+
+        // Split every distinct column value once
+        const StringArena& values = metadata.column_values(column_index);
+        std::vector<uint32_t> value_offsets = {0};
+        std::vector<uint32_t> value_tags;
+        std::string key;
+        for (uint32_t id = 0; id < values.size(); id++) {
+            std::string_view value = values.get(id);
+            size_t tags_begin = value_tags.size();
+            while (!value.empty()) {
+                size_t end = 0;
+                while (end < value.size() && value[end] != ';' &&
+                       !(value[end] == ',' && (separator == TagSeparator::COMMA || end + 1 == value.size() ||
+                                               !std::isspace(static_cast<unsigned char>(value[end + 1]))))) {
+                    end++;
+                }
+                std::string_view name = track_text::trim(value.substr(0, end));
+                value.remove_prefix(end == value.size() ? end : end + 1);
+                track_text::normalize(name, key);
+                if (key.empty()) continue;
+
+                uint32_t tag = keys.add(key);
+                if (tag == names.size()) {
+                    names.add(name);
+                    lists.emplace_back();
+                }
+                // A tag listed twice in one value counts once
+                if (std::find(value_tags.begin() + tags_begin, value_tags.end(), tag) == value_tags.end()) {
+                    value_tags.push_back(tag);
+                }
+            }
+            value_offsets.push_back(static_cast<uint32_t>(value_tags.size()));
+        }
+
+        std::vector<std::vector<uint32_t>> postings(lists.size());
+        track_offsets.reserve(metadata.size() + 1);
+        for (size_t track = 0; track < metadata.size(); track++) {
+            uint32_t value = metadata.value_id(track, column_index);
+            for (uint32_t i = value_offsets[value]; i < value_offsets[value + 1]; i++) {
+                track_tags.push_back(value_tags[i]);
+                if (!excluded || !excluded->test(track)) {
+                    postings[value_tags[i]].push_back(static_cast<uint32_t>(track));
+                }
+            }
+            track_offsets.push_back(static_cast<uint32_t>(track_tags.size()));
+        }
+
+        for (size_t tag = 0; tag < postings.size(); tag++) {
+            List& list = lists[tag];
+            list.begin = bytes.size();
+            list.count = static_cast<uint32_t>(postings[tag].size());
+            list.skip_begin = static_cast<uint32_t>(skips.size());
+            uint32_t previous = 0;
+            for (size_t i = 0; i < postings[tag].size(); i++) {
+                uint32_t track = postings[tag][i];
+                write_varint(bytes, track - previous);
+                previous = track;
+                if ((i + 1) % SKIP_INTERVAL == 0) {
+                    skips.push_back(Skip{track, static_cast<uint32_t>(bytes.size() - list.begin)});
+                }
+            }
+        }
+    }
+
+    // Whether the library has the column at all
+    bool available() const {
+        return column_present;
+    }
+
+    // Id of a tag, or npos if no track carries it
+    uint32_t find(std::string_view name) const {
+        std::string key;
+        track_text::normalize(name, key);
+        return keys.find(key);
+    }
+
+    std::string_view name(uint32_t tag) const {
+        return names.get(tag);
+    }
+
+    // Number of distinct tags
+    size_t size() const {
+        return lists.size();
+    }
+
+    // Number of tracks carrying a tag
+    size_t count(uint32_t tag) const {
+        return lists[tag].count;
+    }
+
+    // Tag ids of a track in column order, e.g. as sparse features. Removed tracks keep theirs.
+    const uint32_t* tags_of(size_t track, size_t& count) const {
+        count = track_offsets[track + 1] - track_offsets[track];
+        return track_tags.data() + track_offsets[track];
+    }
+
+    // Tracks carrying a tag, in increasing order
+    std::vector<uint32_t> tracks(uint32_t tag) const {
+        std::vector<uint32_t> result;
+        result.reserve(lists[tag].count);
+        for (Cursor cursor(*this, tag); !cursor.done(); cursor.next()) {
+            result.push_back(cursor.track());
+        }
+        return result;
+    }
+
+    // Tracks carrying every tag, in increasing order. The shortest list drives the
+    // intersection and the others are probed with seek(), so the cost follows the rarest tag.
+    std::vector<uint32_t> intersect(std::vector<uint32_t> tags) const {
+        std::vector<uint32_t> result;
+        if (tags.empty() || std::find(tags.begin(), tags.end(), npos) != tags.end()) {
+            return result;
+        }
+        std::sort(tags.begin(), tags.end(), [&](uint32_t a, uint32_t b) {
+            return lists[a].count < lists[b].count;
+        });
+
+        std::vector<Cursor> others;
+        for (size_t i = 1; i < tags.size(); i++) {
+            others.emplace_back(*this, tags[i]);
+        }
+        for (Cursor driver(*this, tags[0]); !driver.done(); driver.next()) {
+            uint32_t track = driver.track();
+            bool everywhere = true;
+            for (Cursor& other : others) {
+                other.seek(track);
+                if (other.done()) return result;
+                if (other.track() != track) {
+                    everywhere = false;
+                    break;
+                }
+            }
+            if (everywhere) result.push_back(track);
+        }
+        return result;
+    }
+
+    // Set the bits of every track carrying a tag
+    void mark(uint32_t tag, DynamicBitset& bits) const {
+        for (Cursor cursor(*this, tag); !cursor.done(); cursor.next()) {
+            bits.set(cursor.track());
+        }
+    }
+
+    void clear() {
+        keys.clear();
+        names.clear();
+        lists.clear();
+        bytes.clear();
+        skips.clear();
+        track_offsets.assign(1, 0);
+        track_tags.clear();
+        column_present = false;
+    }
+
+    size_t memory_usage() const {
+        return keys.memory_usage() + names.memory_usage() + lists.capacity() * sizeof(List) + bytes.capacity() +
+               skips.capacity() * sizeof(Skip) + (track_offsets.capacity() + track_tags.capacity()) * sizeof(uint32_t);
+    }
+};
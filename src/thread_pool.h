@@ -0,0 +1,122 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+
+// Fixed set of worker threads that run one job at a time. The calling thread takes part in
+// every job as worker 0, so a pool of size 1 runs everything inline without any threads.
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    std::mutex job_mutex;                        // serializes callers of run()
+    const std::function<void(size_t)>* task = nullptr;
+    size_t generation = 0;
+    size_t running = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    void worker_loop(size_t worker) {
+        size_t seen = 0;
+        while (true) {
+            const std::function<void(size_t)>* current;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                current = task;
+            }
+            execute(*current, worker);
+        }
+    }
+
+    void execute(const std::function<void(size_t)>& job, size_t worker) {
+        try {
+            job(worker);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--running == 0) {
+            finished.notify_all();
+        }
+    }
+
+public:
+    // 0 threads = one per core
+    explicit ThreadPool(size_t threads = 0) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (size_t i = 1; i < threads; i++) {
+            workers.emplace_back([this, i] { worker_loop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return workers.size() + 1;
+    }
+
+    // Run job(worker_index) once on every worker and wait for all of them. The first
+    // exception thrown by any worker is rethrown here.
+    void run(const std::function<void(size_t)>& job) {
+        std::lock_guard<std::mutex> job_lock(job_mutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = &job;
+            running = size();
+            error = nullptr;
+            generation++;
+        }
+        wake.notify_all();
+        execute(job, 0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return running == 0; });
+        task = nullptr;
+        if (error) {
+            std::exception_ptr failure = error;
+            error = nullptr;
+            std::rethrow_exception(failure);
+        }
+    }
+
+    // Split [0, count) into chunks of grain items that workers claim dynamically, and call
+    // body(begin, end, worker_index) for each
+    template <typename Body>
+    void parallel_for(size_t count, size_t grain, Body&& body) {
+        grain = std::max<size_t>(1, grain);
+        std::atomic<size_t> next{0};
+        run([&](size_t worker) {
+            while (true) {
+                size_t begin = next.fetch_add(grain);
+                if (begin >= count) break;
+                body(begin, std::min(count, begin + grain), worker);
+            }
+        });
+    }
+};
@@ -0,0 +1,255 @@
+#pragma once
+
+#include "../vendor/hnswlib/hnswlib/hnswlib.h"
+#include "metadata_store.h"
+#include "bitset.h"
+#include "csv_reader.h"
+#include "csv_dedup.h"
+#include "tag_index.h"
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <charconv>
+#include <stdexcept>
+#include <algorithm>
+
+// Tracks allowed by a compiled TrackFilter, one bit per id. Searches consult it inside the
+// graph walk, so excluded tracks never take up result slots.
+class TrackSelection : public hnswlib::BaseFilterFunctor {
+private:
+    DynamicBitset allowed;
+
+public:
+    TrackSelection() = default;
+    explicit TrackSelection(DynamicBitset bits) : allowed(std::move(bits)) {}
+
+    bool operator()(hnswlib::labeltype id) override {
+        return allowed.test(id);
+    }
+
+    bool contains(size_t id) const {
+        return allowed.test(id);
+    }
+
+    // Number of tracks selected
+    size_t size() const {
+        return allowed.count();
+    }
+
+    const DynamicBitset& bits() const {
+        return allowed;
+    }
+};
+
+// Constraints on track metadata, e.g. "only after 2000, in 4/4, Camelot 8A/8B/9A, not by this
+// artist". Set the constraints with the chained methods, then compile the filter against a
+// library once (HNSWVectorDB::compile_filter) and reuse the selection for every search.
+// Compiling evaluates each constraint once per distinct value of its column, not per track,
+// since the metadata columns are interned; artist and genre constraints read the posting
+// lists of the tag indexes.
+class TrackFilter {
+private:
+    struct Range {
+        bool active = false;
+        int min = 0;
+        int max = 0;
+    };
+
+    Range years;
+    Range popularity;
+    std::vector<std::string> keys;
+    std::vector<std::string> camelot_codes;
+    std::vector<int> signatures;
+    std::vector<std::string> included_artists;
+    std::vector<std::string> excluded_artists;
+    std::vector<std::string> required_genres;
+    std::vector<std::string> any_genres;
+
+    // Leading integer of a field: the year of "2023-11-10", the 4 of "4/4"
+    static bool leading_int(std::string_view field, int& out) {
+        field = track_text::trim(field);
+        auto result = std::from_chars(field.data(), field.data() + field.size(), out);
+        return result.ec == std::errc() && result.ptr != field.data();
+    }
+
+    static bool in_range(const Range& range, int value) {
+        return value >= range.min && value <= range.max;
+    }
+
+    static std::string upper(std::string_view text) {
+        std::string out(track_text::trim(text));
+        for (char& c : out) {
+            if (c >= 'a' && c <= 'z') c = static_cast<char>(c - 'a' + 'A');
+        }
+        return out;
+    }
+
+    static void require_tags(const TagIndex& tags, std::string_view column) {
+        if (!tags.available()) {
+            throw std::invalid_argument("The library has no \"" + std::string(column) + "\" column to filter on");
+        }
+    }
+
+    // Tracks carrying any of the named tags
+    static DynamicBitset any_of(const TagIndex& tags, const std::vector<std::string>& names, size_t size) {
+        DynamicBitset bits(size);
+        for (const auto& name : names) {
+            uint32_t tag = tags.find(name);
+            if (tag != TagIndex::npos) tags.mark(tag, bits);
+        }
+        return bits;
+    }
+
+    // Keep the rows set in bits (or, with invert, the rows not set)
+    static void restrict(const DynamicBitset& bits, bool invert, std::vector<uint8_t>& allowed) {
+        for (size_t row = 0; row < allowed.size(); row++) {
+            allowed[row] &= bits.test(row) != invert;
+        }
+    }
+
+    // Clear the rows whose value in column fails matches. The predicate runs once per
+    // distinct value of the column.
+    template <typename Predicate>
+    static void restrict(const MetadataStore& metadata, std::string_view column, Predicate matches, std::vector<uint8_t>& allowed) {
+        size_t index = metadata.column_index(column);
+        if (index == std::string::npos) {
+            throw std::invalid_argument("The library has no \"" + std::string(column) + "\" column to filter on");
+        }
+        const StringArena& values = metadata.column_values(index);
+        std::vector<uint8_t> value_matches(values.size());
+        for (size_t id = 0; id < values.size(); id++) {
+            value_matches[id] = matches(values.get(static_cast<uint32_t>(id)));
+        }
+        for (size_t row = 0; row < allowed.size(); row++) {
+            allowed[row] &= value_matches[metadata.value_id(row, index)];
+        }
+    }
+
+public:
+    // Album Date year, inclusive
+    TrackFilter& year_between(int min, int max) {
+        years = Range{true, min, max};
+        return *this;
+    }
+
+    // Spotify popularity (0-100), inclusive
+    TrackFilter& popularity_between(int min, int max) {
+        popularity = Range{true, min, max};
+        return *this;
+    }
+
+    // Keys as exported, e.g. "C♯/D♭ Major"
+    TrackFilter& key_in(const std::vector<std::string>& allowed_keys) {
+        keys.clear();
+        for (const auto& key : allowed_keys) {
+            keys.emplace_back(track_text::trim(key));
+        }
+        return *this;
+    }
+
+    // Camelot wheel positions, e.g. {"8A", "8B", "9A"}
+    TrackFilter& camelot_in(const std::vector<std::string>& codes) {
+        camelot_codes.clear();
+        for (const auto& code : codes) {
+            camelot_codes.push_back(upper(code));
+        }
+        return *this;
+    }
+
+    // Beats per bar, e.g. {4} for 4/4
+    TrackFilter& time_signature_in(const std::vector<int>& beats) {
+        signatures = beats;
+        return *this;
+    }
+
+    // Only tracks listing one of these artists. Names match regardless of case and punctuation.
+    TrackFilter& artist_in(const std::vector<std::string>& artists) {
+        included_artists = artists;
+        return *this;
+    }
+
+    // No tracks listing any of these artists
+    TrackFilter& artist_not_in(const std::vector<std::string>& artists) {
+        excluded_artists = artists;
+        return *this;
+    }
+
+    // Only tracks tagged with every one of these genres, e.g. {"indie", "shoegaze"}
+    TrackFilter& genre_all(const std::vector<std::string>& genres) {
+        required_genres = genres;
+        return *this;
+    }
+
+    // Only tracks tagged with at least one of these genres
+    TrackFilter& genre_any(const std::vector<std::string>& genres) {
+        any_genres = genres;
+        return *this;
+    }
+
+    // Bitset of the rows of metadata that pass every constraint, given the artist and genre
+    // indexes of the same library. Throws if a constraint refers to a column the library
+    // doesn't have.
+    DynamicBitset compile(const MetadataStore& metadata, const TagIndex& artists, const TagIndex& genres) const {
+        std::vector<uint8_t> allowed(metadata.size(), 1);
+
+        if (years.active) {
+            restrict(metadata, "Album Date", [&](std::string_view value) {
+                int year = 0;
+                return leading_int(value, year) && in_range(years, year);
+            }, allowed);
+        }
+        if (popularity.active) {
+            restrict(metadata, "Popularity", [&](std::string_view value) {
+                float score = 0.0f;
+                return parse_csv_float(value, score) && score >= popularity.min && score <= popularity.max;
+            }, allowed);
+        }
+        if (!keys.empty()) {
+            restrict(metadata, "Key", [&](std::string_view value) {
+                return std::find(keys.begin(), keys.end(), track_text::trim(value)) != keys.end();
+            }, allowed);
+        }
+        if (!camelot_codes.empty()) {
+            restrict(metadata, "Camelot", [&](std::string_view value) {
+                return std::find(camelot_codes.begin(), camelot_codes.end(), upper(value)) != camelot_codes.end();
+            }, allowed);
+        }
+        if (!signatures.empty()) {
+            restrict(metadata, "Time Signature", [&](std::string_view value) {
+                int beats = 0;
+                return leading_int(value, beats) && std::find(signatures.begin(), signatures.end(), beats) != signatures.end();
+            }, allowed);
+        }
+        if (!included_artists.empty()) {
+            require_tags(artists, "Artist");
+            restrict(any_of(artists, included_artists, metadata.size()), false, allowed);
+        }
+        if (!excluded_artists.empty()) {
+            require_tags(artists, "Artist");
+            restrict(any_of(artists, excluded_artists, metadata.size()), true, allowed);
+        }
+        if (!required_genres.empty()) {
+            require_tags(genres, "Genres");
+            std::vector<uint32_t> tags;
+            for (const auto& name : required_genres) {
+                tags.push_back(genres.find(name));
+            }
+            DynamicBitset bits(metadata.size());
+            for (uint32_t track : genres.intersect(tags)) {
+                bits.set(track);
+            }
+            restrict(bits, false, allowed);
+        }
+        if (!any_genres.empty()) {
+            require_tags(genres, "Genres");
+            restrict(any_of(genres, any_genres, metadata.size()), false, allowed);
+        }
+
+        DynamicBitset bits(allowed.size());
+        for (size_t row = 0; row < allowed.size(); row++) {
+            if (allowed[row]) bits.set(row);
+        }
+        return bits;
+    }
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <stdexcept>
+#include <ostream>
+
+#include "metadata_store.h"
+#include "cow_vector.h"
+#include "binary_io.h"
+#include "hash.h"
+#include "csv_reader.h"
+
+// Identity and content hash of every track in the index, by label. Tracks are keyed by
+// Spotify Track Id, ISRC, or Song + Artist for exports without ids, or by file path for
+// tracks scanned from disk. A refresh looks each incoming track up by key and compares
+// hashes to decide whether it is new, edited or unchanged; labels never seen again are
+// the removed tracks. Labels are never reused, so removed tracks keep their slot.
+class TrackManifest {
+private:
+    StringArena keys{true};
+    CowVector<uint32_t> key_labels;   // key id -> label
+    CowVector<uint64_t> row_hashes;   // label -> content hash
+    CowVector<uint8_t> deleted;       // label -> removed from the library
+    size_t deleted_count = 0;
+
+public:
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    // Positions of the CSV columns that identify a track
+    struct KeyColumns {
+        size_t spotify_id = std::string::npos;
+        size_t isrc = std::string::npos;
+        size_t song = std::string::npos;
+        size_t artist = std::string::npos;
+        size_t row_number = std::string::npos;
+
+        explicit KeyColumns(const std::vector<std::string>& headers)
+            : spotify_id(find_csv_column(headers, "Spotify Track Id")),
+              isrc(find_csv_column(headers, "ISRC")),
+              song(find_csv_column(headers, "Song")),
+              artist(find_csv_column(headers, "Artist")),
+              row_number(find_csv_column(headers, "#")) {}
+    };
+
+    static std::string track_key(std::string_view spotify_id, std::string_view isrc, std::string_view song, std::string_view artist) {
+        if (!spotify_id.empty()) return "spotify:" + std::string(spotify_id);
+        if (!isrc.empty()) return "isrc:" + std::string(isrc);
+        return "track:" + std::string(song) + '\x1f' + std::string(artist);
+    }
+
+    static std::string track_key(const std::vector<std::string_view>& fields, const KeyColumns& columns) {
+        auto field = [&](size_t i) {
+            return i < fields.size() ? fields[i] : std::string_view();
+        };
+        return track_key(field(columns.spotify_id), field(columns.isrc), field(columns.song), field(columns.artist));
+    }
+
+    // Exports can list the same track more than once; every repeat gets its own key so each
+    // row keeps its own label
+    static std::string occurrence_key(const std::string& key, size_t occurrence) {
+        return occurrence == 0 ? key : key + '\x1e' + std::to_string(occurrence);
+    }
+
+    // Files are identified by path; size and modification time stand in for their contents
+    static std::string file_key(std::string_view path) {
+        return "file:" + std::string(path);
+    }
+
+    static bool is_file_key(std::string_view key) {
+        return key.substr(0, 5) == "file:";
+    }
+
+    static uint64_t file_hash(uint64_t size, int64_t modified_time) {
+        uint64_t values[2] = {size, static_cast<uint64_t>(modified_time)};
+        return hash_bytes(reinterpret_cast<const char*>(values), sizeof(values));
+    }
+
+    // Hash of a CSV row. The "#" column is left out because it shifts whenever the export
+    // gains or loses rows above a track.
+    static uint64_t row_hash(const std::vector<std::string_view>& fields, const KeyColumns& columns) {
+        uint64_t h = 0;
+        for (size_t i = 0; i < fields.size(); i++) {
+            if (i != columns.row_number) {
+                h = hash_string(fields[i], h + i);
+            }
+        }
+        return h;
+    }
+
+    // Label of a key, or npos for a track the manifest has never seen
+    size_t find(std::string_view key) const {
+        uint32_t id = keys.find(key);
+        return id == StringArena::npos ? npos : key_labels[id];
+    }
+
+    // Record a new track. Labels must be added in order.
+    void add(std::string_view key, size_t label, uint64_t hash) {
+        if (label != row_hashes.size()) {
+            throw std::logic_error("Manifest labels must be added in order");
+        }
+        uint32_t id = keys.add(key);
+        if (id == key_labels.size()) {
+            key_labels.push_back(static_cast<uint32_t>(label));
+        } else {
+            key_labels.set(id, static_cast<uint32_t>(label));
+        }
+        row_hashes.push_back(hash);
+        deleted.push_back(0);
+    }
+
+    // Record new contents for a known track, bringing it back if it had been removed
+    void update(size_t label, uint64_t hash) {
+        row_hashes.set(label, hash);
+        if (deleted[label]) {
+            deleted.set(label, 0);
+            deleted_count--;
+        }
+    }
+
+    // Call f(key, label) for every key, removed tracks included
+    template <typename F>
+    void for_each_key(F f) const {
+        for (uint32_t id = 0; id < keys.size(); id++) {
+            f(keys.get(id), static_cast<size_t>(key_labels[id]));
+        }
+    }
+
+    void mark_deleted(size_t label) {
+        if (!deleted[label]) {
+            deleted.set(label, 1);
+            deleted_count++;
+        }
+    }
+
+    bool is_deleted(size_t label) const {
+        return label < deleted.size() && deleted[label] != 0;
+    }
+
+    uint64_t hash(size_t label) const {
+        return row_hashes[label];
+    }
+
+    // Number of labels, including removed tracks
+    size_t size() const {
+        return row_hashes.size();
+    }
+
+    size_t removed() const {
+        return deleted_count;
+    }
+
+    void clear() {
+        keys.clear();
+        key_labels.clear();
+        row_hashes.clear();
+        deleted.clear();
+        deleted_count = 0;
+    }
+
+    size_t memory_usage() const {
+        return keys.memory_usage() + key_labels.memory_usage() + row_hashes.memory_usage() + deleted.memory_usage();
+    }
+
+    void write(std::ostream& out) const {
+        keys.write(out);
+        binary_io::write_array(out, key_labels.data(), key_labels.size());
+        binary_io::write_array(out, row_hashes.data(), row_hashes.size());
+        binary_io::write_array(out, deleted.data(), deleted.size());
+    }
+
+    // Borrow the manifest from a mapped snapshot written by write()
+    void attach(binary_io::Cursor& in) {
+        StringArena new_keys;
+        new_keys.attach(in);
+        size_t label_count = 0;
+        size_t hash_count = 0;
+        size_t deleted_size = 0;
+        const uint32_t* labels = in.read_array<uint32_t>(label_count);
+        const uint64_t* hashes = in.read_array<uint64_t>(hash_count);
+        const uint8_t* flags = in.read_array<uint8_t>(deleted_size);
+        if (!new_keys.is_interned() || label_count != new_keys.size() || deleted_size != hash_count) {
+            throw std::runtime_error("Corrupt track manifest");
+        }
+
+        size_t new_deleted_count = 0;
+        for (size_t i = 0; i < label_count; i++) {
+            if (labels[i] >= hash_count) {
+                throw std::runtime_error("Corrupt track manifest");
+            }
+        }
+        for (size_t i = 0; i < deleted_size; i++) {
+            new_deleted_count += flags[i] != 0;
+        }
+
+        // Refreshes and sync look up every incoming track
+        new_keys.build_lookup();
+        keys = std::move(new_keys);
+        key_labels.borrow(labels, label_count);
+        row_hashes.borrow(hashes, hash_count);
+        deleted.borrow(flags, deleted_size);
+        deleted_count = new_deleted_count;
+    }
+};
@@ -0,0 +1,323 @@
+#pragma once
+
+#include "metadata.h"
+#include "hnswlib_csv_to_db.h"
+#include <vector>
+#include <deque>
+#include <list>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+
+struct PrefetchOptions {
+    // Files read at the same time. Like ScanOptions::ioDepth: 1-2 for spinning disks, more
+    // for SSDs and network shares.
+    size_t io_threads = 2;
+    // Bytes read from the start of every file: its headers and tags and the first audio
+    // frames, a few seconds of compressed audio
+    size_t lead_bytes = 512 * 1024;
+    // Size of a single read; cancellation is noticed between reads
+    size_t block_bytes = 64 * 1024;
+    // Capacity of the buffer pool. The least recently used tracks outside the look-ahead
+    // window are dropped first when it is full.
+    size_t pool_bytes = 32 * 1024 * 1024;
+};
+
+// A track read ahead of time. The player decodes the first frames from head and only goes
+// to the file for the rest of it.
+struct PrefetchedTrack {
+    size_t id = 0;
+    std::string path;
+    AudioMetadata metadata;
+    std::vector<char> head;
+    // head holds all of the file
+    bool whole_file = false;
+};
+
+// Counters since the prefetcher was created
+struct PrefetchStats {
+    size_t hits = 0;        // find() returned a buffered track
+    size_t misses = 0;      // find() had nothing, the player read the file itself
+    size_t read = 0;        // tracks read into the pool
+    size_t cancelled = 0;   // reads dropped because their track left the window
+    size_t failed = 0;      // files that couldn't be read
+    size_t evicted = 0;     // tracks dropped from the pool to make room
+    size_t pool_bytes = 0;  // bytes buffered now
+};
+
+// Reads the tracks a player is about to play in the background, so a transition finds the
+// next track's tags and first audio frames in memory instead of waiting on the disk.
+//
+// The player hands prefetch() the ids of its next few tracks (e.g. ShuffleQueue::upcoming())
+// after every transition or change of queue. Tracks that aren't buffered yet are read in
+// that order by a few I/O threads; tracks that dropped out of the window are cancelled,
+// whether still queued or half read. Finished tracks go into a pool bounded by
+// pool_bytes and evicted least recently used first, never while they are in the window if
+// anything else can go. find() never waits for the disk unless asked to.
+//
+// Thread-safe. Paths are resolved on the thread calling prefetch(), so the resolver may use
+// a database that is only safe to read from that thread.
+class TrackPrefetcher {
+public:
+    // Path of a track's file, or an empty string for a track without one
+    using PathResolver = std::function<std::string(size_t id)>;
+
+private:
+    struct Job {
+        size_t id;
+        std::string path;
+        std::atomic<bool> cancelled{false};
+
+        Job(size_t track, std::string file) : id(track), path(std::move(file)) {}
+    };
+
+    using Buffer = std::shared_ptr<const PrefetchedTrack>;
+
+    enum class ReadResult { DONE, CANCELLED, FAILED };
+
+    PathResolver resolve;
+    PrefetchOptions options;
+    std::vector<std::thread> workers;
+
+    mutable std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable track_done;
+    bool stopping = false;
+
+    // Look-ahead window of the last prefetch()
+    std::unordered_set<size_t> window;
+    std::deque<std::shared_ptr<Job>> queued;
+    std::unordered_map<size_t, std::shared_ptr<Job>> reading;
+
+    // Buffer pool; the front of lru is the most recently used track
+    std::list<Buffer> lru;
+    std::unordered_map<size_t, std::list<Buffer>::iterator> buffered;
+    size_t buffered_bytes = 0;
+
+    PrefetchStats counters;
+
+    static size_t buffer_bytes(const PrefetchedTrack& track) {
+        return track.head.size() + track.path.size() + sizeof(PrefetchedTrack);
+    }
+
+    // Read the head of a file and its tags
+    ReadResult read_track(Job& job, PrefetchedTrack& track) {
+        std::ifstream file(job.path, std::ios::binary | std::ios::ate);
+        if (!file) {
+            return ReadResult::FAILED;
+        }
+        uint64_t file_size = static_cast<uint64_t>(file.tellg());
+        file.seekg(0);
+        track.id = job.id;
+        track.path = job.path;
+        size_t block = std::max<size_t>(1, options.block_bytes);
+        while (track.head.size() < options.lead_bytes) {
+            if (job.cancelled) {
+                return ReadResult::CANCELLED;
+            }
+            size_t start = track.head.size();
+            track.head.resize(start + std::min(block, options.lead_bytes - start));
+            file.read(track.head.data() + start, static_cast<std::streamsize>(track.head.size() - start));
+            track.head.resize(start + static_cast<size_t>(file.gcount()));
+            if (!file) {
+                track.whole_file = true;
+                break;
+            }
+        }
+        if (job.cancelled) {
+            return ReadResult::CANCELLED;
+        }
+        // The tags sit in the part just read; parsing them from head doesn't go back to the
+        // file, nor walk the frames of an MP3 without a VBR header to time it
+        track.metadata = readAudioMetadata(job.path, track.head.data(), track.head.size(), file_size);
+        return ReadResult::DONE;
+    }
+
+    // Make room for bytes, dropping tracks outside the window before the ones in it
+    void evict_for(size_t bytes) {
+        for (int pass = 0; pass < 2 && buffered_bytes + bytes > options.pool_bytes; pass++) {
+            for (auto it = lru.end(); it != lru.begin() && buffered_bytes + bytes > options.pool_bytes;) {
+                --it;
+                if (pass == 0 && window.count((*it)->id)) {
+                    continue;
+                }
+                buffered_bytes -= buffer_bytes(**it);
+                buffered.erase((*it)->id);
+                it = lru.erase(it);
+                counters.evicted++;
+            }
+        }
+    }
+
+    void store(Buffer track) {
+        size_t bytes = buffer_bytes(*track);
+        if (bytes > options.pool_bytes) {
+            return;
+        }
+        evict_for(bytes);
+        buffered_bytes += bytes;
+        lru.push_front(track);
+        buffered[track->id] = lru.begin();
+        counters.read++;
+    }
+
+    void worker_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work_ready.wait(lock, [this] { return stopping || !queued.empty(); });
+            if (stopping) return;
+            std::shared_ptr<Job> job = std::move(queued.front());
+            queued.pop_front();
+            reading[job->id] = job;
+            lock.unlock();
+
+            auto track = std::make_shared<PrefetchedTrack>();
+            ReadResult result;
+            try {
+                result = read_track(*job, *track);
+            } catch (const std::exception&) {
+                result = ReadResult::FAILED;
+            }
+
+            lock.lock();
+            reading.erase(job->id);
+            if (result == ReadResult::FAILED) {
+                counters.failed++;
+            } else if (result == ReadResult::DONE && !job->cancelled) {
+                store(std::move(track));
+            } else if (result == ReadResult::CANCELLED && !job->cancelled && !stopping) {
+                // Cancelled and wanted again before this thread gave up on it
+                queued.push_front(std::move(job));
+            } else {
+                counters.cancelled++;
+            }
+            track_done.notify_all();
+        }
+    }
+
+    bool pending(size_t id) const {
+        if (reading.count(id)) return true;
+        return std::any_of(queued.begin(), queued.end(), [id](const std::shared_ptr<Job>& job) { return job->id == id; });
+    }
+
+public:
+    explicit TrackPrefetcher(PathResolver resolver, const PrefetchOptions& settings = PrefetchOptions())
+        : resolve(std::move(resolver)), options(settings) {
+        size_t threads = std::max<size_t>(1, options.io_threads);
+        for (size_t i = 0; i < threads; i++) {
+            workers.emplace_back([this] { worker_loop(); });
+        }
+    }
+
+    // Resolves the local files of a library (see HNSWVectorDB::track_files())
+    explicit TrackPrefetcher(const HNSWVectorDB& db, const PrefetchOptions& settings = PrefetchOptions())
+        : TrackPrefetcher(local_files(db), settings) {}
+
+    ~TrackPrefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            for (auto& entry : reading) entry.second->cancelled = true;
+        }
+        work_ready.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    TrackPrefetcher(const TrackPrefetcher&) = delete;
+    TrackPrefetcher& operator=(const TrackPrefetcher&) = delete;
+
+    // Resolver for the tracks that came from local files. Takes a copy of the paths, so the
+    // database may change afterwards.
+    static PathResolver local_files(const HNSWVectorDB& db) {
+        auto paths = std::make_shared<std::unordered_map<size_t, std::string>>();
+        for (auto& file : db.track_files()) {
+            paths->emplace(file.first, std::move(file.second));
+        }
+        return [paths](size_t id) {
+            auto path = paths->find(id);
+            return path == paths->end() ? std::string() : path->second;
+        };
+    }
+
+    // Make upcoming, in play order, the look-ahead window: read the tracks of it that aren't
+    // buffered or on their way, and cancel the reads of tracks no longer in it
+    void prefetch(const std::vector<size_t>& upcoming) {
+        std::lock_guard<std::mutex> lock(mutex);
+        window.clear();
+        window.insert(upcoming.begin(), upcoming.end());
+
+        std::unordered_map<size_t, std::shared_ptr<Job>> still_queued;
+        for (auto& job : queued) {
+            if (window.count(job->id)) {
+                still_queued.emplace(job->id, std::move(job));
+            } else {
+                counters.cancelled++;
+            }
+        }
+        queued.clear();
+        for (auto& entry : reading) {
+            entry.second->cancelled = window.count(entry.first) == 0;
+        }
+
+        for (size_t id : upcoming) {
+            if (buffered.count(id) || reading.count(id)) {
+                continue;
+            }
+            auto job = still_queued.find(id);
+            if (job != still_queued.end()) {
+                queued.push_back(std::move(job->second));
+                still_queued.erase(job);
+                continue;
+            }
+            std::string path = resolve(id);
+            if (!path.empty()) {
+                queued.push_back(std::make_shared<Job>(id, std::move(path)));
+            }
+        }
+        work_ready.notify_all();
+    }
+
+    // The buffered track, or nullptr if it isn't read yet. With a wait, a track that is being
+    // read is waited for that long at most; without one this never blocks on I/O.
+    std::shared_ptr<const PrefetchedTrack> find(size_t id, std::chrono::milliseconds wait = std::chrono::milliseconds(0)) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto found = buffered.find(id);
+        if (found == buffered.end() && wait.count() > 0) {
+            track_done.wait_for(lock, wait, [&] {
+                found = buffered.find(id);
+                return found != buffered.end() || !pending(id);
+            });
+        }
+        if (found == buffered.end()) {
+            counters.misses++;
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, found->second);
+        counters.hits++;
+        return *found->second;
+    }
+
+    // Drop every buffered track, e.g. after the library was rescanned
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        lru.clear();
+        buffered.clear();
+        buffered_bytes = 0;
+    }
+
+    PrefetchStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        PrefetchStats result = counters;
+        result.pool_bytes = buffered_bytes;
+        return result;
+    }
+};
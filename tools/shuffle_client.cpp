@@ -0,0 +1,91 @@
+// Command-line client of the query daemon (better-shuffle serve).
+//
+//   shuffle-client [--socket PATH] ping
+//   shuffle-client [--socket PATH] search <k> <popularity> <bpm> ... (one value per feature)
+//   shuffle-client [--socket PATH] next <session> [mood values...]
+//   shuffle-client [--socket PATH] metadata <id>
+//   shuffle-client [--socket PATH] reload
+
+#include "query_client.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+
+static void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [--socket PATH] <command>\n"
+              << "  ping\n"
+              << "  search <k> <feature values...>\n"
+              << "  next <session> [mood values...]\n"
+              << "  metadata <id>\n"
+              << "  reload" << std::endl;
+}
+
+static std::vector<float> parse_floats(int argc, char* argv[], int first) {
+    std::vector<float> values;
+    for (int i = first; i < argc; i++) values.push_back(std::stof(argv[i]));
+    return values;
+}
+
+static void print_track(QueryClient& client, uint32_t id) {
+    std::string song;
+    std::string artist;
+    for (const auto& field : client.metadata(id)) {
+        if (field.first == "Song") song = field.second;
+        if (field.first == "Artist") artist = field.second;
+    }
+    std::cout << id << "\t" << song << " - " << artist;
+}
+
+int main(int argc, char* argv[]) {
+    std::string socket_path = query_protocol::default_socket_path();
+    int arg = 1;
+    if (arg + 1 < argc && std::strcmp(argv[arg], "--socket") == 0) {
+        socket_path = argv[arg + 1];
+        arg += 2;
+    }
+    if (arg >= argc) {
+        print_usage(argv[0]);
+        return 2;
+    }
+    std::string command = argv[arg];
+
+    try {
+        QueryClient client(socket_path);
+        if (command == "ping") {
+            QueryClient::ServerInfo info = client.ping();
+            std::cout << info.tracks << " tracks, " << info.dimension << " features, generation " << info.generation
+                      << std::endl;
+        } else if (command == "search" && arg + 1 < argc) {
+            size_t k = std::stoul(argv[arg + 1]);
+            for (const auto& result : client.search(parse_floats(argc, argv, arg + 2), k)) {
+                print_track(client, result.first);
+                std::cout << "\t" << result.second << std::endl;
+            }
+        } else if (command == "next" && arg + 1 < argc) {
+            uint32_t session = static_cast<uint32_t>(std::stoul(argv[arg + 1]));
+            uint32_t id = client.next(session, parse_floats(argc, argv, arg + 2));
+            if (id == query_protocol::NO_TRACK) {
+                std::cout << "Every track was played" << std::endl;
+            } else {
+                print_track(client, id);
+                std::cout << std::endl;
+            }
+        } else if (command == "metadata" && arg + 1 < argc) {
+            for (const auto& field : client.metadata(static_cast<uint32_t>(std::stoul(argv[arg + 1])))) {
+                std::cout << field.first << ": " << field.second << std::endl;
+            }
+        } else if (command == "reload") {
+            QueryClient::ServerInfo info = client.reload();
+            std::cout << "Generation " << info.generation << ", " << info.tracks << " tracks" << std::endl;
+        } else {
+            print_usage(argv[0]);
+            return 2;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,194 @@
+// Load generator for the query daemon (better-shuffle serve). Opens a number of connections,
+// keeps a fixed number of requests in flight on each and reports throughput and latency
+// percentiles. Latency is measured from sending a request to receiving its answer, so it
+// includes the time a request waits in its connection's pipeline and in the server's batches.
+//
+//   shuffle-loadgen [--socket PATH] [--connections N] [--pipeline N] [--seconds N] [--k N]
+//                   [--mix SEARCH,NEXT,METADATA] [--seed N]
+//
+// --mix gives the relative share of each request type, e.g. 8,1,1 (the default).
+
+#include "query_client.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+
+struct LoadOptions {
+    std::string socket_path = query_protocol::default_socket_path();
+    size_t connections = 4;
+    size_t pipeline = 8;
+    double seconds = 10;
+    size_t k = 10;
+    // Relative shares of searches, next-track and metadata requests
+    unsigned mix[3] = {8, 1, 1};
+    uint64_t seed = 42;
+};
+
+using Clock = std::chrono::steady_clock;
+
+// What one connection did, latencies in microseconds
+struct ConnectionResult {
+    std::vector<double> latencies_us;
+    size_t errors = 0;
+    std::string failure;
+};
+
+// Plausible raw values for the playlist export's ten feature columns
+static const float FEATURE_LOW[] = {0, 60, 0, 0, 0, 0, 0, 0, 0, -20};
+static const float FEATURE_HIGH[] = {100, 200, 100, 100, 100, 100, 100, 100, 100, 0};
+
+static std::vector<float> random_features(std::mt19937_64& rng, size_t dimension) {
+    std::vector<float> values(dimension);
+    for (size_t i = 0; i < dimension; i++) {
+        float low = i < 10 ? FEATURE_LOW[i] : 0.0f;
+        float high = i < 10 ? FEATURE_HIGH[i] : 100.0f;
+        values[i] = std::uniform_real_distribution<float>(low, high)(rng);
+    }
+    return values;
+}
+
+static void run_connection(const LoadOptions& options, size_t index, const QueryClient::ServerInfo& info,
+                           Clock::time_point end, ConnectionResult& result) {
+    try {
+        QueryClient client(options.socket_path);
+        std::mt19937_64 rng(options.seed + index);
+        std::discrete_distribution<int> pick_type({double(options.mix[0]), double(options.mix[1]), double(options.mix[2])});
+        std::uniform_int_distribution<uint32_t> pick_track(0, info.tracks > 0 ? info.tracks - 1 : 0);
+        // Send time of every request in flight, and whether it asked for the next track
+        std::unordered_map<uint32_t, std::pair<Clock::time_point, bool>> in_flight;
+        uint32_t session = static_cast<uint32_t>(index);
+        bool session_started = false;
+
+        auto send_one = [&]() {
+            uint32_t request_id = 0;
+            int type = pick_type(rng);
+            switch (type) {
+            case 0:
+                request_id = client.send_search(random_features(rng, info.dimension), options.k);
+                break;
+            case 1:
+                // Start the session with a mood, then keep asking it for the next track
+                request_id = session_started ? client.send_next(session)
+                                             : client.send_next(session, random_features(rng, info.dimension));
+                session_started = true;
+                break;
+            default:
+                request_id = client.send_metadata(pick_track(rng));
+                break;
+            }
+            in_flight[request_id] = {Clock::now(), type == 1};
+        };
+
+        for (size_t i = 0; i < options.pipeline; i++) send_one();
+        while (!in_flight.empty()) {
+            QueryClient::Response response = client.receive();
+            auto sent = in_flight.find(response.request_id);
+            if (sent == in_flight.end()) continue;
+            result.latencies_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent->second.first).count());
+            bool was_next = sent->second.second;
+            in_flight.erase(sent);
+            if (response.status != query_protocol::Status::OK) {
+                result.errors++;
+            } else if (was_next && response.payload.u32() == query_protocol::NO_TRACK) {
+                // The session played every track; start it over
+                session_started = false;
+            }
+            if (Clock::now() < end) send_one();
+        }
+    } catch (const std::exception& e) {
+        result.failure = e.what();
+    }
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t rank = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+static bool parse_mix(const std::string& text, unsigned mix[3]) {
+    std::istringstream in(text);
+    std::string part;
+    unsigned total = 0;
+    for (int i = 0; i < 3; i++) {
+        if (!std::getline(in, part, ',')) return false;
+        mix[i] = static_cast<unsigned>(std::stoul(part));
+        total += mix[i];
+    }
+    return total > 0;
+}
+
+int main(int argc, char* argv[]) {
+    LoadOptions options;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (std::strcmp(argv[i], "--socket") == 0 && has_value) {
+            options.socket_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--connections") == 0 && has_value) {
+            options.connections = std::max<size_t>(1, std::stoul(argv[++i]));
+        } else if (std::strcmp(argv[i], "--pipeline") == 0 && has_value) {
+            options.pipeline = std::max<size_t>(1, std::stoul(argv[++i]));
+        } else if (std::strcmp(argv[i], "--seconds") == 0 && has_value) {
+            options.seconds = std::stod(argv[++i]);
+        } else if (std::strcmp(argv[i], "--k") == 0 && has_value) {
+            options.k = std::stoul(argv[++i]);
+        } else if (std::strcmp(argv[i], "--mix") == 0 && has_value && parse_mix(argv[i + 1], options.mix)) {
+            i++;
+        } else if (std::strcmp(argv[i], "--seed") == 0 && has_value) {
+            options.seed = std::stoull(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--socket PATH] [--connections N] [--pipeline N] [--seconds N] [--k N]"
+                      << " [--mix SEARCH,NEXT,METADATA] [--seed N]" << std::endl;
+            return 2;
+        }
+    }
+
+    QueryClient::ServerInfo info;
+    try {
+        QueryClient client(options.socket_path);
+        info = client.ping();
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cerr << "Server has " << info.tracks << " tracks; " << options.connections << " connections x "
+              << options.pipeline << " in flight for " << options.seconds << " s" << std::endl;
+
+    std::vector<ConnectionResult> results(options.connections);
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.seconds));
+    for (size_t i = 0; i < options.connections; i++) {
+        threads.emplace_back(run_connection, std::cref(options), i, std::cref(info), end, std::ref(results[i]));
+    }
+    for (auto& thread : threads) thread.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<double> latencies;
+    size_t errors = 0;
+    for (const auto& result : results) {
+        latencies.insert(latencies.end(), result.latencies_us.begin(), result.latencies_us.end());
+        errors += result.errors;
+        if (!result.failure.empty()) {
+            std::cerr << "Connection failed: " << result.failure << std::endl;
+        }
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "Requests: " << latencies.size() << " (" << errors << " errors) in " << elapsed << " s\n"
+              << "Throughput: " << latencies.size() / elapsed << " requests/s\n"
+              << "Latency us: p50 " << percentile(latencies, 0.50) << ", p99 " << percentile(latencies, 0.99)
+              << ", p99.9 " << percentile(latencies, 0.999) << ", max " << (latencies.empty() ? 0 : latencies.back())
+              << std::endl;
+    return 0;
+}